@@ -79,6 +79,65 @@ void fsInit()
 	dtermput("OK\n");
 };
 
+/**
+ * Find the block at page 'page' of a block tree of depth 'depth' with head 'head'; returns 0 for a hole. 'scratch'
+ * is a 4KB buffer used for reading the tables.
+ */
+static qword_t treeLookup(qword_t depth, qword_t head, qword_t page, qword_t *scratch)
+{
+	qword_t block = head;
+	qword_t level;
+	for (level=depth; level!=0 && block!=0; level--)
+	{
+		readBlock(block, scratch);
+		block = scratch[(page >> (9 * (level-1))) & 0x1FF];
+	};
+	
+	return block;
+};
+
+/**
+ * Look up a name in a directory indexed by a DIDX record. 'scratch' is a 4KB buffer.
+ */
+static qword_t dirIndexLookup(GXFS_DirIndexRecord *di, const char *name, void *scratch)
+{
+	dword_t hash = 2166136261U;
+	const char *scan;
+	for (scan=name; *scan!=0; scan++)
+	{
+		hash ^= (byte_t) *scan;
+		hash *= 16777619U;
+	};
+	
+	GXFS_DirBlock *db = (GXFS_DirBlock*) scratch;
+	qword_t block = treeLookup(di->diDepth, di->diHead, hash & (di->diBuckets - 1), (qword_t*) scratch);
+	while (block != 0)
+	{
+		readBlock(block, db);
+		
+		qword_t pos = 0;
+		while ((pos + sizeof(GXFS_DirEntry)) <= db->dbUsed && db->dbUsed <= 4080)
+		{
+			GXFS_DirEntry *de = (GXFS_DirEntry*) &db->dbData[pos];
+			if (de->deSize == 0)
+			{
+				break;
+			};
+			
+			if (strcmp(de->deName, name) == 0)
+			{
+				return de->deInode;
+			};
+			
+			pos += de->deSize;
+		};
+		
+		block = db->dbNext;
+	};
+	
+	return 0;
+};
+
 static qword_t dirWalk(qword_t inode, const char *name)
 {
 	char blockbuf[4096];
@@ -107,7 +166,7 @@ static qword_t dirWalk(qword_t inode, const char *name)
 			return 0;
 		};
 		
-		if (rh->rhType != (*((const dword_t*)"DENT")))
+		if (rh->rhType != (*((const dword_t*)"DENT")) && rh->rhType != (*((const dword_t*)"DIDX")))
 		{
 			readpos += rh->rhSize;
 			continue;
@@ -147,6 +206,12 @@ static qword_t dirWalk(qword_t inode, const char *name)
 			readpos += readNow;
 		};
 		
+		if (rh->rhType == (*((const dword_t*)"DIDX")))
+		{
+			// large directory; the entry can only be in its bucket
+			return dirIndexLookup((GXFS_DirIndexRecord*) recbuf, name, blockbuf);
+		};
+		
 		GXFS_DentRecord *dr = (GXFS_DentRecord*) recbuf;
 		if (strcmp(dr->drName, name) == 0)
 		{
@@ -155,36 +220,70 @@ static qword_t dirWalk(qword_t inode, const char *name)
 	};
 };
 
-static void loadFileBlock(FileHandle *fh, qword_t offset)
+/**
+ * Find the block mapping the page 'page' of a file mapped by extents; returns 0 if the page is not mapped.
+ */
+static qword_t extentLookup(FileHandle *fh, qword_t page)
 {
-	fh->bufferBase = offset & ~0xFFFULL;
+	GXFS_ExtentNode node;
+	GXFS_Extent *list = fh->extents;
+	qword_t count = fh->extCount;
 	
-	qword_t lvl[5];
-	lvl[4] = (offset >> 12) & 0x1FF;
-	lvl[3] = (offset >> 21) & 0x1FF;
-	lvl[2] = (offset >> 30) & 0x1FF;
-	lvl[1] = (offset >> 39) & 0x1FF;
-	lvl[0] = (offset >> 48) & 0x1FF;
-	
-	qword_t datablock = fh->head;
-	int i;
-	for (i=(5-fh->depth); i<5; i++)
+	if (fh->extDepth != 0)
 	{
-		qword_t table[512];
-		readBlock(datablock, table);
-		
-		if (table[lvl[i]] == 0)
+		// descend the B-tree to the leaf which would contain the page
+		readBlock(fh->extRoot, &node);
+		while (node.enLevel != 0)
 		{
-			memset(fh->buffer, 0, 4096);
-			return;
-		}
-		else
+			if (node.enCount == 0 || node.enKeys[0].ikFirst > page)
+			{
+				return 0;
+			};
+			
+			qword_t i = 0;
+			while ((i+1) < node.enCount && node.enKeys[i+1].ikFirst <= page) i++;
+			readBlock(node.enKeys[i].ikChild, &node);
+		};
+		
+		list = node.enExtents;
+		count = node.enCount;
+	};
+	
+	qword_t i;
+	for (i=0; i<count; i++)
+	{
+		if (list[i].exLogical <= page && page < (list[i].exLogical + list[i].exLength))
 		{
-			datablock = table[lvl[i]];
+			return list[i].exPhysical + (page - list[i].exLogical);
 		};
 	};
 	
-	readBlock(datablock, fh->buffer);
+	return 0;
+};
+
+static void loadFileBlock(FileHandle *fh, qword_t offset)
+{
+	fh->bufferBase = offset & ~0xFFFULL;
+	
+	// the buffer doubles as space for the tree tables
+	qword_t block;
+	if (fh->useExtents)
+	{
+		block = extentLookup(fh, offset >> 12);
+	}
+	else
+	{
+		block = treeLookup(fh->depth, fh->head, offset >> 12, (qword_t*) fh->buffer);
+	};
+	
+	if (block == 0)
+	{
+		memset(fh->buffer, 0, 4096);
+	}
+	else
+	{
+		readBlock(block, fh->buffer);
+	};
 };
 
 int openFile(FileHandle *fh, const char *path)
@@ -238,7 +337,8 @@ int openFile(FileHandle *fh, const char *path)
 			return -1;
 		};
 		
-		if (rh->rhType != (*((const dword_t*)"TREE")) && rh->rhType != (*((const dword_t*)"ATTR")))
+		if (rh->rhType != (*((const dword_t*)"TREE")) && rh->rhType != (*((const dword_t*)"ATTR"))
+			&& rh->rhType != (*((const dword_t*)"EXTS")))
 		{
 			readpos += rh->rhSize;
 			continue;
@@ -277,11 +377,24 @@ int openFile(FileHandle *fh, const char *path)
 		if (rh->rhType == (*((const dword_t*)"TREE")))
 		{
 			GXFS_TreeRecord *tr = (GXFS_TreeRecord*) recbuf;
+			fh->useExtents = 0;
 			fh->depth = tr->trDepth;
 			fh->head = tr->trHead;
 			loadFileBlock(fh, 0);
 			return 0;
 		}
+		else if (rh->rhType == (*((const dword_t*)"EXTS")))
+		{
+			GXFS_ExtentRecord *xr = (GXFS_ExtentRecord*) recbuf;
+			fh->useExtents = 1;
+			fh->extDepth = xr->xrDepth;
+			fh->extRoot = xr->xrRoot;
+			fh->extCount = xr->xrCount;
+			if (fh->extCount > 4) fh->extCount = 4;
+			memcpy(fh->extents, xr->xrExtents, sizeof(GXFS_Extent) * fh->extCount);
+			loadFileBlock(fh, 0);
+			return 0;
+		}
 		else
 		{
 			GXFS_AttrRecord *ar = (GXFS_AttrRecord*) recbuf;
@@ -220,6 +220,65 @@ typedef struct
 	qword_t trHead;
 } GXFS_TreeRecord;
 
+typedef struct
+{
+	qword_t exLogical;
+	qword_t exPhysical;
+	qword_t exLength;
+} GXFS_Extent;
+
+typedef struct
+{
+	dword_t xrType;
+	dword_t xrSize;
+	qword_t xrDepth;
+	qword_t xrRoot;
+	qword_t xrCount;
+	GXFS_Extent xrExtents[4];
+} GXFS_ExtentRecord;
+
+typedef struct
+{
+	qword_t ikFirst;
+	qword_t ikChild;
+} GXFS_IndexKey;
+
+typedef struct
+{
+	qword_t enCount;
+	qword_t enLevel;
+	union
+	{
+		GXFS_Extent enExtents[170];
+		GXFS_IndexKey enKeys[255];
+	};
+} GXFS_ExtentNode;
+
+typedef struct
+{
+	dword_t diType;
+	dword_t diSize;
+	qword_t diBuckets;
+	qword_t diDepth;
+	qword_t diHead;
+} GXFS_DirIndexRecord;
+
+typedef struct
+{
+	qword_t dbNext;
+	qword_t dbUsed;
+	byte_t dbData[4080];
+} GXFS_DirBlock;
+
+typedef struct
+{
+	qword_t deInode;
+	word_t deSize;
+	word_t deNameLen;
+	dword_t deResv;
+	char deName[];
+} GXFS_DirEntry;
+
 typedef struct
 {
 	char					year[4];
@@ -320,6 +379,11 @@ typedef struct
 #if defined(GXBOOT_FS_GXFS)
 	qword_t				depth;
 	qword_t				head;
+	int				useExtents;
+	qword_t				extDepth;
+	qword_t				extRoot;
+	qword_t				extCount;
+	GXFS_Extent			extents[4];
 	qword_t				bufferBase;
 	byte_t				buffer[4096];
 #elif defined(GXBOOT_FS_ELTORITO)
@@ -57,6 +57,27 @@ switchContext:
 	; the rest is popped by an interrupt return
 	iretq
 
+[global switchContextFrom]
+switchContextFrom:
+	; Like switchContext, but RSI points to the 'onCPU' field of the thread we are switching
+	; away from (or is NULL); we clear it only once we are no longer using that thread's stack,
+	; so that other CPUs may then resume it.
+	cli
+	mov	rsp,		rdi
+	
+	test	rsi,		rsi
+	jz	.popRegs
+	mov	dword [rsi],	0
+
+.popRegs:
+	popAll
+
+	; ignore "intNo" and "errCode"
+	add	rsp,		16
+
+	; the rest is popped by an interrupt return
+	iretq
+
 [global enterDebugContext]
 enterDebugContext:
 	; essentially the same as switchContext, but we trap into the Bochs debugger
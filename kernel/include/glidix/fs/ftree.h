@@ -41,13 +41,33 @@
 #define	FT_FIXED_SIZE				(1 << 2)
 
 /**
- * Describes a single node on a file page tree. There are 16 entries, indexed by each 4
- * bits in a file offset. The bottom level specifies the physical page number.
+ * Readahead window limits, in pages. On a sequential cache miss, the window starts at FT_RA_MIN
+ * and doubles on each further sequential miss, up to FT_RA_MAX.
  */
+#define	FT_RA_MIN				4
+#define	FT_RA_MAX				64
+
+/**
+ * The writeback thread wakes up every FT_WRITEBACK_INTERVAL, and flushes the trees which have had dirty pages
+ * for at least FT_DIRTY_EXPIRE.
+ */
+#define	FT_WRITEBACK_INTERVAL			NT_SECS(5)
+#define	FT_DIRTY_EXPIRE				NT_SECS(30)
+
+/**
+ * Describes a single node on a file page tree. Each node has FT_NODE_ENTRIES entries, indexed by
+ * FT_NODE_SHIFT bits of the page index; the bottom level specifies the physical page number. The
+ * tree only has as many levels as the largest page index needs, so files up to 256KB use just the
+ * top node, and files up to 1GB need at most 3 levels.
+ */
+#define	FT_NODE_SHIFT				6
+#define	FT_NODE_ENTRIES				(1 << FT_NODE_SHIFT)
+#define	FT_NODE_MASK				(FT_NODE_ENTRIES - 1)
+
 typedef union FileNode_
 {
-	union FileNode_*			nodes[16];
-	uint64_t				entries[16];
+	union FileNode_*			nodes[FT_NODE_ENTRIES];
+	uint64_t				entries[FT_NODE_ENTRIES];
 } FileNode;
 
 /**
@@ -92,12 +112,27 @@ typedef struct FileTree_
 	 */
 	int (*load)(struct FileTree_ *ft, off_t pos, void *buffer);
 	
+	/**
+	 * Optional function pointer set by the driver, to load 'count' consecutive pages starting at
+	 * 'pos' (page-aligned) into the page frames listed in 'frames'. The frames are zeroed, as for
+	 * load(). Returns the number of pages loaded, starting from the first one (which may be less than
+	 * 'count', but at least 1), or -1 on error. Readahead is only done if this is set.
+	 */
+	int (*loadRange)(struct FileTree_ *ft, off_t pos, const uint64_t *frames, int count);
+	
 	/**
 	 * Function pointer set by the driver, to flush a specific page into the file.
 	 * The passed offset is always page-aligned. Returns 0 on success, -1 on error.
 	 */
 	int (*flush)(struct FileTree_ *ft, off_t pos, const void *buffer);
 	
+	/**
+	 * Optional function pointer set by the driver, to flush 'count' consecutive pages starting at 'pos'
+	 * (page-aligned) from the page frames listed in 'frames'. Returns 0 on success, -1 on error. If this
+	 * is set, it is used instead of flush() when writing back runs of dirty pages.
+	 */
+	int (*flushRange)(struct FileTree_ *ft, off_t pos, const uint64_t *frames, int count);
+	
 	/**
 	 * Function pointer set by the driver, called whenever the file is resized by ftWrite().
 	 */
@@ -112,9 +147,11 @@ typedef struct FileTree_
 	uint64_t (*getpage)(struct FileTree_ *ft, off_t pos);
 	
 	/**
-	 * Top-level node.
+	 * Top-level node, and the number of levels below it; the tree covers page indices below
+	 * 2^(FT_NODE_SHIFT * (depth+1)), and grows upwards when a page beyond that is needed.
 	 */
 	FileNode				top;
+	int					depth;
 	
 	/**
 	 * Current size of this file in bytes.
@@ -125,6 +162,26 @@ typedef struct FileTree_
 	 * Record lock.
 	 */
 	RangeLock				rlock;
+	
+	/**
+	 * Readahead state, protected by 'lock': the index of the page most recently requested, and the
+	 * current readahead window in pages (0 if the access pattern is not sequential).
+	 */
+	uint64_t				raLast;
+	int					raWindow;
+	
+	/**
+	 * Index of the next page to be examined by the page reclaim CLOCK (see ftGetFreePage()).
+	 */
+	uint64_t				clockPos;
+	
+	/**
+	 * The time (from getNanotime()) at which a page of the tree was first written since it was last flushed,
+	 * or 0 if the tree is clean. Used by the writeback thread to flush trees once their data gets old.
+	 * Protected by 'lock'. Pages dirtied through shared mappings are not counted here; they are written back
+	 * when the mapping goes away, or by ftFlush().
+	 */
+	uint64_t				dirtyTime;
 } FileTree;
 
 /**
@@ -157,7 +214,8 @@ void ftDown(FileTree *ft);
 uint64_t ftGetPage(FileTree *ft, off_t pos);
 
 /**
- * Commit the contents of the file tree to disk.
+ * Commit the contents of the file tree to disk. Only pages of this tree are written; the metadata they depend
+ * on is up to the filesystem driver (see the inode 'flush' callback).
  */
 void ftFlush(FileTree *ft);
 
@@ -186,7 +244,9 @@ void ftUncache(FileTree *ft);
 
 /**
  * Flush one of the pages of a file tree, and return the frame number, which can now be reused (but is not freed).
- * Return 0 if finding a spare page was unsuccessful.
+ * Return 0 if finding a spare page was unsuccessful. Pages are chosen by a CLOCK sweeping all cached trees in
+ * turn: unreferenced pages with PI_ACCESSED set have the flag cleared and are skipped, and the first one without
+ * it is evicted.
  */
 uint64_t ftGetFreePage();
 
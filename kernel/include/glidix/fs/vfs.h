@@ -138,6 +138,15 @@
  */
 #define	VFS_ST_RDONLY			(1 << 0)
 #define	VFS_ST_NOSUID			(1 << 1)
+#define	VFS_ST_NOATIME			(1 << 2)		/* never update access times */
+#define	VFS_ST_NODIRATIME		(1 << 3)		/* never update access times of directories */
+#define	VFS_ST_RELATIME			(1 << 4)		/* update access times only as described below */
+
+/**
+ * With VFS_ST_RELATIME, the access time is only updated if it is not later than the modification or change
+ * time, or is at least this many seconds old.
+ */
+#define	VFS_RELATIME_INTERVAL		(24 * 60 * 60)
 
 /**
  * vfsMakeDirEx() flags.
@@ -150,7 +159,10 @@
 #define	MNT_RDONLY			(1 << 0)
 #define	MNT_NOSUID			(1 << 1)
 #define	MNT_TEMP			(1 << 2)
-#define	MNT_ALL				((1 << 3)-1)
+#define	MNT_NOATIME			(1 << 3)
+#define	MNT_NODIRATIME			(1 << 4)
+#define	MNT_RELATIME			(1 << 5)
+#define	MNT_ALL				((1 << 6)-1)
 
 /**
  * The AT_* flags.
@@ -240,10 +252,23 @@ struct kstatvfs
 struct kdirent
 {
 	ino_t				d_ino;
-	char				d_resv[64];
+	int				d_key;		/* key of the entry in its directory */
+	char				d_resv[60];
 	char				d_name[];
 };
 
+/**
+ * Largest buffer filled by a single vfsReadDirBatch() through the getdents() system call.
+ */
+#define	VFS_READDIR_MAX			0x10000
+
+/**
+ * Number of slots in the negative lookup cache, and the longest name (including the terminator) which it
+ * can remember.
+ */
+#define	VFS_NEGCACHE_SIZE		1024
+#define	VFS_NEGCACHE_NAME		56
+
 /**
  * All the structure typedefs here, definitions below.
  */
@@ -381,6 +406,30 @@ struct Inode_
 	 */
 	Dentry* dents;
 	
+	/**
+	 * Tail of the dentry list (so that appends are constant-time), the number of dentries on
+	 * the list, and a hash table of the same dentries indexed by name (chained through
+	 * 'hashNext'). The table is allocated lazily and grows as the directory does; all of those
+	 * are protected by the inode lock.
+	 */
+	Dentry* lastDent;
+	int numDents;
+	Dentry** dentHash;
+	int dentHashSize;
+	
+	/**
+	 * The dentry most recently returned by vfsReadDirBatch() (or NULL), so that the next batch can
+	 * continue from it rather than from the start of the list. Protected by the inode lock.
+	 */
+	Dentry* readHint;
+	
+	/**
+	 * Generation of the dentry list, used to validate negative lookup cache entries for this directory.
+	 * It is 0 until first needed, and is set to a new, globally unique value whenever a dentry is added.
+	 * Changed with the inode lock held, but read without it.
+	 */
+	uint64_t dentGen;
+	
 	/**
 	 * If these function pointers are not NULL, then it is called every time this inode is opened,
 	 * and may return additional data to be associated with the file description, and to release
@@ -499,6 +548,11 @@ struct Dentry_
 	 * Dentry flags (VFS_DENTRY_*).
 	 */
 	int					flags;
+	
+	/**
+	 * Next dentry in the same bucket of the directory's name hash table.
+	 */
+	Dentry*					hashNext;
 };
 
 /**
@@ -1117,6 +1171,16 @@ int vfsChangeXPerm(InodeRef startdir, const char *path, uint64_t ixperm, uint64_
  */
 ssize_t vfsReadDir(Inode *inode, int key, struct kdirent **out);
 
+/**
+ * Given an inode representing a directory, fill 'buffer' with as many 'struct kdirent' as fit in 'size' bytes,
+ * starting with the entry whose key is '*keyp' (or the next higher one). Each entry is padded to a multiple of 8
+ * bytes, so the next one starts at offset (sizeof(struct kdirent) + strlen(d_name) + 8) & ~7. On success, returns
+ * the number of bytes filled, which is 0 at the end of the directory, and sets '*keyp' to the key at which to
+ * continue. On error, returns the error number as a negative; -EINVAL means the next entry does not fit in the
+ * buffer.
+ */
+ssize_t vfsReadDirBatch(Inode *inode, int *keyp, void *buffer, size_t size);
+
 /**
  * Move an inode from one dentry to another. This is used to implement rename(). Returns 0 on success, error number
  * on error.
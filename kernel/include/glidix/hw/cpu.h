@@ -31,6 +31,7 @@
 
 #include <glidix/util/common.h>
 #include <glidix/thread/spinlock.h>
+#include <glidix/thread/sched.h>
 
 /**
  * This structure describes a CPU.
@@ -47,6 +48,16 @@ typedef struct
 	 * The CPU's APIC ID.
 	 */
 	uint32_t apicID;
+	
+	/**
+	 * The CPU's runqueue; one queue per priority level, all protected by 'runqLock'.
+	 * 'runqLoad' is the number of threads currently queued; other CPUs read it without
+	 * the lock when looking for work to steal.
+	 */
+	Spinlock runqLock;
+	RunqueueEntry* runqFirst[NUM_PRIO_Q];
+	RunqueueEntry* runqLast[NUM_PRIO_Q];
+	volatile int runqLoad;
 } CPU;
 
 /**
@@ -122,6 +133,16 @@ void haltAllCPU();
  */
 CPU* getCurrentCPU();
 
+/**
+ * Returns the CPU with the specified Glidix-assigned ID.
+ */
+CPU* getCPU(int id);
+
+/**
+ * Returns the number of CPUs in the system.
+ */
+int getCPUCount();
+
 /**
  * Send the scheduler hint to a CPU.
  */
@@ -132,6 +153,17 @@ void sendHintToCPU(int id);
  */
 void sendHintToEveryCPU();
 
+/**
+ * Flush the TLB on every CPU, and wait until they have all done so. This must be called with
+ * interrupts enabled, as the calling CPU flushes its own TLB by handling the IPI too.
+ */
+void cpuFlushTLB();
+
+/**
+ * Called by the I_IPI_FLUSH_TLB handler.
+ */
+void cpuOnFlushTLB();
+
 /**
  * Mark the calling CPU as ready to dispatch threads.
  */
@@ -143,9 +175,15 @@ void cpuReady();
 void cpuBusy();
 
 /**
- * Wake up the first ready CPU.
+ * If the specified CPU is ready (idle), mark it as busy and send it the scheduler hint so that
+ * it stops halting and looks at its runqueue. Does nothing if 'id' is -1.
+ */
+void cpuWake(int id);
+
+/**
+ * Return the ID of an idle CPU, preferring 'preferred' if it is idle; or -1 if all CPUs are busy.
  */
-void cpuDispatch();
+int cpuFindIdle(int preferred);
 
 /**
  * Return nonzero if the CPU should continue sleeping.
@@ -98,6 +98,7 @@
 // 0x70 (112) + x interrupts are IPIs
 #define	I_IPI_HALT			0x70
 #define	I_IPI_SCHED_HINT		0x71
+#define	I_IPI_FLUSH_TLB			0x72
 
 typedef struct
 {
@@ -71,7 +71,9 @@ typedef struct
 	uint64_t			pwt:1;
 	uint64_t			pcd:1;
 	uint64_t			accessed:1;
-	uint64_t			zero:6;		// ignored and PS (page size = 0 for 4KB pages) and 4 ignored bits.
+	uint64_t			ignore:1;
+	uint64_t			ps:1;		// page size (1 = this entry maps a 1GB page)
+	uint64_t			zero:4;
 	uint64_t			pdPhysAddr:36;
 	uint64_t			zero2:4;
 	uint64_t			ignored:11;
@@ -139,7 +141,8 @@ PML4 *getPML4();
 void refreshAddrSpace();
 
 /**
- * Write data from the 'buffer' into the specified memory frame.
+ * Write data from the 'buffer' into the specified memory frame. Both of these go through the
+ * direct physical map (see physmem.h).
  */
 void frameWrite(uint64_t frame, const void *buffer);
 
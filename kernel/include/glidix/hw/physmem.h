@@ -46,14 +46,43 @@ extern uint64_t phmUsedFrames;
 extern uint64_t phmCachedFrames;
 
 /**
- * Initialize the physical memory manager.
+ * All physical memory is permanently mapped, read-write, starting at PHM_DIRECT_MAP_BASE
+ * (pml4[266]), using the largest pages the CPU supports. This lets the kernel access any frame
+ * without temporary mappings or TLB flushes. The map covers at most PHM_DIRECT_MAP_SIZE bytes;
+ * memory above that is ignored by the physical memory manager. Ranges which the memory map does
+ * not report as RAM are mapped uncacheable.
+ */
+#define	PHM_DIRECT_MAP_BASE			0xFFFF850000000000UL
+#define	PHM_DIRECT_MAP_SIZE			0x8000000000UL
+#define	PHYS_TO_VIRT(addr)			((void*)(PHM_DIRECT_MAP_BASE + (uint64_t)(addr)))
+#define	FRAME_TO_VIRT(frame)			PHYS_TO_VIRT((uint64_t)(frame) << 12)
+
+/**
+ * Physical address one past the last byte covered by the direct map.
+ */
+extern uint64_t phmDirectMapEnd;
+
+/**
+ * Initialize the physical memory manager. initPhysMem() also sets up the direct map.
  */
 void initPhysMem(uint64_t numPages, MultibootMemoryMap *mmap, uint64_t mmapEnd, uint64_t end);
 void initPhysMem2();
 
 /**
- * Allocate a list of consecutive frames, and return the index of the first one.
- * Flags should be 0.
+ * Start the page reclaim thread. Called once the scheduler is up.
+ */
+void initPhysMem3();
+
+/**
+ * Flags for phmAllocFrameEx().
+ */
+#define	PHM_NOPERCPU				(1 << 0)		/* bypass the per-CPU frame list */
+
+/**
+ * Allocate a list of consecutive frames, and return the index of the first one. The run is
+ * aligned to the next power of two at or above 'count', and may be at most 1024 frames long.
+ * Flags are a bitwise-OR of PHM_*; PHM_NOPERCPU must be passed while the calling CPU's per-CPU
+ * area is not yet mapped.
  * Return 0 on failure.
  */
 uint64_t phmAllocFrameEx(uint64_t count, int flags);
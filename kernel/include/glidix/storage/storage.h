@@ -58,9 +58,55 @@
 #define	SD_TRACK_SIZE				0x8000UL
 
 /**
- * Cache flags.
+ * Cache flags. Dirty entries also hold, in the bits above SD_BLOCK_DIRTY, the writeback epoch (the low bits
+ * of 'dirtyTick') at which they became dirty.
  */
 #define	SD_BLOCK_DIRTY				(1UL << 48)
+#define	SD_BLOCK_EPOCH_SHIFT			49
+#define	SD_BLOCK_EPOCH_MAX			0x7FUL
+#define	SD_BLOCK_EPOCH_MASK			(SD_BLOCK_EPOCH_MAX << SD_BLOCK_EPOCH_SHIFT)
+
+/**
+ * The flush thread wakes up every SD_WRITEBACK_INTERVAL, and writes back the tracks which have been dirty
+ * for at least SD_DIRTY_EXPIRE intervals.
+ */
+#define	SD_WRITEBACK_INTERVAL			NT_SECS(5)
+#define	SD_DIRTY_EXPIRE				6
+
+/**
+ * I/O request types.
+ */
+#define	SD_REQ_READ				0
+#define	SD_REQ_WRITE				1
+
+/**
+ * How long a read or write request may wait in the queue before it is dispatched regardless of the
+ * elevator order.
+ */
+#define	SD_DEADLINE_READ			NT_MILLI(50)
+#define	SD_DEADLINE_WRITE			NT_MILLI(500)
+
+/**
+ * Maximum size of a merged transfer, in bytes (the size of the per-device merge buffer).
+ */
+#define	SD_MERGE_MAX				0x40000UL
+
+/**
+ * Maximum number of frames in a merged transfer of frames, and in each transfer done by sdReadFrames()
+ * and sdWriteFrames().
+ */
+#define	SD_MERGE_FRAMES				256
+
+/**
+ * Maximum number of I/O threads per storage device, and their stack size.
+ */
+#define	SD_MAX_WORKERS				8
+#define	SD_WORKER_STACK_SIZE			0x10000
+
+/**
+ * Number of track writes which a flush keeps queued at once.
+ */
+#define	SD_FLUSH_BATCH				32
 
 /**
  * MBR partition entry.
@@ -172,8 +218,83 @@ typedef struct
 	 * EIO).
 	 */
 	int (*eject)(void *drvdata);
+	
+	/**
+	 * Maximum number of bytes which readBlocks() and writeBlocks() accept in a single call. The I/O
+	 * queue merges adjacent requests up to this size, and splits larger ones. If this is 0 (or not
+	 * present), SD_TRACK_SIZE is assumed.
+	 */
+	size_t maxTransfer;
+	
+	/**
+	 * Number of readBlocks() and writeBlocks() calls which may be in progress at the same time (for
+	 * drivers which queue commands on the device). The storage device gets this many I/O threads,
+	 * up to SD_MAX_WORKERS. If this is 0 (or not present), 1 is assumed.
+	 */
+	int queueDepth;
+	
+	/**
+	 * Optional. Transfer 'numBlocks' blocks starting at 'startBlock' to (SD_REQ_READ) or from (SD_REQ_WRITE)
+	 * the physical pages whose frame numbers are listed in 'frames', in order; the transfer size is always
+	 * a multiple of the page size. The driver splits the transfer into as many commands as it needs, and
+	 * may not allocate memory, as with readBlocks(). If this is not implemented, the pages are transferred
+	 * through the direct map with readBlocks() and writeBlocks().
+	 */
+	int (*transferFrames)(void *drvdata, int type, size_t startBlock, size_t numBlocks, const uint64_t *frames);
 } SDOps;
 
+/**
+ * An I/O request, submitted to a device with sdSubmit().
+ */
+typedef struct SDRequest_
+{
+	/**
+	 * Next request in the queue (used internally).
+	 */
+	struct SDRequest_*			next;
+	
+	/**
+	 * Type of request (SD_REQ_READ or SD_REQ_WRITE).
+	 */
+	int					type;
+	
+	/**
+	 * The range of blocks to transfer, and the buffer to transfer into or out of.
+	 */
+	size_t					startBlock;
+	size_t					numBlocks;
+	void*					buffer;
+	
+	/**
+	 * If not NULL, the request transfers to or from these page frames (see SDOps.transferFrames) instead
+	 * of 'buffer'.
+	 */
+	const uint64_t*				frames;
+	
+	/**
+	 * Called by the I/O thread once the request has completed, with 'status' set to 0 or an error
+	 * number. This must not block on any other I/O; the request may be released once it is called.
+	 */
+	void (*callback)(struct SDRequest_ *req);
+	void*					context;
+	int					status;
+	
+	/**
+	 * Time (nanotime) at which the request must be dispatched (set by sdSubmit()).
+	 */
+	uint64_t				deadline;
+} SDRequest;
+
+/**
+ * Describes a track being loaded into the cache, or written directly to disk, while the cache lock is
+ * not held. Lives on the stack of the thread doing the transfer.
+ */
+typedef struct SDInflight_
+{
+	struct SDInflight_*			next;
+	uint64_t				track;
+} SDInflight;
+
 /**
  * Represents a storage device.
  */
@@ -226,12 +347,17 @@ typedef struct
 	uint64_t				openParts;
 	
 	/**
-	 * The thread which flushes the drive every 10-20 seconds, and a semaphore which is signalled when
+	 * The thread which writes back old dirty tracks, and a semaphore which is signalled when
 	 * the thread should terminate.
 	 */
 	Thread*					threadFlush;
 	Semaphore				semFlush;
 	
+	/**
+	 * Number of writeback intervals which have passed; used to age dirty tracks. Protected by 'cacheLock'.
+	 */
+	uint64_t				dirtyTick;
+	
 	/**
 	 * This mutex protects the cache.
 	 */
@@ -242,6 +368,42 @@ typedef struct
 	 */
 	BlockTreeNode				cacheTop;
 	
+	/**
+	 * Index of the next track to be examined by the cache reclaim CLOCK (see sdFreeMemory()).
+	 * Protected by 'cacheLock'.
+	 */
+	uint64_t				clockTrack;
+	
+	/**
+	 * List of tracks currently being transferred with the cache lock dropped, and a semaphore on which
+	 * 'inflightWaiters' threads are waiting for such transfers to finish. Protected by 'cacheLock'.
+	 */
+	SDInflight*				inflight;
+	int					inflightWaiters;
+	Semaphore				semInflight;
+	
+	/**
+	 * The I/O request queue (in order of submission) and the lock protecting it. 'ioNext' is the block
+	 * after the end of the last dispatched request, where the elevator currently is.
+	 */
+	Mutex					ioLock;
+	SDRequest*				ioQueue;
+	size_t					ioNext;
+	
+	/**
+	 * The threads which service the request queue, and a semaphore signalled when a request is submitted
+	 * (or the threads should terminate).
+	 */
+	Thread*					ioWorkers[SD_MAX_WORKERS];
+	int					numWorkers;
+	Semaphore				semIO;
+	
+	/**
+	 * The buffer used for merged transfers, and the lock held by the thread using it.
+	 */
+	void*					ioMergeBuffer;
+	Mutex					mergeLock;
+	
 	/**
 	 * Path to the GUID link or NULL.
 	 */
@@ -319,13 +481,54 @@ StorageDevice* sdCreate(SDParams *params, const char *name, SDOps *ops, void *dr
  */
 void sdHangup(StorageDevice *sd);
 
+/**
+ * Queue an I/O request on a storage device. Requests are dispatched by the device's I/O threads in
+ * elevator order (unless their deadline passes first), with adjacent requests of the same type merged
+ * into a single transfer. 'req->callback' is called on completion.
+ */
+void sdSubmit(StorageDevice *sd, SDRequest *req);
+
+/**
+ * Submit an I/O request and wait for it to complete. Returns 0 on success or an error number.
+ */
+int sdIO(StorageDevice *sd, int type, size_t startBlock, size_t numBlocks, void *buffer);
+
 /**
  * Flush all disk caches to memory.
  */
 void sdSync();
 
 /**
- * TODO
+ * Read or write a storage device (or partition) opened as 'fp', without adding the data to the block
+ * cache. Filesystem drivers use this for file contents, which are already cached in file trees, and
+ * keep the block cache for metadata. Tracks which are already cached are used for reads and updated
+ * by writes, so the two paths stay coherent. If 'fp' is not a storage device, or the range is not
+ * block-aligned, these fall back to normal cached I/O. Return the number of bytes transferred, or -1
+ * on error (with ERRNO set).
+ */
+ssize_t sdReadDirect(File *fp, void *buffer, size_t size, off_t offset);
+ssize_t sdWriteDirect(File *fp, const void *buffer, size_t size, off_t offset);
+
+/**
+ * Like sdReadDirect() and sdWriteDirect(), but transfer 'count' whole pages at 'offset' directly to or from
+ * the physical frames in 'frames', with as few commands as the driver allows. Used by filesystem drivers
+ * to move runs of page cache pages which are contiguous on disk.
+ */
+ssize_t sdReadFrames(File *fp, const uint64_t *frames, int count, off_t offset);
+ssize_t sdWriteFrames(File *fp, const uint64_t *frames, int count, off_t offset);
+
+/**
+ * Write out the cached blocks of the storage device (or partition) opened as 'fp' which cover 'size' bytes at
+ * 'offset', and wait for the writes to complete. Filesystem drivers use this to commit just the metadata that
+ * a file depends on, instead of the whole device. If 'fp' is not a storage device, the whole file is flushed.
+ * Returns 0 on success, or an error number.
+ */
+int sdSyncRange(File *fp, off_t offset, size_t size);
+
+/**
+ * Evict one track from the block caches, writing it back first if it is dirty, and return one of its
+ * frames (the rest are freed); return 0 if nothing could be evicted. Tracks are chosen by a CLOCK over
+ * each device in turn, using the track usage counter as the reference bit.
  */
 uint64_t	sdFreeMemory();
 
@@ -57,7 +57,8 @@
 
 /**
  * Set if at least 1 process accessed the page before unmapping it (so the access time needs to
- * be updated).
+ * be updated). Page reclaim also uses this as the reference bit of its CLOCK: cached pages with
+ * this flag set get a second chance before being evicted.
  */
 #define	PI_ACCESSED				(1UL << 34)
 
@@ -120,6 +121,11 @@ void piUncache(uint64_t frame);
  */
 int piCheckFlush(uint64_t frame);
 
+/**
+ * Clear the accessed flag of a page, and return true if it was set.
+ */
+int piCheckAccessed(uint64_t frame);
+
 /**
  * Mark a page as cached, with a reference count of 0xFFFFFF. The page must not have been accessed before.
  * This is used for things like mapping video memory.
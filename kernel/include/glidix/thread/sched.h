@@ -462,6 +462,19 @@ typedef struct _Thread
 	 */
 	RunqueueEntry			runq;
 	
+	/**
+	 * ID of the CPU this thread last ran on; the scheduler tries to queue it there again
+	 * when it becomes runnable.
+	 */
+	int				lastCPU;
+	
+	/**
+	 * If nonzero, this is 1 plus the ID of a CPU which is running this thread, or is still on its
+	 * kernel stack while switching away from it; no other CPU may resume the thread until this is
+	 * cleared. It is cleared by switchContextFrom() once the old stack is no longer in use.
+	 */
+	volatile int			onCPU;
+	
 	/**
 	 * Nice value of the thread.
 	 */
@@ -543,6 +556,7 @@ void initSched();
 void initSched2();
 void initSchedAP();				// initialize scheduling on an AP, when the main sched is already inited
 void switchContext(Regs *regs);
+void switchContextFrom(Regs *regs, volatile int *prevOnCPU);	// like switchContext(), but clears *prevOnCPU once off the old stack
 void dumpRunqueue();
 void switchTask(Regs *regs);
 void switchTaskUnlocked(Regs *regs);
@@ -696,7 +710,8 @@ int thnice(int incr);
  * Map a different frame into the "temporary page", and return the previous frame number. You MUST map the old
  * page number in before the calling function returns. Most importantly, since the temporary page is at the
  * top of the kernel stack, and that area is used by signal dispatching, it MUST be returned to normal before
- * returning to userspace.
+ * returning to userspace. RAM is always accessible through the direct map (FRAME_TO_VIRT() in physmem.h), so
+ * this is only needed for device memory above it.
  */
 uint64_t mapTempFrame(uint64_t frame);
 
@@ -42,6 +42,7 @@ extern int readyForDynamic;
 
 void initMemoryPhase1(uint64_t placement, uint64_t size);
 void initMemoryPhase2();
+void initMemoryPhase3();
 void *kxmallocDynamic(size_t size, int flags, const char *aid, int lineno);
 void *_kxmalloc(size_t size, int flags, const char *aid, int lineno);
 void *_kmalloc(size_t size, const char *aid, int lineno);
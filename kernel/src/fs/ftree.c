@@ -35,15 +35,74 @@
 #include <glidix/thread/sched.h>
 #include <glidix/display/console.h>
 #include <glidix/hw/physmem.h>
+#include <glidix/util/time.h>
 
 static Mutex ftMtx;
 static FileTree* ftFirst;
 static FileTree* ftLast;
 
+/**
+ * The tree currently under the page reclaim CLOCK hand; NULL means the start of the list.
+ */
+static FileTree* ftClockHand;
+
+/**
+ * Flush trees whose dirty pages have reached FT_DIRTY_EXPIRE. Each tree is pinned with a reference while it is
+ * flushed, so that the list lock is not held during I/O; the pin is kept until the lock has been taken again and
+ * the next tree found, so the cursor is always valid. If the tree was uncached in the meantime, the scan starts
+ * over.
+ */
+static void ftWriteback()
+{
+	uint64_t now = getNanotime();
+	FileTree *held = NULL;
+	
+	mutexLock(&ftMtx);
+	FileTree *ft = ftFirst;
+	while (ft != NULL)
+	{
+		if (ft->dirtyTime == 0 || (now - ft->dirtyTime) < FT_DIRTY_EXPIRE)
+		{
+			ft = ft->next;
+			continue;
+		};
+		
+		ftUp(ft);
+		mutexUnlock(&ftMtx);
+		
+		if (held != NULL) ftDown(held);
+		held = ft;
+		
+		ftFlush(ft);
+		
+		mutexLock(&ftMtx);
+		ft = held->next;
+		if (held->flags & FT_ANON) ft = ftFirst;
+	};
+	mutexUnlock(&ftMtx);
+	
+	if (held != NULL) ftDown(held);
+};
+
+static void ftWritebackThread(void *context)
+{
+	while (1)
+	{
+		sleep(FT_WRITEBACK_INTERVAL / NT_MILLI(1));
+		ftWriteback();
+	};
+};
+
 void ftInit()
 {
 	mutexInit(&ftMtx);
 	ftFirst = ftLast = NULL;
+	
+	KernelThreadParams pars;
+	memset(&pars, 0, sizeof(KernelThreadParams));
+	pars.stackSize = DEFAULT_STACK_SIZE;
+	pars.name = "File writeback";
+	CreateKernelThread(ftWritebackThread, &pars, NULL);
 };
 
 FileTree* ftCreate(int flags)
@@ -88,12 +147,16 @@ void ftUp(FileTree *ft)
 	__sync_add_and_fetch(&ft->refcount, 1);
 };
 
+/**
+ * In the functions below, 'level' is the number of levels below 'node' (0 means its entries are frames),
+ * and 'base' is the index of 'node' within its level.
+ */
 static void deleteTree(int level, FileNode *node)
 {
 	int i;
-	for (i=0; i<16; i++)
+	for (i=0; i<FT_NODE_ENTRIES; i++)
 	{
-		if (level == 12)
+		if (level == 0)
 		{
 			if (node->entries[i] != 0) piUncache(node->entries[i]);
 		}
@@ -102,41 +165,76 @@ static void deleteTree(int level, FileNode *node)
 			FileNode *subnode = node->nodes[i];
 			if (subnode != NULL)
 			{
-				deleteTree(level+1, subnode);
+				deleteTree(level-1, subnode);
+				kfree(subnode);
 			};
-			kfree(subnode);
 		};
 	};
 };
 
-static void flushTree(FileTree *ft, int level, FileNode *node, uint64_t base)
+/**
+ * Flush the dirty pages in a leaf. If the driver has flushRange(), each run of consecutive dirty pages is
+ * written with a single call.
+ */
+static void flushLeaf(FileTree *ft, FileNode *node, uint64_t base)
 {
+	uint64_t run[FT_NODE_ENTRIES];
+	int runStart = 0;
+	int runLen = 0;
+	
 	int i;
-	for (i=0; i<16; i++)
+	for (i=0; i<FT_NODE_ENTRIES; i++)
 	{
-		uint64_t pos = (base << 4) | (uint64_t)i;
-		if (level == 12)
+		uint64_t pos = (base << FT_NODE_SHIFT) | (uint64_t)i;
+		uint64_t frame = node->entries[i];
+		
+		if (frame == 0 || !piCheckFlush(frame))
 		{
-			if (ft->flush != NULL)
+			if (runLen != 0)
 			{
-				if (node->entries[i] != 0)
-				{
-					if (piCheckFlush(node->entries[i]))
-					{
-						uint8_t pagebuf[0x1000];
-						frameRead(node->entries[i], pagebuf);
-						ft->flush(ft, pos << 12, pagebuf);
-					};
-				};
+				uint64_t runPos = (base << FT_NODE_SHIFT) | (uint64_t)runStart;
+				ft->flushRange(ft, runPos << 12, run, runLen);
+				runLen = 0;
 			};
 		}
+		else if (ft->flushRange != NULL)
+		{
+			if (runLen == 0) runStart = i;
+			run[runLen++] = frame;
+		}
 		else
 		{
-			FileNode *subnode = node->nodes[i];
-			if (subnode != NULL)
-			{
-				flushTree(ft, level+1, subnode, pos);
-			};
+			ft->flush(ft, pos << 12, FRAME_TO_VIRT(frame));
+		};
+	};
+	
+	if (runLen != 0)
+	{
+		uint64_t runPos = (base << FT_NODE_SHIFT) | (uint64_t)runStart;
+		ft->flushRange(ft, runPos << 12, run, runLen);
+	};
+};
+
+static void flushTree(FileTree *ft, int level, FileNode *node, uint64_t base)
+{
+	if (level == 0)
+	{
+		if (ft->flush != NULL || ft->flushRange != NULL)
+		{
+			flushLeaf(ft, node, base);
+		};
+		
+		return;
+	};
+	
+	int i;
+	for (i=0; i<FT_NODE_ENTRIES; i++)
+	{
+		uint64_t pos = (base << FT_NODE_SHIFT) | (uint64_t)i;
+		FileNode *subnode = node->nodes[i];
+		if (subnode != NULL)
+		{
+			flushTree(ft, level-1, subnode, pos);
 		};
 	};
 };
@@ -151,14 +249,15 @@ void ftDown(FileTree *ft)
 			if (ft->getpage == NULL)
 			{
 				// uncache all pages
-				deleteTree(0, &ft->top);
+				deleteTree(ft->depth, &ft->top);
 			};
 
 			kfree(ft);
 		}
 		else
 		{
-			flushTree(ft, 0, &ft->top, 0);
+			ft->dirtyTime = 0;
+			flushTree(ft, ft->depth, &ft->top, 0);
 		};
 	};
 };
@@ -166,77 +265,205 @@ void ftDown(FileTree *ft)
 void ftFlush(FileTree *ft)
 {
 	semWait(&ft->lock);
-	flushTree(ft, 0, &ft->top, 0);
+	ft->dirtyTime = 0;
+	flushTree(ft, ft->depth, &ft->top, 0);
 	semSignal(&ft->lock);
 };
 
-static uint64_t getPageUnlocked(FileTree *ft, off_t pos)
+/**
+ * Note that a page of the tree was dirtied. Call with the tree locked.
+ */
+static void markTreeDirty(FileTree *ft)
 {
-	if (ft->getpage != NULL)
+	if (ft->dirtyTime == 0) ft->dirtyTime = getNanotime();
+};
+
+/**
+ * Return a pointer to the contents of the specified frame. Cached pages are always within the direct
+ * map; only frames returned by a 'getpage' callback (device memory such as framebuffers) may lie
+ * above it, in which case they are mapped onto the temporary frame. Pass the value stored in 'old'
+ * to unmapFrame() when done.
+ */
+static void* mapFrame(uint64_t frame, uint64_t *old)
+{
+	if ((frame << 12) < phmDirectMapEnd)
 	{
-		uint64_t frame = ft->getpage(ft, pos & ~0xFFF);
-		piStaticFrame(frame);
-		return frame;
+		*old = 0;
+		return FRAME_TO_VIRT(frame);
+	};
+	
+	*old = mapTempFrame(frame);
+	return tmpframe();
+};
+
+static void unmapFrame(uint64_t old)
+{
+	if (old != 0) mapTempFrame(old);
+};
+
+/**
+ * Return the bottom-level node covering the page at 'pos'; the page's entry is at index
+ * (pos >> 12) & FT_NODE_MASK. If 'make' is nonzero, the tree is grown and nodes are created as
+ * necessary; otherwise NULL is returned if the node does not exist.
+ */
+static FileNode* getLeaf(FileTree *ft, off_t pos, int make)
+{
+	uint64_t page = (uint64_t) pos >> 12;
+	
+	// add levels at the top until the page is covered; the old top becomes the first child
+	while ((page >> (FT_NODE_SHIFT * (ft->depth+1))) != 0)
+	{
+		if (!make) return NULL;
+		
+		FileNode *newNode = NEW(FileNode);
+		memcpy(newNode, &ft->top, sizeof(FileNode));
+		memset(&ft->top, 0, sizeof(FileNode));
+		ft->top.nodes[0] = newNode;
+		ft->depth++;
 	};
 	
 	FileNode *node = &ft->top;
-	int i;
-	for (i=0; i<12; i++)
+	int level;
+	for (level=ft->depth; level>0; level--)
 	{
-		uint64_t ent = (pos >> (12 + 4 * (12 - i))) & 0xF;
+		uint64_t ent = (page >> (FT_NODE_SHIFT * level)) & FT_NODE_MASK;
 		
 		if (node->nodes[ent] == NULL)
 		{
+			if (!make) return NULL;
+			
 			FileNode *newNode = NEW(FileNode);
 			memset(newNode, 0, sizeof(FileNode));
-			
 			node->nodes[ent] = newNode;
-			node = newNode;
-		}
-		else
-		{
-			node = node->nodes[ent];
 		};
+		
+		node = node->nodes[ent];
 	};
 	
-	// load the page if necessary
-	uint64_t pageIndex = (pos >> 12) & 0xF;
-	if (node->entries[pageIndex] == 0)
+	return node;
+};
+
+/**
+ * Load the page at 'pos', which is not in the cache, along with up to 'count'-1 of the pages after it,
+ * stopping at the end of the file or at the first page which is already cached. Each page is loaded
+ * straight into a new (zeroed) frame, and all of them with a single loadRange() call if the driver has
+ * one. Returns the frame for 'pos' with a reference held, or 0 on error; the other pages are left in the
+ * cache unreferenced.
+ */
+static uint64_t loadPages(FileTree *ft, off_t pos, int count)
+{
+	uint64_t frames[FT_RA_MAX];
+	FileNode *leaves[FT_RA_MAX];
+	
+	int num;
+	for (num=0; num<count; num++)
 	{
-		// first let's try loading
-		uint8_t pagebuf[0x1000];
-		memset(pagebuf, 0, 0x1000);
+		off_t pagePos = pos + ((off_t)num << 12);
 		
-		if ((ft->flags & FT_ANON) == 0)
+		// readahead stops at the end of the file or at a cached page; only create nodes for
+		// pages we are actually going to load
+		if (num != 0)
 		{
-			if (ft->load == NULL)
-			{
-				return 0;
-			};
-		
-			if (ft->load(ft, pos, pagebuf) != 0)
-			{
-				return 0;
-			};
+			if (pagePos >= ft->size) break;
+			
+			FileNode *leaf = getLeaf(ft, pagePos, 0);
+			if (leaf != NULL && leaf->entries[(pagePos >> 12) & FT_NODE_MASK] != 0) break;
 		};
 		
-		uint64_t frame = piNew(PI_CACHE);
-		if (frame == 0)
+		leaves[num] = getLeaf(ft, pagePos, 1);
+		frames[num] = piNew(PI_CACHE);
+		if (frames[num] == 0) break;
+	};
+	
+	if (num == 0)
+	{
+		return 0;
+	};
+	
+	int loaded;
+	if (ft->flags & FT_ANON)
+	{
+		loaded = num;
+	}
+	else if (ft->loadRange != NULL)
+	{
+		loaded = ft->loadRange(ft, pos, frames, num);
+	}
+	else
+	{
+		// without loadRange(), callers never ask for more than one page
+		loaded = (ft->load(ft, pos, FRAME_TO_VIRT(frames[0])) == 0) ? 1 : -1;
+	};
+	
+	int i;
+	for (i=0; i<num; i++)
+	{
+		if (i < loaded)
 		{
-			return 0;
+			off_t pagePos = pos + ((off_t)i << 12);
+			leaves[i]->entries[(pagePos >> 12) & FT_NODE_MASK] = frames[i];
+			
+			// only the requested page is referenced by the caller
+			if (i != 0) piDecref(frames[i]);
+		}
+		else
+		{
+			piUncache(frames[i]);
+			piDecref(frames[i]);
 		};
-		
-		frameWrite(frame, pagebuf);
-		
-		node->entries[pageIndex] = frame;
+	};
+	
+	if (loaded < 1)
+	{
+		return 0;
+	};
+	
+	return frames[0];
+};
+
+static uint64_t getPageUnlocked(FileTree *ft, off_t pos)
+{
+	if (ft->getpage != NULL)
+	{
+		uint64_t frame = ft->getpage(ft, pos & ~0xFFF);
+		piStaticFrame(frame);
 		return frame;
-	}
-	else
+	};
+	
+	uint64_t page = pos >> 12;
+	int sequential = (page == ft->raLast+1);
+	ft->raLast = page;
+	
+	FileNode *node = getLeaf(ft, pos, 1);
+	uint64_t frame = node->entries[page & FT_NODE_MASK];
+	if (frame != 0)
 	{
-		uint64_t frame = node->entries[pageIndex];
 		piIncref(frame);
 		return frame;
 	};
+	
+	if ((ft->flags & FT_ANON) == 0 && ft->load == NULL && ft->loadRange == NULL)
+	{
+		return 0;
+	};
+	
+	// grow the readahead window while misses are sequential, and drop it as soon as they are not
+	if ((ft->flags & FT_ANON) || ft->loadRange == NULL || !sequential)
+	{
+		ft->raWindow = 0;
+	}
+	else if (ft->raWindow == 0)
+	{
+		ft->raWindow = FT_RA_MIN;
+	}
+	else if (ft->raWindow < FT_RA_MAX)
+	{
+		ft->raWindow *= 2;
+	};
+	
+	int count = ft->raWindow;
+	if (count == 0) count = 1;
+	return loadPages(ft, pos & ~0xFFF, count);
 };
 
 uint64_t ftGetPage(FileTree *ft, off_t pos)
@@ -278,9 +505,9 @@ ssize_t ftRead(FileTree *ft, void *buffer, size_t size, off_t pos)
 		}
 		else
 		{
-			uint64_t old = mapTempFrame(frame);
-			memcpy(put, (char*) tmpframe() + (pos & 0xFFF), sizeToRead);
-			mapTempFrame(old);
+			uint64_t old;
+			memcpy(put, (char*) mapFrame(frame, &old) + (pos & 0xFFF), sizeToRead);
+			unmapFrame(old);
 			piMarkAccessed(frame);
 			piDecref(frame);
 		};
@@ -333,12 +560,13 @@ ssize_t ftWrite(FileTree *ft, const void *buffer, size_t size, off_t pos)
 		}
 		else
 		{
-			uint64_t old = mapTempFrame(frame);
-			memcpy((char*) tmpframe() + (pos & 0xFFF), scan, sizeToWrite);
-			mapTempFrame(old);
+			uint64_t old;
+			memcpy((char*) mapFrame(frame, &old) + (pos & 0xFFF), scan, sizeToWrite);
+			unmapFrame(old);
 			piMarkAccessed(frame);
 			piMarkDirty(frame);
 			piDecref(frame);
+			markTreeDirty(ft);
 		};
 		
 		scan += sizeToWrite;
@@ -351,6 +579,44 @@ ssize_t ftWrite(FileTree *ft, const void *buffer, size_t size, off_t pos)
 	return sizeWritten;
 };
 
+/**
+ * Uncache all pages at index 'firstPage' and above, and delete the nodes which no longer hold any.
+ */
+static void truncateTree(int level, FileNode *node, uint64_t base, uint64_t firstPage)
+{
+	int i;
+	for (i=0; i<FT_NODE_ENTRIES; i++)
+	{
+		uint64_t index = (base << FT_NODE_SHIFT) | (uint64_t)i;
+		uint64_t start = index << (FT_NODE_SHIFT * level);
+		uint64_t span = 1UL << (FT_NODE_SHIFT * level);
+		
+		if ((start + span) <= firstPage) continue;
+		
+		if (level == 0)
+		{
+			if (node->entries[i] != 0)
+			{
+				piUncache(node->entries[i]);
+				node->entries[i] = 0;
+			};
+		}
+		else if (node->nodes[i] != NULL)
+		{
+			if (start >= firstPage)
+			{
+				deleteTree(level-1, node->nodes[i]);
+				kfree(node->nodes[i]);
+				node->nodes[i] = NULL;
+			}
+			else
+			{
+				truncateTree(level-1, node->nodes[i], index, firstPage);
+			};
+		};
+	};
+};
+
 int ftTruncate(FileTree *ft, size_t size)
 {
 	if (ft->flags & FT_FIXED_SIZE)
@@ -367,37 +633,7 @@ int ftTruncate(FileTree *ft, size_t size)
 	
 	if (size < ft->size)
 	{
-		size_t pos;
-		for (pos=(size+0xFFF) & (~0xFFF); pos<ft->size; pos+=0x1000)
-		{
-			FileNode *node = &ft->top;
-			int i;
-			int foundNode = 1;
-			for (i=0; i<12; i++)
-			{
-				uint64_t ent = (pos >> (12 + 4 * (12 - i))) & 0xF;
-		
-				if (node->nodes[ent] == NULL)
-				{
-					foundNode = 0;
-					break;
-				}
-				else
-				{
-					node = node->nodes[ent];
-				};
-			};
-			
-			if (foundNode)
-			{
-				uint64_t pageIndex = (pos >> 12) & 0xF;
-				if (node->entries[pageIndex] != 0)
-				{
-					piUncache(node->entries[pageIndex]);
-					node->entries[pageIndex] = 0;
-				};
-			};
-		};
+		truncateTree(ft->depth, &ft->top, 0, (size+0xFFF) >> 12);
 	};
 	
 	// zero out the end of the current page if truncating on a non-page-boundary.
@@ -406,12 +642,13 @@ int ftTruncate(FileTree *ft, size_t size)
 		uint64_t frame = getPageUnlocked(ft, size & ~0xFFF);
 		if (frame != 0)
 		{
-			uint64_t old = mapTempFrame(frame);
-			memset((char*) tmpframe() + (size & 0xFFF), 0, 0x1000 - (size & 0xFFF));
-			mapTempFrame(old);
+			uint64_t old;
+			memset((char*) mapFrame(frame, &old) + (size & 0xFFF), 0, 0x1000 - (size & 0xFFF));
+			unmapFrame(old);
 			piMarkAccessed(frame);
 			piMarkDirty(frame);
 			piDecref(frame);
+			markTreeDirty(ft);
 		};
 	};
 	
@@ -423,29 +660,36 @@ int ftTruncate(FileTree *ft, size_t size)
 void ftUncache(FileTree *ft)
 {
 	// TODO: maybe remove all the file locks ??
+	// taking the tree lock waits for any flush in progress, so none can call the driver after we return
+	semWait(&ft->lock);
 	mutexLock(&ftMtx);
+	if (ftClockHand == ft) ftClockHand = ft->next;
 	if (ft->prev != NULL) ft->prev->next = ft->next;
 	if (ftFirst == ft) ftFirst = ft->next;
 	if (ft->next != NULL) ft->next->prev = ft->prev;
 	if (ftLast == ft) ftLast = ft->prev;
 	ft->load = NULL;
+	ft->loadRange = NULL;
 	ft->flush = NULL;
+	ft->flushRange = NULL;
 	ft->update = NULL;
 	ft->flags |= FT_ANON;
+	ft->dirtyTime = 0;
 	mutexUnlock(&ftMtx);
+	semSignal(&ft->lock);
 };
 
 static void ftDumpTree(FileTree *ft, int level, FileNode *node, uint64_t base)
 {
 	char tabs[16];
 	memset(tabs, 0, 16);
-	memset(tabs, ' ', level+1);
+	memset(tabs, ' ', ft->depth-level+1);
 
 	int i;
-	for (i=0; i<16; i++)
+	for (i=0; i<FT_NODE_ENTRIES; i++)
 	{
-		uint64_t pos = (base << 4) | (uint64_t)i;
-		if (level == 12)
+		uint64_t pos = (base << FT_NODE_SHIFT) | (uint64_t)i;
+		if (level == 0)
 		{
 			if (node->entries[i] != 0)
 			{
@@ -461,49 +705,58 @@ static void ftDumpTree(FileTree *ft, int level, FileNode *node, uint64_t base)
 			if (subnode != NULL)
 			{
 				kprintf("%sEntry %d:\n", tabs, i);
-				ftDumpTree(ft, level+1, subnode, pos);
+				ftDumpTree(ft, level-1, subnode, pos);
 			};
 		};
 	};
 };
 
-static uint64_t tryFreeFrame(FileTree *ft, int level, FileNode *node, uint64_t base)
-{	
+/**
+ * Advance the CLOCK hand of 'ft' from 'clockPos' to the next evictable page, and evict it. Returns the frame,
+ * or 0 if the end of the tree was reached first. Call with the tree locked, as getLeaf() and truncateTree()
+ * change its shape.
+ */
+static uint64_t clockScan(FileTree *ft, int level, FileNode *node, uint64_t base)
+{
 	int i;
-	for (i=0; i<16; i++)
+	for (i=0; i<FT_NODE_ENTRIES; i++)
 	{
-		uint64_t pos = (base << 4) | (uint64_t)i;
-		if (level == 12)
+		uint64_t index = (base << FT_NODE_SHIFT) | (uint64_t)i;
+		uint64_t start = index << (FT_NODE_SHIFT * level);
+		uint64_t span = 1UL << (FT_NODE_SHIFT * level);
+		
+		if ((start + span) <= ft->clockPos) continue;
+		
+		if (level == 0)
 		{
-			if (node->entries[i] != 0)
+			uint64_t frame = node->entries[i];
+			if (frame == 0) continue;
+			
+			ft->clockPos = index + 1;
+			
+			uint64_t flags = piGetInfo(frame);
+			if ((flags & 0xFFFFFFFF) != 0) continue;
+			if (piCheckAccessed(frame)) continue;
+			
+			if (piCheckFlush(frame))
 			{
-				uint64_t flags = piGetInfo(node->entries[i]);
-				if ((flags & 0xFFFFFFFF) == 0)
+				if (ft->flush != NULL)
 				{
-					if (flags & PI_DIRTY)
-					{
-						if (ft->flush != NULL)
-						{
-							uint8_t pagebuf[0x1000];
-							frameRead(node->entries[i], pagebuf);
-							ft->flush(ft, pos << 12, pagebuf);
-						};
-					};
-					
-					uint64_t ent = node->entries[i];
-					node->entries[i] = 0;
-					__sync_fetch_and_add(&phmCachedFrames, -1);
-					return ent;
+					ft->flush(ft, index << 12, FRAME_TO_VIRT(frame));
 				};
 			};
+			
+			node->entries[i] = 0;
+			__sync_fetch_and_add(&phmCachedFrames, -1);
+			return frame;
 		}
 		else
 		{
 			FileNode *subnode = node->nodes[i];
 			if (subnode != NULL)
 			{
-				uint64_t val = tryFreeFrame(ft, level+1, subnode, pos);
-				if (val != 0) return val;
+				uint64_t frame = clockScan(ft, level-1, subnode, index);
+				if (frame != 0) return frame;
 			};
 		};
 	};
@@ -526,36 +779,44 @@ uint64_t ftGetFreePage()
 	
 	currentlyInFreePage = 1;
 	
-	FileTree *ft;
-	for (ft=ftFirst; ft!=NULL; ft=ft->next)
+	// go around at most twice: the first round may only clear accessed flags
+	FileTree *ft = ftClockHand;
+	if (ft == NULL) ft = ftFirst;
+	FileTree *start = ft;
+	int rounds = 0;
+	
+	while (ft != NULL)
 	{
-		if (ft->getpage == NULL)
+		// trees which are busy (possibly being grown or truncated, or held by the thread which is
+		// allocating right now) are skipped rather than waited for
+		if (ft->getpage == NULL && semWaitGen(&ft->lock, 1, SEM_W_NONBLOCK, 0) == 1)
 		{
-			uint64_t maybeFrame = tryFreeFrame(ft, 0, &ft->top, 0);
-			if (maybeFrame != 0)
+			uint64_t frame = clockScan(ft, ft->depth, &ft->top, 0);
+			
+			// if we reached the end of this tree, rewind it for the next round
+			if (frame == 0) ft->clockPos = 0;
+			semSignal(&ft->lock);
+			
+			if (frame != 0)
 			{
-				// move this FileTree to the end of the list, so that we don't
-				// always free from the same one
-				if (ft != ftLast)
-				{
-					if (ftFirst == ft) ftFirst = ft->next;
-					if (ft->prev != NULL) ft->prev->next = ft->next;
-					if (ft->next != NULL) ft->next->prev = ft->prev;
-					
-					ftLast->next = ft;
-					ft->next = NULL;
-					ft->prev = ftLast;
-					
-					ftLast = ft;
-				};
-
+				ftClockHand = ft;
 				currentlyInFreePage = 0;
 				mutexUnlock(&ftMtx);
-				return maybeFrame;
+				return frame;
 			};
 		};
+		
+		// move on to the next tree
+		ft = ft->next;
+		if (ft == NULL) ft = ftFirst;
+		
+		if (ft == start)
+		{
+			if (++rounds == 2) break;
+		};
 	};
 	
+	ftClockHand = ft;
 	currentlyInFreePage = 0;
 	mutexUnlock(&ftMtx);
 	return 0;
@@ -588,6 +849,6 @@ void ftDumpInfo()
 	for (ft=ftFirst; ft!=NULL; ft=ft->next)
 	{
 		kprintf("FileTree@%p (size=%lu, getpage=%p)\n", ft, ft->size, ft->getpage);
-		ftDumpTree(ft, 0, &ft->top, 0);
+		ftDumpTree(ft, ft->depth, &ft->top, 0);
 	};
 };
@@ -42,6 +42,29 @@ static Inode *kernelRootInode;
 static Dentry *kernelRootDentry;
 static ino_t nextRootIno = 2;
 
+/**
+ * The negative lookup cache. It remembers names recently looked up and found missing in a directory, so
+ * that repeated failed lookups (such as searches of library paths or $PATH) do not have to lock the
+ * directory. A slot is valid only while the directory's generation is still the one recorded; adding any
+ * dentry to the directory gives it a new generation. Generations are never reused, so neither is a slot
+ * valid for a new inode which happens to have the same address as a freed one.
+ * 
+ * Lookups do not take any lock: each slot has a sequence count, which is odd while the slot is being
+ * rewritten, and a lookup only trusts what it read if the count was even and unchanged around it.
+ * Insertions are serialized by 'semNegCache'.
+ */
+typedef struct
+{
+	volatile uint64_t			seq;
+	Inode*					dir;
+	uint64_t				gen;
+	char					name[VFS_NEGCACHE_NAME];
+} NegativeDentry;
+
+static NegativeDentry negCache[VFS_NEGCACHE_SIZE];
+static Semaphore semNegCache;
+static uint64_t nextDentGen = 1;
+
 DentryRef VFS_NULL_DREF = {NULL, NULL};
 InodeRef VFS_NULL_IREF = {NULL, NULL};
 
@@ -68,6 +91,7 @@ static int rootRegInode(FileSystem *fs, Inode *inode)
 void vfsInit()
 {
 	semInit2(&semConst, 1);
+	semInit(&semNegCache);
 	
 	// create the "kernel root filesystem". It does not actually appear on the mount table,
 	// but is the root of all kernel threads and the initial root of "init"
@@ -166,6 +190,34 @@ void vfsDirtyInode(Inode *inode)
 	inode->flags |= VFS_INODE_DIRTY;
 };
 
+/**
+ * Returns nonzero if accessing the inode at time 'now' should update its access time, according to the mount
+ * flags of its filesystem.
+ */
+static int vfsAtimeDue(Inode *inode, time_t now)
+{
+	int flags = 0;
+	if (inode->fs != NULL) flags = inode->fs->flags;
+	
+	if (flags & VFS_ST_NOATIME)
+	{
+		return 0;
+	};
+	
+	if ((flags & VFS_ST_NODIRATIME) && (inode->mode & VFS_MODE_TYPEMASK) == VFS_MODE_DIRECTORY)
+	{
+		return 0;
+	};
+	
+	if (flags & VFS_ST_RELATIME)
+	{
+		return inode->atime <= inode->mtime || inode->atime <= inode->ctime
+			|| (now - inode->atime) >= VFS_RELATIME_INTERVAL;
+	};
+	
+	return 1;
+};
+
 int vfsFlush(Inode *inode)
 {
 	if (inode->ino == 0)
@@ -211,6 +263,13 @@ void vfsDownrefInode(Inode *inode)
 			semSignal(&fs->lock);
 		};
 		
+		// uncache the tree before the driver frees its data, so that writeback can no longer call it
+		if (inode->ft != NULL)
+		{
+			ftUp(inode->ft);
+			ftUncache(inode->ft);
+		};
+		
 		if (inode->free != NULL)
 		{
 			inode->free(inode);
@@ -220,11 +279,10 @@ void vfsDownrefInode(Inode *inode)
 		// deleted too, so no need to free those.
 		if (inode->ft != NULL)
 		{
-			ftUp(inode->ft);
-			ftUncache(inode->ft);
 			ftDown(inode->ft);
 		};
 		
+		kfree(inode->dentHash);
 		kfree(inode->target);
 		kfree(inode);
 	};
@@ -486,13 +544,213 @@ InodeRef vfsGetCurrentDir()
 	};
 };
 
+/**
+ * Hash a dentry name (FNV-1a).
+ */
+static uint32_t vfsHashName(const char *name)
+{
+	uint32_t hash = 2166136261U;
+	while (*name != 0)
+	{
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619U;
+	};
+	
+	return hash;
+};
+
+/**
+ * Resize the name hash table of a directory to the given number of buckets (a power of 2), and hash all
+ * of its dentries into it. Returns 0 on success, or -1 if the new table cannot be allocated, in which
+ * case the old one is kept; lookups still work with it, just slower. The directory must be locked.
+ */
+static int vfsRehashDir(Inode *dir, int newSize)
+{
+	Dentry **table = (Dentry**) kmalloc(sizeof(Dentry*) * newSize);
+	if (table == NULL) return -1;
+	memset(table, 0, sizeof(Dentry*) * newSize);
+	
+	Dentry *dent;
+	for (dent=dir->dents; dent!=NULL; dent=dent->next)
+	{
+		uint32_t bucket = vfsHashName(dent->name) & (newSize - 1);
+		dent->hashNext = table[bucket];
+		table[bucket] = dent;
+	};
+	
+	kfree(dir->dentHash);
+	dir->dentHash = table;
+	dir->dentHashSize = newSize;
+	return 0;
+};
+
+/**
+ * Return the negative lookup cache slot for a name in a directory.
+ */
+static NegativeDentry* vfsNegSlot(Inode *dir, const char *name)
+{
+	uint64_t hash = vfsHashName(name) ^ (((uint64_t) dir >> 4) * 0x9E3779B1);
+	return &negCache[(hash ^ (hash >> 16)) & (VFS_NEGCACHE_SIZE - 1)];
+};
+
+/**
+ * Returns nonzero if 'name' is known to be missing from the directory 'dir'. Does not lock the directory.
+ */
+static int vfsNegLookup(Inode *dir, const char *name)
+{
+	uint64_t gen = dir->dentGen;
+	size_t len = strlen(name);
+	if (gen == 0 || len >= VFS_NEGCACHE_NAME)
+	{
+		return 0;
+	};
+	
+	NegativeDentry *slot = vfsNegSlot(dir, name);
+	uint64_t seq = slot->seq;
+	if (seq & 1)
+	{
+		return 0;
+	};
+	
+	__sync_synchronize();
+	
+	// the name may be half-written, so compare within the buffer only, and only trust an unchanged slot
+	int hit = slot->dir == dir && slot->gen == gen && memcmp(slot->name, name, len+1) == 0;
+	
+	__sync_synchronize();
+	return hit && slot->seq == seq;
+};
+
+/**
+ * Remember that 'name' is missing from the directory 'dir', which must be locked.
+ */
+static void vfsNegInsert(Inode *dir, const char *name)
+{
+	if (strlen(name) >= VFS_NEGCACHE_NAME)
+	{
+		return;
+	};
+	
+	if (dir->dentGen == 0)
+	{
+		dir->dentGen = __sync_fetch_and_add(&nextDentGen, 1);
+	};
+	
+	NegativeDentry *slot = vfsNegSlot(dir, name);
+	semWait(&semNegCache);
+	slot->seq++;
+	__sync_synchronize();
+	slot->dir = dir;
+	slot->gen = dir->dentGen;
+	strcpy(slot->name, name);
+	__sync_synchronize();
+	slot->seq++;
+	semSignal(&semNegCache);
+};
+
+/**
+ * Add a dentry to the end of a directory's list, and to its name hash table. The directory must be locked.
+ */
+static void vfsInsertDentry(Inode *dir, Dentry *dent)
+{
+	// invalidate negative lookup cache entries for the directory
+	dir->dentGen = __sync_fetch_and_add(&nextDentGen, 1);
+	
+	dent->next = NULL;
+	dent->prev = dir->lastDent;
+	if (dir->lastDent == NULL) dir->dents = dent;
+	else dir->lastDent->next = dent;
+	dir->lastDent = dent;
+	dir->numDents++;
+	
+	if (dir->dentHash == NULL || dir->numDents > 2 * dir->dentHashSize)
+	{
+		// (re)building the table also links in the new dentry
+		if (vfsRehashDir(dir, dir->dentHash == NULL ? 16 : 2 * dir->dentHashSize) == 0) return;
+	};
+	
+	if (dir->dentHash != NULL)
+	{
+		uint32_t bucket = vfsHashName(dent->name) & (dir->dentHashSize - 1);
+		dent->hashNext = dir->dentHash[bucket];
+		dir->dentHash[bucket] = dent;
+	};
+};
+
+/**
+ * Remove a dentry from a directory's list and name hash table. The directory must be locked.
+ */
+static void vfsUnlinkDentry(Inode *dir, Dentry *dent)
+{
+	if (dent->prev != NULL) dent->prev->next = dent->next;
+	if (dent->next != NULL) dent->next->prev = dent->prev;
+	if (dir->dents == dent) dir->dents = dent->next;
+	if (dir->lastDent == dent) dir->lastDent = dent->prev;
+	if (dir->readHint == dent) dir->readHint = dent->prev;
+	dir->numDents--;
+	
+	if (dir->dentHash != NULL)
+	{
+		Dentry **link = &dir->dentHash[vfsHashName(dent->name) & (dir->dentHashSize - 1)];
+		while (*link != NULL)
+		{
+			if (*link == dent)
+			{
+				*link = dent->hashNext;
+				break;
+			};
+			
+			link = &(*link)->hashNext;
+		};
+	};
+};
+
+/**
+ * Find a dentry by name in a directory. The directory must be locked.
+ */
+static Dentry* vfsFindDentry(Inode *dir, const char *name)
+{
+	Dentry *dent;
+	if (dir->dentHash == NULL)
+	{
+		for (dent=dir->dents; dent!=NULL; dent=dent->next)
+		{
+			if (strcmp(dent->name, name) == 0) return dent;
+		};
+	}
+	else
+	{
+		for (dent=dir->dentHash[vfsHashName(name) & (dir->dentHashSize - 1)]; dent!=NULL; dent=dent->hashNext)
+		{
+			if (strcmp(dent->name, name) == 0) return dent;
+		};
+	};
+	
+	return NULL;
+};
+
 DentryRef vfsGetChildDentry(InodeRef diref, const char *entname, int create)
 {
-	// update the access time of the inode
-	mutexLock(&diref.inode->lock);
-	diref.inode->atime = time();
-	vfsDirtyInode(diref.inode);		// should it be made dirty here?
-	mutexUnlock(&diref.inode->lock);
+	// a name recently found missing needs neither the lock nor an access time update
+	if (!create && vfsNegLookup(diref.inode, entname))
+	{
+		vfsUnrefInode(diref);
+		
+		DentryRef nulref;
+		nulref.dent = NULL;
+		nulref.top = NULL;
+		return nulref;
+	};
+	
+	// update the access time of the inode, if the mount flags want that
+	time_t now = time();
+	if (vfsAtimeDue(diref.inode, now))
+	{
+		mutexLock(&diref.inode->lock);
+		diref.inode->atime = now;
+		vfsDirtyInode(diref.inode);
+		mutexUnlock(&diref.inode->lock);
+	};
 	
 	// first the special ones
 	if (strcmp(entname, ".") == 0 || entname[0] == 0)
@@ -521,17 +779,14 @@ DentryRef vfsGetChildDentry(InodeRef diref, const char *entname, int create)
 		mutexLock(&diref.inode->lock);
 		
 		// first check if it already exists
-		Dentry *dent;
-		for (dent=diref.inode->dents; dent!=NULL; dent=dent->next)
+		Dentry *dent = vfsFindDentry(diref.inode, entname);
+		if (dent != NULL)
 		{
-			if (strcmp(dent->name, entname) == 0)
-			{
-				DentryRef dref;
-				dref.dent = dent;
-				dref.top = diref.top;
-				
-				return dref;
-			};
+			DentryRef dref;
+			dref.dent = dent;
+			dref.top = diref.top;
+			
+			return dref;
 		};
 		
 		// not found; create if needed else fail
@@ -559,18 +814,7 @@ DentryRef vfsGetChildDentry(InodeRef diref, const char *entname, int create)
 			dent->ino = 0;
 			dent->key = __sync_fetch_and_add(&diref.inode->nextKey, 1);
 			dent->flags = VFS_DENTRY_TEMP;
-			
-			if (diref.inode->dents == NULL)
-			{
-				diref.inode->dents = dent;
-			}
-			else
-			{
-				Dentry *last = diref.inode->dents;
-				while (last->next != NULL) last = last->next;
-				last->next = dent;
-				dent->prev = last;
-			};
+			vfsInsertDentry(diref.inode, dent);
 			
 			// the modificaiton and change times of the directory will be updated,
 			// and marked dirty, once the caller does something with the dentry. so no
@@ -582,6 +826,7 @@ DentryRef vfsGetChildDentry(InodeRef diref, const char *entname, int create)
 		}
 		else
 		{
+			vfsNegInsert(diref.inode, entname);
 			mutexUnlock(&diref.inode->lock);
 			vfsUnrefInode(diref);
 			
@@ -604,18 +849,7 @@ void vfsAppendDentry(Inode *dir, const char *name, ino_t ino)
 	vfsUprefInode(dir);
 	dent->ino = ino;
 	dent->key = __sync_fetch_and_add(&dir->nextKey, 1);
-	
-	if (dir->dents == NULL)
-	{
-		dir->dents = dent;
-	}
-	else
-	{
-		Dentry *last = dir->dents;
-		while (last->next != NULL) last = last->next;
-		last->next = dent;
-		dent->prev = last;
-	};
+	vfsInsertDentry(dir, dent);
 	
 	mutexUnlock(&dir->lock);
 };
@@ -922,8 +1156,17 @@ void vfsBindInode(DentryRef dref, Inode *target)
 static void vfsLinkDown(Inode *inode)
 {
 	mutexLock(&inode->lock);
+	vfsDirtyInode(inode);
 	if ((--inode->links) == 0)
-	{	
+	{
+		// uncache the tree first, so that writeback can no longer touch the blocks which the
+		// driver frees when dropping the inode
+		if (inode->ft != NULL)
+		{
+			ftUp(inode->ft);
+			ftUncache(inode->ft);
+		};
+		
 		if (inode->drop != NULL)
 		{
 			inode->drop(inode);
@@ -931,8 +1174,6 @@ static void vfsLinkDown(Inode *inode)
 		
 		if (inode->ft != NULL)
 		{
-			ftUp(inode->ft);
-			ftUncache(inode->ft);
 			ftDown(inode->ft);
 			inode->ft = NULL;
 		};
@@ -1042,11 +1283,9 @@ void vfsRemoveDentry(DentryRef dref)
 {
 	assert(dref.dent->ino == 0);
 	
-	if (dref.dent->prev != NULL) dref.dent->prev->next = dref.dent->next;
-	if (dref.dent->next != NULL) dref.dent->next->prev = dref.dent->prev;
-	if (dref.dent->dir->dents == dref.dent) dref.dent->dir->dents = dref.dent->next;
-	
 	Inode *dir = dref.dent->dir;
+	vfsUnlinkDentry(dir, dref.dent);
+	
 	vfsDirtyInode(dir);
 	mutexUnlock(&dir->lock);
 	vfsDownrefInode(dir);
@@ -1120,6 +1359,9 @@ int vfsMount(DentryRef dref, Inode *mntroot, int flags)
 			// new filesystem; apply flags
 			if (flags & MNT_RDONLY) mntroot->fs->flags |= VFS_ST_RDONLY;
 			if (flags & MNT_NOSUID) mntroot->fs->flags |= VFS_ST_NOSUID;
+			if (flags & MNT_NOATIME) mntroot->fs->flags |= VFS_ST_NOATIME;
+			if (flags & MNT_NODIRATIME) mntroot->fs->flags |= VFS_ST_NODIRATIME;
+			if (flags & MNT_RELATIME) mntroot->fs->flags |= VFS_ST_RELATIME;
 		};
 	};
 	
@@ -1244,7 +1486,12 @@ File* vfsOpen(InodeRef startdir, const char *path, int oflag, mode_t mode, int *
 File* vfsOpenInode(InodeRef iref, int oflag, int *error)
 {
 	__sync_fetch_and_add(&iref.inode->numOpens, 1);
-	iref.inode->atime = time();
+	time_t now = time();
+	if (vfsAtimeDue(iref.inode, now))
+	{
+		iref.inode->atime = now;
+		vfsDirtyInode(iref.inode);
+	};
 		
 	void *filedata = NULL;
 	if (iref.inode->open != NULL)
@@ -1319,7 +1566,12 @@ static ssize_t vfsReadUnlocked(File *fp, void *buffer, size_t size, off_t offset
 		return -1;
 	};
 
-	fp->iref.inode->atime = time();
+	time_t now = time();
+	if (vfsAtimeDue(fp->iref.inode, now))
+	{
+		fp->iref.inode->atime = now;
+		vfsDirtyInode(fp->iref.inode);
+	};
 
 	if (fp->iref.inode->pread != NULL)
 	{
@@ -1349,6 +1601,7 @@ static ssize_t vfsWriteUnlocked(File *fp, const void *buffer, size_t size, off_t
 	};
 
 	fp->iref.inode->mtime = fp->iref.inode->ctime = time();
+	vfsDirtyInode(fp->iref.inode);
 	
 	if (fp->iref.inode->pwrite != NULL)
 	{
@@ -1778,6 +2031,7 @@ int vfsTruncate(Inode *inode, off_t size)
 	
 	ftTruncate(inode->ft, (size_t) size);
 	inode->mtime = inode->ctime = time();
+	vfsDirtyInode(inode);
 	
 	return 0;
 };
@@ -2355,6 +2609,12 @@ int vfsUnmount(const char *path, int flags)
 				vfsDownrefInode(scan);		// == dent->dir
 			};
 			
+			kfree(scan->dentHash);
+			scan->dentHash = NULL;
+			scan->lastDent = NULL;
+			scan->readHint = NULL;
+			scan->numDents = 0;
+			
 			vfsDownrefInode(scan);
 		};
 		
@@ -2483,6 +2743,7 @@ ssize_t vfsReadDir(Inode *inode, int key, struct kdirent **out)
 			break;
 		};
 		
+		dirent->d_key = key;
 		*out = dirent;
 		mutexUnlock(&inode->lock);
 		return sizeof(struct kdirent) + 3;
@@ -2497,6 +2758,7 @@ ssize_t vfsReadDir(Inode *inode, int key, struct kdirent **out)
 			struct kdirent *dirent = (struct kdirent*) kmalloc(sizeof(struct kdirent) + strlen(dent->name) + 1);
 			memset(dirent, 0, sizeof(struct kdirent) + strlen(dent->name) + 1);
 			dirent->d_ino = dent->ino;
+			dirent->d_key = key;
 			strcpy(dirent->d_name, dent->name);
 			*out = dirent;
 			mutexUnlock(&inode->lock);
@@ -2515,6 +2777,95 @@ ssize_t vfsReadDir(Inode *inode, int key, struct kdirent **out)
 	else return -EOVERFLOW;
 };
 
+/**
+ * Append a directory entry to a batch being filled by vfsReadDirBatch(). Returns 0 if it does not fit.
+ */
+static int vfsPackDirent(char *buffer, size_t size, size_t *usedp, ino_t ino, int key, const char *name)
+{
+	size_t entsize = (sizeof(struct kdirent) + strlen(name) + 8) & ~7;
+	if ((size - *usedp) < entsize)
+	{
+		return 0;
+	};
+	
+	struct kdirent *dirent = (struct kdirent*) &buffer[*usedp];
+	memset(dirent, 0, entsize);
+	dirent->d_ino = ino;
+	dirent->d_key = key;
+	strcpy(dirent->d_name, name);
+	
+	*usedp += entsize;
+	return 1;
+};
+
+ssize_t vfsReadDirBatch(Inode *inode, int *keyp, void *buffer, size_t size)
+{
+	if ((inode->mode & VFS_MODE_TYPEMASK) != VFS_MODE_DIRECTORY)
+	{
+		return -ENOTDIR;
+	};
+	
+	mutexLock(&inode->lock);
+	
+	size_t used = 0;
+	int key = *keyp;
+	int full = 0;
+	if (key < 0) key = 0;
+	
+	// first the special ones
+	while (key < 2)
+	{
+		ino_t ino = inode->ino;
+		if (key == 1 && inode->parent != NULL) ino = inode->parent->dir->ino;
+		
+		if (!vfsPackDirent((char*) buffer, size, &used, ino, key, key == 0 ? "." : ".."))
+		{
+			full = 1;
+			break;
+		};
+		
+		key++;
+	};
+	
+	if (!full)
+	{
+		// the list is sorted by key, so we can continue from the last dentry returned if it precedes
+		// the one we want
+		Dentry *dent = inode->dents;
+		if (inode->readHint != NULL && inode->readHint->key < key)
+		{
+			dent = inode->readHint;
+		};
+		
+		while (dent != NULL && dent->key < key)
+		{
+			dent = dent->next;
+		};
+		
+		for (; dent!=NULL; dent=dent->next)
+		{
+			if (!vfsPackDirent((char*) buffer, size, &used, dent->ino, dent->key, dent->name))
+			{
+				full = 1;
+				break;
+			};
+			
+			key = dent->key + 1;
+			inode->readHint = dent;
+		};
+	};
+	
+	mutexUnlock(&inode->lock);
+	
+	if (full && used == 0)
+	{
+		return -EINVAL;
+	};
+	
+	*keyp = key;
+	return (ssize_t) used;
+};
+
 int vfsMove(InodeRef startold, const char *oldpath, InodeRef startnew, const char *newpath, int flags)
 {
 	int allFlags = VFS_MV_EXCL;
@@ -59,18 +59,35 @@ extern char _per_cpu_start;
 extern char _per_cpu_end;
 void _syscall_entry();
 
+/* physmem.c */
+void __zeroFrame(uint64_t frame);
+
+/**
+ * Allocate a zeroed frame for the per-CPU area. The per-CPU frame list cannot be used for this,
+ * as it lives in the very area we are mapping.
+ */
+static uint64_t allocPerCPUFrame()
+{
+	uint64_t frame = phmAllocFrameEx(1, PHM_NOPERCPU);
+	__zeroFrame(frame);
+	return frame;
+};
+
 static uint16_t cpuReadyBitmap;
 
+static Spinlock tlbLock;
+static volatile int tlbFlushAcks;
+
 void initPerCPU()
 {
 	PML4 *pml4 = getPML4();
 	pml4->entries[261].present = 1;
-	pml4->entries[261].pdptPhysAddr = phmAllocZeroFrame();
+	pml4->entries[261].pdptPhysAddr = allocPerCPUFrame();
 	pml4->entries[261].rw = 1;
 	refreshAddrSpace();
 	
 	uint64_t firstPage = (uint64_t) &_per_cpu_start / 0x1000;
-	uint64_t lastPage = (uint64_t) &_per_cpu_start / 0x1000;
+	uint64_t lastPage = ((uint64_t) &_per_cpu_end - 1) / 0x1000;
 	
 	uint64_t page;
 	for (page=firstPage; page<=lastPage; page++)
@@ -84,7 +101,7 @@ void initPerCPU()
 		if (!pdpt->entries[pdIndex].present)
 		{
 			pdpt->entries[pdIndex].present = 1;
-			pdpt->entries[pdIndex].pdPhysAddr = phmAllocZeroFrame();
+			pdpt->entries[pdIndex].pdPhysAddr = allocPerCPUFrame();
 			pdpt->entries[pdIndex].rw = 1;
 			refreshAddrSpace();
 		};
@@ -93,7 +110,7 @@ void initPerCPU()
 		if (!pd->entries[ptIndex].present)
 		{
 			pd->entries[ptIndex].present = 1;
-			pd->entries[ptIndex].ptPhysAddr = phmAllocZeroFrame();
+			pd->entries[ptIndex].ptPhysAddr = allocPerCPUFrame();
 			pd->entries[ptIndex].rw = 1;
 			refreshAddrSpace();
 		};
@@ -102,7 +119,7 @@ void initPerCPU()
 		if (!pt->entries[pageIndex].present)
 		{
 			pt->entries[pageIndex].present = 1;
-			pt->entries[pageIndex].framePhysAddr = phmAllocZeroFrame();
+			pt->entries[pageIndex].framePhysAddr = allocPerCPUFrame();
 			pt->entries[pageIndex].rw = 1;
 			refreshAddrSpace();
 		};
@@ -136,8 +153,9 @@ int numCPU = 1;
 void initMultiProc()
 {
 	cpuReadyBitmap = 0;
-	memset(cpuList, 0, sizeof(CPU)*16);
 	
+	// do not clear cpuList: it is zeroed at startup anyway, and the scheduler has already queued
+	// threads on the boot CPU's runqueue.
 	cpuList[0].id = 0;
 	cpuList[0].apicID = (apic->id >> 24);
 	currentCPU = &cpuList[0];
@@ -196,10 +214,7 @@ void initMultiProc()
 		memset(&pmlAP->entries[261], 0, 8);
 		
 		// now also copy the PML4 over to the real frame
-		ispLock();
-		ispSetFrame(pmlFrame);
-		memcpy(ispGetPointer(), pmlAP, 0x1000);
-		ispUnlock();
+		frameWrite(pmlFrame, pmlAP);
 		
 		// OK, pass the PML4 to the AP
 		tramData->pageMapPhys = pmlFrame * 0x1000;
@@ -316,6 +331,16 @@ CPU *getCurrentCPU()
 	return currentCPU;
 };
 
+CPU *getCPU(int id)
+{
+	return &cpuList[id];
+};
+
+int getCPUCount()
+{
+	return numCPU;
+};
+
 void sendHintToCPU(int cpuID)
 {
 	uint64_t retflags = getFlagsRegister();
@@ -334,6 +359,47 @@ void sendHintToCPU(int cpuID)
 	setFlagsRegister(retflags);
 };
 
+void cpuFlushTLB()
+{
+	if (getCurrentCPU() == NULL || numCPU == 1)
+	{
+		refreshAddrSpace();
+		return;
+	};
+	
+	spinlockAcquire(&tlbLock);
+	tlbFlushAcks = 0;
+	__sync_synchronize();
+	
+	uint64_t retflags = getFlagsRegister();
+	cli();
+	
+	apic->icrHigh = 0;
+	__sync_synchronize();
+	apic->icrLow = 0x00080072;	// I_IPI_FLUSH_TLB, all including self
+	__sync_synchronize();
+	
+	while (apic->icrLow & (1 << 12))
+	{
+		__sync_synchronize();
+	};
+	
+	setFlagsRegister(retflags);
+	
+	while (tlbFlushAcks != numCPU)
+	{
+		__sync_synchronize();
+	};
+	
+	spinlockRelease(&tlbLock);
+};
+
+void cpuOnFlushTLB()
+{
+	refreshAddrSpace();
+	__sync_fetch_and_add(&tlbFlushAcks, 1);
+};
+
 void sendHintToEveryCPU()
 {
 	if (numCPU == 1) return;
@@ -428,21 +494,34 @@ void cpuBusy()
 	__sync_fetch_and_and(&cpuReadyBitmap, ~(1 << getCurrentCPU()->id));
 };
 
-void cpuDispatch()
+void cpuWake(int id)
 {
 	if (getCurrentCPU() == NULL) return;
 	if (numCPU == 1) return;
+	if (id == -1) return;
+	
+	uint16_t mask = 1 << id;
+	if (__sync_fetch_and_and(&cpuReadyBitmap, ~mask) & mask)
+	{
+		if (id != getCurrentCPU()->id) sendHintToCPU(id);
+	};
+};
 
+int cpuFindIdle(int preferred)
+{
+	if (getCurrentCPU() == NULL) return -1;
+	if (numCPU == 1) return -1;
+	
+	uint16_t bitmap = cpuReadyBitmap;
+	if (bitmap & (1 << preferred)) return preferred;
+	
 	int i;
 	for (i=0; i<numCPU; i++)
 	{
-		uint16_t mask = 1 << i;
-		if (__sync_fetch_and_and(&cpuReadyBitmap, ~mask) & mask)
-		{
-			if (i != getCurrentCPU()->id) sendHintToCPU(i);
-			return;
-		};
+		if (bitmap & (1 << i)) return i;
 	};
+	
+	return -1;
 };
 
 int cpuSleeping()
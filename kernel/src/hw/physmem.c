@@ -36,10 +36,12 @@
 #include <glidix/storage/storage.h>
 #include <glidix/hw/pagetab.h>
 #include <glidix/fs/ftree.h>
+#include <glidix/thread/sched.h>
 
 uint64_t phmTotalFrames;
 uint64_t phmUsedFrames;
 uint64_t phmCachedFrames;
+uint64_t phmDirectMapEnd;
 
 /**
  * The next frame to return if we are allocating using placement. This is done before
@@ -55,18 +57,78 @@ static MultibootMemoryMap*	memoryMapStart;
 static uint64_t			memoryMapEnd;
 
 /**
- * Total number of frames in the system, and the frame bitmap.
+ * Total number of frames in the system.
  */
 static uint64_t			numSystemFrames;
-static uint8_t*			frameBitmap = NULL;
 
 /**
- * Lowest frame that could be free (i.e. one that was free during init).
+ * The buddy allocator. Free memory is kept as naturally-aligned blocks of 2^order frames, with
+ * one free list per order, linked through 'frameLinks' (indexed by frame; 0 terminates a list,
+ * since frame 0 is never allocatable). 'frameOrder[frame]' is the order of the free block starting
+ * at 'frame', or PHM_NOT_FREE if no free block starts there. All of this is protected by
+ * 'physmemLock', which must be taken with interrupts disabled.
  */
-static uint64_t			lowestFreeFrame;
+#define	PHM_MAX_ORDER			10
+#define	PHM_NOT_FREE			0xFF
+
+typedef struct
+{
+	uint32_t			prev;
+	uint32_t			next;
+} FrameLink;
+
+static FrameLink*		frameLinks = NULL;
+static uint8_t*			frameOrder = NULL;
+static uint64_t			freeLists[PHM_MAX_ORDER+1];
+static uint64_t			freeBlocks[PHM_MAX_ORDER+1];
 
 static Spinlock			physmemLock;
 
+/**
+ * Per-CPU list of free single frames, accessed with interrupts disabled. It is refilled from,
+ * and flushed to, the buddy allocator PHM_HOT_BATCH frames at a time.
+ */
+#define	PHM_HOT_FRAMES			64
+#define	PHM_HOT_BATCH			32
+
+typedef struct
+{
+	int				count;
+	uint64_t			frames[PHM_HOT_FRAMES];
+} HotFrames;
+
+static PER_CPU HotFrames	hotFrames;
+
+/**
+ * The direct map PDPT lives in the kernel image. If the CPU cannot do 1GB pages, or a gigabyte
+ * is only partly RAM, it gets a page directory of 2MB pages instead; the first one is static, and
+ * the rest are allocated by placement (which hands out low memory, already covered by the first
+ * gigabyte). Only RAM is mapped write-back; holes and MMIO ranges are mapped uncacheable, so that
+ * the CPU never speculatively reads device memory. A 2MB region which is partly RAM is split into
+ * 4KB pages, using one of the PHM_DIRECT_MAP_PTS static page tables; if they run out, the whole
+ * region is mapped uncacheable.
+ */
+#define	PHM_DIRECT_MAP_PML4E		266
+#define	PHM_DIRECT_MAP_PTS		16
+
+static PAGE_ALIGN PDPT		directPDPT;
+static PAGE_ALIGN PD		directFirstPD;
+static PAGE_ALIGN PT		directPTs[PHM_DIRECT_MAP_PTS];
+static int			directPTsUsed;
+
+/**
+ * Page reclaim watermarks, in frames. Allocations which leave fewer than 'reclaimLowWater' frames
+ * free set 'reclaimPending'; the reclaim thread notices within PHM_RECLAIM_POLL milliseconds, and
+ * evicts cold cache pages (writing them back if dirty) until at least 'reclaimHighWater' frames are
+ * free. Allocations therefore only reclaim synchronously if the thread falls behind.
+ */
+#define	PHM_RECLAIM_POLL		50
+#define	PHM_RECLAIM_MIN			256
+
+static uint64_t			reclaimLowWater;
+static uint64_t			reclaimHighWater;
+static volatile int		reclaimPending;
+
 static int isUseableMemory(MultibootMemoryMap *mmap)
 {
 	if (mmap->type != 1) return 0;
@@ -90,8 +152,149 @@ static int isFrameInArea(MultibootMemoryMap *mmap, uint64_t frame)
 	};
 };
 
+static int cpuHasHugePages()
+{
+	uint32_t eax = 0x80000001, edx;
+	ASM ("cpuid" : "+a" (eax), "=d" (edx) : : "ebx", "ecx");
+	return !!(edx & (1 << 26));
+};
+
+/**
+ * Check how much of the physical range [start, end) the memory map reports as RAM (including ACPI
+ * tables and NVS). Returns 1 if all of it, 0 if none of it, or -1 if only part of it.
+ */
+static int directMapIsRAM(uint64_t start, uint64_t end)
+{
+	uint64_t covered = 0;
+	MultibootMemoryMap *mmap;
+	for (mmap=memoryMapStart; (uint64_t)mmap<memoryMapEnd; mmap=(MultibootMemoryMap*) ((uint64_t) mmap + mmap->size + 4))
+	{
+		if (mmap->type != 1 && mmap->type != 3 && mmap->type != 4) continue;
+		
+		uint64_t areaStart = mmap->baseAddr;
+		uint64_t areaEnd = mmap->baseAddr + mmap->len;
+		if (areaStart < start) areaStart = start;
+		if (areaEnd > end) areaEnd = end;
+		if (areaStart < areaEnd) covered += areaEnd - areaStart;
+	};
+	
+	if (covered >= end - start) return 1;
+	if (covered == 0) return 0;
+	return -1;
+};
+
+static void fillDirectPT(PT *pt, uint64_t base)
+{
+	memset(pt, 0, sizeof(PT));
+	
+	uint64_t i;
+	for (i=0; i<512; i++)
+	{
+		uint64_t addr = base + (i << 12);
+		pt->entries[i].present = 1;
+		pt->entries[i].rw = 1;
+		pt->entries[i].framePhysAddr = addr >> 12;
+		
+		if (directMapIsRAM(addr, addr + 0x1000) != 1)
+		{
+			pt->entries[i].pcd = 1;
+			pt->entries[i].pwt = 1;
+		};
+	};
+};
+
+static void fillDirectPD(PD *pd, uint64_t gig)
+{
+	memset(pd, 0, sizeof(PD));
+	
+	uint64_t i;
+	for (i=0; i<512; i++)
+	{
+		uint64_t base = (gig << 30) | (i << 21);
+		int ram = directMapIsRAM(base, base + 0x200000);
+		
+		pd->entries[i].present = 1;
+		pd->entries[i].rw = 1;
+		
+		if (ram == -1 && directPTsUsed < PHM_DIRECT_MAP_PTS)
+		{
+			PT *pt = &directPTs[directPTsUsed++];
+			fillDirectPT(pt, base);
+			pd->entries[i].ptPhysAddr = VIRT_TO_FRAME(pt);
+		}
+		else
+		{
+			pd->entries[i].ps = 1;
+			pd->entries[i].ptPhysAddr = base >> 12;
+			
+			if (ram != 1)
+			{
+				pd->entries[i].pcd = 1;
+				pd->entries[i].pwt = 1;
+			};
+		};
+	};
+};
+
+static void initDirectMap()
+{
+	uint64_t numGigs = (numSystemFrames + 0x3FFFF) >> 18;
+	phmDirectMapEnd = numGigs << 30;
+	
+	memset(&directPDPT, 0, sizeof(PDPT));
+	PML4 *pml4 = getPML4();
+	pml4->entries[PHM_DIRECT_MAP_PML4E].present = 1;
+	pml4->entries[PHM_DIRECT_MAP_PML4E].rw = 1;
+	pml4->entries[PHM_DIRECT_MAP_PML4E].pdptPhysAddr = VIRT_TO_FRAME(&directPDPT);
+	
+	int huge = cpuHasHugePages();
+	uint64_t gig;
+	for (gig=0; gig<numGigs; gig++)
+	{
+		PDPTe *pdpte = &directPDPT.entries[gig];
+		int ram = directMapIsRAM(gig << 30, (gig+1) << 30);
+		if (huge && ram != -1)
+		{
+			pdpte->ps = 1;
+			pdpte->pdPhysAddr = gig << 18;
+			
+			if (ram == 0)
+			{
+				pdpte->pcd = 1;
+				pdpte->pwt = 1;
+			};
+		}
+		else if (gig == 0)
+		{
+			fillDirectPD(&directFirstPD, 0);
+			pdpte->pdPhysAddr = VIRT_TO_FRAME(&directFirstPD);
+		}
+		else
+		{
+			uint64_t frame = phmAllocFrame();
+			if (frame >= (gig << 18))
+			{
+				panic("direct map page directory allocated outside the mapped area");
+			};
+			
+			fillDirectPD((PD*) FRAME_TO_VIRT(frame), gig);
+			pdpte->pdPhysAddr = frame;
+		};
+		
+		pdpte->rw = 1;
+		pdpte->present = 1;
+		refreshAddrSpace();
+	};
+};
+
 void initPhysMem(uint64_t numPages, MultibootMemoryMap *mmap, uint64_t mmapEnd, uint64_t endAddr)
 {
+	if (numPages > (PHM_DIRECT_MAP_SIZE >> 12))
+	{
+		// we can only manage what we can map
+		numPages = PHM_DIRECT_MAP_SIZE >> 12;
+	};
+	
 	placementFrame = endAddr >> 12;
 	numSystemFrames = numPages;
 	spinlockRelease(&physmemLock);
@@ -118,33 +321,103 @@ void initPhysMem(uint64_t numPages, MultibootMemoryMap *mmap, uint64_t mmapEnd,
 		FAILED();
 		panic("no RAM addresses detected!");
 	};
+	
+	initDirectMap();
+};
+
+static void buddyInsert(uint64_t frame, int order)
+{
+	frameOrder[frame] = order;
+	frameLinks[frame].prev = 0;
+	frameLinks[frame].next = freeLists[order];
+	if (freeLists[order] != 0) frameLinks[freeLists[order]].prev = frame;
+	freeLists[order] = frame;
+	freeBlocks[order]++;
 };
 
-static void phmClearFrame(uint64_t frame)
+static void buddyRemove(uint64_t frame, int order)
 {
-	uint64_t byte = frame/8;
-	uint64_t bit = frame%8;
-	atomic_and8(&frameBitmap[byte], ~(1 << bit));
+	if (frameLinks[frame].prev != 0) frameLinks[frameLinks[frame].prev].next = frameLinks[frame].next;
+	else freeLists[order] = frameLinks[frame].next;
+	if (frameLinks[frame].next != 0) frameLinks[frameLinks[frame].next].prev = frameLinks[frame].prev;
+	frameOrder[frame] = PHM_NOT_FREE;
+	freeBlocks[order]--;
 };
 
 /**
- * Returns 0 if the frame was successfully acquired.
+ * Take a block of 2^order frames from the free lists, splitting a larger block if necessary.
+ * Returns 0 if there is no block large enough. Call with physmemLock held.
  */
-static int phmTryFrame(uint64_t frame)
+static uint64_t buddyAlloc(int order)
 {
-	uint64_t byte = frame/8;
-	int bit = (int) (frame%8);
-	return atomic_test_and_set8(&frameBitmap[byte], bit);
+	int current;
+	for (current=order; current<=PHM_MAX_ORDER; current++)
+	{
+		if (freeLists[current] != 0) break;
+	};
+	
+	if (current > PHM_MAX_ORDER) return 0;
+	
+	uint64_t frame = freeLists[current];
+	buddyRemove(frame, current);
+	
+	// give back the upper halves we don't need
+	while (current > order)
+	{
+		current--;
+		buddyInsert(frame + (1UL << current), current);
+	};
+	
+	return frame;
 };
 
+/**
+ * Return a block of 2^order frames to the free lists, merging it with its buddy for as long as
+ * the buddy is free and of the same order. Call with physmemLock held.
+ */
+static void buddyFree(uint64_t frame, int order)
+{
+	if (frameOrder[frame] != PHM_NOT_FREE)
+	{
+		panic("physmem: double free of frame 0x%lx", frame);
+	};
+	
+	while (order < PHM_MAX_ORDER)
+	{
+		uint64_t buddy = frame ^ (1UL << order);
+		if (buddy >= numSystemFrames || frameOrder[buddy] != order)
+		{
+			break;
+		};
+		
+		buddyRemove(buddy, order);
+		frame &= ~(1UL << order);
+		order++;
+	};
+	
+	buddyInsert(frame, order);
+};
+
+/**
+ * Which cache frameFromCache() tries first; it alternates, so that the file page cache and the block
+ * device cache are both aged by their CLOCKs, rather than one being drained before the other is touched.
+ */
+static int reclaimTurn;
+
 static uint64_t frameFromCache()
 {
 	getCurrentThread()->allocFromCacheNow = 1;
 	
-	uint64_t frame = ftGetFreePage();
-	if (frame == 0)
+	uint64_t frame;
+	if (__sync_fetch_and_add(&reclaimTurn, 1) & 1)
 	{
 		frame = sdFreeMemory();
+		if (frame == 0) frame = ftGetFreePage();
+	}
+	else
+	{
+		frame = ftGetFreePage();
+		if (frame == 0) frame = sdFreeMemory();
 	};
 	
 	getCurrentThread()->allocFromCacheNow = 0;
@@ -153,206 +426,97 @@ static uint64_t frameFromCache()
 
 static int tryFreeMemory()
 {
-	getCurrentThread()->allocFromCacheNow = 1;
-	
-	uint64_t frame = ftGetFreePage();
+	uint64_t frame = frameFromCache();
 	if (frame == 0)
 	{
-		frame = sdFreeMemory();
-		if (frame == 0)
-		{
-			getCurrentThread()->allocFromCacheNow = 0;
-			return -1;
-		};
+		return -1;
 	};
 	
-	phmFreeFrame(frame);
-	getCurrentThread()->allocFromCacheNow = 0;
+	// straight to the buddy allocator, so that it may coalesce into a contiguous run
+	phmFreeFrameEx(frame, 1);
 	return 0;
 };
 
 static void nomem()
 {
 	enableDebugTerm();
-	kprintf("physmem: there are %lu frames in the pool, %lu is the first allocatable one. dumping bitmap:",
-			numSystemFrames, lowestFreeFrame);
-	uint64_t i;
-	for (i=0; i<numSystemFrames>>3; i++)
+	kprintf("physmem: there are %lu frames in the pool, %lu used. free blocks by order:\n",
+			numSystemFrames, phmUsedFrames);
+	int order;
+	for (order=0; order<=PHM_MAX_ORDER; order++)
 	{
-		if ((i % 32) == 0) kprintf("\n");
-		kprintf("%02hhX ", frameBitmap[i]);
+		kprintf("  order %d: %lu\n", order, freeBlocks[order]);
 	};
-	kprintf("\n-- END OF BITMAP --\n");
 	sdDumpInfo();
 	ftDumpInfo();
 	panic("out of physical memory!");
 };
 
-static uint64_t phmAllocSingle()
+static int64_t phmFreeFrames()
 {
-	while (1)
-	{
-		uint64_t i;
-		uint64_t limit = numSystemFrames;
-	
-		// find the first group of 64 frames that isn't all used
-		uint64_t *bitmap64 = (uint64_t*) frameBitmap;
-		uint64_t startAt = 0;
-		for (i=(lowestFreeFrame>>6); i<(limit>>6); i++)
-		{
-			if (bitmap64[i] != 0xFFFFFFFFFFFFFFFF)
-			{
-				startAt = i << 6;
-				break;
-			};
-		};
-	
-		if (startAt == 0)
-		{
-			uint64_t result = frameFromCache();
-			if (result == 0) nomem();
-			return result;
-		};
-	
-		for (i=startAt; i<limit; i++)
-		{
-			if (phmTryFrame(i) == 0)
-			{
-				__sync_fetch_and_add(&phmUsedFrames, 1);
-				return i;
-			};
-		};
-		
-		uint64_t result = frameFromCache();
-		if (result == 0) nomem();
-		return result;
-	};
+	return (int64_t) phmTotalFrames - (int64_t) phmUsedFrames;
 };
 
-static uint64_t phmAlloc8()
+static void checkWatermark()
 {
-	while (1)
-	{
-		uint64_t i;
-		uint64_t numGroups = numSystemFrames;
-
-		// find the first group of 64 frames that isn't all used
-		uint64_t *bitmap64 = (uint64_t*) frameBitmap;
-		uint64_t startAt = 0;
-		for (i=(lowestFreeFrame>>6); i<(numGroups>>6); i++)
-		{
-			if (bitmap64[i] != 0xFFFFFFFFFFFFFFFF)
-			{
-				startAt = i << 6;
-				break;
-			};
-		};
-	
-		if (startAt == 0)
-		{
-			uint64_t result = sdFreeMemory();
-			if (result == 0)
-			{
-				if (tryFreeMemory() == -1) nomem();
-				else continue;
-			};
-			
-			return result;
-		};
-
-		uint8_t *bitmap8 = frameBitmap;
-		for (i=(startAt>>3); i<(numGroups>>3); i++)
-		{
-			if (atomic_compare_and_swap8(&bitmap8[i], 0, 0xFF) == 0)
-			{
-				// just claimed the 8 frames at this location
-				__sync_fetch_and_add(&phmUsedFrames, 8);
-				return i << 3;
-			};
-		};
-		
-		// try freeing some more memory
-		uint64_t result = sdFreeMemory();
-		if (result == 0)
-		{
-			if (tryFreeMemory() == -1) nomem();
-			else continue;
-		};
-		
-		return result;
-	};
+	if (phmFreeFrames() < (int64_t) reclaimLowWater) reclaimPending = 1;
 };
 
-static uint64_t phmAlloc16()
+static uint64_t phmAllocSingle()
 {
-	while (1)
-	{
-		uint64_t i;
-		uint64_t numGroups = numSystemFrames;
+	uint64_t flags = getFlagsRegister();
+	cli();
 	
-		uint16_t *bitmap16 = (uint16_t*) frameBitmap;
-		for (i=(lowestFreeFrame>>4); i<(numGroups>>4); i++)
+	if (hotFrames.count == 0)
+	{
+		spinlockAcquire(&physmemLock);
+		while (hotFrames.count < PHM_HOT_BATCH)
 		{
-			if (atomic_compare_and_swap16(&bitmap16[i], 0, 0xFFFF) == 0)
-			{
-				// just claimed the 16 frames at this location
-				__sync_fetch_and_add(&phmUsedFrames, 16);
-				return i << 4;
-			};
-		};
-
-		// try freeing some more memory
-		if (tryFreeMemory() == -1)
-		{
-			// that didn't work
-			nomem();
+			uint64_t frame = buddyAlloc(0);
+			if (frame == 0) break;
+			hotFrames.frames[hotFrames.count++] = frame;
 		};
+		spinlockRelease(&physmemLock);
 	};
-};
-
-static uint64_t phmAlloc32()
-{
-	while (1)
-	{
-		uint64_t i;
-		uint64_t numGroups = numSystemFrames;
 	
-		uint32_t *bitmap32 = (uint32_t*) frameBitmap;
-		for (i=(lowestFreeFrame>>5); i<(numGroups>>5); i++)
-		{
-			if (atomic_compare_and_swap32(&bitmap32[i], 0, 0xFFFFFFFF) == 0)
-			{
-				// just claimed the 32 frames at this location
-				__sync_fetch_and_add(&phmUsedFrames, 32);
-				return i << 5;
-			};
-		};
-
-		// try freeing some more memory
-		if (tryFreeMemory() == -1)
-		{
-			// that didn't work
-			nomem();
-		};
+	if (hotFrames.count != 0)
+	{
+		uint64_t frame = hotFrames.frames[--hotFrames.count];
+		setFlagsRegister(flags);
+		__sync_fetch_and_add(&phmUsedFrames, 1);
+		checkWatermark();
+		return frame;
 	};
+	
+	setFlagsRegister(flags);
+	
+	// no free memory left; take a frame from the cache
+	reclaimPending = 1;
+	uint64_t result = frameFromCache();
+	if (result == 0) nomem();
+	return result;
 };
 
-static uint64_t phmAlloc64()
+/**
+ * Allocate a block of 2^order contiguous frames directly from the buddy allocator, evicting
+ * cached pages until one is available.
+ */
+static uint64_t phmAllocOrder(int order)
 {
 	while (1)
 	{
-		uint64_t i;
-		uint64_t numGroups = numSystemFrames;
-	
-		uint64_t *bitmap64 = (uint64_t*) frameBitmap;
-		for (i=(lowestFreeFrame>>6); i<(numGroups>>6); i++)
+		uint64_t flags = getFlagsRegister();
+		cli();
+		spinlockAcquire(&physmemLock);
+		uint64_t frame = buddyAlloc(order);
+		spinlockRelease(&physmemLock);
+		setFlagsRegister(flags);
+		
+		if (frame != 0)
 		{
-			if (atomic_compare_and_swap64(&bitmap64[i], 0, 0xFFFFFFFFFFFFFFFF) == 0)
-			{
-				// just claimed the 64 frames at this location
-				__sync_fetch_and_add(&phmUsedFrames, 64);
-				return i << 6;
-			};
+			__sync_fetch_and_add(&phmUsedFrames, 1UL << order);
+			checkWatermark();
+			return frame;
 		};
 		
 		// try freeing some more memory
@@ -366,47 +530,88 @@ static uint64_t phmAlloc64()
 
 void initPhysMem2()
 {
-	frameBitmap = (uint8_t*) kmalloc(numSystemFrames/8+1);
+	frameLinks = (FrameLink*) kmalloc(sizeof(FrameLink) * numSystemFrames);
+	frameOrder = (uint8_t*) kmalloc(numSystemFrames);
 
 	// We mark all frames used, and then free the ones that belong to the normal RAM
 	// ranges. This way, phmAllocFrame() will never return memory holes.
-	memset(frameBitmap, 0xFF, numSystemFrames/8+1);
+	memset(frameOrder, PHM_NOT_FREE, numSystemFrames);
+	memset(freeLists, 0, sizeof(freeLists));
+	memset(freeBlocks, 0, sizeof(freeBlocks));
 	
 	phmTotalFrames = 0;
 	
+	spinlockAcquire(&physmemLock);
 	MultibootMemoryMap *mmap = memoryMapStart;
 	while ((uint64_t) mmap < memoryMapEnd)
 	{
 		if (isUseableMemory(mmap))
 		{
 			uint64_t startFrame = mmap->baseAddr / 0x1000;
-			uint64_t endFrame = (mmap->baseAddr + mmap->len) / 0x1000 + 1;
+			uint64_t endFrame = (mmap->baseAddr + mmap->len) / 0x1000;
+			if (startFrame < placementFrame) startFrame = placementFrame;
+			if (endFrame > numSystemFrames) endFrame = numSystemFrames;
 			
-			uint64_t i;
-			for (i=startFrame; i<endFrame; i++)
+			// free the range as the largest aligned blocks that fit
+			uint64_t frame = startFrame;
+			while (frame < endFrame)
 			{
-				if (i >= placementFrame)
+				int order = 0;
+				while (order < PHM_MAX_ORDER
+					&& (frame & ((1UL << (order+1)) - 1)) == 0
+					&& frame + (1UL << (order+1)) <= endFrame)
 				{
-					phmClearFrame(i);
-					phmTotalFrames++;
+					order++;
 				};
+				
+				buddyFree(frame, order);
+				frame += (1UL << order);
+				phmTotalFrames += (1UL << order);
 			};
 		};
 		
 		mmap = (MultibootMemoryMap*) ((uint64_t) mmap + mmap->size + 4);
 	};
+	spinlockRelease(&physmemLock);
 	
-	uint64_t i;
-	for (i=0; i<(numSystemFrames/8); i++)
+	phmUsedFrames = 0;
+	
+	reclaimLowWater = phmTotalFrames / 64;
+	if (reclaimLowWater < PHM_RECLAIM_MIN) reclaimLowWater = PHM_RECLAIM_MIN;
+	reclaimHighWater = 2 * reclaimLowWater;
+};
+
+static void reclaimThread(void *context)
+{
+	(void)context;
+	
+	while (1)
 	{
-		if (frameBitmap[i] != 0xFF)
+		sleep(PHM_RECLAIM_POLL);
+		if (!reclaimPending) continue;
+		
+		reclaimPending = 0;
+		uint64_t evicted = 0;
+		while (phmFreeFrames() < (int64_t) reclaimHighWater)
 		{
-			lowestFreeFrame = i * 8;
-			break;
+			if (tryFreeMemory() != 0) break;
+			evicted++;
+		};
+		
+		if (evicted != 0)
+		{
+			kprintf_debug("physmem: reclaim thread evicted %lu cache pages\n", evicted);
 		};
 	};
-	
-	phmUsedFrames = 0;
+};
+
+void initPhysMem3()
+{
+	KernelThreadParams pars;
+	memset(&pars, 0, sizeof(KernelThreadParams));
+	pars.stackSize = DEFAULT_STACK_SIZE;
+	pars.name = "Page reclaim";
+	CreateKernelThread(reclaimThread, &pars, NULL);
 };
 
 static void loadNextMemory()
@@ -430,7 +635,7 @@ static void loadNextMemory()
 uint64_t phmAllocFrame()
 {
 	uint64_t out;
-	if (frameBitmap == NULL)
+	if (frameOrder == NULL)
 	{
 		spinlockAcquire(&physmemLock);
 		uint64_t mmapStartFrame = memoryMap->baseAddr / 0x1000;
@@ -456,15 +661,47 @@ uint64_t phmAllocFrame()
 
 void phmFreeFrameEx(uint64_t start, uint64_t count)
 {
-	uint64_t i;
-	for (i=0; i<count; i++)
+	uint64_t flags = getFlagsRegister();
+	cli();
+	spinlockAcquire(&physmemLock);
+	
+	// free the range as the largest aligned blocks that fit
+	uint64_t frame = start;
+	uint64_t end = start + count;
+	while (frame < end)
 	{
-		phmFreeFrame(start+i);
+		int order = 0;
+		while (order < PHM_MAX_ORDER
+			&& (frame & ((1UL << (order+1)) - 1)) == 0
+			&& frame + (1UL << (order+1)) <= end)
+		{
+			order++;
+		};
+		
+		buddyFree(frame, order);
+		frame += (1UL << order);
 	};
+	
+	spinlockRelease(&physmemLock);
+	setFlagsRegister(flags);
+	
+	__sync_fetch_and_add(&phmUsedFrames, -count);
 };
 
-/* pagetab.asm */
-void __zeroFrame(uint64_t frame);
+void frameWrite(uint64_t frame, const void *buffer)
+{
+	memcpy(FRAME_TO_VIRT(frame), buffer, 0x1000);
+};
+
+void frameRead(uint64_t frame, void *buffer)
+{
+	memcpy(buffer, FRAME_TO_VIRT(frame), 0x1000);
+};
+
+void __zeroFrame(uint64_t frame)
+{
+	memset(FRAME_TO_VIRT(frame), 0, 0x1000);
+};
 
 uint64_t phmAllocZeroFrame()
 {
@@ -476,37 +713,25 @@ uint64_t phmAllocZeroFrame()
 uint64_t phmAllocFrameEx(uint64_t count, int flags)
 {
 	if (count == 0) return 0;
-	if (count == 1) return phmAllocSingle();
+	if (count == 1 && (flags & PHM_NOPERCPU) == 0) return phmAllocSingle();
 	
-	uint64_t actuallyAllocated;
-	uint64_t base;
-	if (count > 64)
-	{
-		panic("attempted to allocate more than 64 consecutive frames (%d)\n", (int) count);
-	}
-	else if (count > 32)
-	{
-		actuallyAllocated = 64;
-		base = phmAlloc64();
-	}
-	else if (count > 16)
-	{
-		actuallyAllocated = 32;
-		base = phmAlloc32();
-	}
-	else if (count > 8)
-	{
-		actuallyAllocated = 16;
-		base = phmAlloc16();
-	}
-	else
+	int order = 0;
+	while ((1UL << order) < count) order++;
+	
+	if (order > PHM_MAX_ORDER)
 	{
-		actuallyAllocated = 8;
-		base = phmAlloc8();
+		panic("attempted to allocate more than %d consecutive frames (%d)\n", 1 << PHM_MAX_ORDER, (int) count);
 	};
 	
+	uint64_t base = phmAllocOrder(order);
+	
 	// free the unneeded frames
-	phmFreeFrameEx(base + count, actuallyAllocated - count);
+	uint64_t actuallyAllocated = 1UL << order;
+	if (actuallyAllocated != count)
+	{
+		phmFreeFrameEx(base + count, actuallyAllocated - count);
+	};
+	
 	return base;
 };
 
@@ -514,5 +739,25 @@ void phmFreeFrame(uint64_t frame)
 {
 	if (frame == 0) panic("attempted to free a null frame!");
 	__sync_fetch_and_add(&phmUsedFrames, -1);
-	phmClearFrame(frame);
+	
+	uint64_t flags = getFlagsRegister();
+	cli();
+	
+	if (hotFrames.count == PHM_HOT_FRAMES)
+	{
+		// give the older half of the list back to the buddy allocator
+		spinlockAcquire(&physmemLock);
+		int i;
+		for (i=0; i<PHM_HOT_BATCH; i++)
+		{
+			buddyFree(hotFrames.frames[i], 0);
+		};
+		spinlockRelease(&physmemLock);
+		
+		memcpy(hotFrames.frames, &hotFrames.frames[PHM_HOT_BATCH], sizeof(uint64_t) * (PHM_HOT_FRAMES - PHM_HOT_BATCH));
+		hotFrames.count -= PHM_HOT_BATCH;
+	};
+	
+	hotFrames.frames[hotFrames.count++] = frame;
+	setFlagsRegister(flags);
 };
@@ -1674,10 +1674,15 @@ uint64_t sys_block_on(uint64_t addr, uint64_t expectedVal)
 	};
 	
 	uint64_t offset = addr & 0xFFF;
-	uint64_t oldFrame = mapTempFrame(frame);
-	
 	uint64_t physAddr = (frame << 12) | offset;
-	uint64_t *ptr = (uint64_t*) tmpframe() + (offset >> 3);
+	if (physAddr >= phmDirectMapEnd)
+	{
+		// not RAM
+		piDecref(frame);
+		return EINVAL;
+	};
+	
+	uint64_t *ptr = (uint64_t*) PHYS_TO_VIRT(physAddr);
 	
 	cli();
 	lockSched();
@@ -1686,7 +1691,6 @@ uint64_t sys_block_on(uint64_t addr, uint64_t expectedVal)
 	{
 		unlockSched();
 		sti();
-		mapTempFrame(oldFrame);
 		piDecref(frame);
 		return 0;
 	};
@@ -1697,7 +1701,6 @@ uint64_t sys_block_on(uint64_t addr, uint64_t expectedVal)
 	kyield();
 
 	getCurrentThread()->blockPhys = 0;
-	mapTempFrame(oldFrame);
 	piDecref(frame);
 	return 0;
 };
@@ -3336,6 +3339,55 @@ size_t sys_getdent(int fd, int key)
 	return size;
 };
 
+ssize_t sys_getdents(int fd, int *ukey, void *ubuffer, size_t size)
+{
+	File *fp = ftabGet(getCurrentThread()->ftab, fd);
+	if (fp == NULL)
+	{
+		ERRNO = EBADF;
+		return -1;
+	};
+	
+	int key;
+	if (memcpy_u2k(&key, ukey, sizeof(int)) != 0)
+	{
+		vfsClose(fp);
+		ERRNO = EFAULT;
+		return -1;
+	};
+	
+	// a shorter batch is fine; the caller just comes back for more
+	if (size > VFS_READDIR_MAX) size = VFS_READDIR_MAX;
+	
+	void *tmpbuf = kmalloc(size);
+	if (tmpbuf == NULL)
+	{
+		vfsClose(fp);
+		ERRNO = ENOBUFS;
+		return -1;
+	};
+	
+	ssize_t out = vfsReadDirBatch(fp->iref.inode, &key, tmpbuf, size);
+	vfsClose(fp);
+	
+	if (out < 0)
+	{
+		kfree(tmpbuf);
+		ERRNO = -out;
+		return -1;
+	};
+	
+	if (memcpy_k2u(ubuffer, tmpbuf, out) != 0 || memcpy_k2u(ukey, &key, sizeof(int)) != 0)
+	{
+		kfree(tmpbuf);
+		ERRNO = EFAULT;
+		return -1;
+	};
+	
+	kfree(tmpbuf);
+	return out;
+};
+
 int sys_getktu(void *buffer, size_t size)
 {
 	if (getCurrentThread()->ktusz < size)
@@ -3663,7 +3715,7 @@ int sys_usb_getstr(uint64_t devid, uint8_t index, uint16_t langid, char *ubuffer
  * System call table for fast syscalls, and the number of system calls.
  * Do not use NULL entries! Instead, for unused entries, enter SYS_NULL.
  */
-#define SYSCALL_NUMBER 157
+#define SYSCALL_NUMBER 158
 void* sysTable[SYSCALL_NUMBER] = {
 	&sys_exit,				// 0
 	&sys_write,				// 1
@@ -3822,6 +3874,7 @@ void* sysTable[SYSCALL_NUMBER] = {
 	&sys_usb_devdesc,			// 154
 	&sys_usb_langids,			// 155
 	&sys_usb_getstr,			// 156
+	&sys_getdents,				// 157
 };
 uint64_t sysNumber = SYSCALL_NUMBER;
 
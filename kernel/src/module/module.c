@@ -91,15 +91,11 @@ static int allocModuleBlock()
 
 static uint64_t *mapModuleArea(int modblock, int numSectors)
 {
-	ispLock();
-
-	// physical frame indices of page tables we will use; we collect them here to avoid constantly
-	// switching the ISP.
+	// physical frame indices of page tables we will use
 	uint64_t *ptFrames = (uint64_t*) kmalloc(8*(numSectors+512*numSectors));
 
 	uint64_t pdPhysFrame = phmAllocFrame();
-	ispSetFrame(pdPhysFrame);
-	PD *pd = ispGetPointer();
+	PD *pd = (PD*) FRAME_TO_VIRT(pdPhysFrame);
 	memset(pd, 0, 0x1000);
 
 	int i;
@@ -118,10 +114,9 @@ static uint64_t *mapModuleArea(int modblock, int numSectors)
 	};
 
 	// now the module pages to physical frames.
-	PT *pt = ispGetPointer();
 	for (i=0; i<numSectors; i++)
 	{
-		ispSetFrame(ptFrames[i]);
+		PT *pt = (PT*) FRAME_TO_VIRT(ptFrames[i]);
 		memset(pt, 0, 0x1000);
 		int j;
 		for (j=0; j<512; j++)
@@ -132,8 +127,6 @@ static uint64_t *mapModuleArea(int modblock, int numSectors)
 		};
 	};
 
-	ispUnlock();
-
 	// now map that into the address space
 	cli();
 	pdptModuleSpace.entries[modblock].present = 1;
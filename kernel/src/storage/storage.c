@@ -158,43 +158,609 @@ static int sdfile_pathctl(Inode *inode, uint64_t cmd, void *params)
 	return -1;
 };
 
-static void sdFlushTree(StorageDevice *sd, BlockTreeNode *node, int level, uint64_t pos)
+/**
+ * Return the maximum number of blocks the driver of 'sd' accepts in a single transfer.
+ */
+static size_t sdMaxBlocks(StorageDevice *sd)
+{
+	size_t maxTransfer = SD_TRACK_SIZE;
+	if (sd->ops->size > __builtin_offsetof(SDOps, maxTransfer) && sd->ops->maxTransfer != 0)
+	{
+		maxTransfer = sd->ops->maxTransfer;
+	};
+	
+	return maxTransfer / sd->blockSize;
+};
+
+/**
+ * Return nonzero if the driver of 'sd' implements transferFrames().
+ */
+static int sdHasFrames(StorageDevice *sd)
+{
+	return IMPLEMENTS(sd->ops, transferFrames);
+};
+
+void sdSubmit(StorageDevice *sd, SDRequest *req)
+{
+	req->next = NULL;
+	req->status = 0;
+	if (req->type == SD_REQ_WRITE)
+	{
+		req->deadline = getNanotime() + SD_DEADLINE_WRITE;
+	}
+	else
+	{
+		req->deadline = getNanotime() + SD_DEADLINE_READ;
+	};
+	
+	mutexLock(&sd->ioLock);
+	if (sd->flags & SD_HANGUP)
+	{
+		// the I/O threads may be gone
+		mutexUnlock(&sd->ioLock);
+		req->status = ENXIO;
+		req->callback(req);
+		return;
+	};
+	
+	SDRequest **put = &sd->ioQueue;
+	while (*put != NULL) put = &(*put)->next;
+	*put = req;
+	mutexUnlock(&sd->ioLock);
+	
+	semSignal(&sd->semIO);
+};
+
+static void sdIOComplete(SDRequest *req)
+{
+	semSignal((Semaphore*) req->context);
+};
+
+/**
+ * Submit a request for the given buffer or frames, and wait for it to complete.
+ */
+static int sdIOGen(StorageDevice *sd, int type, size_t startBlock, size_t numBlocks, void *buffer, const uint64_t *frames)
+{
+	Semaphore semDone;
+	semInit2(&semDone, 0);
+	
+	SDRequest req;
+	memset(&req, 0, sizeof(SDRequest));
+	req.type = type;
+	req.startBlock = startBlock;
+	req.numBlocks = numBlocks;
+	req.buffer = buffer;
+	req.frames = frames;
+	req.callback = sdIOComplete;
+	req.context = &semDone;
+	
+	sdSubmit(sd, &req);
+	semWait(&semDone);
+	
+	return req.status;
+};
+
+int sdIO(StorageDevice *sd, int type, size_t startBlock, size_t numBlocks, void *buffer)
+{
+	return sdIOGen(sd, type, startBlock, numBlocks, buffer, NULL);
+};
+
+static int sdIOFrames(StorageDevice *sd, int type, size_t startBlock, size_t numBlocks, const uint64_t *frames)
 {
+	return sdIOGen(sd, type, startBlock, numBlocks, NULL, frames);
+};
+
+/**
+ * Remove 'req' from the request queue. Call with 'ioLock' held.
+ */
+static void sdUnqueue(StorageDevice *sd, SDRequest *req)
+{
+	SDRequest **scan = &sd->ioQueue;
+	while (*scan != req) scan = &(*scan)->next;
+	*scan = req->next;
+	req->next = NULL;
+};
+
+/**
+ * Remove the next request to dispatch from the queue and return it. This is the request with the earliest
+ * expired deadline if there is one; otherwise the elevator continues upwards from 'ioNext', going back to
+ * the lowest block once there is nothing above it (C-LOOK). Call with 'ioLock' held and the queue non-empty.
+ */
+static SDRequest* sdPickRequest(StorageDevice *sd)
+{
+	uint64_t now = getNanotime();
+	SDRequest *late = NULL;
+	SDRequest *ahead = NULL;
+	SDRequest *lowest = NULL;
+	
+	SDRequest *req;
+	for (req=sd->ioQueue; req!=NULL; req=req->next)
+	{
+		if (req->deadline <= now && (late == NULL || req->deadline < late->deadline)) late = req;
+		if (req->startBlock >= sd->ioNext && (ahead == NULL || req->startBlock < ahead->startBlock)) ahead = req;
+		if (lowest == NULL || req->startBlock < lowest->startBlock) lowest = req;
+	};
+	
+	req = late;
+	if (req == NULL) req = ahead;
+	if (req == NULL) req = lowest;
+	
+	sdUnqueue(sd, req);
+	return req;
+};
+
+/**
+ * Remove from the queue all requests which can be merged with 'first' (of the same type, adjacent to it
+ * or to each other, totalling at most 'maxBlocks'), and return them as a list linked in block order.
+ * Call with 'ioLock' held.
+ */
+static SDRequest* sdMergeRequests(StorageDevice *sd, SDRequest *first, size_t maxBlocks)
+{
+	SDRequest *head = first;
+	SDRequest *tail = first;
+	size_t startBlock = first->startBlock;
+	size_t numBlocks = first->numBlocks;
+	
+	int merged = 1;
+	while (merged)
+	{
+		merged = 0;
+		
+		SDRequest *req;
+		for (req=sd->ioQueue; req!=NULL; req=req->next)
+		{
+			if (req->type != first->type) continue;
+			if ((req->frames == NULL) != (first->frames == NULL)) continue;
+			if ((numBlocks + req->numBlocks) > maxBlocks) continue;
+			
+			if (req->startBlock == (startBlock + numBlocks))
+			{
+				sdUnqueue(sd, req);
+				tail->next = req;
+				tail = req;
+			}
+			else if ((req->startBlock + req->numBlocks) == startBlock)
+			{
+				sdUnqueue(sd, req);
+				req->next = head;
+				head = req;
+				startBlock = req->startBlock;
+			}
+			else
+			{
+				continue;
+			};
+			
+			numBlocks += req->numBlocks;
+			merged = 1;
+			break;
+		};
+	};
+	
+	return head;
+};
+
+/**
+ * Call the driver to perform a transfer, splitting it up if it is larger than the driver accepts.
+ */
+static int sdDispatch(StorageDevice *sd, int type, size_t startBlock, size_t numBlocks, void *buffer)
+{
+	size_t maxBlocks = sdMaxBlocks(sd);
+	uint8_t *put = (uint8_t*) buffer;
+	
+	while (numBlocks > 0)
+	{
+		size_t count = numBlocks;
+		if (count > maxBlocks) count = maxBlocks;
+		
+		int status;
+		if (type == SD_REQ_WRITE) status = sd->ops->writeBlocks(sd->drvdata, startBlock, count, put);
+		else status = sd->ops->readBlocks(sd->drvdata, startBlock, count, put);
+		
+		if (status != 0) return status;
+		
+		startBlock += count;
+		numBlocks -= count;
+		put += count * sd->blockSize;
+	};
+	
+	return 0;
+};
+
+/**
+ * Transfer to or from a list of frames; without transferFrames(), each run of physically contiguous frames
+ * is transferred through the direct map.
+ */
+static int sdDispatchFrames(StorageDevice *sd, int type, size_t startBlock, size_t numBlocks, const uint64_t *frames)
+{
+	if (sdHasFrames(sd))
+	{
+		return sd->ops->transferFrames(sd->drvdata, type, startBlock, numBlocks, frames);
+	};
+	
+	size_t blocksPerPage = 0x1000 / sd->blockSize;
+	size_t numPages = numBlocks / blocksPerPage;
+	size_t i = 0;
+	
+	while (i < numPages)
+	{
+		size_t run = 1;
+		while ((i+run) < numPages && frames[i+run] == (frames[i]+run)) run++;
+		
+		int status = sdDispatch(sd, type, startBlock + i * blocksPerPage, run * blocksPerPage, FRAME_TO_VIRT(frames[i]));
+		if (status != 0) return status;
+		
+		i += run;
+	};
+	
+	return 0;
+};
+
+static void sdIOThread(void *context)
+{
+	StorageDevice *sd = (StorageDevice*) context;
+	
+	size_t maxMerge = 0;
+	if (sd->ioMergeBuffer != NULL)
+	{
+		maxMerge = sdMaxBlocks(sd);
+		if (maxMerge > SD_MERGE_MAX / sd->blockSize) maxMerge = SD_MERGE_MAX / sd->blockSize;
+	};
+	
+	while (1)
+	{
+		mutexLock(&sd->ioLock);
+		if (sd->ioQueue == NULL)
+		{
+			int hangup = sd->flags & SD_HANGUP;
+			mutexUnlock(&sd->ioLock);
+			
+			if (hangup) break;
+			semWait(&sd->semIO);
+			continue;
+		};
+		
+		// only merge if the merge buffer is free; otherwise, another thread is doing a merged transfer,
+		// and we dispatch the request on its own instead of waiting
+		SDRequest *list = sdPickRequest(sd);
+		int haveMergeBuffer = 0;
+		if (list->frames != NULL)
+		{
+			// frame lists are simply concatenated; no buffer needed
+			if (sdHasFrames(sd)) list = sdMergeRequests(sd, list, SD_MERGE_FRAMES * (0x1000 / sd->blockSize));
+		}
+		else if (maxMerge != 0 && mutexTryLock(&sd->mergeLock) == 0)
+		{
+			list = sdMergeRequests(sd, list, maxMerge);
+			if (list->next == NULL) mutexUnlock(&sd->mergeLock);
+			else haveMergeBuffer = 1;
+		};
+		
+		size_t startBlock = list->startBlock;
+		size_t numBlocks = 0;
+		SDRequest *req;
+		for (req=list; req!=NULL; req=req->next)
+		{
+			numBlocks += req->numBlocks;
+		};
+		
+		sd->ioNext = startBlock + numBlocks;
+		mutexUnlock(&sd->ioLock);
+		
+		int status;
+		if (sd->flags & SD_HANGUP)
+		{
+			status = ENXIO;
+		}
+		else if (list->frames != NULL && list->next == NULL)
+		{
+			status = sdDispatchFrames(sd, list->type, startBlock, numBlocks, list->frames);
+		}
+		else if (list->frames != NULL)
+		{
+			uint64_t frames[SD_MERGE_FRAMES];
+			size_t numFrames = 0;
+			for (req=list; req!=NULL; req=req->next)
+			{
+				size_t count = req->numBlocks * sd->blockSize / 0x1000;
+				memcpy(&frames[numFrames], req->frames, 8 * count);
+				numFrames += count;
+			};
+			
+			status = sdDispatchFrames(sd, list->type, startBlock, numBlocks, frames);
+		}
+		else if (list->next == NULL)
+		{
+			status = sdDispatch(sd, list->type, startBlock, numBlocks, list->buffer);
+		}
+		else
+		{
+			// merged transfer; goes through the merge buffer
+			uint8_t *buffer = (uint8_t*) sd->ioMergeBuffer;
+			if (list->type == SD_REQ_WRITE)
+			{
+				for (req=list; req!=NULL; req=req->next)
+				{
+					memcpy(buffer + (req->startBlock - startBlock) * sd->blockSize, req->buffer,
+						req->numBlocks * sd->blockSize);
+				};
+			};
+			
+			status = sdDispatch(sd, list->type, startBlock, numBlocks, buffer);
+			
+			if (list->type == SD_REQ_READ && status == 0)
+			{
+				for (req=list; req!=NULL; req=req->next)
+				{
+					memcpy(req->buffer, buffer + (req->startBlock - startBlock) * sd->blockSize,
+						req->numBlocks * sd->blockSize);
+				};
+			};
+		};
+		
+		if (haveMergeBuffer) mutexUnlock(&sd->mergeLock);
+		
+		while (list != NULL)
+		{
+			// the callback may release the request
+			req = list;
+			list = list->next;
+			
+			req->status = status;
+			req->callback(req);
+		};
+	};
+};
+
+/**
+ * Return nonzero if the track containing 'pos' is in flight. Call with the cache lock held.
+ */
+static int sdIsInflight(StorageDevice *sd, uint64_t pos)
+{
+	SDInflight *inflight;
+	for (inflight=sd->inflight; inflight!=NULL; inflight=inflight->next)
+	{
+		if (inflight->track == (pos >> 15)) return 1;
+	};
+	
+	return 0;
+};
+
+/**
+ * If the track containing 'pos' is in flight, wait for the transfer to finish and return 1; the cache lock is
+ * dropped while waiting, so the caller must look the track up again. Otherwise, return 0. Call with the cache
+ * lock held.
+ */
+static int sdWaitInflight(StorageDevice *sd, uint64_t pos)
+{
+	if (!sdIsInflight(sd, pos)) return 0;
+	
+	// every finished transfer wakes up all the waiters; spurious wakeups just cause another lookup
+	sd->inflightWaiters++;
+	mutexUnlock(&sd->cacheLock);
+	semWait(&sd->semInflight);
+	mutexLock(&sd->cacheLock);
+	return 1;
+};
+
+/**
+ * Mark the track containing 'pos' as in flight, before dropping the cache lock to transfer it.
+ */
+static void sdBeginInflight(StorageDevice *sd, SDInflight *inflight, uint64_t pos)
+{
+	inflight->track = pos >> 15;
+	inflight->next = sd->inflight;
+	sd->inflight = inflight;
+};
+
+/**
+ * Remove an in-flight mark after re-acquiring the cache lock, and wake up the waiters.
+ */
+static void sdEndInflight(StorageDevice *sd, SDInflight *inflight)
+{
+	SDInflight **scan = &sd->inflight;
+	while (*scan != inflight) scan = &(*scan)->next;
+	*scan = inflight->next;
+	
+	if (sd->inflightWaiters != 0)
+	{
+		semSignal2(&sd->semInflight, sd->inflightWaiters);
+		sd->inflightWaiters = 0;
+	};
+};
+
+/**
+ * A batch of track writes submitted together by sdFlushTracks(), so that the elevator can order and merge them.
+ */
+typedef struct
+{
+	SDRequest				reqs[SD_FLUSH_BATCH];
+	int					count;
+	Semaphore				semDone;
+	
+	/**
+	 * The first error reported by any of the writes, or 0.
+	 */
+	int					error;
+} SDFlushBatch;
+
+/**
+ * Which dirty tracks sdFlushTracks() should write: those with index in [firstTrack, endTrack), which
+ * have been dirty for at least 'minAge' writeback intervals.
+ */
+typedef struct
+{
+	uint64_t				firstTrack;
+	uint64_t				endTrack;
+	int					minAge;
+} SDFlushScope;
+
+/**
+ * Mark a cache tree entry as dirty. The writeback epoch is only set on the transition from clean, so
+ * that it records when the oldest dirty data below the entry was written.
+ */
+static void sdMarkDirty(StorageDevice *sd, uint64_t *entry)
+{
+	if ((*entry & SD_BLOCK_DIRTY) == 0)
+	{
+		*entry |= SD_BLOCK_DIRTY | ((sd->dirtyTick & SD_BLOCK_EPOCH_MAX) << SD_BLOCK_EPOCH_SHIFT);
+	};
+};
+
+/**
+ * Return the number of writeback intervals for which the data below a dirty entry has been dirty.
+ */
+static int sdDirtyAge(StorageDevice *sd, uint64_t entry)
+{
+	return (int) ((sd->dirtyTick - (entry >> SD_BLOCK_EPOCH_SHIFT)) & SD_BLOCK_EPOCH_MAX);
+};
+
+static void sdFlushComplete(SDRequest *req)
+{
+	SDFlushBatch *batch = (SDFlushBatch*) req->context;
+	if (req->status != 0 && batch->error == 0) batch->error = req->status;
+	semSignal(&batch->semDone);
+};
+
+/**
+ * Wait for all writes in the batch to complete, and empty it.
+ */
+static void sdFlushWait(SDFlushBatch *batch)
+{
+	int left = batch->count;
+	while (left > 0)
+	{
+		left -= semWaitGen(&batch->semDone, left, 0, 0);
+	};
+	
+	batch->count = 0;
+};
+
+/**
+ * Submit writes for the dirty tracks under 'node' which are within the scope. Returns nonzero if any dirty
+ * tracks are left under it, in which case the age of the oldest one is stored in 'oldest'; the entries on
+ * the way are updated so that they stay dirty exactly when something below them is.
+ */
+static int sdFlushTree(StorageDevice *sd, BlockTreeNode *node, int level, uint64_t pos, SDFlushBatch *batch, SDFlushScope *scope, int *oldest)
+{
+	int remain = 0;
+	int maxAge = 0;
+	
 	uint64_t i;
 	for (i=0; i<128; i++)
 	{
-		if (node->entries[i] & SD_BLOCK_DIRTY)
+		uint64_t entry = node->entries[i];
+		if ((entry & SD_BLOCK_DIRTY) == 0) continue;
+		
+		uint64_t index = (pos << 7) | i;
+		uint64_t span = 1UL << (7 * (6 - level));
+		int age = sdDirtyAge(sd, entry);
+		
+		if (((index + 1) * span) <= scope->firstTrack || (index * span) >= scope->endTrack || age < scope->minAge)
+		{
+			// out of scope (and if too young, so is everything below it)
+			remain = 1;
+			if (age > maxAge) maxAge = age;
+			continue;
+		};
+		
+		uint64_t canaddr = (entry & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
+		if (level == 6)
 		{
-			node->entries[i] &= ~SD_BLOCK_DIRTY;
-			if (level == 6)
+			node->entries[i] &= ~(SD_BLOCK_DIRTY | SD_BLOCK_EPOCH_MASK);
+			size_t bytepos = index << 15;
+			
+			if (batch->count == SD_FLUSH_BATCH)
 			{
-				uint64_t canaddr = (node->entries[i] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
-				size_t bytepos = ((pos << 7) | i) << 15;
-				size_t startBlock = bytepos / sd->blockSize;
-				size_t numBlocks = SD_TRACK_SIZE / sd->blockSize;
-				sd->ops->writeBlocks(sd->drvdata, startBlock, numBlocks, (const void*) canaddr);
+				sdFlushWait(batch);
+			};
+			
+			SDRequest *req = &batch->reqs[batch->count++];
+			req->type = SD_REQ_WRITE;
+			req->startBlock = bytepos / sd->blockSize;
+			req->numBlocks = SD_TRACK_SIZE / sd->blockSize;
+			req->buffer = (void*) canaddr;
+			req->callback = sdFlushComplete;
+			req->context = batch;
+			sdSubmit(sd, req);
+		}
+		else
+		{
+			int subOldest;
+			if (sdFlushTree(sd, (BlockTreeNode*)canaddr, level+1, index, batch, scope, &subOldest))
+			{
+				uint64_t epoch = (sd->dirtyTick - subOldest) & SD_BLOCK_EPOCH_MAX;
+				node->entries[i] = (entry & ~SD_BLOCK_EPOCH_MASK) | (epoch << SD_BLOCK_EPOCH_SHIFT);
+				
+				remain = 1;
+				if (subOldest > maxAge) maxAge = subOldest;
 			}
 			else
 			{
-				uint64_t canaddr = (node->entries[i] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
-				sdFlushTree(sd, (BlockTreeNode*)canaddr, level+1, (pos << 7) | i);
+				node->entries[i] &= ~(SD_BLOCK_DIRTY | SD_BLOCK_EPOCH_MASK);
 			};
 		};
 	};
+	
+	*oldest = maxAge;
+	return remain;
+};
+
+/**
+ * Write out the dirty tracks with index in [firstTrack, endTrack) which have been dirty for at least 'minAge'
+ * writeback intervals, and wait for the writes. Call this only when the cache is locked. Returns 0 on success,
+ * or the error number of the first write which failed.
+ */
+static int sdFlushTracks(StorageDevice *sd, uint64_t firstTrack, uint64_t endTrack, int minAge)
+{
+	SDFlushBatch batch;
+	batch.count = 0;
+	batch.error = 0;
+	semInit2(&batch.semDone, 0);
+	
+	SDFlushScope scope;
+	scope.firstTrack = firstTrack;
+	scope.endTrack = endTrack;
+	scope.minAge = minAge;
+	
+	int oldest;
+	sdFlushTree(sd, &sd->cacheTop, 0, 0, &batch, &scope, &oldest);
+	sdFlushWait(&batch);
+	
+	return batch.error;
 };
 
-static void sdFlush(StorageDevice *sd)
+static int sdFlush(StorageDevice *sd)
 {
 	// call this only when the cache is locked
-	sdFlushTree(sd, &sd->cacheTop, 0, 0);
+	return sdFlushTracks(sd, 0, ~0UL, 0);
+};
+
+/**
+ * Flush the tracks covering 'size' bytes at 'pos' (relative to the start of the device).
+ */
+static int sdFlushRange(StorageDevice *sd, uint64_t pos, uint64_t size)
+{
+	mutexLock(&sd->cacheLock);
+	int error = sdFlushTracks(sd, pos >> 15, (pos + size + SD_TRACK_SIZE - 1) >> 15, 0);
+	mutexUnlock(&sd->cacheLock);
+	
+	return error;
 };
 
 static int sdfile_flush(Inode *inode)
 {
+	// only the part of the device which this file covers
 	SDDeviceFile *fdev = (SDDeviceFile*) inode->fsdata;
-	mutexLock(&fdev->sd->cacheLock);
-	sdFlush(fdev->sd);
-	mutexUnlock(&fdev->sd->cacheLock);
+	uint64_t size = fdev->size;
+	if (size == 0) size = fdev->sd->totalSize - fdev->offset;
+	
+	int error = sdFlushRange(fdev->sd, fdev->offset, size);
+	if (error != 0)
+	{
+		ERRNO = error;
+		return -1;
+	};
 	
 	return 0;
 };
@@ -226,7 +792,8 @@ static void sdfile_close(Inode *inode, void *filedata)
 /**
  * Return a pointer to the specified cache track. If 'make' is 0, and the track does not exist,
  * NULL is returned (if 'make' is 1, the track is read from disk on a cache miss). If 'dirty' is
- * 1, the track is marked dirty. Call this ONLY while the cacheLock is locked.
+ * 1, the track is marked dirty. Call this ONLY while the cacheLock is locked; it is dropped while
+ * a missing track is being read, so pointers into the tree must not be kept across the call.
  *
  * NULL can also be returned on error, in whcih case *error is set to the errno.
  *
@@ -234,58 +801,90 @@ static void sdfile_close(Inode *inode, void *filedata)
  */
 static void* sdGetCache(StorageDevice *sd, uint64_t pos, int make, int dirty, int *error)
 {
-	uint64_t i;
-	BlockTreeNode *node = &sd->cacheTop;
-	for (i=0; i<6; i++)
+	// a track which we loaded with the cache lock dropped, and must now insert
+	void *loaded = NULL;
+	
+	while (1)
 	{
-		uint64_t sub = (pos >> (15 + 7 * (6 - i))) & 0x7F;
-		uint64_t entry = node->entries[sub];
-		
-		if (entry == 0)
+		uint64_t i;
+		BlockTreeNode *node = &sd->cacheTop;
+		for (i=0; i<6; i++)
 		{
-			if (!make)
+			uint64_t sub = (pos >> (15 + 7 * (6 - i))) & 0x7F;
+			uint64_t entry = node->entries[sub];
+			
+			if (entry == 0)
 			{
-				*error = EAGAIN;
-				return NULL;
+				if (!make)
+				{
+					*error = EAGAIN;
+					return NULL;
+				};
+				
+				getCurrentThread()->sdMissNow = 1;
+				BlockTreeNode *nextNode = NEW(BlockTreeNode);
+				memset(nextNode, 0, sizeof(BlockTreeNode));
+				getCurrentThread()->sdMissNow = 0;
+				
+				// bottom 48 bits of address, set usage counter to 1, dirty if needed
+				node->entries[sub] = ((uint64_t) nextNode & 0xFFFFFFFFFFFF) | (1UL << 56);
+				if (dirty) sdMarkDirty(sd, &node->entries[sub]);
+				
+				node = nextNode;
+			}
+			else
+			{
+				// increment usage counter
+				uint64_t ucnt = entry >> 56;
+				if (ucnt != 255)
+				{
+					node->entries[sub] += (1UL << 56);
+				};
+				if (dirty) sdMarkDirty(sd, &node->entries[sub]);
+				
+				// get canonical address
+				uint64_t canaddr = (node->entries[sub] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
+				
+				// follow
+				node = (BlockTreeNode*) canaddr;
 			};
-			
-			getCurrentThread()->sdMissNow = 1;
-			BlockTreeNode *nextNode = NEW(BlockTreeNode);
-			memset(nextNode, 0, sizeof(BlockTreeNode));
-			getCurrentThread()->sdMissNow = 0;
-			
-			// bottom 48 bits of address, set usage counter to 1, dirty if needed
-			node->entries[sub] = ((uint64_t) nextNode & 0xFFFFFFFFFFFF) | (1UL << 56);
-			if (dirty) node->entries[sub] |= SD_BLOCK_DIRTY;
-			
-			node = nextNode;
-		}
-		else
+		};
+		
+		uint64_t track = (pos >> 15) & 0x7F;
+		if (node->entries[track] != 0)
 		{
-			// increment usage counter
-			uint64_t ucnt = entry >> 56;
-			if (ucnt != 255)
+			if (loaded != NULL)
 			{
-				node->entries[sub] += (1UL << 56);
+				// loads of a track are serialized by the in-flight list
+				panic("sdGetCache: track at 0x%lX loaded twice", pos);
 			};
-			if (dirty) node->entries[sub] |= SD_BLOCK_DIRTY;
-			
-			// get canonical address
-			uint64_t canaddr = (node->entries[sub] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
 			
-			// follow
-			node = (BlockTreeNode*) canaddr;
+			uint64_t trackAddr = (node->entries[track] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
+			if ((node->entries[track] >> 56) != 255)
+			{
+				node->entries[track] += (1UL << 56);
+			};
+			if (dirty) sdMarkDirty(sd, &node->entries[track]);
+			return (void*) trackAddr;
 		};
-	};
-	
-	uint64_t track = (pos >> 15) & 0x7F;
-	uint64_t trackAddr;
-	if (node->entries[track] == 0)
-	{
+		
+		if (loaded != NULL)
+		{
+			node->entries[track] = ((uint64_t) loaded & 0xFFFFFFFFFFFF) | (1UL << 56);
+			if (dirty) sdMarkDirty(sd, &node->entries[track]);
+			return loaded;
+		};
+		
 		if (!make)
 		{
-			*error = EAGAIN;
-			return NULL;
+			*error = EAGAIN;
+			return NULL;
+		};
+		
+		if (sdWaitInflight(sd, pos))
+		{
+			// someone else was loading or writing it; look again
+			continue;
 		};
 		
 		getCurrentThread()->sdMissNow = 1;
@@ -310,9 +909,28 @@ static void* sdGetCache(StorageDevice *sd, uint64_t pos, int make, int dirty, in
 		
 		void *vptr = mapPhysMemoryList(frames, 8);
 		getCurrentThread()->sdMissNow = 0;
-		int status = sd->ops->readBlocks(sd->drvdata, (pos & ~0x7FFFUL) / sd->blockSize,
-							SD_TRACK_SIZE / sd->blockSize,
-							vptr);
+		
+		// read the track with the cache lock dropped, so that other tracks can be accessed (and
+		// loaded) in the meantime; anyone wanting this track waits for us in sdWaitInflight().
+		// the lookup is then repeated, as the tree may have changed.
+		SDInflight inflight;
+		sdBeginInflight(sd, &inflight, pos);
+		mutexUnlock(&sd->cacheLock);
+		
+		// straight into the frames if possible
+		int status;
+		if ((0x1000 % sd->blockSize) == 0)
+		{
+			status = sdIOFrames(sd, SD_REQ_READ, (pos & ~0x7FFFUL) / sd->blockSize, SD_TRACK_SIZE / sd->blockSize, frames);
+		}
+		else
+		{
+			status = sdIO(sd, SD_REQ_READ, (pos & ~0x7FFFUL) / sd->blockSize, SD_TRACK_SIZE / sd->blockSize, vptr);
+		};
+		
+		mutexLock(&sd->cacheLock);
+		sdEndInflight(sd, &inflight);
+		
 		if (status != 0)
 		{
 			unmapPhysMemory(vptr, 0x8000);
@@ -323,18 +941,8 @@ static void* sdGetCache(StorageDevice *sd, uint64_t pos, int make, int dirty, in
 		};
 		
 		__sync_fetch_and_add(&phmCachedFrames, 8);
-		
-		node->entries[track] = ((uint64_t) vptr & 0xFFFFFFFFFFFF) | (1UL << 56);
-		if (dirty) node->entries[track] |= SD_BLOCK_DIRTY;
-		trackAddr = (uint64_t) vptr;
-	}
-	else
-	{
-		trackAddr = (node->entries[track] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
-		if (dirty) node->entries[track] |= SD_BLOCK_DIRTY;
+		loaded = vptr;
 	};
-	
-	return (void*) trackAddr;
 };
 
 static ssize_t sdRead(StorageDevice *sd, uint64_t pos, void *buf, size_t size)
@@ -370,7 +978,7 @@ static ssize_t sdRead(StorageDevice *sd, uint64_t pos, void *buf, size_t size)
 			{
 				// cache miss but allocations banned
 				char tmp[SD_TRACK_SIZE];
-				int status = sd->ops->readBlocks(sd->drvdata, (pos & ~0x7FFFUL) / sd->blockSize,
+				int status = sdIO(sd, SD_REQ_READ, (pos & ~0x7FFFUL) / sd->blockSize,
 									SD_TRACK_SIZE / sd->blockSize,
 									tmp);
 				if (status == 0) fixed = 1;
@@ -439,7 +1047,7 @@ static ssize_t sdWrite(StorageDevice *sd, uint64_t pos, const void *buf, size_t
 			{
 				// cache miss but allocations banned
 				char tmp[SD_TRACK_SIZE];
-				int status = sd->ops->readBlocks(sd->drvdata, (pos & ~0x7FFFUL) / sd->blockSize,
+				int status = sdIO(sd, SD_REQ_READ, (pos & ~0x7FFFUL) / sd->blockSize,
 									SD_TRACK_SIZE / sd->blockSize,
 									tmp);
 				if (status == 0) fixed = 1;
@@ -473,7 +1081,7 @@ static ssize_t sdWrite(StorageDevice *sd, uint64_t pos, const void *buf, size_t
 		
 		if (immediateFlush)
 		{
-			sd->ops->readBlocks(sd->drvdata, (orgpos & ~0x7FFFUL) / sd->blockSize,
+			sdIO(sd, SD_REQ_WRITE, (orgpos & ~0x7FFFUL) / sd->blockSize,
 						SD_TRACK_SIZE / sd->blockSize,
 						(void*)trackAddr);
 		};
@@ -522,6 +1130,311 @@ static ssize_t sdfile_pwrite(Inode *inode, File *fp, const void *buf, size_t siz
 	return sdWrite(handle->sd, actualStart, buf, size);
 };
 
+/**
+ * Transfer blocks between the device and 'buf' without caching them. Tracks which are already in the
+ * cache are used for reads and updated by writes (which still go to the disk), so that the cache stays
+ * coherent with the disk. 'pos' and 'size' must be block-aligned.
+ */
+static ssize_t sdTransferDirect(StorageDevice *sd, uint64_t pos, void *buf, size_t size, int write)
+{
+	if (sd->flags & SD_HANGUP)
+	{
+		ERRNO = ENXIO;
+		return -1;
+	};
+	
+	uint8_t *put = (uint8_t*) buf;
+	ssize_t sizeDone = 0;
+	
+	while (size > 0)
+	{
+		uint64_t offsetIntoTrack = pos & (SD_TRACK_SIZE-1);
+		uint64_t toDo = SD_TRACK_SIZE - offsetIntoTrack;
+		
+		if (toDo > size)
+		{
+			toDo = size;
+		};
+		
+		mutexLock(&sd->cacheLock);
+		
+		int error;
+		int status = 0;
+		uint8_t *track = (uint8_t*) sdGetCache(sd, pos, 0, 0, &error);
+		if (track != NULL)
+		{
+			if (write)
+			{
+				// write through, with the lock held so that the cached copy matches the disk
+				memcpy(track + offsetIntoTrack, put, toDo);
+				status = sdIO(sd, SD_REQ_WRITE, pos / sd->blockSize, toDo / sd->blockSize, put);
+			}
+			else
+			{
+				memcpy(put, track + offsetIntoTrack, toDo);
+			};
+			
+			mutexUnlock(&sd->cacheLock);
+		}
+		else if (write)
+		{
+			// if the track is being loaded, wait for it to become cached; otherwise, make sure it
+			// does not get loaded until the new data is on disk
+			if (sdWaitInflight(sd, pos))
+			{
+				mutexUnlock(&sd->cacheLock);
+				continue;
+			};
+			
+			SDInflight inflight;
+			sdBeginInflight(sd, &inflight, pos);
+			mutexUnlock(&sd->cacheLock);
+			
+			status = sdIO(sd, SD_REQ_WRITE, pos / sd->blockSize, toDo / sd->blockSize, put);
+			
+			mutexLock(&sd->cacheLock);
+			sdEndInflight(sd, &inflight);
+			mutexUnlock(&sd->cacheLock);
+		}
+		else
+		{
+			mutexUnlock(&sd->cacheLock);
+			status = sdIO(sd, SD_REQ_READ, pos / sd->blockSize, toDo / sd->blockSize, put);
+		};
+		
+		if (status != 0)
+		{
+			if (sizeDone == 0)
+			{
+				ERRNO = status;
+				return -1;
+			};
+			
+			return sizeDone;
+		};
+		
+		put += toDo;
+		sizeDone += toDo;
+		pos += toDo;
+		size -= toDo;
+	};
+	
+	return sizeDone;
+};
+
+static ssize_t sdDirectIO(File *fp, void *buf, size_t size, off_t offset, int write)
+{
+	if (fp->iref.inode->pread != sdfile_pread)
+	{
+		// not a storage device
+		if (write) return vfsPWrite(fp, buf, size, offset);
+		else return vfsPRead(fp, buf, size, offset);
+	};
+	
+	SDHandle *handle = (SDHandle*) fp->filedata;
+	StorageDevice *sd = handle->sd;
+	uint64_t actualStart = handle->offset + (uint64_t) offset;
+	
+	if ((actualStart % sd->blockSize) != 0 || (size % sd->blockSize) != 0)
+	{
+		if (write) return sdfile_pwrite(fp->iref.inode, fp, buf, size, offset);
+		else return sdfile_pread(fp->iref.inode, fp, buf, size, offset);
+	};
+	
+	if (handle->size != 0)
+	{
+		if (offset >= handle->size)
+		{
+			return 0;
+		};
+		
+		if ((offset+size) > handle->size)
+		{
+			size = handle->size - offset;
+		};
+	};
+	
+	return sdTransferDirect(sd, actualStart, buf, size, write);
+};
+
+ssize_t sdReadDirect(File *fp, void *buffer, size_t size, off_t offset)
+{
+	return sdDirectIO(fp, buffer, size, offset, 0);
+};
+
+ssize_t sdWriteDirect(File *fp, const void *buffer, size_t size, off_t offset)
+{
+	return sdDirectIO(fp, (void*) buffer, size, offset, 1);
+};
+
+/**
+ * Transfer whole pages between the device and frames, without caching them, in chunks of SD_MERGE_FRAMES.
+ * If a chunk overlaps tracks which are cached or in flight, its pages go through sdTransferDirect() one at a
+ * time, which keeps the cache coherent; otherwise, the whole chunk is a single request. 'pos' must be
+ * block-aligned.
+ */
+static ssize_t sdTransferFrames(StorageDevice *sd, uint64_t pos, const uint64_t *frames, int count, int write)
+{
+	if (sd->flags & SD_HANGUP)
+	{
+		ERRNO = ENXIO;
+		return -1;
+	};
+	
+	ssize_t sizeDone = 0;
+	while (count > 0)
+	{
+		int chunk = count;
+		if (chunk > SD_MERGE_FRAMES) chunk = SD_MERGE_FRAMES;
+		uint64_t end = pos + ((uint64_t) chunk << 12);
+		
+		mutexLock(&sd->cacheLock);
+		
+		int shared = 0;
+		uint64_t trackPos;
+		for (trackPos=(pos & ~(SD_TRACK_SIZE-1)); trackPos<end; trackPos+=SD_TRACK_SIZE)
+		{
+			int error;
+			if (sdGetCache(sd, trackPos, 0, 0, &error) != NULL || sdIsInflight(sd, trackPos))
+			{
+				shared = 1;
+				break;
+			};
+		};
+		
+		int status = 0;
+		if (shared)
+		{
+			mutexUnlock(&sd->cacheLock);
+			
+			int i;
+			for (i=0; i<chunk; i++)
+			{
+				if (sdTransferDirect(sd, pos + ((uint64_t) i << 12), FRAME_TO_VIRT(frames[i]), 0x1000, write) != 0x1000)
+				{
+					status = ERRNO;
+					break;
+				};
+			};
+		}
+		else if (write)
+		{
+			// keep the tracks from being loaded until the new data is on disk
+			SDInflight marks[SD_MERGE_FRAMES * 0x1000 / SD_TRACK_SIZE + 1];
+			int numMarks = 0;
+			for (trackPos=(pos & ~(SD_TRACK_SIZE-1)); trackPos<end; trackPos+=SD_TRACK_SIZE)
+			{
+				sdBeginInflight(sd, &marks[numMarks++], trackPos);
+			};
+			
+			mutexUnlock(&sd->cacheLock);
+			status = sdIOFrames(sd, SD_REQ_WRITE, pos / sd->blockSize, ((uint64_t) chunk << 12) / sd->blockSize, frames);
+			
+			mutexLock(&sd->cacheLock);
+			while (numMarks--)
+			{
+				sdEndInflight(sd, &marks[numMarks]);
+			};
+			mutexUnlock(&sd->cacheLock);
+		}
+		else
+		{
+			mutexUnlock(&sd->cacheLock);
+			status = sdIOFrames(sd, SD_REQ_READ, pos / sd->blockSize, ((uint64_t) chunk << 12) / sd->blockSize, frames);
+		};
+		
+		if (status != 0)
+		{
+			if (sizeDone == 0)
+			{
+				ERRNO = status;
+				return -1;
+			};
+			
+			return sizeDone;
+		};
+		
+		frames += chunk;
+		count -= chunk;
+		pos = end;
+		sizeDone += (ssize_t) chunk << 12;
+	};
+	
+	return sizeDone;
+};
+
+static ssize_t sdFramesIO(File *fp, const uint64_t *frames, int count, off_t offset, int write)
+{
+	SDHandle *handle = (SDHandle*) fp->filedata;
+	StorageDevice *sd = NULL;
+	if (fp->iref.inode->pread == sdfile_pread) sd = handle->sd;
+	
+	uint64_t size = (uint64_t) count << 12;
+	if (sd == NULL || ((handle->offset + (uint64_t) offset) % sd->blockSize) != 0 || (0x1000 % sd->blockSize) != 0
+		|| (handle->size != 0 && (offset + size) > handle->size))
+	{
+		// not a storage device, or not whole blocks within the partition; go one page at a time
+		ssize_t sizeDone = 0;
+		int i;
+		for (i=0; i<count; i++)
+		{
+			ssize_t result = sdDirectIO(fp, FRAME_TO_VIRT(frames[i]), 0x1000, offset + ((off_t) i << 12), write);
+			if (result != 0x1000)
+			{
+				if (sizeDone == 0) return result;
+				if (result > 0) sizeDone += result;
+				return sizeDone;
+			};
+			
+			sizeDone += 0x1000;
+		};
+		
+		return sizeDone;
+	};
+	
+	return sdTransferFrames(sd, handle->offset + (uint64_t) offset, frames, count, write);
+};
+
+ssize_t sdReadFrames(File *fp, const uint64_t *frames, int count, off_t offset)
+{
+	return sdFramesIO(fp, frames, count, offset, 0);
+};
+
+ssize_t sdWriteFrames(File *fp, const uint64_t *frames, int count, off_t offset)
+{
+	return sdFramesIO(fp, frames, count, offset, 1);
+};
+
+int sdSyncRange(File *fp, off_t offset, size_t size)
+{
+	if (fp->iref.inode->pread != sdfile_pread)
+	{
+		// not a storage device; flush the whole file
+		return vfsFlush(fp->iref.inode);
+	};
+	
+	SDHandle *handle = (SDHandle*) fp->filedata;
+	if (handle->size != 0)
+	{
+		if (offset >= handle->size)
+		{
+			return 0;
+		};
+		
+		if ((offset+size) > handle->size)
+		{
+			size = handle->size - offset;
+		};
+	};
+	
+	if (size == 0)
+	{
+		return 0;
+	};
+	
+	return sdFlushRange(handle->sd, handle->offset + (uint64_t) offset, size);
+};
+
 static void* sdfile_open(Inode *inode, int oflags)
 {
 	SDHandle *handle = NEW(SDHandle);
@@ -897,8 +1810,7 @@ static void sdFlushThread(void *context)
 	
 	while (1)
 	{
-		uint64_t nanotimeout = NT_SECS(120);
-		int status = semWaitGen(&sd->semFlush, 1, 0, nanotimeout);
+		int status = semWaitGen(&sd->semFlush, 1, 0, SD_WRITEBACK_INTERVAL);
 		
 		if (status == 1)
 		{
@@ -906,8 +1818,11 @@ static void sdFlushThread(void *context)
 		}
 		else if (status == -ETIMEDOUT)
 		{
+			// write back only the tracks which have been dirty for long enough, so that the
+			// writeback is spread out instead of the whole cache going out at once
 			mutexLock(&sd->cacheLock);
-			sdFlush(sd);
+			sd->dirtyTick++;
+			sdFlushTracks(sd, 0, ~0UL, SD_DIRTY_EXPIRE);
 			mutexUnlock(&sd->cacheLock);
 		};
 	};
@@ -940,6 +1855,15 @@ StorageDevice* sdCreate(SDParams *params, const char *name, SDOps *ops, void *dr
 	sd->numSubs = 0;
 	sd->openParts = 0;
 	semInit2(&sd->semFlush, 0);
+	semInit2(&sd->semInflight, 0);
+	semInit2(&sd->semIO, 0);
+	mutexInit(&sd->ioLock);
+	sd->inflight = NULL;
+	sd->inflightWaiters = 0;
+	sd->ioQueue = NULL;
+	sd->ioNext = 0;
+	sd->ioMergeBuffer = kmalloc(SD_MERGE_MAX);
+	mutexInit(&sd->mergeLock);
 	
 	if (strlen(name) > 127)
 	{
@@ -958,8 +1882,27 @@ StorageDevice* sdCreate(SDParams *params, const char *name, SDOps *ops, void *dr
 	pars.name = "SDI Flush Thread";
 	sd->threadFlush = CreateKernelThread(sdFlushThread, &pars, sd);
 	
+	// one I/O thread for each command the driver can have in progress; they are joined by sdHangup(),
+	// so they do not need references
+	sd->numWorkers = 1;
+	if (ops->size > __builtin_offsetof(SDOps, queueDepth) && ops->queueDepth > 1)
+	{
+		sd->numWorkers = ops->queueDepth;
+		if (sd->numWorkers > SD_MAX_WORKERS) sd->numWorkers = SD_MAX_WORKERS;
+	};
+	
+	pars.stackSize = SD_WORKER_STACK_SIZE;
+	pars.name = "SDI I/O Thread";
+	int i;
+	for (i=0; i<sd->numWorkers; i++)
+	{
+		sd->ioWorkers[i] = CreateKernelThread(sdIOThread, &pars, sd);
+	};
+	
 	mutexInit(&sd->cacheLock);
 	memset(&sd->cacheTop, 0, sizeof(BlockTreeNode));
+	sd->clockTrack = 0;
+	sd->dirtyTick = 0;
 	
 	// master device file
 	SDDeviceFile *fdev = NEW(SDDeviceFile);
@@ -1038,6 +1981,14 @@ void sdHangup(StorageDevice *sd)
 	sd->flags |= SD_HANGUP;
 	semSignal(&sd->semFlush);
 	ReleaseKernelThread(sd->threadFlush);
+	
+	// the I/O threads complete the remaining requests with ENXIO and exit
+	semSignal2(&sd->semIO, sd->numWorkers);
+	int j;
+	for (j=0; j<sd->numWorkers; j++)
+	{
+		ReleaseKernelThread(sd->ioWorkers[j]);
+	};
 	mutexUnlock(&sd->lock);
 	
 	mutexLock(&mtxList);
@@ -1069,54 +2020,43 @@ void sdSync()
 	mutexUnlock(&mtxList);
 };
 
-static uint64_t sdTryFree(StorageDevice *sd, BlockTreeNode *node, int level, uint64_t addr)
+/**
+ * Advance the CLOCK hand of 'sd' from 'clockTrack' to the next track which was not used since the hand
+ * last passed, clearing the usage counters of those which were, and evict it. Empty nodes are deleted on
+ * the way. Returns one of the track's frames, or 0 if the end of the cache was reached first. Call with
+ * the cache lock held.
+ */
+static uint64_t sdClockScan(StorageDevice *sd, BlockTreeNode *node, int level, uint64_t addr)
 {
-	while (1)
+	uint64_t i;
+	for (i=0; i<128; i++)
 	{
-		uint64_t i;
-	
-		uint64_t lowestUsage;
-		uint64_t lowestIndex;
-		int foundAny = 0;
-	
-		for (i=0; i<128; i++)
+		uint64_t index = (addr << 7) | i;
+		uint64_t span = 1UL << (7 * (6 - level));
+		
+		if (node->entries[i] == 0) continue;
+		if (((index + 1) * span) <= sd->clockTrack) continue;
+		
+		uint64_t canaddr = (node->entries[i] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
+		if (level == 6)
 		{
-			if (node->entries[i] != 0)
+			sd->clockTrack = index + 1;
+			
+			if ((node->entries[i] >> 56) != 0)
 			{
-				if (!foundAny)
-				{
-					lowestUsage = node->entries[i] >> 56;
-					lowestIndex = i;
-					foundAny = 1;
-				}
-				else if ((node->entries[i] >> 56) < lowestUsage)
-				{
-					lowestUsage = node->entries[i] >> 56;
-					lowestIndex = i;
-				};
+				// used since we last came here; second chance
+				node->entries[i] &= ~(0xFFUL << 56);
+				continue;
 			};
-		};
-	
-		// we cached nothing at this level, report failure
-		if (!foundAny)
-		{
-			return 0;
-		};
-	
-		if (level == 6)
-		{
-			if (node->entries[lowestIndex] & SD_BLOCK_DIRTY)
+			
+			if (node->entries[i] & SD_BLOCK_DIRTY)
 			{
-				uint64_t canaddr = (node->entries[lowestIndex] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
-				uint64_t bytepos = ((addr << 7) | lowestIndex) << 15;
-				uint64_t startBlock = bytepos / sd->blockSize;
+				uint64_t startBlock = (index << 15) / sd->blockSize;
 				uint64_t numBlocks = SD_TRACK_SIZE / sd->blockSize;
-				sd->ops->writeBlocks(sd->drvdata, startBlock, numBlocks, (const void*) canaddr);
+				sdIO(sd, SD_REQ_WRITE, startBlock, numBlocks, (void*) canaddr);
 			};
-		
-			uint64_t canaddr = (node->entries[lowestIndex] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
-
-			node->entries[lowestIndex] = 0;
+			
+			node->entries[i] = 0;
 			
 			uint64_t frames[8];
 			unmapPhysMemoryAndGet((void*)canaddr, 0x8000, frames);
@@ -1133,21 +2073,26 @@ static uint64_t sdTryFree(StorageDevice *sd, BlockTreeNode *node, int level, uin
 		}
 		else
 		{
-			uint64_t canaddr = (node->entries[lowestIndex] & 0xFFFFFFFFFFFF) | 0xFFFF800000000000;
-			uint64_t result = sdTryFree(sd, (BlockTreeNode*) canaddr, level+1, (addr << 7) | lowestIndex);
+			BlockTreeNode *subnode = (BlockTreeNode*) canaddr;
+			uint64_t result = sdClockScan(sd, subnode, level+1, index);
 			
-			if (result != 0)
+			int k;
+			for (k=0; k<128; k++)
 			{
-				return result;
-			}
-			else
+				if (subnode->entries[k] != 0) break;
+			};
+			
+			if (k == 128)
 			{
-				kfree((void*)canaddr);
-				node->entries[lowestIndex] = 0;
-				// and try again
+				kfree(subnode);
+				node->entries[i] = 0;
 			};
+			
+			if (result != 0) return result;
 		};
 	};
+	
+	return 0;
 };
 
 static void sdDump(StorageDevice *sd, BlockTreeNode *node, int level, uint64_t addr)
@@ -1190,23 +2135,32 @@ static void sdDump(StorageDevice *sd, BlockTreeNode *node, int level, uint64_t a
 	};
 };
 
+/**
+ * Index of the device currently under the CLOCK hand. Protected by 'mtxList'.
+ */
+static int sdClockDev = 0;
+
 uint64_t sdFreeMemory()
 {
 	mutexLock(&mtxList);
 	uint64_t result = 0;
 	
+	// go around at most twice: the first round may only clear usage counters
 	int i;
-	for (i=0; i<26; i++)
+	for (i=0; i<2*26; i++)
 	{
-		StorageDevice *sd = sdList[i];
+		StorageDevice *sd = sdList[sdClockDev];
 		if (sd != NULL)
 		{
 			mutexLock(&sd->cacheLock);
-			result = sdTryFree(sd, &sd->cacheTop, 0, 0);
+			result = sdClockScan(sd, &sd->cacheTop, 0, 0);
+			if (result == 0) sd->clockTrack = 0;
 			mutexUnlock(&sd->cacheLock);
 		
 			if (result != 0) break;
 		};
+		
+		sdClockDev = (sdClockDev + 1) % 26;
 	};
 	
 	mutexUnlock(&mtxList);
@@ -152,6 +152,13 @@ int piCheckFlush(uint64_t frame)
 	return !!(val & PI_DIRTY);
 };
 
+int piCheckAccessed(uint64_t frame)
+{
+	uint64_t val = __sync_fetch_and_and(&piRoot.branches[(frame>>27)&0x1FF]->branches[(frame>>18)&0x1FF]->branches[(frame>>9)&0x1FF]->entries[frame&0x1FF], ~PI_ACCESSED);
+	
+	return !!(val & PI_ACCESSED);
+};
+
 void piStaticFrame(uint64_t frame)
 {
 	mutexLock(&piLock);
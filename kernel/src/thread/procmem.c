@@ -945,50 +945,48 @@ static uint64_t clonePT(PT *pt)
 static uint64_t clonePD(PD *pd)
 {
 	uint64_t frame = phmAllocFrame();
-	PD copy;
+	PD *copy = (PD*) FRAME_TO_VIRT(frame);
 	
-	memset(&copy, 0, sizeof(PD));
+	memset(copy, 0, sizeof(PD));
 	
 	int i;
 	for (i=0; i<512; i++)
 	{
 		if (pd->entries[i].present)
 		{
-			copy.entries[i].rw = 1;
-			copy.entries[i].user = 1;
-			copy.entries[i].present = 1;
+			copy->entries[i].rw = 1;
+			copy->entries[i].user = 1;
+			copy->entries[i].present = 1;
 			
 			uint64_t ptAddr = ((uint64_t)&pd->entries[i]) << 9;
-			copy.entries[i].ptPhysAddr = clonePT((PT*) ptAddr);
+			copy->entries[i].ptPhysAddr = clonePT((PT*) ptAddr);
 		};
 	};
 	
-	frameWrite(frame, &copy);
 	return frame;
 };
 
 static uint64_t clonePDPT(PDPT *pdpt)
 {
 	uint64_t frame = phmAllocFrame();
-	PDPT copy;
+	PDPT *copy = (PDPT*) FRAME_TO_VIRT(frame);
 	
-	memset(&copy, 0, sizeof(PDPT));
+	memset(copy, 0, sizeof(PDPT));
 	
 	int i;
 	for (i=0; i<512; i++)
 	{
 		if (pdpt->entries[i].present)
 		{
-			copy.entries[i].rw = 1;
-			copy.entries[i].user = 1;
-			copy.entries[i].present = 1;
+			copy->entries[i].rw = 1;
+			copy->entries[i].user = 1;
+			copy->entries[i].present = 1;
 			
 			uint64_t pdAddr = ((uint64_t)&pdpt->entries[i]) << 9;
-			copy.entries[i].pdPhysAddr = clonePD((PD*) pdAddr);
+			copy->entries[i].pdPhysAddr = clonePD((PD*) pdAddr);
 		};
 	};
 	
-	frameWrite(frame, &copy);
 	return frame;
 };
 
@@ -1064,52 +1062,52 @@ void vmUp(ProcMem *pm)
 
 void deletePT(uint64_t frame)
 {
-	PT pt;
-	frameRead(frame, &pt);
-	phmFreeFrame(frame);
+	PT *pt = (PT*) FRAME_TO_VIRT(frame);
 	
 	int i;
 	for (i=0; i<512; i++)
 	{
-		if (pt.entries[i].gx_loaded)
+		if (pt->entries[i].gx_loaded)
 		{
-			if (pt.entries[i].dirty) piMarkDirty(pt.entries[i].framePhysAddr);
-			if (pt.entries[i].accessed) piMarkAccessed(pt.entries[i].framePhysAddr);
-			piDecref(pt.entries[i].framePhysAddr);
+			if (pt->entries[i].dirty) piMarkDirty(pt->entries[i].framePhysAddr);
+			if (pt->entries[i].accessed) piMarkAccessed(pt->entries[i].framePhysAddr);
+			piDecref(pt->entries[i].framePhysAddr);
 		};
 	};
+	
+	phmFreeFrame(frame);
 };
 
 void deletePD(uint64_t frame)
 {
-	PD pd;
-	frameRead(frame, &pd);
-	phmFreeFrame(frame);
+	PD *pd = (PD*) FRAME_TO_VIRT(frame);
 	
 	int i;
 	for (i=0; i<512; i++)
 	{
-		if (pd.entries[i].present)
+		if (pd->entries[i].present)
 		{
-			deletePT(pd.entries[i].ptPhysAddr);
+			deletePT(pd->entries[i].ptPhysAddr);
 		};
 	};
+	
+	phmFreeFrame(frame);
 };
 
 void deletePDPT(uint64_t frame)
 {
-	PDPT pdpt;
-	frameRead(frame, &pdpt);
-	phmFreeFrame(frame);
+	PDPT *pdpt = (PDPT*) FRAME_TO_VIRT(frame);
 	
 	int i;
 	for (i=0; i<512; i++)
 	{
-		if (pdpt.entries[i].present)
+		if (pdpt->entries[i].present)
 		{
-			deletePD(pdpt.entries[i].pdPhysAddr);
+			deletePD(pdpt->entries[i].pdPhysAddr);
 		};
 	};
+	
+	phmFreeFrame(frame);
 };
 
 void vmDown(ProcMem *pm)
@@ -63,9 +63,6 @@ static Thread *threadSysMan;
 static Spinlock notifLock;
 static SchedNotif *firstNotif;
 
-static RunqueueEntry *runqFirst[NUM_PRIO_Q];
-static RunqueueEntry *runqLast[NUM_PRIO_Q];
-
 typedef struct
 {
 	char symbol;
@@ -420,7 +417,13 @@ static void sysManFunc(void *ignore)
 			
 			if (threadFound != currentThread)
 			{
-				// removed from runqueue, now do cleanup
+				// removed from runqueue; wait until the CPU which switched away from it
+				// is off its stack, then do cleanup
+				while (threadFound->onCPU != 0)
+				{
+					__sync_synchronize();
+				};
+				
 				if (threadFound->creds != NULL)
 				{
 					closingPid = threadFound->creds->pid;
@@ -517,7 +520,7 @@ void initSchedAP()
 
 extern void reloadTR();
 
-static void jumpToTask()
+static void jumpToTask(volatile int *prevOnCPU)
 {
 	// set /proc/self target on current CPU
 	if (currentThread->creds != NULL) procfsSetPid(currentThread->creds->pid);
@@ -540,7 +543,7 @@ static void jumpToTask()
 	// switch context
 	fpuLoad(&currentThread->fpuRegs);
 	apic->timerInitCount = quantumTicks;
-	switchContext(&currentThread->regs);
+	switchContextFrom(&currentThread->regs, prevOnCPU);
 };
 
 void lockSched()
@@ -575,7 +578,142 @@ static int getPrio(Thread *thread)
 	return (NUM_PRIO_Q/2) + thread->niceVal;
 };
 
-void switchTaskUnlocked(Regs *regs)
+/**
+ * Returns the CPU whose runqueue the calling CPU uses. Before initMultiProc() there is no current
+ * CPU yet, and everything goes on the boot CPU's runqueue.
+ */
+static CPU* schedCurrentCPU()
+{
+	CPU *cpu = getCurrentCPU();
+	if (cpu == NULL) cpu = getCPU(0);
+	return cpu;
+};
+
+/**
+ * Add a thread to the end of the specified CPU's runqueue at the specified priority. The caller
+ * must have already claimed the thread's runqueue entry by setting 'runq.thread'.
+ */
+static void runqPush(CPU *cpu, Thread *thread, int prio)
+{
+	spinlockAcquire(&cpu->runqLock);
+	thread->runq.next = NULL;
+	if (cpu->runqLast[prio] == NULL)
+	{
+		cpu->runqFirst[prio] = cpu->runqLast[prio] = &thread->runq;
+	}
+	else
+	{
+		cpu->runqLast[prio]->next = &thread->runq;
+		cpu->runqLast[prio] = &thread->runq;
+	};
+	cpu->runqLoad++;
+	spinlockRelease(&cpu->runqLock);
+};
+
+/**
+ * Remove the highest-priority thread from the specified CPU's runqueue and return it, or return
+ * NULL if there is none. Threads which another CPU is still switching away from are skipped, as
+ * that CPU is still on their kernel stack; 'self' is the ID of the calling CPU, which may take
+ * back the thread it is switching away from. The caller must hold the CPU's runqueue lock.
+ */
+static Thread* runqPopLocked(CPU *cpu, int self)
+{
+	int i;
+	for (i=0; i<NUM_PRIO_Q; i++)
+	{
+		RunqueueEntry *prev = NULL;
+		RunqueueEntry *ent;
+		for (ent=cpu->runqFirst[i]; ent!=NULL; ent=ent->next)
+		{
+			Thread *thread = ent->thread;
+			if (thread->onCPU != 0 && thread->onCPU != self+1)
+			{
+				prev = ent;
+				continue;
+			};
+			
+			if (prev == NULL) cpu->runqFirst[i] = ent->next;
+			else prev->next = ent->next;
+			if (cpu->runqLast[i] == ent) cpu->runqLast[i] = prev;
+			cpu->runqLoad--;
+			
+			__sync_synchronize();
+			thread->runq.thread = NULL;
+			return thread;
+		};
+	};
+	
+	return NULL;
+};
+
+static Thread* runqPop(CPU *cpu)
+{
+	if (cpu->runqLoad == 0) return NULL;
+	
+	spinlockAcquire(&cpu->runqLock);
+	Thread *thread = runqPopLocked(cpu, cpu->id);
+	spinlockRelease(&cpu->runqLock);
+	return thread;
+};
+
+/**
+ * Take a thread from the runqueue of the busiest other CPU. We only try the lock, and never wait
+ * for it, so an idle CPU looking for work never holds up a busy one; if the lock is contended we
+ * just try again on the next switch.
+ */
+static Thread* runqSteal(CPU *thief)
+{
+	int busiest = -1;
+	int maxLoad = 0;
+	int numCPU = getCPUCount();
+	
+	int i;
+	for (i=0; i<numCPU; i++)
+	{
+		if (i == thief->id) continue;
+		
+		int load = getCPU(i)->runqLoad;
+		if (load > maxLoad)
+		{
+			busiest = i;
+			maxLoad = load;
+		};
+	};
+	
+	if (busiest == -1) return NULL;
+	
+	CPU *victim = getCPU(busiest);
+	if (spinlockTry(&victim->runqLock) != 0) return NULL;
+	Thread *thread = runqPopLocked(victim, thief->id);
+	spinlockRelease(&victim->runqLock);
+	return thread;
+};
+
+/**
+ * Put a runnable thread on a runqueue, unless it is already queued. It goes to the CPU it last ran
+ * on if that CPU is idle or if no CPU is idle; otherwise to an idle CPU. Only the CPU that got the
+ * thread is woken up.
+ */
+static void enqueueThread(Thread *thread, int prio)
+{
+	if (!__sync_bool_compare_and_swap(&thread->runq.thread, NULL, thread))
+	{
+		// already on a runqueue
+		return;
+	};
+	
+	int target = cpuFindIdle(thread->lastCPU);
+	if (target == -1) target = thread->lastCPU;
+	
+	runqPush(getCPU(target), thread, prio);
+	cpuWake(target);
+};
+
+/**
+ * Switch to the next thread. If 'locked' is nonzero, the caller holds the scheduler lock, and
+ * it will be released; otherwise we only take it if we need to dispatch signals.
+ */
+static void schedSwitch(Regs *regs, int locked)
 {
 	// get number of ticks used
 	uint64_t ticks = quantumTicks - apic->timerCurrentCount;
@@ -585,77 +723,76 @@ void switchTaskUnlocked(Regs *regs)
 	// wake up
 	cpuBusy();
 	
-	// update process statistics if attached
+	// update process statistics if attached; other threads of the process may be switching
+	// on other CPUs at the same time.
 	if (currentThread->creds != NULL)
 	{
-		currentThread->creds->ps.ps_ticks += ticks;
-		currentThread->creds->ps.ps_entries++;
+		__sync_fetch_and_add(&currentThread->creds->ps.ps_ticks, ticks);
+		__sync_fetch_and_add(&currentThread->creds->ps.ps_entries, 1);
 	};
 	
 	// remember the context of this thread.
 	fpuSave(&currentThread->fpuRegs);
 	memcpy(&currentThread->regs, regs, sizeof(Regs));
 
-	// put the current thread back into the queue if still running
-	if (canSched(currentThread))
+	// put the current thread back into our queue if still running, and if there is now
+	// other work waiting here, let an idle CPU come and steal it.
+	CPU *cpu = schedCurrentCPU();
+	if (currentThread != idleThread && canSched(currentThread))
 	{
-		if (currentThread->runq.thread == NULL)
+		if (__sync_bool_compare_and_swap(&currentThread->runq.thread, NULL, currentThread))
 		{
-			currentThread->runq.thread = currentThread;
-			currentThread->runq.next = NULL;
-			if (runqLast[getPrio(currentThread)] == NULL)
-			{
-				runqFirst[getPrio(currentThread)] = runqLast[getPrio(currentThread)] = &currentThread->runq;
-			}
-			else
-			{
-				runqLast[getPrio(currentThread)]->next = &currentThread->runq;
-				runqLast[getPrio(currentThread)] = &currentThread->runq;
-				cpuDispatch();
-			};
+			runqPush(cpu, currentThread, getPrio(currentThread));
 		};
+		if (cpu->runqLoad > 1) cpuWake(cpuFindIdle(cpu->id));
 	};
 
-	// wait for the next thread to execute
-	int i;
-	for (i=0; i<NUM_PRIO_Q; i++)
+	// get the next thread to execute; if we have none, try to steal one, and if there is
+	// nothing anywhere, go idle. a queued thread which another CPU is still switching away
+	// from is left alone; we will pick it up on a later switch.
+	Thread *prevThread = currentThread;
+	Thread *next = runqPop(cpu);
+	if (next == NULL) next = runqSteal(cpu);
+	if (next == NULL)
 	{
-		if (runqFirst[i] != NULL)
-		{
-			break;
-		};
-	};
-	
-	if (i == NUM_PRIO_Q)
-	{
-		// no thread waiting; go idle
 		cpuReady();
-		currentThread = idleThread;
-	}
-	else
-	{	
-		currentThread = runqFirst[i]->thread;
-		runqFirst[i] = runqFirst[i]->next;
-		if (runqFirst[i] == NULL) runqLast[i] = NULL;
-		currentThread->runq.thread = NULL;
+		next = idleThread;
 	};
 	
-	// if there are signals ready to dispatch, dispatch them.
-	if (haveReadySigs(currentThread))
+	currentThread = next;
+	currentThread->lastCPU = cpu->id;
+	currentThread->onCPU = cpu->id + 1;
+	
+	// if there are signals ready to dispatch, dispatch them. the unlocked check of pendingSet
+	// may miss a signal being sent right now; it will then be dispatched on the next switch.
+	// i've found that catching signals in kernel mode is a bad idea
+	if (currentThread->pendingSet != 0 && (currentThread->regs.cs & 3) == 3)
 	{
-		// i've found that catching signals in kernel mode is a bad idea
-		if ((currentThread->regs.cs & 3) == 3)
+		if (!locked)
+		{
+			spinlockAcquire(&schedLock);
+			locked = 1;
+		};
+		
+		if (haveReadySigs(currentThread))
 		{
 			dispatchSignal();
 		};
 	};
 
-	spinlockRelease(&schedLock);
+	if (locked) spinlockRelease(&schedLock);
 	
 	// the scheduler lock is now released, but we know the thread is not terminated,
 	// and so currentThread will not be suddenly released so it is safe to use it.
 	// it can only terminate when we dispatch a signal, and only this CPU can do this.
-	jumpToTask();
+	// the previous thread may only be resumed elsewhere once we are off its stack.
+	if (prevThread == currentThread) jumpToTask(NULL);
+	else jumpToTask(&prevThread->onCPU);
+};
+
+void switchTaskUnlocked(Regs *regs)
+{
+	schedSwitch(regs, 1);
 };
 
 void switchTask(Regs *regs)
@@ -667,8 +804,18 @@ void switchTask(Regs *regs)
 		return;
 	};
 	
-	spinlockAcquire(&schedLock);
-	switchTaskUnlocked(regs);
+	// the flags which stop a thread from being scheduled are only ever set by the thread itself,
+	// so if the current thread is runnable (or idle), no other CPU can change that under us, and
+	// we can switch without the scheduler lock. this is the path taken on every timer tick.
+	if (currentThread == idleThread || canSched(currentThread))
+	{
+		schedSwitch(regs, 0);
+	}
+	else
+	{
+		spinlockAcquire(&schedLock);
+		schedSwitch(regs, 1);
+	};
 };
 
 int haveReadySigs(Thread *thread)
@@ -738,8 +885,8 @@ static void kernelThreadExit()
 
 void ReleaseKernelThread(Thread *thread)
 {
-	// busy-wait until the thread terminates
-	while ((thread->flags & THREAD_TERMINATED) == 0)
+	// busy-wait until the thread terminates, and its CPU has switched away from it
+	while ((thread->flags & THREAD_TERMINATED) == 0 || thread->onCPU != 0)
 	{
 		__sync_synchronize();
 		kyield();
@@ -832,19 +979,10 @@ Thread* CreateKernelThread(KernelThreadEntry entry, KernelThreadParams *params,
 	thread->prev = currentThread;
 	currentThread->next = thread;
 	
+	thread->lastCPU = schedCurrentCPU()->id;
 	if (canSched(thread))
 	{
-		thread->runq.thread = thread;
-		thread->runq.next = NULL;
-		if (runqLast[NUM_PRIO_Q/2 - 1] == NULL)
-		{
-			runqFirst[NUM_PRIO_Q/2 - 1] = runqLast[NUM_PRIO_Q/2 - 1] = &thread->runq;
-		}
-		else
-		{
-			runqLast[NUM_PRIO_Q/2 - 1]->next = &thread->runq;
-			runqLast[NUM_PRIO_Q/2 - 1] = &thread->runq;
-		};
+		enqueueThread(thread, NUM_PRIO_Q/2 - 1);
 	};
 	
 	// there is no need to update currentThread->prev, it will only be broken for the init
@@ -899,22 +1037,7 @@ int signalThread(Thread *thread)
 	{
 		thread->flags &= ~THREAD_WAITING;
 
-		if (thread->runq.thread == NULL)
-		{
-			thread->runq.thread = thread;
-			thread->runq.next = NULL;
-			if (runqLast[getPrio(thread)] == NULL)
-			{
-				runqFirst[getPrio(thread)] = runqLast[getPrio(thread)] = &thread->runq;
-			}
-			else
-			{
-				runqLast[getPrio(thread)]->next = &thread->runq;
-				runqLast[getPrio(thread)] = &thread->runq;
-			};
-		};
-		
-		cpuDispatch();
+		enqueueThread(thread, getPrio(thread));
 	}
 	else
 	{
@@ -1122,17 +1245,8 @@ int threadClone(Regs *regs, int flags, MachineState *state)
 	thread->prev = currentThread;
 	currentThread->next = thread;
 
-	thread->runq.thread = thread;
-	thread->runq.next = NULL;
-	if (runqLast[getPrio(thread)] == NULL)
-	{
-		runqFirst[getPrio(thread)] = runqLast[getPrio(thread)] = &thread->runq;
-	}
-	else
-	{
-		runqLast[getPrio(thread)]->next = &thread->runq;
-		runqLast[getPrio(thread)] = &thread->runq;
-	};
+	thread->lastCPU = schedCurrentCPU()->id;
+	enqueueThread(thread, getPrio(thread));
 
 	spinlockRelease(&schedLock);
 	sti();
@@ -104,6 +104,11 @@ void initMemoryPhase2()
 	readyForDynamic = 1;
 };
 
+void initMemoryPhase3()
+{
+	// the block heap never returns memory, so it has no trimmer thread
+};
+
 static HeapHeader *heapHeaderFromFooter(HeapFooter *foot)
 {
 	uint64_t footerAddr = (uint64_t) foot;
@@ -39,18 +39,49 @@
 #include <glidix/util/isp.h>
 #include <glidix/storage/storage.h>
 #include <glidix/util/random.h>
+#include <glidix/util/time.h>
+#include <glidix/thread/sched.h>
+#include <glidix/hw/cpu.h>
 #include <stdint.h>
 
 #define	HEAP_BASE_ADDR				0xFFFF810000000000
 #define	NUM_BUCKETS				26
 
+/**
+ * Buckets below MAG_BUCKETS (32 bytes up to 4KB) are served from per-CPU magazines, each
+ * holding up to MAG_ROUNDS free slabs. A magazine is refilled from, or half-flushed back to,
+ * the shared buckets in one go, so most alloc/free pairs never take the heap lock.
+ */
+#define	MAG_BUCKETS				8
+#define	MAG_ROUNDS				32
+
+/**
+ * Free slabs in bucket HEAP_TRIM_BUCKET (64KB) and above have all pages but the first unmapped
+ * and returned to physical memory by the heap trimmer thread, which runs every HEAP_TRIM_INTERVAL
+ * milliseconds if any such slabs were freed. HEAP_TRIM_BATCH is the number of frames unmapped
+ * per TLB shootdown.
+ */
+#define	HEAP_TRIM_BUCKET			11
+#define	HEAP_TRIM_INTERVAL			5000
+#define	HEAP_TRIM_BATCH				256
+
+/**
+ * Magic value at the start of a slab which is on a free list. Used slabs begin with their bucket
+ * index, so this never matches one.
+ */
+#define	HEAP_FREE_MAGIC				0x46524545534C4142UL
+
 static Mutex heapLock;
 
 /**
- * Header used on a free slab. They form a linked list with equal-sized neighbours.
+ * Header used on a free slab. They form a doubly-linked list with equal-sized neighbours, so that
+ * a free buddy can be unlinked when coalescing. This exactly fills the smallest (32-byte) slab.
  */
 typedef struct FreeSlab_
 {
+	uint64_t magic;
+	uint64_t bucket;
+	struct FreeSlab_ *prev;
 	struct FreeSlab_ *next;
 } FreeSlab;
 
@@ -86,6 +117,38 @@ typedef struct
  */
 static FreeSlab* buckets[NUM_BUCKETS];
 
+/**
+ * Set when a slab in bucket HEAP_TRIM_BUCKET or above is freed, so the trimmer knows it has work.
+ */
+static volatile int heapTrimPending;
+
+/**
+ * A per-CPU magazine of free slabs for a single bucket. It is only ever accessed by its own
+ * CPU with interrupts disabled. 'hits' counts operations served by the magazine since they
+ * were last added to the shared statistics.
+ */
+typedef struct
+{
+	int					count;
+	uint64_t				hits;
+	FreeSlab*				rounds[MAG_ROUNDS];
+} Magazine;
+
+static PER_CPU Magazine magazines[MAG_BUCKETS];
+
+/**
+ * Per-bucket statistics, protected by the heap lock: 'hits' is the number of allocations and
+ * frees served by a per-CPU magazine, and 'misses' the number that had to go to the shared
+ * buckets. Magazine hits are added here whenever the magazine next visits the shared buckets.
+ */
+typedef struct
+{
+	uint64_t				hits;
+	uint64_t				misses;
+} BucketStats;
+
+static BucketStats bucketStats[NUM_BUCKETS];
+
 /**
  * Ensure that the specified page range is mapped.
  */
@@ -137,6 +200,75 @@ static void mapPages(void *ptr_, size_t size)
 	};
 };
 
+/**
+ * Unmap all pages in the specified range which are mapped, and store their frames in 'frames'.
+ * Stops early if 'max' frames have been stored; returns the address at which to continue.
+ * The caller must flush the TLBs on all CPUs before releasing the frames.
+ */
+static uint64_t unmapPages(uint64_t addr, uint64_t end, uint64_t *frames, int *count, int max)
+{
+	while (addr < end && *count < max)
+	{
+		PML4e *pml4e = VIRT_TO_PML4E(addr);
+		if (!pml4e->present)
+		{
+			addr = (addr + (1UL << 39)) & ~((1UL << 39) - 1);
+			continue;
+		};
+		
+		PDPTe *pdpte = VIRT_TO_PDPTE(addr);
+		if (!pdpte->present)
+		{
+			addr = (addr + (1UL << 30)) & ~((1UL << 30) - 1);
+			continue;
+		};
+		
+		PDe *pde = VIRT_TO_PDE(addr);
+		if (!pde->present)
+		{
+			addr = (addr + (1UL << 21)) & ~((1UL << 21) - 1);
+			continue;
+		};
+		
+		PTe *pte = VIRT_TO_PTE(addr);
+		if (pte->present)
+		{
+			frames[(*count)++] = pte->framePhysAddr;
+			pte->framePhysAddr = 0;
+			pte->present = 0;
+			invlpg((void*)addr);
+		};
+		
+		addr += 0x1000;
+	};
+	
+	return addr;
+};
+
+/**
+ * Add a slab to the front of a bucket's free list. The first page of the slab must be mapped.
+ */
+static void slabLink(FreeSlab *slab, int bucket)
+{
+	slab->magic = HEAP_FREE_MAGIC;
+	slab->bucket = bucket;
+	slab->prev = NULL;
+	slab->next = buckets[bucket];
+	if (slab->next != NULL) slab->next->prev = slab;
+	buckets[bucket] = slab;
+};
+
+/**
+ * Remove a slab from the bucket's free list and mark it as no longer free.
+ */
+static void slabUnlink(FreeSlab *slab, int bucket)
+{
+	if (slab->prev != NULL) slab->prev->next = slab->next;
+	else buckets[bucket] = slab->next;
+	if (slab->next != NULL) slab->next->prev = slab->prev;
+	slab->magic = 0;
+};
+
 /**
  * Allocate a free slab from the specified bucket and remove it from said bucket. If there are no slabs in this
  * bucket, take a slab from the next bucket up and split it in half. If there are no more slabs available at all,
@@ -152,7 +284,7 @@ static FreeSlab* slabAlloc(int bucket)
 	if (buckets[bucket] != NULL)
 	{
 		FreeSlab *front = buckets[bucket];
-		buckets[bucket] = front->next;
+		slabUnlink(front, bucket);
 		return front;
 	}
 	else
@@ -162,13 +294,133 @@ static FreeSlab* slabAlloc(int bucket)
 		
 		FreeSlab *other = (FreeSlab*) ((uint64_t) higher + slabSize);
 		mapPages(other, 1);
-		other->next = NULL;
-		buckets[bucket] = other;
+		slabLink(other, bucket);
 		
 		return higher;
 	};
 };
 
+/**
+ * Return a slab to the specified bucket, merging it with its buddy for as long as the buddy is
+ * free and of the same size. The buddy's first page is always mapped: it is the start of a slab,
+ * since any slab containing it would also contain this one.
+ */
+static void slabFree(FreeSlab *slab, int bucket)
+{
+	while (bucket < (NUM_BUCKETS-1))
+	{
+		uint64_t slabSize = 1UL << (bucket+5);
+		FreeSlab *buddy = (FreeSlab*) (HEAP_BASE_ADDR + (((uint64_t) slab - HEAP_BASE_ADDR) ^ slabSize));
+		if (buddy->magic != HEAP_FREE_MAGIC || buddy->bucket != (uint64_t) bucket)
+		{
+			break;
+		};
+		
+		slabUnlink(buddy, bucket);
+		if (buddy < slab) slab = buddy;
+		bucket++;
+	};
+	
+	slabLink(slab, bucket);
+	if (bucket >= HEAP_TRIM_BUCKET) heapTrimPending = 1;
+};
+
+/**
+ * Allocate a slab from the specified bucket, which must be below MAG_BUCKETS, using the calling CPU's
+ * magazine. On a miss, the magazine is refilled with half its capacity from the shared buckets.
+ */
+static FreeSlab* magAlloc(int bucket)
+{
+	uint64_t flags = getFlagsRegister();
+	cli();
+	Magazine *mag = &magazines[bucket];
+	if (mag->count != 0)
+	{
+		FreeSlab *slab = mag->rounds[--mag->count];
+		mag->hits++;
+		setFlagsRegister(flags);
+		return slab;
+	};
+	
+	uint64_t hits = mag->hits;
+	mag->hits = 0;
+	setFlagsRegister(flags);
+	
+	FreeSlab *batch[MAG_ROUNDS/2];
+	int count;
+	
+	mutexLock(&heapLock);
+	bucketStats[bucket].hits += hits;
+	bucketStats[bucket].misses++;
+	for (count=0; count<MAG_ROUNDS/2; count++)
+	{
+		batch[count] = slabAlloc(bucket);
+		if (batch[count] == NULL) break;
+	};
+	mutexUnlock(&heapLock);
+	
+	if (count == 0) return NULL;
+	
+	// we may have been moved to another CPU in the meantime, or another thread on this CPU
+	// may have refilled the magazine; put back whatever doesn't fit
+	cli();
+	while (count > 1 && mag->count < MAG_ROUNDS)
+	{
+		mag->rounds[mag->count++] = batch[--count];
+	};
+	setFlagsRegister(flags);
+	
+	if (count > 1)
+	{
+		mutexLock(&heapLock);
+		while (count > 1)
+		{
+			slabFree(batch[--count], bucket);
+		};
+		mutexUnlock(&heapLock);
+	};
+	
+	return batch[0];
+};
+
+/**
+ * Return a slab to the specified bucket, which must be below MAG_BUCKETS, using the calling CPU's
+ * magazine. If the magazine is full, the older half of it is flushed to the shared buckets.
+ */
+static void magFree(int bucket, FreeSlab *slab)
+{
+	uint64_t flags = getFlagsRegister();
+	cli();
+	Magazine *mag = &magazines[bucket];
+	if (mag->count != MAG_ROUNDS)
+	{
+		mag->rounds[mag->count++] = slab;
+		mag->hits++;
+		setFlagsRegister(flags);
+		return;
+	};
+	
+	FreeSlab *batch[MAG_ROUNDS/2];
+	memcpy(batch, mag->rounds, sizeof(batch));
+	memcpy(mag->rounds, &mag->rounds[MAG_ROUNDS/2], sizeof(batch));
+	mag->count -= MAG_ROUNDS/2;
+	mag->rounds[mag->count++] = slab;
+	
+	uint64_t hits = mag->hits;
+	mag->hits = 0;
+	setFlagsRegister(flags);
+	
+	mutexLock(&heapLock);
+	bucketStats[bucket].hits += hits;
+	bucketStats[bucket].misses++;
+	int i;
+	for (i=0; i<MAG_ROUNDS/2; i++)
+	{
+		slabFree(batch[i], bucket);
+	};
+	mutexUnlock(&heapLock);
+};
+
 /**
  * Initialize the heap. This is done by adding a single big slab.
  */
@@ -176,12 +428,82 @@ void initMemoryPhase2()
 {
 	FreeSlab *initSlab = (FreeSlab*) HEAP_BASE_ADDR;
 	mapPages(initSlab, 1);
-	initSlab->next = NULL;
-	buckets[NUM_BUCKETS-1] = initSlab;
+	slabLink(initSlab, NUM_BUCKETS-1);
 	
 	readyForDynamic = 1;
 };
 
+/**
+ * Give the physical memory behind large free slabs back to the system. Every free slab in bucket
+ * HEAP_TRIM_BUCKET or above keeps only its first page (which holds the free list header).
+ */
+static void heapTrim()
+{
+	static uint64_t frames[HEAP_TRIM_BATCH];
+	uint64_t released = 0;
+	
+	mutexLock(&heapLock);
+	heapTrimPending = 0;
+	
+	int bucket;
+	for (bucket=HEAP_TRIM_BUCKET; bucket<NUM_BUCKETS; bucket++)
+	{
+		FreeSlab *slab;
+		for (slab=buckets[bucket]; slab!=NULL; slab=slab->next)
+		{
+			uint64_t addr = (uint64_t) slab + 0x1000;
+			uint64_t end = (uint64_t) slab + (1UL << (bucket+5));
+			
+			while (addr < end)
+			{
+				int count = 0;
+				addr = unmapPages(addr, end, frames, &count, HEAP_TRIM_BATCH);
+				if (count == 0) break;
+				
+				cpuFlushTLB();
+				
+				int i;
+				for (i=0; i<count; i++)
+				{
+					phmFreeFrame(frames[i]);
+				};
+				
+				released += count;
+			};
+		};
+	};
+	
+	mutexUnlock(&heapLock);
+	
+	if (released != 0)
+	{
+		kprintf_debug("heap: trimmer released %lu frames\n", released);
+	};
+};
+
+static void heapTrimThread(void *context)
+{
+	(void)context;
+	
+	while (1)
+	{
+		sleep(HEAP_TRIM_INTERVAL);
+		if (heapTrimPending) heapTrim();
+	};
+};
+
+/**
+ * Start the heap trimmer thread. Called once the scheduler is up.
+ */
+void initMemoryPhase3()
+{
+	KernelThreadParams pars;
+	memset(&pars, 0, sizeof(KernelThreadParams));
+	pars.stackSize = DEFAULT_STACK_SIZE;
+	pars.name = "Heap trimmer";
+	CreateKernelThread(heapTrimThread, &pars, NULL);
+};
+
 /**
  * Allocate memory.
  */
@@ -207,15 +529,26 @@ void *kxmallocDynamic(size_t size, int flags, const char *aid, int lineno)
 		return NULL;
 	};
 	
-	mutexLock(&heapLock);
-	FreeSlab *fslab = slabAlloc(bucket);
-	if (fslab == NULL)
+	FreeSlab *fslab;
+	if (bucket < MAG_BUCKETS)
+	{
+		// slabs this small never cross a page boundary, so they are already fully mapped
+		fslab = magAlloc(bucket);
+		if (fslab == NULL) return NULL;
+	}
+	else
 	{
+		mutexLock(&heapLock);
+		fslab = slabAlloc(bucket);
+		if (fslab == NULL)
+		{
+			mutexUnlock(&heapLock);
+			return NULL;
+		};
+		mapPages(fslab, size);
+		bucketStats[bucket].misses++;
 		mutexUnlock(&heapLock);
-		return NULL;
 	};
-	mapPages(fslab, size);
-	mutexUnlock(&heapLock);
 	
 	UsedSlab *uslab = (UsedSlab*) fslab;
 	uslab->bucket = bucket;
@@ -237,9 +570,15 @@ void _kfree(void *block, const char *who, int line)
 	FreeSlab *fslab = (FreeSlab*) uslab;
 	int bucket = (int) uslab->bucket;
 	
+	if (bucket < MAG_BUCKETS)
+	{
+		magFree(bucket, fslab);
+		return;
+	};
+	
 	mutexLock(&heapLock);
-	fslab->next = buckets[bucket];
-	buckets[bucket] = fslab;
+	slabFree(fslab, bucket);
+	bucketStats[bucket].misses++;
 	mutexUnlock(&heapLock);
 };
 
@@ -279,8 +618,7 @@ void *krealloc(void *block, size_t size)
 		mapPages(second, 1);
 		
 		mutexLock(&heapLock);
-		second->next = buckets[slab->bucket];
-		buckets[slab->bucket] = second;
+		slabFree(second, slab->bucket);
 		mutexUnlock(&heapLock);
 		
 		return block;
@@ -351,6 +689,16 @@ void heapDump()
 			kprintf("%p in bucket %d (%s)\n", slab, bucket, bucketLabels[bucket]);
 		};
 	};
+	
+	kprintf("BUCKET STATISTICS (magazine hits/shared heap misses)\n");
+	for (bucket=0; bucket<NUM_BUCKETS; bucket++)
+	{
+		if (bucketStats[bucket].hits != 0 || bucketStats[bucket].misses != 0)
+		{
+			kprintf("%s: %lu hits, %lu misses\n", bucketLabels[bucket],
+				bucketStats[bucket].hits, bucketStats[bucket].misses);
+		};
+	};
 };
 
 #endif	/* __CONFIG_HEAP_SLAB */
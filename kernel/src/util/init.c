@@ -549,6 +549,8 @@ void kmain2()
 	};
 
 	initSched2();
+	initMemoryPhase3();
+	initPhysMem3();
 	
 	// this must come after AcpiInitializeSubsystem() because ACPI calls
 	// AcpiOsInitialize() which maps more stuff into the PML4
@@ -29,6 +29,7 @@
 #include <glidix/util/isp.h>
 #include <glidix/util/common.h>
 #include <glidix/hw/pagetab.h>
+#include <glidix/hw/physmem.h>
 #include <glidix/util/memory.h>
 #include <glidix/util/string.h>
 #include <glidix/thread/spinlock.h>
@@ -120,6 +121,12 @@ void ispUnlock()
 
 void pmem_read(void *buffer, uint64_t physAddr, size_t len)
 {
+	if ((physAddr + len) <= phmDirectMapEnd)
+	{
+		memcpy(buffer, PHYS_TO_VIRT(physAddr), len);
+		return;
+	};
+	
 	ispLock();
 	while (len != 0)
 	{
@@ -131,6 +138,7 @@ void pmem_read(void *buffer, uint64_t physAddr, size_t len)
 		ispSetFrame(frame);
 		memcpy(buffer, (void*)((uint64_t)ispGetPointer() + offset), toCopy);
 		len -= toCopy;
+		physAddr += toCopy;
 		buffer = (void*)((uint64_t)buffer+toCopy);
 	};
 	ispUnlock();
@@ -138,6 +146,12 @@ void pmem_read(void *buffer, uint64_t physAddr, size_t len)
 
 void pmem_write(uint64_t physAddr, const void *buffer, size_t len)
 {
+	if ((physAddr + len) <= phmDirectMapEnd)
+	{
+		memcpy(PHYS_TO_VIRT(physAddr), buffer, len);
+		return;
+	};
+	
 	ispLock();
 	while (len != 0)
 	{
@@ -149,6 +163,7 @@ void pmem_write(uint64_t physAddr, const void *buffer, size_t len)
 		ispSetFrame(frame);
 		memcpy((void*)((uint64_t)ispGetPointer() + offset), buffer, toCopy);
 		len -= toCopy;
+		physAddr += toCopy;
 		buffer = (void*)((uint64_t)buffer+toCopy);
 	};
 	ispUnlock();
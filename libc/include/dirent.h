@@ -34,15 +34,21 @@
 struct dirent
 {
 	ino_t				d_ino;
-	char				__d_resv[64];
+	int				__d_key;
+	char				__d_resv[60];
 	char				d_name[];
 };
 
+/* size of the buffer into which directory entries are read in batches */
+#define	__DIR_BUFSIZE			0x4000
+
 typedef struct
 {
 	int __fd;
-	struct dirent* __current;
-	int __key;
+	int __key;			/* key at which the next batch starts */
+	char* __buf;
+	size_t __buflen;
+	size_t __bufpos;
 } DIR;
 
 #ifdef __cplusplus
@@ -186,6 +186,7 @@
 #define	__SYS_usb_devdesc			154
 #define	__SYS_usb_langids			155
 #define	__SYS_usb_getstr			156
+#define	__SYS_getdents				157
 
 /* flags for __SYS_mv */
 #define	__MV_EXCL				(1 << 0)
@@ -33,6 +33,9 @@
 #define	MNT_RDONLY			(1 << 0)
 #define	MNT_NOSUID			(1 << 1)
 #define	MNT_TEMP			(1 << 2)
+#define	MNT_NOATIME			(1 << 3)
+#define	MNT_NODIRATIME			(1 << 4)
+#define	MNT_RELATIME			(1 << 5)
 
 #define	mount _glidix_mount
 #define	unmount _glidix_unmount
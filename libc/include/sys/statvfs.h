@@ -30,6 +30,9 @@
 
 #define	ST_RDONLY			(1 << 0)
 #define	ST_NOSUID			(1 << 1)
+#define	ST_NOATIME			(1 << 2)
+#define	ST_NODIRATIME			(1 << 3)
+#define	ST_RELATIME			(1 << 4)
 
 struct statvfs
 {
@@ -32,7 +32,7 @@
 
 int closedir(DIR *dirp)
 {
-	free(dirp->__current);
+	free(dirp->__buf);
 	close(dirp->__fd);
 	free(dirp);
 	return 0;
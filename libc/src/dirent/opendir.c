@@ -61,8 +61,10 @@ DIR *fdopendir(int fd)
 	};
 	
 	dirp->__fd = fd;
-	dirp->__current = NULL;
 	dirp->__key = 0;
+	dirp->__buf = NULL;
+	dirp->__buflen = 0;
+	dirp->__bufpos = 0;
 	
 	return dirp;
 };
@@ -36,40 +36,32 @@
 
 struct dirent *readdir(DIR *dirp)
 {
-	int errnum = errno;
-	
-	free(dirp->__current);
-	dirp->__current = NULL;
-	
-	while (dirp->__current == NULL)
+	if (dirp->__bufpos == dirp->__buflen)
 	{
-		uint64_t size = __syscall(__SYS_getdent, dirp->__fd, dirp->__key++);
-		if (size == 0)
+		// read the next batch of entries
+		if (dirp->__buf == NULL)
 		{
-			if (errno == ENOENT)
-			{
-				continue;
-			}
-			else if (errno == EOVERFLOW)
-			{
-				errno = errnum;
-				return NULL;
-			}
-			else
+			dirp->__buf = (char*) malloc(__DIR_BUFSIZE);
+			if (dirp->__buf == NULL)
 			{
+				errno = ENOMEM;
 				return NULL;
 			};
 		};
 		
-		dirp->__current = (struct dirent*) malloc(size);
-		if (dirp->__current == NULL)
+		ssize_t size = (ssize_t) __syscall(__SYS_getdents, dirp->__fd, &dirp->__key, dirp->__buf, __DIR_BUFSIZE);
+		if (size <= 0)
 		{
-			errno = ENOMEM;
+			// end of directory (errno unchanged), or error
 			return NULL;
 		};
 		
-		__syscall(__SYS_getktu, dirp->__current, size);
+		dirp->__buflen = (size_t) size;
+		dirp->__bufpos = 0;
 	};
 	
-	return dirp->__current;
+	// entries are padded to 8 bytes
+	struct dirent *ent = (struct dirent*) &dirp->__buf[dirp->__bufpos];
+	dirp->__bufpos += (sizeof(struct dirent) + strlen(ent->d_name) + 8) & ~7;
+	return ent;
 };
@@ -35,5 +35,6 @@
 void rewinddir(DIR *dirp)
 {
 	dirp->__key = 0;
+	dirp->__buflen = dirp->__bufpos = 0;
 };
 
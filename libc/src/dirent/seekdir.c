@@ -30,10 +30,18 @@
 
 long telldir(DIR *dirp)
 {
+	if (dirp->__bufpos < dirp->__buflen)
+	{
+		// the next entry has already been read
+		struct dirent *ent = (struct dirent*) &dirp->__buf[dirp->__bufpos];
+		return (long) ent->__d_key;
+	};
+	
 	return (long) dirp->__key;
 };
 
 void seekdir(DIR *dirp, long loc)
 {
 	dirp->__key = (int) loc;
+	dirp->__buflen = dirp->__bufpos = 0;
 };
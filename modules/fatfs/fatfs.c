@@ -35,67 +35,229 @@
 #include <glidix/display/console.h>
 #include <glidix/util/errno.h>
 #include <glidix/thread/sched.h>
+#include <glidix/storage/storage.h>
+#include <glidix/hw/physmem.h>
 
 #include "fatfs.h"
 
-static void readClusterChain(Fatfs *fatfs, uint32_t cluster, uint32_t **clustersOut, size_t *countOut)
+/**
+ * Return the FAT cache page with the specified index, loading it from disk if necessary. Returns NULL
+ * on I/O error. Call with the filesystem lock held (or during mounting).
+ */
+static uint32_t* fatfsGetCachePage(Fatfs *fatfs, size_t pageIndex)
 {
-	uint32_t *clusters = NULL;
-	size_t numClusters = 0;
-	
-	while (cluster != 0 && cluster < 0x0FFFFFF7)
+	if (fatfs->fatCache[pageIndex] == NULL)
 	{
-		size_t index = numClusters++;
-		clusters = (uint32_t*) krealloc(clusters, 4 * numClusters);
-		clusters[index] = cluster;
-		
-		if (vfsPRead(fatfs->fp, &cluster, 4, fatfs->fatpos + 4 * cluster) != 4)
+		uint32_t *page = (uint32_t*) kmalloc(4 * FAT_CACHE_ENTRIES);
+		if (vfsPRead(fatfs->fp, page, 4 * FAT_CACHE_ENTRIES, fatfs->fatpos + 4 * FAT_CACHE_ENTRIES * pageIndex)
+			!= 4 * FAT_CACHE_ENTRIES)
 		{
-			break;
+			kfree(page);
+			return NULL;
 		};
 		
-		cluster &= 0x0FFFFFFF;
+		fatfs->fatCache[pageIndex] = page;
 	};
 	
-	*clustersOut = clusters;
-	*countOut = numClusters;
+	return fatfs->fatCache[pageIndex];
 };
 
-static uint32_t getFreeCluster(Fatfs *fatfs)
+/**
+ * Get the FAT entry for the specified cluster. Invalid cluster numbers and I/O errors are reported as
+ * the end of a chain.
+ */
+static uint32_t fatfsGetEntry(Fatfs *fatfs, uint32_t cluster)
 {
-	uint32_t *track = (uint32_t*) kmalloc(2 * 1024 * 1024);
-	size_t currentTrack = (size_t) -1;
+	if (cluster < 2 || cluster >= fatfs->maxCluster)
+	{
+		return FAT_ENTRY_END;
+	};
 	
-	size_t i;
-	for (i=2; i<fatfs->numClusters; i++)
+	uint32_t *page = fatfsGetCachePage(fatfs, cluster / FAT_CACHE_ENTRIES);
+	if (page == NULL)
 	{
-		size_t trackno = i / (2 * 1024 * 1024 / 4);
-		size_t offset = i % (2 * 1024 * 1024 / 4);
-		
-		if (currentTrack != trackno)
+		return FAT_ENTRY_END;
+	};
+	
+	return page[cluster % FAT_CACHE_ENTRIES] & FAT_ENTRY_MASK;
+};
+
+/**
+ * Set the FAT entry for the specified cluster, writing it through to the disk and updating the free
+ * cluster bitmap. Returns 0 on success, -1 on error.
+ */
+static int fatfsSetEntry(Fatfs *fatfs, uint32_t cluster, uint32_t value)
+{
+	if (cluster < 2 || cluster >= fatfs->maxCluster)
+	{
+		return -1;
+	};
+	
+	uint32_t *page = fatfsGetCachePage(fatfs, cluster / FAT_CACHE_ENTRIES);
+	if (page == NULL)
+	{
+		return -1;
+	};
+	
+	// the top 4 bits are reserved and must be preserved
+	uint32_t *entry = &page[cluster % FAT_CACHE_ENTRIES];
+	uint32_t newval = (*entry & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+	if (vfsPWrite(fatfs->fp, &newval, 4, fatfs->fatpos + 4 * cluster) != 4)
+	{
+		return -1;
+	};
+	
+	*entry = newval;
+	if (value == 0)
+	{
+		fatfs->freeMap[cluster / 64] |= (1UL << (cluster % 64));
+	}
+	else
+	{
+		fatfs->freeMap[cluster / 64] &= ~(1UL << (cluster % 64));
+	};
+	
+	return 0;
+};
+
+/**
+ * Append a cluster to the chain of an inode, extending the last extent if the cluster directly follows it.
+ */
+static void fatfsChainAppend(FATInodeTable *itab, uint32_t cluster)
+{
+	if (itab->numExtents != 0)
+	{
+		FATExtent *last = &itab->extents[itab->numExtents-1];
+		if (last->start + last->count == cluster)
 		{
-			currentTrack = trackno;
-			if (vfsPRead(fatfs->fp, track, 2 * 1024 * 1024, fatfs->fatpos + currentTrack * 2 * 1024 * 1024) < 2 * 1024 * 1024)
-			{
-				break;
-			};
+			last->count++;
+			itab->numClusters++;
+			return;
+		};
+	};
+	
+	size_t index = itab->numExtents++;
+	itab->extents = (FATExtent*) krealloc(itab->extents, sizeof(FATExtent) * itab->numExtents);
+	itab->extents[index].index = (uint32_t) itab->numClusters;
+	itab->extents[index].start = cluster;
+	itab->extents[index].count = 1;
+	itab->numClusters++;
+};
+
+/**
+ * Remove the last cluster from the chain of an inode, and return its number.
+ */
+static uint32_t fatfsChainTrim(FATInodeTable *itab)
+{
+	FATExtent *last = &itab->extents[itab->numExtents-1];
+	uint32_t cluster = last->start + (--last->count);
+	if (last->count == 0)
+	{
+		itab->numExtents--;
+	};
+	
+	itab->numClusters--;
+	return cluster;
+};
+
+/**
+ * Return the cluster number at the specified index in the chain of an inode. If 'runOut' is not NULL,
+ * the number of physically contiguous clusters starting at that index is stored there.
+ */
+static uint32_t fatfsChainGet(FATInodeTable *itab, size_t clusterIndex, size_t *runOut)
+{
+	// binary search for the extent containing the index
+	size_t low = 0;
+	size_t high = itab->numExtents;
+	while (high - low > 1)
+	{
+		size_t mid = (low + high) / 2;
+		if (itab->extents[mid].index <= clusterIndex)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		};
+	};
+	
+	FATExtent *ext = &itab->extents[low];
+	size_t offset = clusterIndex - ext->index;
+	assert(offset < ext->count);
+	
+	if (runOut != NULL) *runOut = ext->count - offset;
+	return ext->start + (uint32_t) offset;
+};
+
+/**
+ * Return the first cluster of an inode, or 0 if it has none.
+ */
+static uint32_t fatfsChainFirst(FATInodeTable *itab)
+{
+	if (itab->numExtents == 0) return 0;
+	return itab->extents[0].start;
+};
+
+static void readClusterChain(Fatfs *fatfs, uint32_t cluster, FATInodeTable *itab)
+{
+	itab->extents = NULL;
+	itab->numExtents = 0;
+	itab->numClusters = 0;
+	
+	while (cluster >= 2 && cluster < FAT_ENTRY_BAD)
+	{
+		// a chain longer than the volume must contain a loop
+		if (itab->numClusters == fatfs->numClusters)
+		{
+			kprintf("fatfs: warning: cluster chain loop detected\n");
+			break;
 		};
 		
-		if (track[offset] == 0)
+		fatfsChainAppend(itab, cluster);
+		cluster = fatfsGetEntry(fatfs, cluster);
+	};
+};
+
+/**
+ * Find a free cluster, searching the bitmap from 'hint' onwards (next-fit); if 'hint' is 0, the search
+ * continues from where the previous one ended. Returns 0 if the volume is full.
+ */
+static uint32_t getFreeCluster(Fatfs *fatfs, uint32_t hint)
+{
+	if (hint < 2 || hint >= fatfs->maxCluster)
+	{
+		hint = fatfs->nextFree;
+		if (hint < 2 || hint >= fatfs->maxCluster) hint = 2;
+	};
+	
+	size_t numWords = (fatfs->maxCluster + 63) / 64;
+	size_t wordIndex = hint / 64;
+	uint64_t word = fatfs->freeMap[wordIndex] & (~0UL << (hint % 64));
+	
+	size_t i;
+	for (i=0; i<=numWords; i++)
+	{
+		if (word != 0)
 		{
-			kfree(track);
-			return (uint32_t) i;
+			uint32_t cluster = (uint32_t) (wordIndex * 64 + __builtin_ctzl(word));
+			fatfs->nextFree = cluster + 1;
+			return cluster;
 		};
+		
+		if (++wordIndex == numWords) wordIndex = 0;
+		word = fatfs->freeMap[wordIndex];
 	};
 	
-	kfree(track);
 	return 0;
 };
 
 static int expandClusterChain(FATInodeTable *itab)
 {
-	// allocate a new cluster
-	uint32_t newCluster = getFreeCluster(itab->fatfs);
+	// allocate a new cluster, preferably right after the current last one
+	uint32_t prevCluster = 0;
+	if (itab->numClusters != 0) prevCluster = fatfsChainGet(itab, itab->numClusters-1, NULL);
+	uint32_t newCluster = getFreeCluster(itab->fatfs, prevCluster + 1);
 	if (newCluster == 0)
 	{
 		return -1;
@@ -111,23 +273,19 @@ static int expandClusterChain(FATInodeTable *itab)
 	};
 	
 	// mark it as used
-	uint32_t usedval = 0x0FFFFFFF;
-	if (vfsPWrite(itab->fatfs->fp, &usedval, 4, itab->fatfs->fatpos + 4 * newCluster) != 4)
+	if (fatfsSetEntry(itab->fatfs, newCluster, FAT_ENTRY_END) != 0)
 	{
 		return -1;
 	};
 	
 	// link the previous cluster
-	uint32_t prevCluster = itab->clusters[itab->numClusters-1];
-	if (vfsPWrite(itab->fatfs->fp, &newCluster, 4, itab->fatfs->fatpos + 4 * prevCluster) != 4)
+	if (prevCluster != 0 && fatfsSetEntry(itab->fatfs, prevCluster, newCluster) != 0)
 	{
 		return -1;
 	};
 	
 	// append to list
-	size_t index = itab->numClusters++;
-	itab->clusters = (uint32_t*) krealloc(itab->clusters, 4 * itab->numClusters);
-	itab->clusters[index] = newCluster;
+	fatfsChainAppend(itab, newCluster);
 	
 	// increase count
 	__sync_fetch_and_add(&itab->fatfs->fs->freeBlocks, -1);
@@ -138,19 +296,17 @@ static int expandClusterChain(FATInodeTable *itab)
 static int shrinkClusterChain(FATInodeTable *itab)
 {
 	// last cluster
-	uint32_t toFree = itab->clusters[--itab->numClusters];
+	uint32_t toFree = fatfsChainTrim(itab);
 	
 	// free it
-	uint32_t freeval = 0;
-	if (vfsPWrite(itab->fatfs->fp, &freeval, 4, itab->fatfs->fatpos + 4 * toFree) != 4)
+	if (fatfsSetEntry(itab->fatfs, toFree, 0) != 0)
 	{
 		return -1;
 	};
 	
 	// mark the previous one as last
-	uint32_t prevCluster = itab->clusters[itab->numClusters-1];
-	uint32_t endval = 0x0FFFFFFF;
-	if (vfsPWrite(itab->fatfs->fp, &endval, 4, itab->fatfs->fatpos + 4 * prevCluster) != 4)
+	uint32_t prevCluster = fatfsChainGet(itab, itab->numClusters-1, NULL);
+	if (fatfsSetEntry(itab->fatfs, prevCluster, FAT_ENTRY_END) != 0)
 	{
 		return -1;
 	};
@@ -177,14 +333,14 @@ static FATInodeTable* getInodeInfoByCluster(Fatfs *fatfs, uint32_t cluster)
 	FATInodeTable *itab;
 	for (itab=fatfs->itab; itab!=NULL; itab=itab->next)
 	{
-		if (itab->clusters != NULL && itab->clusters[0] == cluster) return itab;
+		if (itab->numExtents != 0 && itab->extents[0].start == cluster) return itab;
 	};
 	
 	// create a new one if not found
 	itab = NEW(FATInodeTable);
 	memset(itab, 0, sizeof(FATInodeTable));
 	itab->ino = __sync_fetch_and_add(&fatfs->nextIno, 1);
-	readClusterChain(fatfs, cluster, &itab->clusters, &itab->numClusters);
+	readClusterChain(fatfs, cluster, itab);
 	itab->fatfs = fatfs;
 	
 	itab->next = fatfs->itab;
@@ -193,14 +349,14 @@ static FATInodeTable* getInodeInfoByCluster(Fatfs *fatfs, uint32_t cluster)
 	return itab;
 };
 
-static int fatfsTreeLoad(FileTree *ft, off_t offset, void *buffer)
+/**
+ * Load the page at 'offset' into 'buffer'. Call with the filesystem lock held.
+ */
+static int fatfsLoadPage(FATInodeTable *itab, off_t offset, void *buffer)
 {
 	char *put = (char*) buffer;
 	size_t sizeLeft = 0x1000;
 	
-	FATInodeTable *itab = (FATInodeTable*) ft->data;
-	semWait(&itab->fatfs->lock);
-	
 	while (sizeLeft)
 	{
 		size_t clusterIndex = offset / itab->fatfs->clusterSize;
@@ -210,26 +366,52 @@ static int fatfsTreeLoad(FileTree *ft, off_t offset, void *buffer)
 		{
 			if (expandClusterChain(itab) != 0)
 			{
-				semSignal(&itab->fatfs->lock);
 				return -1;
 			};
 		};
 		
-		off_t clusterPos = itab->fatfs->clusterPos + (itab->clusters[clusterIndex]-2) * itab->fatfs->clusterSize
-					+ clusterOffset;
-		size_t willRead = itab->fatfs->clusterSize - clusterOffset;
+		// read across the whole contiguous run at once
+		size_t run;
+		uint32_t cluster = fatfsChainGet(itab, clusterIndex, &run);
+		off_t clusterPos = itab->fatfs->clusterPos + (cluster-2) * itab->fatfs->clusterSize + clusterOffset;
+		size_t willRead = run * itab->fatfs->clusterSize - clusterOffset;
 		if (willRead > sizeLeft) willRead = sizeLeft;
 		
-		if (vfsPRead(itab->fatfs->fp, put, willRead, clusterPos) != willRead) return -1;
+		if (sdReadDirect(itab->fatfs->fp, put, willRead, clusterPos) != willRead) return -1;
 		sizeLeft -= willRead;
 		put += willRead;
 		offset += willRead;
 	};
 	
-	semSignal(&itab->fatfs->lock);
 	return 0;
 };
 
+static int fatfsTreeLoad(FileTree *ft, off_t offset, void *buffer)
+{
+	FATInodeTable *itab = (FATInodeTable*) ft->data;
+	semWait(&itab->fatfs->lock);
+	int status = fatfsLoadPage(itab, offset, buffer);
+	semSignal(&itab->fatfs->lock);
+	return status;
+};
+
+static int fatfsTreeLoadRange(FileTree *ft, off_t offset, const uint64_t *frames, int count)
+{
+	FATInodeTable *itab = (FATInodeTable*) ft->data;
+	semWait(&itab->fatfs->lock);
+	
+	int loaded;
+	for (loaded=0; loaded<count; loaded++)
+	{
+		if (fatfsLoadPage(itab, offset + ((off_t)loaded << 12), FRAME_TO_VIRT(frames[loaded])) != 0) break;
+	};
+	
+	semSignal(&itab->fatfs->lock);
+	
+	if (loaded == 0) return -1;
+	return loaded;
+};
+
 static int fatfsTreeFlush(FileTree *ft, off_t offset, const void *buffer)
 {
 	const char *scan = (const char*) buffer;
@@ -245,12 +427,13 @@ static int fatfsTreeFlush(FileTree *ft, off_t offset, const void *buffer)
 		
 		assert(itab->numClusters > clusterIndex);
 		
-		off_t clusterPos = itab->fatfs->clusterPos + (itab->clusters[clusterIndex]-2) * itab->fatfs->clusterSize
-					+ clusterOffset;
-		size_t willWrite = itab->fatfs->clusterSize - clusterOffset;
+		size_t run;
+		uint32_t cluster = fatfsChainGet(itab, clusterIndex, &run);
+		off_t clusterPos = itab->fatfs->clusterPos + (cluster-2) * itab->fatfs->clusterSize + clusterOffset;
+		size_t willWrite = run * itab->fatfs->clusterSize - clusterOffset;
 		if (willWrite > sizeLeft) willWrite = sizeLeft;
 		
-		if (vfsPWrite(itab->fatfs->fp, scan, willWrite, clusterPos) != willWrite) return -1;
+		if (sdWriteDirect(itab->fatfs->fp, scan, willWrite, clusterPos) != willWrite) return -1;
 		sizeLeft -= willWrite;
 		scan += willWrite;
 		offset += willWrite;
@@ -274,7 +457,7 @@ static void fatfsTreeUpdate(FileTree *ft)
 			char buffer[itab->fatfs->clusterSize];
 			memset(buffer, 0, itab->fatfs->clusterSize);
 			vfsPWrite(itab->fatfs->fp, buffer, itab->fatfs->clusterSize,
-				itab->fatfs->clusterPos + itab->fatfs->clusterSize * (itab->clusters[0]-2));
+				itab->fatfs->clusterPos + itab->fatfs->clusterSize * (fatfsChainFirst(itab)-2));
 			break;
 		};
 		
@@ -287,6 +470,7 @@ static void fatfsTreeUpdate(FileTree *ft)
 static void fatfsSetTreeOps(FileTree *ft)
 {
 	ft->load = fatfsTreeLoad;
+	ft->loadRange = fatfsTreeLoadRange;
 	ft->flush = fatfsTreeFlush;
 	ft->update = fatfsTreeUpdate;
 };
@@ -305,7 +489,7 @@ static int putdent(FATInodeTable *itab, size_t pos, FATDent *dent)
 		};
 	};
 	
-	size_t realpos = itab->fatfs->clusterPos + itab->fatfs->clusterSize * (itab->clusters[clusterIndex]-2) + offset;
+	size_t realpos = itab->fatfs->clusterPos + itab->fatfs->clusterSize * (fatfsChainGet(itab, clusterIndex, NULL)-2) + offset;
 	if (vfsPWrite(itab->fatfs->fp, dent, 32, realpos) != 32)
 	{
 		ERRNO = EIO;
@@ -351,11 +535,11 @@ static int fatfsInodeFlush(Inode *inode)
 		memset(&dot, 0, 32);
 		memcpy(dot.filename, ".          ", 11);
 		dot.attr = FAT_ATTR_DIR;
-		dot.clusterHigh = itab->clusters[0] >> 16;
-		dot.clusterLow = itab->clusters[0];
+		dot.clusterHigh = fatfsChainFirst(itab) >> 16;
+		dot.clusterLow = fatfsChainFirst(itab);
 		dot.size = 0;
 		
-		if (vfsPWrite(itab->fatfs->fp, &dot, 32, itab->fatfs->clusterPos + itab->fatfs->clusterSize * (itab->clusters[0]-2)) != 32)
+		if (vfsPWrite(itab->fatfs->fp, &dot, 32, itab->fatfs->clusterPos + itab->fatfs->clusterSize * (fatfsChainFirst(itab)-2)) != 32)
 		{
 			semSignal(&itab->fatfs->lock);
 			ERRNO = EIO;
@@ -365,7 +549,7 @@ static int fatfsInodeFlush(Inode *inode)
 		memcpy(dot.filename, "..         ", 11);
 		// TODO: perhaps actually set the cluster number correctly, based on parent ???
 		
-		if (vfsPWrite(itab->fatfs->fp, &dot, 32, itab->fatfs->clusterPos + itab->fatfs->clusterSize * (itab->clusters[0]-2) + 32) != 32)
+		if (vfsPWrite(itab->fatfs->fp, &dot, 32, itab->fatfs->clusterPos + itab->fatfs->clusterSize * (fatfsChainFirst(itab)-2) + 32) != 32)
 		{
 			semSignal(&itab->fatfs->lock);
 			ERRNO = EIO;
@@ -518,8 +702,8 @@ static int fatfsInodeFlush(Inode *inode)
 				assert(targetItab != NULL);
 				
 				fent.attr = targetItab->cattr;
-				fent.clusterHigh = (uint16_t) (targetItab->clusters[0] >> 16);
-				fent.clusterLow = (uint16_t) (targetItab->clusters[0]);
+				fent.clusterHigh = (uint16_t) (fatfsChainFirst(targetItab) >> 16);
+				fent.clusterLow = (uint16_t) (fatfsChainFirst(targetItab));
 				fent.size = targetItab->csize;
 				
 				// update the position of the dent
@@ -533,7 +717,7 @@ static int fatfsInodeFlush(Inode *inode)
 						return -1;
 					};
 				};
-				size_t realpos = itab->fatfs->clusterPos + itab->fatfs->clusterSize * (itab->clusters[clusterIndex]-2) + offset;
+				size_t realpos = itab->fatfs->clusterPos + itab->fatfs->clusterSize * (fatfsChainGet(itab, clusterIndex, NULL)-2) + offset;
 				targetItab->dentpos = realpos;
 				
 				putdent(itab, currentPos, &fent);
@@ -552,7 +736,7 @@ static int fatfsInodeFlush(Inode *inode)
 				return -1;
 			};
 		};
-		size_t realpos = itab->fatfs->clusterPos + itab->fatfs->clusterSize * (itab->clusters[clusterIndex]-2) + offset;
+		size_t realpos = itab->fatfs->clusterPos + itab->fatfs->clusterSize * (fatfsChainGet(itab, clusterIndex, NULL)-2) + offset;
 		size_t sizeLeft = itab->fatfs->clusterSize - offset;
 		
 		char padding[sizeLeft];
@@ -590,15 +774,19 @@ static void fatfsDropInode(Inode *inode)
 		// free all the clusters
 		__sync_fetch_and_add(&itab->fatfs->fs->freeBlocks, itab->numClusters);
 		
-		uint32_t freeval = 0;
 		size_t i;
-		for (i=0; i<itab->numClusters; i++)
+		for (i=0; i<itab->numExtents; i++)
 		{
-			vfsPWrite(itab->fatfs->fp, &freeval, 4, itab->fatfs->fatpos + 4 * itab->clusters[i]);
+			uint32_t j;
+			for (j=0; j<itab->extents[i].count; j++)
+			{
+				fatfsSetEntry(itab->fatfs, itab->extents[i].start + j, 0);
+			};
 		};
 		
-		kfree(itab->clusters);
-		itab->clusters = NULL;
+		kfree(itab->extents);
+		itab->extents = NULL;
+		itab->numExtents = 0;
 		itab->numClusters = 0;
 	};
 	
@@ -616,7 +804,7 @@ static int fatfsRegInode(FileSystem *fs, Inode *inode)
 	Fatfs *fatfs = (Fatfs*) fs->fsdata;
 	semWait(&fatfs->lock);
 	
-	uint32_t newCluster = getFreeCluster(fatfs);
+	uint32_t newCluster = getFreeCluster(fatfs, 0);
 	if (newCluster == 0)
 	{
 		semSignal(&fatfs->lock);
@@ -633,8 +821,7 @@ static int fatfsRegInode(FileSystem *fs, Inode *inode)
 		return -1;
 	};
 	
-	uint32_t endval = 0x0FFFFFFF;
-	if (vfsPWrite(fatfs->fp, &endval, 4, fatfs->fatpos + 4 * newCluster) != 4)
+	if (fatfsSetEntry(fatfs, newCluster, FAT_ENTRY_END) != 0)
 	{
 		semSignal(&fatfs->lock);
 		ERRNO = EIO;
@@ -650,9 +837,7 @@ static int fatfsRegInode(FileSystem *fs, Inode *inode)
 	itab->ino = __sync_fetch_and_add(&fatfs->nextIno, 1);
 	inode->ino = itab->ino;
 	itab->dentpos = 0;
-	itab->clusters = (uint32_t*) kmalloc(4);
-	itab->clusters[0] = newCluster;
-	itab->numClusters = 1;
+	fatfsChainAppend(itab, newCluster);
 	itab->fatfs = fatfs;
 	itab->csize = 0;
 	itab->cattr = 0;
@@ -744,7 +929,7 @@ static int fatfsLoadInode(FileSystem *fs, Inode *inode)
 			size_t dentIndex = i % dentsPerCluster;
 			
 			if (clusterIndex >= itab->numClusters) break;
-			off_t pos = fatfs->clusterPos + fatfs->clusterSize * (itab->clusters[clusterIndex]-2) + 32 * dentIndex;
+			off_t pos = fatfs->clusterPos + fatfs->clusterSize * (fatfsChainGet(itab, clusterIndex, NULL)-2) + 32 * dentIndex;
 			
 			FATDent ent;
 			if (vfsPRead(fatfs->fp, &ent, 32, pos) != 32) break;
@@ -857,10 +1042,18 @@ static void fatfsUnmount(FileSystem *fs)
 		FATInodeTable *itab = fatfs->itab;
 		fatfs->itab = itab->next;
 		
-		kfree(itab->clusters);
+		kfree(itab->extents);
 		kfree(itab);
 	};
 	
+	size_t i;
+	for (i=0; i<fatfs->fatPages; i++)
+	{
+		kfree(fatfs->fatCache[i]);
+	};
+	
+	kfree(fatfs->fatCache);
+	kfree(fatfs->freeMap);
 	vfsClose(fatfs->fp);
 	kfree(fatfs);
 };
@@ -968,14 +1161,6 @@ static Inode* fatfsOpenRoot(const char *image, int flags, const void *options, s
 	fatfs->fatpos = vbr.reservedSectors * vbr.sectorSize;
 	fatfs->nextIno = 3;				// 2 = root directory
 	
-	// initialize the virtual inode table by creating an entry for the root directory
-	FATInodeTable *itab = NEW(FATInodeTable);
-	memset(itab, 0, sizeof(FATInodeTable));
-	itab->ino = 2;
-	itab->fatfs = fatfs;
-	readClusterChain(fatfs, vbr.rootCluster, &itab->clusters, &itab->numClusters);
-	fatfs->itab = itab;
-	
 	semInit(&fatfs->lock);
 
 	fatfs->clusterSize = vbr.sectorSize * vbr.sectorsPerCluster;
@@ -984,6 +1169,20 @@ static Inode* fatfsOpenRoot(const char *image, int flags, const void *options, s
 	kprintf("fatfs: cluster size: %lu\n", fatfs->clusterSize);
 	fatfs->numClusters = ((size_t)vbr.sectorsLarge * (size_t)vbr.sectorSize - fatfs->clusterPos) / fatfs->clusterSize;
 	
+	// clusters are numbered from 2, and the FAT must have an entry for each
+	size_t fatEntries = (size_t) vbr.sectorsPerFat * (size_t) vbr.sectorSize / 4;
+	size_t maxCluster = fatfs->numClusters + 2;
+	if (maxCluster > fatEntries) maxCluster = fatEntries;
+	fatfs->maxCluster = (uint32_t) maxCluster;
+	
+	// set up the FAT cache (loaded on demand) and the free cluster bitmap (filled in below)
+	fatfs->fatPages = (maxCluster + FAT_CACHE_ENTRIES - 1) / FAT_CACHE_ENTRIES;
+	fatfs->fatCache = (uint32_t**) kmalloc(sizeof(uint32_t*) * fatfs->fatPages);
+	memset(fatfs->fatCache, 0, sizeof(uint32_t*) * fatfs->fatPages);
+	fatfs->freeMap = (uint64_t*) kmalloc(8 * ((maxCluster + 63) / 64));
+	memset(fatfs->freeMap, 0, 8 * ((maxCluster + 63) / 64));
+	fatfs->nextFree = 2;
+	
 	FileSystem *fs = vfsCreateFileSystem("fatfs");
 	fs->fsdata = fatfs;
 	fs->loadInode = fatfsLoadInode;
@@ -1000,7 +1199,7 @@ static Inode* fatfsOpenRoot(const char *image, int flags, const void *options, s
 	kprintf("fatfs: number of clusters: %lu\n", fatfs->numClusters);
 	
 	size_t i;
-	for (i=0; i<fatfs->numClusters; i++)
+	for (i=2; i<maxCluster; i++)
 	{
 		size_t trackno = i / (2 * 1024 * 1024 / 4);
 		size_t offset = i % (2 * 1024 * 1024 / 4);
@@ -1014,12 +1213,24 @@ static Inode* fatfsOpenRoot(const char *image, int flags, const void *options, s
 			};
 		};
 		
-		fs->freeBlocks += !track[offset];
+		if ((track[offset] & FAT_ENTRY_MASK) == 0)
+		{
+			fatfs->freeMap[i / 64] |= (1UL << (i % 64));
+			fs->freeBlocks++;
+		};
 	};
 	
 	kfree(track);
 	fatfs->fs = fs;
 	
+	// initialize the virtual inode table by creating an entry for the root directory
+	FATInodeTable *itab = NEW(FATInodeTable);
+	memset(itab, 0, sizeof(FATInodeTable));
+	itab->ino = 2;
+	itab->fatfs = fatfs;
+	readClusterChain(fatfs, vbr.rootCluster, itab);
+	fatfs->itab = itab;
+	
 	Inode *root = vfsCreateInode(NULL, VFS_MODE_DIRECTORY);
 	root->fs = fs;
 	fs->imap = root;
@@ -1028,7 +1239,14 @@ static Inode* fatfsOpenRoot(const char *image, int flags, const void *options, s
 	if (fatfsLoadInode(fs, root) != 0)
 	{
 		vfsDownrefInode(root);
+		kfree(itab->extents);
 		kfree(itab);
+		for (i=0; i<fatfs->fatPages; i++)
+		{
+			kfree(fatfs->fatCache[i]);
+		};
+		kfree(fatfs->fatCache);
+		kfree(fatfs->freeMap);
 		kfree(fs);
 		kfree(fatfs);
 		vfsClose(fp);
@@ -40,6 +40,18 @@
 
 #define	FAT_ATTR_LFN			0x0F
 
+/**
+ * Number of FAT entries in a single page of the FAT cache.
+ */
+#define	FAT_CACHE_ENTRIES		1024
+
+/**
+ * FAT entry values.
+ */
+#define	FAT_ENTRY_MASK			0x0FFFFFFF
+#define	FAT_ENTRY_BAD			0x0FFFFFF7
+#define	FAT_ENTRY_END			0x0FFFFFFF
+
 typedef struct
 {
 	/* BPB */
@@ -104,6 +116,23 @@ typedef struct
 	uint16_t			finalChars[2];
 } PACKED FATLongEntry;
 
+/**
+ * A run of physically contiguous clusters within a cluster chain.
+ */
+typedef struct
+{
+	/**
+	 * Index of the first cluster of this run within the chain.
+	 */
+	uint32_t			index;
+	
+	/**
+	 * First cluster number, and the number of clusters in the run.
+	 */
+	uint32_t			start;
+	uint32_t			count;
+} FATExtent;
+
 /**
  * Entry in the "virtual inode table". This maps inode numbers generated by the driver
  * to information on the FAT volume.
@@ -131,9 +160,10 @@ typedef struct FATInodeTable_
 	off_t				dentpos;
 	
 	/**
-	 * List of allocated clusters and the chain size.
+	 * The cluster chain, stored as a list of extents, and the total number of clusters in it.
 	 */
-	uint32_t*			clusters;
+	FATExtent*			extents;
+	size_t				numExtents;
 	size_t				numClusters;
 	
 	/**
@@ -198,6 +228,29 @@ typedef struct Fatfs_
 	 */
 	size_t				numClusters;
 	
+	/**
+	 * One past the highest valid cluster number.
+	 */
+	uint32_t			maxCluster;
+	
+	/**
+	 * The FAT cache. Each page holds FAT_CACHE_ENTRIES entries and is loaded from disk when first
+	 * accessed; NULL pages are not yet loaded. Changes are written through to the disk.
+	 */
+	uint32_t**			fatCache;
+	size_t				fatPages;
+	
+	/**
+	 * Free cluster bitmap; a set bit means the cluster is free. Built when mounting, and kept
+	 * in sync with the FAT afterwards.
+	 */
+	uint64_t*			freeMap;
+	
+	/**
+	 * Next-fit hint: the cluster at which to start searching for a free one.
+	 */
+	uint32_t			nextFree;
+	
 	/**
 	 * The VFS filesystem description.
 	 */
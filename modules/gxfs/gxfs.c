@@ -36,11 +36,15 @@
 #include <glidix/util/string.h>
 #include <glidix/util/errno.h>
 #include <glidix/thread/sched.h>
+#include <glidix/storage/storage.h>
+#include <glidix/hw/physmem.h>
+#include <glidix/thread/pageinfo.h>
 
 #include "gxfs.h"
 
 /* features supported by this driver */
-#define	GXFS_SUPPORTED_FEATURES			(GXFS_FEATURE_BASE)
+#define	GXFS_SUPPORTED_FEATURES			(GXFS_FEATURE_BASE | GXFS_FEATURE_BITMAP | GXFS_FEATURE_EXTENTS \
+							| GXFS_FEATURE_DIRINDEX)
 
 static int checkSuperblockHeader(GXFS_SuperblockHeader *sbh)
 {
@@ -61,6 +65,22 @@ static void gxfsFlushSuperblock(GXFS *gxfs)
 	vfsPWrite(gxfs->fp, &gxfs->sbb, sizeof(GXFS_SuperblockBody), GXFS_SBB_OFFSET);
 };
 
+static void gxfsFreeBitmap(GXFS *gxfs)
+{
+	if (gxfs->useBitmap)
+	{
+		uint64_t i;
+		for (i=0; i<gxfs->numGroups; i++)
+		{
+			kfree(gxfs->bitmap[i]);
+		};
+		
+		kfree(gxfs->bitmap);
+		kfree(gxfs->groupFree);
+		gxfs->useBitmap = 0;
+	};
+};
+
 static void gxfsUnmount(FileSystem *fs)
 {
 	kprintf("gxfs: unmounting\n");
@@ -72,6 +92,7 @@ static void gxfsUnmount(FileSystem *fs)
 		gxfsFlushSuperblock(gxfs);
 	};
 	vfsClose(gxfs->fp);
+	gxfsFreeBitmap(gxfs);
 	kfree(gxfs);
 };
 
@@ -103,7 +124,220 @@ static int gxfsWriteBlock(GXFS *gxfs, uint64_t blockno, const void *buffer)
 	};
 };
 
-static uint64_t gxfsAllocBlock(FileSystem *fs)
+static void gxfsDirtyInit(GXFS_DirtyList *list)
+{
+	semInit(&list->lock);
+	list->count = 0;
+	list->overflow = 0;
+};
+
+/**
+ * Remember that the metadata block 'blockno' was written, so that the next sync of 'list' commits it.
+ */
+static void gxfsDirtyAdd(GXFS_DirtyList *list, uint64_t blockno)
+{
+	semWait(&list->lock);
+	int i;
+	for (i=0; i<list->count; i++)
+	{
+		if (list->blocks[i] == blockno)
+		{
+			semSignal(&list->lock);
+			return;
+		};
+	};
+	
+	if (list->count == GXFS_DIRTY_MAX)
+	{
+		list->overflow = 1;
+	}
+	else
+	{
+		list->blocks[list->count++] = blockno;
+	};
+	semSignal(&list->lock);
+};
+
+/**
+ * Write out the blocks on a dirty list and wait for them to reach the disk. If the list overflowed, the
+ * whole partition is synced. Returns 0 on success, or an error number.
+ */
+static int gxfsDirtySync(GXFS *gxfs, GXFS_DirtyList *list)
+{
+	uint64_t blocks[GXFS_DIRTY_MAX];
+	
+	semWait(&list->lock);
+	int count = list->count;
+	int overflow = list->overflow;
+	memcpy(blocks, list->blocks, 8 * count);
+	list->count = 0;
+	list->overflow = 0;
+	semSignal(&list->lock);
+	
+	if (overflow)
+	{
+		return sdSyncRange(gxfs->fp, 0, 0x200000 + (gxfs->sbb.sbbTotalBlocks << 12));
+	};
+	
+	int i;
+	for (i=0; i<count; i++)
+	{
+		int error = sdSyncRange(gxfs->fp, 0x200000 + (blocks[i] << 12), 4096);
+		if (error != 0) return error;
+	};
+	
+	return 0;
+};
+
+/**
+ * Write a block of the index of a file tree; it is committed when the file is synced.
+ */
+static int gxfsWriteTreeBlock(GXFS_Tree *data, uint64_t blockno, const void *buffer)
+{
+	semWait(&data->cacheLock);
+	if (data->leafBlock == blockno)
+	{
+		memcpy(data->leafTable, buffer, 4096);
+	};
+	semSignal(&data->cacheLock);
+	
+	gxfsDirtyAdd(&data->dirty, blockno);
+	return gxfsWriteBlock((GXFS*) data->fs->fsdata, blockno, buffer);
+};
+
+/**
+ * Read the bottom-level table 'blockno' of a file tree, which maps the 2MB region 'key' of the file. The cached
+ * copy is used if it is the same table; otherwise, the table read becomes the cached one.
+ */
+static int gxfsReadLeaf(GXFS_Tree *data, uint64_t key, uint64_t blockno, uint64_t *table)
+{
+	semWait(&data->cacheLock);
+	if (data->leafBlock == blockno)
+	{
+		memcpy(table, data->leafTable, 4096);
+		semSignal(&data->cacheLock);
+		return 0;
+	};
+	semSignal(&data->cacheLock);
+	
+	if (gxfsReadBlock((GXFS*) data->fs->fsdata, blockno, table) != 0)
+	{
+		return -1;
+	};
+	
+	// allocate outside the lock; freeing pages may call back into this tree
+	uint64_t *leafTable = NULL;
+	if (data->leafTable == NULL) leafTable = (uint64_t*) kmalloc(4096);
+	
+	semWait(&data->cacheLock);
+	if (data->leafTable == NULL)
+	{
+		data->leafTable = leafTable;
+		leafTable = NULL;
+	};
+	
+	if (data->leafTable != NULL)
+	{
+		memcpy(data->leafTable, table, 4096);
+		data->leafBlock = blockno;
+		data->leafKey = key;
+	};
+	semSignal(&data->cacheLock);
+	
+	kfree(leafTable);
+	return 0;
+};
+
+/**
+ * If the bottom-level table which maps 'pos' is cached, return its block number in '*blockOut' and its entry for
+ * 'pos' in '*entryOut', and return 1. Otherwise, return 0.
+ */
+static int gxfsLookupLeaf(GXFS_Tree *data, off_t pos, uint64_t *blockOut, uint64_t *entryOut)
+{
+	int found = 0;
+	
+	semWait(&data->cacheLock);
+	if (data->leafBlock != 0 && data->leafKey == (pos >> 21))
+	{
+		*blockOut = data->leafBlock;
+		*entryOut = data->leafTable[(pos >> 12) & 0x1FF];
+		found = 1;
+	};
+	semSignal(&data->cacheLock);
+	
+	return found;
+};
+
+static void gxfsFreeTree(GXFS_Tree *data)
+{
+	kfree(data->leafTable);
+	kfree(data->extents);
+	kfree(data->extFreed);
+	kfree(data->extLeaves);
+	kfree(data->extIndex);
+	kfree(data);
+};
+
+/**
+ * Read and write file data blocks. These bypass the block device cache, since file contents are
+ * cached in file trees; gxfsReadBlock() and gxfsWriteBlock() are used for metadata.
+ */
+static int gxfsReadDataBlock(GXFS *gxfs, uint64_t blockno, void *buffer)
+{
+	uint64_t off = 0x200000 + (blockno << 12);
+	ssize_t size = sdReadDirect(gxfs->fp, buffer, 4096, off);
+	if (size != 4096)
+	{
+		kprintf("gxfs: data block read failure: size=%ld, errno=%d\n", size, ERRNO);
+		return -1;
+	};
+	
+	return 0;
+};
+
+static int gxfsWriteDataBlock(GXFS *gxfs, uint64_t blockno, const void *buffer)
+{
+	uint64_t off = 0x200000 + (blockno << 12);
+	if (sdWriteDirect(gxfs->fp, buffer, 4096, off) != 4096)
+	{
+		return -1;
+	};
+	
+	return 0;
+};
+
+/**
+ * Read or write 'count' data blocks, consecutive on disk starting at 'blockno', directly to or from page
+ * frames.
+ */
+static int gxfsReadDataFrames(GXFS *gxfs, uint64_t blockno, const uint64_t *frames, int count)
+{
+	uint64_t off = 0x200000 + (blockno << 12);
+	ssize_t size = sdReadFrames(gxfs->fp, frames, count, off);
+	if (size != ((ssize_t) count << 12))
+	{
+		kprintf("gxfs: data block read failure: size=%ld, errno=%d\n", size, ERRNO);
+		return -1;
+	};
+	
+	return 0;
+};
+
+static int gxfsWriteDataFrames(GXFS *gxfs, uint64_t blockno, const uint64_t *frames, int count)
+{
+	uint64_t off = 0x200000 + (blockno << 12);
+	if (sdWriteFrames(gxfs->fp, frames, count, off) != ((ssize_t) count << 12))
+	{
+		return -1;
+	};
+	
+	return 0;
+};
+
+/**
+ * Allocate a block from the free list; used when the filesystem has no free-space bitmap.
+ */
+static uint64_t gxfsListAlloc(FileSystem *fs)
 {
 	GXFS *gxfs = (GXFS*) fs->fsdata;
 	
@@ -127,54 +361,1159 @@ static uint64_t gxfsAllocBlock(FileSystem *fs)
 	}
 	else
 	{
-		char blockbuf[4096];
-		uint64_t result = gxfs->sbb.sbbFreeHead;
-		if (gxfsReadBlock(gxfs, result, blockbuf) != 0)
+		char blockbuf[4096];
+		uint64_t result = gxfs->sbb.sbbFreeHead;
+		if (gxfsReadBlock(gxfs, result, blockbuf) != 0)
+		{
+			semSignal(&gxfs->lock);
+			return 0;
+		};
+		
+		gxfs->sbb.sbbFreeHead = *((uint64_t*)blockbuf);
+		gxfs->sbb.sbbUsedBlocks++;
+		__sync_fetch_and_add(&fs->freeBlocks, -1);
+		__sync_fetch_and_add(&fs->freeInodes, -1);
+		gxfsFlushSuperblock(gxfs);
+		semSignal(&gxfs->lock);
+		return result;
+	};
+};
+
+/**
+ * Return the bitmap block of the specified group, loading it (and counting its free blocks) if this is the
+ * first time it is used. Called with the lock held. Returns NULL on I/O error.
+ */
+static uint8_t* gxfsGetGroup(GXFS *gxfs, uint64_t group)
+{
+	if (gxfs->bitmap[group] == NULL)
+	{
+		uint8_t *bitmap = (uint8_t*) kmalloc(4096);
+		if (gxfsReadBlock(gxfs, gxfs->sbb.sbbBitmapStart + group, bitmap) != 0)
+		{
+			kfree(bitmap);
+			return NULL;
+		};
+		
+		// bits past the end of the filesystem do not count
+		uint64_t limit = gxfs->sbb.sbbTotalBlocks - group * GXFS_GROUP_BLOCKS;
+		if (limit > GXFS_GROUP_BLOCKS) limit = GXFS_GROUP_BLOCKS;
+		
+		uint32_t count = 0;
+		uint64_t i;
+		for (i=0; i<limit; i++)
+		{
+			if (bitmap[i >> 3] == 0xFF)
+			{
+				i |= 7;
+			}
+			else if ((bitmap[i >> 3] & (1 << (i & 7))) == 0)
+			{
+				count++;
+			};
+		};
+		
+		gxfs->bitmap[group] = bitmap;
+		gxfs->groupFree[group] = count;
+	};
+	
+	return gxfs->bitmap[group];
+};
+
+/**
+ * Write back the bitmap block of the specified group. This only updates the block cache; the block is committed
+ * along with the other allocator blocks.
+ */
+static void gxfsPutGroup(GXFS *gxfs, uint64_t group)
+{
+	uint64_t blockno = gxfs->sbb.sbbBitmapStart + group;
+	gxfsWriteBlock(gxfs, blockno, gxfs->bitmap[group]);
+	gxfsDirtyAdd(&gxfs->allocDirty, blockno);
+};
+
+/**
+ * Allocate up to 'want' consecutive blocks from the bitmap, preferably starting at 'hint', and return the number
+ * of blocks actually allocated in '*countOut'. An extent never crosses a group boundary. Called with the lock
+ * held. Returns the first block of the extent, or 0 if the filesystem is full.
+ */
+static uint64_t gxfsBitmapAlloc(GXFS *gxfs, uint64_t hint, uint64_t want, uint64_t *countOut)
+{
+	if (hint == 0 || hint >= gxfs->sbb.sbbTotalBlocks) hint = gxfs->allocHint;
+	if (hint >= gxfs->sbb.sbbTotalBlocks) hint = 0;
+	
+	uint64_t group = hint / GXFS_GROUP_BLOCKS;
+	uint64_t index = hint % GXFS_GROUP_BLOCKS;
+	
+	// visit the starting group twice, so that the part before the hint is also searched
+	uint64_t tries;
+	for (tries=0; tries<=gxfs->numGroups; tries++)
+	{
+		if (gxfs->groupFree[group] != 0)
+		{
+			uint8_t *bitmap = gxfsGetGroup(gxfs, group);
+			if (bitmap == NULL) return 0;
+			
+			uint64_t base = group * GXFS_GROUP_BLOCKS;
+			uint64_t limit = gxfs->sbb.sbbTotalBlocks - base;
+			if (limit > GXFS_GROUP_BLOCKS) limit = GXFS_GROUP_BLOCKS;
+			
+			while (index < limit && gxfs->groupFree[group] != 0)
+			{
+				if (bitmap[index >> 3] == 0xFF)
+				{
+					index = (index | 7) + 1;
+					continue;
+				};
+				
+				if (bitmap[index >> 3] & (1 << (index & 7)))
+				{
+					index++;
+					continue;
+				};
+				
+				// found a free block; take as many of the following ones as are free too
+				uint64_t count = 0;
+				while (count < want && (index+count) < limit
+					&& (bitmap[(index+count) >> 3] & (1 << ((index+count) & 7))) == 0)
+				{
+					bitmap[(index+count) >> 3] |= (1 << ((index+count) & 7));
+					count++;
+				};
+				
+				gxfs->groupFree[group] -= count;
+				gxfs->sbb.sbbUsedBlocks += count;
+				gxfs->allocHint = base + index + count;
+				gxfsPutGroup(gxfs, group);
+				
+				*countOut = count;
+				return base + index;
+			};
+		};
+		
+		group = (group + 1) % gxfs->numGroups;
+		index = 0;
+	};
+	
+	return 0;
+};
+
+/**
+ * Mark a block as free in the bitmap; the caller writes back the bitmap block with gxfsPutGroup(). Called with
+ * the lock held. Returns 0 on success, or -1 if the block could not be freed.
+ */
+static int gxfsBitmapFree(GXFS *gxfs, uint64_t block)
+{
+	if (block >= gxfs->sbb.sbbTotalBlocks)
+	{
+		kprintf("gxfs: WARNING: attempting to free block %lu which is out of range\n", block);
+		return -1;
+	};
+	
+	uint64_t group = block / GXFS_GROUP_BLOCKS;
+	uint64_t index = block % GXFS_GROUP_BLOCKS;
+	uint8_t *bitmap = gxfsGetGroup(gxfs, group);
+	if (bitmap == NULL)
+	{
+		kprintf("gxfs: WARNING: failed to load a bitmap block; block %lu leaked\n", block);
+		return -1;
+	};
+	
+	if ((bitmap[index >> 3] & (1 << (index & 7))) == 0)
+	{
+		kprintf("gxfs: WARNING: block %lu freed twice; filesystem probably corrupt\n", block);
+		return -1;
+	};
+	
+	bitmap[index >> 3] &= ~(1 << (index & 7));
+	gxfs->groupFree[group]++;
+	gxfs->sbb.sbbUsedBlocks--;
+	return 0;
+};
+
+/**
+ * Allocate up to 'want' consecutive blocks, preferably starting at 'hint' (0 = no preference), and return the
+ * number of blocks actually allocated in '*countOut'. Without a bitmap, this always allocates a single block
+ * from the free list. Returns the first block, or 0 if the filesystem is full.
+ */
+static uint64_t gxfsAllocExtent(FileSystem *fs, uint64_t hint, uint64_t want, uint64_t *countOut)
+{
+	GXFS *gxfs = (GXFS*) fs->fsdata;
+	if (!gxfs->useBitmap)
+	{
+		*countOut = 1;
+		return gxfsListAlloc(fs);
+	};
+	
+	semWait(&gxfs->lock);
+	uint64_t result = gxfsBitmapAlloc(gxfs, hint, want, countOut);
+	if (result != 0)
+	{
+		__sync_fetch_and_add(&fs->freeBlocks, -(*countOut));
+		__sync_fetch_and_add(&fs->freeInodes, -(*countOut));
+		gxfsFlushSuperblock(gxfs);
+	};
+	semSignal(&gxfs->lock);
+	
+	return result;
+};
+
+static uint64_t gxfsAllocBlock(FileSystem *fs)
+{
+	uint64_t count;
+	return gxfsAllocExtent(fs, 0, 1, &count);
+};
+
+static void gxfsFreeBlock(FileSystem *fs, uint64_t block)
+{
+	GXFS *gxfs = (GXFS*) fs->fsdata;
+	
+	semWait(&gxfs->lock);
+	if (gxfs->useBitmap)
+	{
+		if (gxfsBitmapFree(gxfs, block) != 0)
+		{
+			semSignal(&gxfs->lock);
+			return;
+		};
+		
+		gxfsPutGroup(gxfs, block / GXFS_GROUP_BLOCKS);
+	}
+	else
+	{
+		char blockbuf[4096];
+		*((uint64_t*)blockbuf) = gxfs->sbb.sbbFreeHead;
+		gxfsWriteBlock(gxfs, block, blockbuf);
+		gxfsDirtyAdd(&gxfs->allocDirty, block);
+		gxfs->sbb.sbbFreeHead = block;
+	};
+	gxfsFlushSuperblock(gxfs);
+	semSignal(&gxfs->lock);
+	
+	__sync_fetch_and_add(&fs->freeBlocks, 1);
+	__sync_fetch_and_add(&fs->freeInodes, 1);
+};
+
+/**
+ * Free 'count' consecutive blocks starting at 'first'. With a bitmap, this is done under a single lock, writing
+ * back each affected bitmap block once.
+ */
+static void gxfsFreeExtent(FileSystem *fs, uint64_t first, uint64_t count)
+{
+	GXFS *gxfs = (GXFS*) fs->fsdata;
+	if (!gxfs->useBitmap)
+	{
+		while (count--)
+		{
+			gxfsFreeBlock(fs, first++);
+		};
+		
+		return;
+	};
+	
+	semWait(&gxfs->lock);
+	uint64_t freed = 0;
+	uint64_t i;
+	for (i=0; i<count; i++)
+	{
+		uint64_t block = first + i;
+		if (gxfsBitmapFree(gxfs, block) == 0) freed++;
+		
+		// write back the bitmap block when leaving its group
+		uint64_t group = block / GXFS_GROUP_BLOCKS;
+		if ((i == count-1 || ((block+1) % GXFS_GROUP_BLOCKS) == 0)
+			&& group < gxfs->numGroups && gxfs->bitmap[group] != NULL)
+		{
+			gxfsPutGroup(gxfs, group);
+		};
+	};
+	gxfsFlushSuperblock(gxfs);
+	semSignal(&gxfs->lock);
+	
+	__sync_fetch_and_add(&fs->freeBlocks, freed);
+	__sync_fetch_and_add(&fs->freeInodes, freed);
+};
+
+/**
+ * Allocate up to 'want' consecutive blocks as in gxfsAllocExtent(), and fill them with zeroes; the blocks are
+ * added to the 'dirty' list.
+ */
+static uint64_t gxfsAllocZeroExtent(FileSystem *fs, uint64_t hint, uint64_t want, uint64_t *countOut,
+					GXFS_DirtyList *dirty)
+{
+	uint64_t count;
+	uint64_t first = gxfsAllocExtent(fs, hint, want, &count);
+	if (first == 0) return 0;
+	
+	char buf[4096];
+	memset(buf, 0, 4096);
+	
+	uint64_t i;
+	for (i=0; i<count; i++)
+	{
+		if (gxfsWriteBlock((GXFS*) fs->fsdata, first+i, buf) != 0)
+		{
+			for (i=0; i<count; i++)
+			{
+				gxfsFreeBlock(fs, first+i);
+			};
+			
+			return 0;
+		};
+		
+		gxfsDirtyAdd(dirty, first+i);
+	};
+	
+	*countOut = count;
+	return first;
+};
+
+/**
+ * Allocate a block for file data, preferably at 'hint', and fill it with zeroes. File data bypasses the block
+ * cache, so the block is written directly and is not put on any dirty list.
+ */
+static uint64_t gxfsAllocDataBlock(FileSystem *fs, uint64_t hint)
+{
+	uint64_t count;
+	uint64_t block = gxfsAllocExtent(fs, hint, 1, &count);
+	if (block == 0) return 0;
+	
+	char buf[4096];
+	memset(buf, 0, 4096);
+	
+	if (gxfsWriteDataBlock((GXFS*) fs->fsdata, block, buf) != 0)
+	{
+		gxfsFreeBlock(fs, block);
+		return 0;
+	};
+	
+	return block;
+};
+
+/**
+ * Allocate a block, preferably at 'hint', and fill it with zeroes; the block is added to the 'dirty' list.
+ */
+static uint64_t gxfsAllocZeroBlock(FileSystem *fs, uint64_t hint, GXFS_DirtyList *dirty)
+{
+	uint64_t count;
+	return gxfsAllocZeroExtent(fs, hint, 1, &count, dirty);
+};
+
+/**
+ * Write the extents of a file to its B-tree, unless they fit in the EXTS record itself. The tree is updated by
+ * copy-on-write: leaves which still hold the same extents are kept, and the other leaves and all index nodes
+ * are written to new blocks. Returns the height of the tree in '*depthOut' (0 if the extents are to be stored
+ * inline) and its root in '*rootOut', and the blocks of the old tree which are no longer used in '*staleOut'
+ * (to be freed once the EXTS record referring to the new tree is written, then passed to kfree()) and
+ * '*numStaleOut'. Call with the file tree locked. Returns 0 on success, or -1 if there is not enough space.
+ */
+static int gxfsExtWriteTree(GXFS_Tree *data, uint64_t *depthOut, uint64_t *rootOut,
+				uint64_t **staleOut, uint64_t *numStaleOut)
+{
+	// count the nodes on each level
+	uint64_t numLeaves = 0;
+	uint64_t numIndex = 0;
+	uint64_t reuse = 0;
+	if (data->numExtents > GXFS_INLINE_EXTENTS)
+	{
+		numLeaves = (data->numExtents + GXFS_LEAF_EXTENTS - 1) / GXFS_LEAF_EXTENTS;
+		uint64_t levelNodes = numLeaves;
+		while (levelNodes > 1)
+		{
+			levelNodes = (levelNodes + GXFS_INDEX_KEYS - 1) / GXFS_INDEX_KEYS;
+			numIndex += levelNodes;
+		};
+		
+		// a leaf is still valid if it was full and all its extents are unchanged
+		reuse = data->extClean / GXFS_LEAF_EXTENTS;
+		if (reuse > data->numExtLeaves) reuse = data->numExtLeaves;
+	};
+	
+	// the leaves, then each level of index nodes; allocate all the new ones up front
+	uint64_t totalNodes = numLeaves + numIndex;
+	uint64_t *blocks = (uint64_t*) kmalloc(8 * totalNodes);
+	memcpy(blocks, data->extLeaves, 8 * reuse);
+	uint64_t numBlocks = reuse;
+	while (numBlocks < totalNodes)
+	{
+		uint64_t hint = 0;
+		if (numBlocks != 0) hint = blocks[numBlocks-1] + 1;
+		
+		uint64_t count;
+		uint64_t first = gxfsAllocExtent(data->fs, hint, totalNodes - numBlocks, &count);
+		if (first == 0)
+		{
+			uint64_t i;
+			for (i=reuse; i<numBlocks; i++)
+			{
+				gxfsFreeBlock(data->fs, blocks[i]);
+			};
+			
+			kfree(blocks);
+			return -1;
+		};
+		
+		while (count--)
+		{
+			blocks[numBlocks++] = first++;
+		};
+	};
+	
+	GXFS_IndexKey *keys = (GXFS_IndexKey*) kmalloc(sizeof(GXFS_IndexKey) * numLeaves);
+	GXFS_ExtentNode *node = (GXFS_ExtentNode*) kmalloc(sizeof(GXFS_ExtentNode));
+	int status = 0;
+	
+	// the leaves which have changed
+	uint64_t nextBlock = 0;
+	uint64_t i;
+	for (i=0; i<numLeaves; i++)
+	{
+		uint64_t first = i * GXFS_LEAF_EXTENTS;
+		uint64_t count = data->numExtents - first;
+		if (count > GXFS_LEAF_EXTENTS) count = GXFS_LEAF_EXTENTS;
+		
+		keys[i].ikFirst = data->extents[first].exLogical;
+		keys[i].ikChild = blocks[nextBlock++];
+		if (i < reuse) continue;
+		
+		memset(node, 0, sizeof(GXFS_ExtentNode));
+		node->enCount = count;
+		node->enLevel = 0;
+		memcpy(node->enExtents, &data->extents[first], sizeof(GXFS_Extent) * count);
+		
+		if (gxfsWriteTreeBlock(data, keys[i].ikChild, node) != 0) status = -1;
+	};
+	
+	// index nodes, each level replacing the keys of the level below in place
+	uint64_t level = 0;
+	uint64_t levelNodes = numLeaves;
+	while (levelNodes > 1)
+	{
+		level++;
+		uint64_t upperNodes = (levelNodes + GXFS_INDEX_KEYS - 1) / GXFS_INDEX_KEYS;
+		for (i=0; i<upperNodes; i++)
+		{
+			uint64_t first = i * GXFS_INDEX_KEYS;
+			uint64_t count = levelNodes - first;
+			if (count > GXFS_INDEX_KEYS) count = GXFS_INDEX_KEYS;
+			
+			memset(node, 0, sizeof(GXFS_ExtentNode));
+			node->enCount = count;
+			node->enLevel = level;
+			memcpy(node->enKeys, &keys[first], sizeof(GXFS_IndexKey) * count);
+			
+			keys[i].ikFirst = node->enKeys[0].ikFirst;
+			keys[i].ikChild = blocks[nextBlock++];
+			if (gxfsWriteTreeBlock(data, keys[i].ikChild, node) != 0) status = -1;
+		};
+		
+		levelNodes = upperNodes;
+	};
+	
+	if (status != 0)
+	{
+		for (i=reuse; i<totalNodes; i++)
+		{
+			gxfsFreeBlock(data->fs, blocks[i]);
+		};
+		
+		kfree(blocks);
+	}
+	else
+	{
+		if (numLeaves == 0)
+		{
+			*depthOut = 0;
+			*rootOut = 0;
+		}
+		else
+		{
+			*depthOut = level + 1;
+			*rootOut = keys[0].ikChild;
+		};
+		
+		// the old leaves which were not kept and all the old index nodes are stale
+		uint64_t numStale = (data->numExtLeaves - reuse) + data->numExtIndex;
+		uint64_t *stale = (uint64_t*) kmalloc(8 * numStale);
+		memcpy(stale, &data->extLeaves[reuse], 8 * (data->numExtLeaves - reuse));
+		memcpy(&stale[data->numExtLeaves - reuse], data->extIndex, 8 * data->numExtIndex);
+		*staleOut = stale;
+		*numStaleOut = numStale;
+		
+		kfree(data->extLeaves);
+		kfree(data->extIndex);
+		data->extLeaves = blocks;
+		data->numExtLeaves = numLeaves;
+		data->extIndex = (uint64_t*) kmalloc(8 * numIndex);
+		memcpy(data->extIndex, &blocks[numLeaves], 8 * numIndex);
+		data->numExtIndex = numIndex;
+		data->extClean = data->numExtents;
+	};
+	
+	kfree(node);
+	kfree(keys);
+	return status;
+};
+
+/**
+ * Free the blocks of an extent B-tree (but not the blocks which its extents map).
+ */
+static void gxfsExtFreeTree(FileSystem *fs, uint64_t depth, uint64_t root)
+{
+	if (depth == 0) return;
+	
+	if (depth > 1)
+	{
+		GXFS_ExtentNode *node = (GXFS_ExtentNode*) kmalloc(sizeof(GXFS_ExtentNode));
+		if (gxfsReadBlock((GXFS*) fs->fsdata, root, node) != 0 || node->enCount > GXFS_INDEX_KEYS)
+		{
+			kprintf("gxfs: WARNING: failed to read an extent tree node %lu; blocks leaked\n", root);
+		}
+		else
+		{
+			uint64_t i;
+			for (i=0; i<node->enCount; i++)
+			{
+				gxfsExtFreeTree(fs, depth-1, node->enKeys[i].ikChild);
+			};
+		};
+		
+		kfree(node);
+	};
+	
+	gxfsFreeBlock(fs, root);
+};
+
+/**
+ * Append the extents stored in an extent B-tree to the in-memory list of a file which is being loaded, and its
+ * nodes to 'extLeaves' and 'extIndex'. 'extClean' is lowered to the first extent which is not where
+ * gxfsExtWriteTree() would have put it, so that the leaves from there on are not reused.
+ */
+static int gxfsExtLoadTree(GXFS_Tree *data, uint64_t depth, uint64_t root)
+{
+	GXFS_ExtentNode *node = (GXFS_ExtentNode*) kmalloc(sizeof(GXFS_ExtentNode));
+	if (gxfsReadBlock((GXFS*) data->fs->fsdata, root, node) != 0)
+	{
+		kfree(node);
+		return -1;
+	};
+	
+	if (node->enLevel != depth-1
+		|| node->enCount > (node->enLevel == 0 ? GXFS_LEAF_EXTENTS : GXFS_INDEX_KEYS))
+	{
+		kprintf("gxfs: extent tree node %lu is corrupt\n", root);
+		kfree(node);
+		return -1;
+	};
+	
+	uint64_t i;
+	if (node->enLevel == 0)
+	{
+		if (data->numExtents != data->numExtLeaves * GXFS_LEAF_EXTENTS && data->numExtents < data->extClean)
+		{
+			data->extClean = data->numExtents;
+		};
+		
+		data->extLeaves = (uint64_t*) krealloc(data->extLeaves, 8 * (data->numExtLeaves+1));
+		data->extLeaves[data->numExtLeaves++] = root;
+		
+		if ((data->numExtents + node->enCount) > data->maxExtents)
+		{
+			data->maxExtents = data->numExtents + node->enCount;
+			data->extents = (GXFS_Extent*) krealloc(data->extents, sizeof(GXFS_Extent) * data->maxExtents);
+		};
+		
+		memcpy(&data->extents[data->numExtents], node->enExtents, sizeof(GXFS_Extent) * node->enCount);
+		data->numExtents += node->enCount;
+	}
+	else
+	{
+		data->extIndex = (uint64_t*) krealloc(data->extIndex, 8 * (data->numExtIndex+1));
+		data->extIndex[data->numExtIndex++] = root;
+		
+		for (i=0; i<node->enCount; i++)
+		{
+			if (gxfsExtLoadTree(data, depth-1, node->enKeys[i].ikChild) != 0)
+			{
+				kfree(node);
+				return -1;
+			};
+		};
+	};
+	
+	kfree(node);
+	return 0;
+};
+
+static GXFS_Tree* gxfsNewTreeData(FileSystem *fs)
+{
+	GXFS_Tree *data = NEW(GXFS_Tree);
+	data->fs = fs;
+	data->depth = 0;
+	data->head = 0;
+	gxfsDirtyInit(&data->dirty);
+	semInit(&data->cacheLock);
+	data->leafTable = NULL;
+	data->leafBlock = 0;
+	data->leafKey = 0;
+	data->useExtents = 0;
+	data->extents = NULL;
+	data->numExtents = 0;
+	data->maxExtents = 0;
+	data->extDepth = 0;
+	data->extRoot = 0;
+	data->extDirty = 0;
+	semInit(&data->extLock);
+	data->extFreed = NULL;
+	data->numExtFreed = 0;
+	data->extLeaves = NULL;
+	data->numExtLeaves = 0;
+	data->extIndex = NULL;
+	data->numExtIndex = 0;
+	data->extClean = 0;
+	data->headDirty = 0;
+	data->metaLeaves = 0;
+	return data;
+};
+
+/**
+ * Walk 'levels' levels down the tree towards the page at 'pos', allocating blocks for holes, and
+ * return the block number reached in *blockOut. The tree must already be deep enough for 'pos'.
+ */
+static int gxfsTreeWalk(GXFS_Tree *data, off_t pos, int levels, uint64_t *blockOut)
+{
+	uint64_t lvl[5];
+	lvl[4] = (pos >> 12) & 0x1FF;
+	lvl[3] = (pos >> 21) & 0x1FF;
+	lvl[2] = (pos >> 30) & 0x1FF;
+	lvl[1] = (pos >> 39) & 0x1FF;
+	lvl[0] = (pos >> 48) & 0x1FF;
+	
+	uint64_t datablock = data->head;
+	int i = 5 - data->depth;
+	
+	// if the bottom-level table is cached, skip the upper levels
+	uint64_t leafBlock, entry;
+	if (data->depth != 0 && levels >= (data->depth-1) && gxfsLookupLeaf(data, pos, &leafBlock, &entry))
+	{
+		if (levels == (data->depth-1))
+		{
+			*blockOut = leafBlock;
+			return 0;
+		};
+		
+		if (entry != 0)
+		{
+			*blockOut = entry;
+			return 0;
+		};
+		
+		datablock = leafBlock;
+		i = 4;
+	};
+	
+	for (; i<(5-data->depth+levels); i++)
+	{
+		uint64_t table[512];
+		int status;
+		if (i == 4)
+		{
+			status = gxfsReadLeaf(data, pos >> 21, datablock, table);
+		}
+		else
+		{
+			status = gxfsReadBlock((GXFS*) data->fs->fsdata, datablock, table);
+		};
+		
+		if (status != 0)
+		{
+			return -1;
+		};
+		
+		if (table[lvl[i]] == 0)
+		{
+			// keep the new block close to its neighbour, or to the table that points to it
+			uint64_t hint = datablock + 1;
+			if (lvl[i] != 0 && table[lvl[i]-1] != 0) hint = table[lvl[i]-1] + 1;
+			
+			// at the bottom level, the new block holds file data unless this is a directory index
+			uint64_t newblock;
+			if (i == 4 && !data->metaLeaves) newblock = gxfsAllocDataBlock(data->fs, hint);
+			else newblock = gxfsAllocZeroBlock(data->fs, hint, &data->dirty);
+			
+			if (newblock == 0)
+			{
+				return -1;
+			};
+			
+			table[lvl[i]] = newblock;
+			if (gxfsWriteTreeBlock(data, datablock, table) != 0)
+			{
+				gxfsFreeBlock(data->fs, newblock);
+				return -1;
+			};
+
+			datablock = newblock;
+		}
+		else
+		{
+			datablock = table[lvl[i]];
+		};
+	};
+	
+	*blockOut = datablock;
+	return 0;
+};
+
+/**
+ * Make the tree deep enough to contain the page at 'pos'.
+ */
+static int gxfsTreeGrow(GXFS_Tree *data, off_t pos)
+{
+	uint64_t sizeLimit = (1UL << 57) - 1;
+	if (pos > sizeLimit)
+	{
+		return -1;
+	};
+	
+	while (pos >= (1UL << (12 + 9 * data->depth)))
+	{
+		// we must increase the depth
+		uint64_t indirect = gxfsAllocBlock(data->fs);
+		if (indirect == 0) return -1;
+		
+		uint64_t table[512];
+		memset(table, 0, 4096);
+		table[0] = data->head;
+		
+		if (gxfsWriteTreeBlock(data, indirect, table) != 0)
+		{
+			gxfsFreeBlock(data->fs, indirect);
+			return -1;
+		};
+		
+		data->head = indirect;
+		data->depth++;
+		data->headDirty = 1;
+	};
+	
+	return 0;
+};
+
+/**
+ * Hash a name for the directory index (32-bit FNV-1a); the low bits select the bucket.
+ */
+static uint32_t gxfsDirHash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+	while (*name != 0)
+	{
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619U;
+	};
+	
+	return hash;
+};
+
+/**
+ * Return the contribution of an entry to the fingerprint of its bucket. Fingerprints are sums of those, so
+ * they do not depend on the order of the entries.
+ */
+static uint64_t gxfsDirPrint(const char *name, uint64_t ino)
+{
+	uint64_t hash = 14695981039346656037UL;
+	while (*name != 0)
+	{
+		hash ^= (uint8_t) *name++;
+		hash *= 1099511628211UL;
+	};
+	
+	hash ^= ino * 0x9E3779B97F4A7C15UL;
+	hash ^= hash >> 31;
+	hash *= 0xBF58476D1CE4E5B9UL;
+	hash ^= hash >> 29;
+	return hash;
+};
+
+/**
+ * Free the blocks of a directory index tree, including the bucket chains. 'buf' is scratch space.
+ */
+static void gxfsDirDeleteRecur(FileSystem *fs, uint64_t depth, uint64_t head, GXFS_DirBlock *buf)
+{
+	if (head == 0) return;
+	
+	GXFS *gxfs = (GXFS*) fs->fsdata;
+	if (depth == 0)
+	{
+		while (head != 0)
+		{
+			if (gxfsReadBlock(gxfs, head, buf) != 0)
+			{
+				enableDebugTerm();
+				kprintf("gxfs: failed to read a directory index block %lu: corruption likely\n", head);
+				return;
+			};
+			
+			uint64_t next = buf->dbNext;
+			gxfsFreeBlock(fs, head);
+			head = next;
+		};
+	}
+	else
+	{
+		uint64_t table[512];
+		if (gxfsReadBlock(gxfs, head, table) != 0)
+		{
+			enableDebugTerm();
+			kprintf("gxfs: failed to read a tree node %lu: corruption likely\n", head);
+			return;
+		};
+		
+		int i;
+		for (i=0; i<512; i++)
+		{
+			gxfsDirDeleteRecur(fs, depth-1, table[i], buf);
+		};
+		
+		gxfsFreeBlock(fs, head);
+	};
+};
+
+/**
+ * Delete a directory index from disk and release it.
+ */
+static void gxfsDirFreeIndex(FileSystem *fs, GXFS_Tree *index)
+{
+	GXFS_DirBlock *buf = NEW(GXFS_DirBlock);
+	gxfsDirDeleteRecur(fs, index->depth, index->head, buf);
+	kfree(buf);
+	gxfsFreeTree(index);
+};
+
+/**
+ * Read the entries of all buckets under a directory index tree into the dentry list of 'inode', adding them
+ * to the bucket fingerprints in 'prints'.
+ */
+static int gxfsDirLoadRecur(Inode *inode, uint64_t depth, uint64_t head, uint64_t *prints, uint64_t buckets,
+				GXFS_DirBlock *buf)
+{
+	if (head == 0) return 0;
+	
+	GXFS *gxfs = (GXFS*) inode->fs->fsdata;
+	if (depth == 0)
+	{
+		while (head != 0)
+		{
+			if (gxfsReadBlock(gxfs, head, buf) != 0)
+			{
+				return -1;
+			};
+			
+			if (buf->dbUsed > GXFS_DIRBLOCK_DATA)
+			{
+				kprintf("gxfs: directory index block %lu is corrupt\n", head);
+				return -1;
+			};
+			
+			uint64_t pos = 0;
+			while (pos < buf->dbUsed)
+			{
+				GXFS_DirEntry *de = (GXFS_DirEntry*) &buf->dbData[pos];
+				if ((buf->dbUsed - pos) < sizeof(GXFS_DirEntry)
+					|| de->deSize > (buf->dbUsed - pos)
+					|| de->deSize < (sizeof(GXFS_DirEntry) + de->deNameLen + 1)
+					|| (de->deSize & 7) != 0
+					|| de->deName[de->deNameLen] != 0)
+				{
+					kprintf("gxfs: directory index block %lu is corrupt\n", head);
+					return -1;
+				};
+				
+				vfsAppendDentry(inode, de->deName, de->deInode);
+				prints[gxfsDirHash(de->deName) & (buckets - 1)] += gxfsDirPrint(de->deName, de->deInode);
+				pos += de->deSize;
+			};
+			
+			head = buf->dbNext;
+		};
+	}
+	else
+	{
+		uint64_t table[512];
+		if (gxfsReadBlock(gxfs, head, table) != 0)
+		{
+			return -1;
+		};
+		
+		int i;
+		for (i=0; i<512; i++)
+		{
+			if (gxfsDirLoadRecur(inode, depth-1, table[i], prints, buckets, buf) != 0)
+			{
+				return -1;
+			};
+		};
+	};
+	
+	return 0;
+};
+
+/**
+ * Rewrite bucket 'bucket' of a directory index with the 'count' entries in 'ents', reusing the blocks already
+ * in its chain. Returns 0 on success, or an error number.
+ */
+static int gxfsDirWriteBucket(GXFS_Tree *index, uint64_t bucket, Dentry **ents, uint64_t count, GXFS_DirBlock *buf)
+{
+	FileSystem *fs = index->fs;
+	GXFS *gxfs = (GXFS*) fs->fsdata;
+	
+	// count the blocks needed
+	uint64_t needed = 1;
+	uint64_t used = 0;
+	uint64_t i;
+	for (i=0; i<count; i++)
+	{
+		uint64_t size = (sizeof(GXFS_DirEntry) + strlen(ents[i]->name) + 8) & ~7;
+		if (size > GXFS_DIRBLOCK_DATA)
+		{
+			return ENAMETOOLONG;
+		};
+		
+		if (used + size > GXFS_DIRBLOCK_DATA)
+		{
+			needed++;
+			used = 0;
+		};
+		
+		used += size;
+	};
+	
+	// collect the blocks of the current chain, and allocate any more that are needed before anything is
+	// written, so that running out of space leaves the bucket intact
+	uint64_t block;
+	if (gxfsTreeWalk(index, bucket << 12, index->depth, &block) != 0)
+	{
+		return ENOSPC;
+	};
+	
+	uint64_t *chain = (uint64_t*) kmalloc(8 * needed);
+	uint64_t numChain = 0;
+	while (block != 0 && numChain < needed)
+	{
+		chain[numChain++] = block;
+		if (gxfsReadBlock(gxfs, block, buf) != 0)
+		{
+			kfree(chain);
+			return EIO;
+		};
+		
+		block = buf->dbNext;
+	};
+	
+	uint64_t excess = block;
+	uint64_t numOld = numChain;
+	while (numChain < needed)
+	{
+		uint64_t allocated;
+		uint64_t newblock = gxfsAllocExtent(fs, chain[numChain-1] + 1, 1, &allocated);
+		if (newblock == 0)
+		{
+			while (numChain > numOld)
+			{
+				gxfsFreeBlock(fs, chain[--numChain]);
+			};
+			
+			kfree(chain);
+			return ENOSPC;
+		};
+		
+		chain[numChain++] = newblock;
+	};
+	
+	// write the entries
+	uint64_t current = 0;
+	memset(buf, 0, sizeof(GXFS_DirBlock));
+	for (i=0; i<count; i++)
+	{
+		size_t nameLen = strlen(ents[i]->name);
+		uint64_t size = (sizeof(GXFS_DirEntry) + nameLen + 8) & ~7;
+		
+		if (buf->dbUsed + size > GXFS_DIRBLOCK_DATA)
+		{
+			buf->dbNext = chain[current+1];
+			if (gxfsWriteTreeBlock(index, chain[current], buf) != 0)
+			{
+				kfree(chain);
+				return EIO;
+			};
+			
+			current++;
+			memset(buf, 0, sizeof(GXFS_DirBlock));
+		};
+		
+		// the block is zeroed, so the name is terminated
+		GXFS_DirEntry *de = (GXFS_DirEntry*) &buf->dbData[buf->dbUsed];
+		de->deInode = ents[i]->ino;
+		de->deSize = size;
+		de->deNameLen = nameLen;
+		memcpy(de->deName, ents[i]->name, nameLen);
+		buf->dbUsed += size;
+	};
+	
+	buf->dbNext = 0;
+	int status = gxfsWriteTreeBlock(index, chain[current], buf);
+	kfree(chain);
+	if (status != 0)
+	{
+		return EIO;
+	};
+	
+	// release the blocks no longer in the chain
+	while (excess != 0)
+	{
+		if (gxfsReadBlock(gxfs, excess, buf) != 0)
 		{
-			semSignal(&gxfs->lock);
-			return 0;
+			enableDebugTerm();
+			kprintf("gxfs: failed to read a directory index block %lu: corruption likely\n", excess);
+			break;
 		};
 		
-		gxfs->sbb.sbbFreeHead = *((uint64_t*)blockbuf);
-		gxfs->sbb.sbbUsedBlocks++;
-		__sync_fetch_and_add(&fs->freeBlocks, -1);
-		__sync_fetch_and_add(&fs->freeInodes, -1);
-		gxfsFlushSuperblock(gxfs);
-		semSignal(&gxfs->lock);
-		return result;
+		uint64_t next = buf->dbNext;
+		gxfsFreeBlock(fs, excess);
+		excess = next;
 	};
+	
+	return 0;
 };
 
-static void gxfsFreeBlock(FileSystem *fs, uint64_t block)
+/**
+ * Write the entries of a directory to the index 'index' with 'buckets' buckets, rewriting only the buckets whose
+ * fingerprint differs from the one in 'prints'. 'prints' is updated for each bucket written. The directory must
+ * be locked. Returns 0 on success, or an error number.
+ */
+static int gxfsDirWriteIndex(Inode *inode, GXFS_Tree *index, uint64_t buckets, uint64_t *prints)
 {
-	GXFS *gxfs = (GXFS*) fs->fsdata;
+	uint64_t *newPrints = (uint64_t*) kmalloc(8 * buckets);
+	uint64_t *ends = (uint64_t*) kmalloc(8 * buckets);
+	memset(newPrints, 0, 8 * buckets);
+	memset(ends, 0, 8 * buckets);
 	
-	semWait(&gxfs->lock);
-	char blockbuf[4096];
-	*((uint64_t*)blockbuf) = gxfs->sbb.sbbFreeHead;
-	gxfsWriteBlock(gxfs, block, blockbuf);
-	gxfs->sbb.sbbFreeHead = block;
-	gxfsFlushSuperblock(gxfs);
-	semSignal(&gxfs->lock);
+	Dentry *dent;
+	for (dent=inode->dents; dent!=NULL; dent=dent->next)
+	{
+		if (dent->ino != 0 && (dent->flags & VFS_DENTRY_TEMP) == 0)
+		{
+			uint64_t bucket = gxfsDirHash(dent->name) & (buckets - 1);
+			newPrints[bucket] += gxfsDirPrint(dent->name, dent->ino);
+			ends[bucket]++;
+		};
+	};
 	
-	__sync_fetch_and_add(&fs->freeBlocks, 1);
-	__sync_fetch_and_add(&fs->freeInodes, 1);
+	// sort the entries of the changed buckets by bucket; 'ends' becomes the start of each bucket in 'sorted',
+	// and then its end once the entries are placed
+	uint64_t total = 0;
+	uint64_t bucket;
+	for (bucket=0; bucket<buckets; bucket++)
+	{
+		uint64_t count = ends[bucket];
+		ends[bucket] = total;
+		if (newPrints[bucket] != prints[bucket]) total += count;
+	};
+	
+	Dentry **sorted = (Dentry**) kmalloc(sizeof(Dentry*) * (total + 1));
+	for (dent=inode->dents; dent!=NULL; dent=dent->next)
+	{
+		if (dent->ino != 0 && (dent->flags & VFS_DENTRY_TEMP) == 0)
+		{
+			bucket = gxfsDirHash(dent->name) & (buckets - 1);
+			if (newPrints[bucket] != prints[bucket])
+			{
+				sorted[ends[bucket]++] = dent;
+			};
+		};
+	};
+	
+	GXFS_DirBlock *buf = NEW(GXFS_DirBlock);
+	int error = 0;
+	uint64_t start = 0;
+	for (bucket=0; bucket<buckets; bucket++)
+	{
+		if (newPrints[bucket] != prints[bucket])
+		{
+			error = gxfsDirWriteBucket(index, bucket, &sorted[start], ends[bucket] - start, buf);
+			if (error != 0) break;
+			
+			prints[bucket] = newPrints[bucket];
+			start = ends[bucket];
+		};
+	};
+	
+	kfree(buf);
+	kfree(sorted);
+	kfree(ends);
+	kfree(newPrints);
+	return error;
 };
 
-static uint64_t gxfsAllocZeroBlock(FileSystem *fs)
+/**
+ * Bring the hashed index of a directory up to date with its dentries. If the directory is not indexed yet,
+ * this creates an index once it has GXFS_DIRINDEX_MIN entries; if the buckets have grown too long, the index is
+ * replaced with a larger one, and the old one is returned in '*oldOut', to be deleted once the inode no longer
+ * refers to it. The directory must be locked. Returns 0 on success, or an error number; if building a new
+ * index fails, the directory keeps the old one.
+ */
+static int gxfsDirUpdate(Inode *inode, GXFS_Tree **oldOut)
 {
-	uint64_t block = gxfsAllocBlock(fs);
-	if (block == 0) return 0;
+	GXFS *gxfs = (GXFS*) inode->fs->fsdata;
+	GXFS_Inode *idata = (GXFS_Inode*) inode->fsdata;
+	*oldOut = NULL;
 	
-	char buf[4096];
-	memset(buf, 0, 4096);
-	if (gxfsWriteBlock((GXFS*) fs->fsdata, block, buf) != 0)
+	uint64_t count = 0;
+	Dentry *dent;
+	for (dent=inode->dents; dent!=NULL; dent=dent->next)
 	{
-		gxfsFreeBlock(fs, block);
+		if (dent->ino != 0 && (dent->flags & VFS_DENTRY_TEMP) == 0)
+		{
+			count++;
+		};
+	};
+	
+	if (idata->dirIndex == NULL && (!gxfs->useDirIndex || count < GXFS_DIRINDEX_MIN))
+	{
+		// stays a list of DENT records
 		return 0;
 	};
 	
-	return block;
+	if (idata->dirIndex != NULL && count <= idata->dirBuckets * GXFS_DIRINDEX_MAXLOAD)
+	{
+		return gxfsDirWriteIndex(inode, idata->dirIndex, idata->dirBuckets, idata->dirPrints);
+	};
+	
+	uint64_t buckets = 2;
+	while (buckets * GXFS_DIRINDEX_LOAD < count) buckets <<= 1;
+	
+	GXFS_Tree *index = gxfsNewTreeData(inode->fs);
+	index->metaLeaves = 1;
+	uint64_t *prints = (uint64_t*) kmalloc(8 * buckets);
+	memset(prints, 0, 8 * buckets);
+	
+	int error = ENOSPC;
+	if (gxfsTreeGrow(index, (buckets - 1) << 12) == 0)
+	{
+		error = gxfsDirWriteIndex(inode, index, buckets, prints);
+	};
+	
+	if (error != 0)
+	{
+		gxfsDirFreeIndex(inode->fs, index);
+		kfree(prints);
+		return error;
+	};
+	
+	*oldOut = idata->dirIndex;
+	kfree(idata->dirPrints);
+	idata->dirIndex = index;
+	idata->dirBuckets = buckets;
+	idata->dirPrints = prints;
+	return 0;
 };
 
 typedef struct
@@ -247,10 +1586,11 @@ static void gxfsWriteInodeRecord(InodeWriter *writer, const void *buffer, size_t
 	};
 };
 
-static int gxfsFlushInode(Inode *inode)
+/**
+ * Write the records of an inode. Returns 0 on success, or an error number.
+ */
+static int gxfsWriteInodeRecords(Inode *inode)
 {
-	if (inode->fs->flags & VFS_ST_RDONLY) return 0;
-	
 	GXFS_Inode *idata = (GXFS_Inode*) inode->fsdata;
 	InodeWriter writer;
 	writer.fs = inode->fs;
@@ -315,37 +1655,107 @@ static int gxfsFlushInode(Inode *inode)
 		kfree(buffer);
 	};
 	
-	// DENT records
-	Dentry *dent;
-	for (dent=inode->dents; dent!=NULL; dent=dent->next)
+	// DIDX record if the directory is indexed, otherwise DENT records
+	GXFS_Tree *oldIndex = NULL;
+	int dirError = 0;
+	if ((inode->mode & VFS_MODE_TYPEMASK) == VFS_MODE_DIRECTORY)
 	{
-		if (dent->ino != 0 && (dent->flags & VFS_DENTRY_TEMP) == 0)
+		dirError = gxfsDirUpdate(inode, &oldIndex);
+	};
+	
+	if (idata->dirIndex != NULL)
+	{
+		GXFS_DirIndexRecord di;
+		di.diType = GXFS_RT("DIDX");
+		di.diSize = sizeof(GXFS_DirIndexRecord);
+		di.diBuckets = idata->dirBuckets;
+		di.diDepth = idata->dirIndex->depth;
+		di.diHead = idata->dirIndex->head;
+		gxfsWriteInodeRecord(&writer, &di, di.diSize);
+	}
+	else
+	{
+		Dentry *dent;
+		for (dent=inode->dents; dent!=NULL; dent=dent->next)
 		{
-			size_t recsize = (sizeof(GXFS_DentRecord) + strlen(dent->name) + 7) & ~7;
-			GXFS_DentRecord *dr = (GXFS_DentRecord*) kmalloc(recsize);
-			memset(dr, 0, recsize);
-		
-			dr->drType = GXFS_RT("DENT");
-			dr->drRecordSize = recsize;
-			dr->drInode = dent->ino;
-			dr->drInoType = 0xFF;		// "unknown"
-			memcpy(dr->drName, dent->name, strlen(dent->name));
+			if (dent->ino != 0 && (dent->flags & VFS_DENTRY_TEMP) == 0)
+			{
+				size_t recsize = (sizeof(GXFS_DentRecord) + strlen(dent->name) + 7) & ~7;
+				GXFS_DentRecord *dr = (GXFS_DentRecord*) kmalloc(recsize);
+				memset(dr, 0, recsize);
 			
-			gxfsWriteInodeRecord(&writer, dr, recsize);
-			kfree(dr);
+				dr->drType = GXFS_RT("DENT");
+				dr->drRecordSize = recsize;
+				dr->drInode = dent->ino;
+				dr->drInoType = 0xFF;		// "unknown"
+				memcpy(dr->drName, dent->name, strlen(dent->name));
+				
+				gxfsWriteInodeRecord(&writer, dr, recsize);
+				kfree(dr);
+			};
 		};
 	};
 	
-	// TREE record if needed
+	// TREE or EXTS record if needed
+	int extError = 0;
+	uint64_t *stale = NULL;
+	uint64_t numStale = 0;
+	GXFS_Extent *freed = NULL;
+	uint64_t numFreed = 0;
 	if (inode->ft != NULL)
 	{
 		GXFS_Tree *tree = (GXFS_Tree*) inode->ft->data;
-		GXFS_TreeRecord tr;
-		tr.trType = GXFS_RT("TREE");
-		tr.trSize = sizeof(GXFS_TreeRecord);
-		tr.trDepth = tree->depth;
-		tr.trHead = tree->head;
-		gxfsWriteInodeRecord(&writer, &tr, tr.trSize);
+		if (tree->useExtents)
+		{
+			GXFS_ExtentRecord xr;
+			memset(&xr, 0, sizeof(GXFS_ExtentRecord));
+			xr.xrType = GXFS_RT("EXTS");
+			xr.xrSize = sizeof(GXFS_ExtentRecord);
+			
+			// the extents only change with the tree locked
+			semWait(&inode->ft->lock);
+			if (tree->extDirty)
+			{
+				uint64_t depth, root;
+				if (gxfsExtWriteTree(tree, &depth, &root, &stale, &numStale) == 0)
+				{
+					tree->extDepth = depth;
+					tree->extRoot = root;
+					tree->extDirty = 0;
+					
+					// blocks truncated away so far are no longer in the map being written
+					freed = tree->extFreed;
+					numFreed = tree->numExtFreed;
+					tree->extFreed = NULL;
+					tree->numExtFreed = 0;
+				}
+				else
+				{
+					extError = 1;
+				};
+			};
+			
+			xr.xrDepth = tree->extDepth;
+			xr.xrRoot = tree->extRoot;
+			if (tree->extDepth == 0)
+			{
+				xr.xrCount = tree->numExtents;
+				if (xr.xrCount > GXFS_INLINE_EXTENTS) xr.xrCount = GXFS_INLINE_EXTENTS;
+				memcpy(xr.xrExtents, tree->extents, sizeof(GXFS_Extent) * xr.xrCount);
+			};
+			semSignal(&inode->ft->lock);
+			
+			gxfsWriteInodeRecord(&writer, &xr, xr.xrSize);
+		}
+		else
+		{
+			GXFS_TreeRecord tr;
+			tr.trType = GXFS_RT("TREE");
+			tr.trSize = sizeof(GXFS_TreeRecord);
+			tr.trDepth = tree->depth;
+			tr.trHead = tree->head;
+			gxfsWriteInodeRecord(&writer, &tr, tr.trSize);
+		};
 	};
 	
 	// free remaining unused blocks
@@ -361,14 +1771,108 @@ static int gxfsFlushInode(Inode *inode)
 	kfree(idata->blocks);
 	idata->blocks = writer.outBlocks;
 	
+	// the inode now refers to the new extent tree and directory index, if they were rebuilt
+	uint64_t i;
+	for (i=0; i<numStale; i++)
+	{
+		gxfsFreeBlock(inode->fs, stale[i]);
+	};
+	kfree(stale);
+	
+	for (i=0; i<numFreed; i++)
+	{
+		gxfsFreeExtent(inode->fs, freed[i].exPhysical, freed[i].exLength);
+	};
+	kfree(freed);
+	
+	if (oldIndex != NULL)
+	{
+		gxfsDirFreeIndex(inode->fs, oldIndex);
+	};
+	
+	if (extError)
+	{
+		return ENOSPC;
+	};
+	
+	return dirError;
+};
+
+static int gxfsFlushInode(Inode *inode)
+{
+	if (inode->fs->flags & VFS_ST_RDONLY) return 0;
+	
+	// the records only need rewriting if the inode, or the mapping of its data, changed since they were
+	// last written
+	GXFS_Inode *idata = (GXFS_Inode*) inode->fsdata;
+	int dirty = __sync_fetch_and_and(&inode->flags, ~VFS_INODE_DIRTY) & VFS_INODE_DIRTY;
+	if (inode->ft != NULL)
+	{
+		GXFS_Tree *tree = (GXFS_Tree*) inode->ft->data;
+		if (tree->useExtents) dirty |= tree->extDirty;
+		else dirty |= __sync_fetch_and_and(&tree->headDirty, 0);
+	};
+	
+	int recError = 0;
+	if (dirty)
+	{
+		recError = gxfsWriteInodeRecords(inode);
+		if (recError != 0) vfsDirtyInode(inode);
+	};
+	
+	// commit only the metadata this file depends on: blocks freed or zeroed by the allocator, the
+	// file's tree index or directory index, its inode blocks, and finally the superblock
+	GXFS *gxfs = (GXFS*) inode->fs->fsdata;
+	int error = gxfsDirtySync(gxfs, &gxfs->allocDirty);
+	if (error == 0 && inode->ft != NULL)
+	{
+		error = gxfsDirtySync(gxfs, &((GXFS_Tree*) inode->ft->data)->dirty);
+	};
+	
+	if (error == 0 && idata->dirIndex != NULL)
+	{
+		error = gxfsDirtySync(gxfs, &idata->dirIndex->dirty);
+	};
+	
+	uint64_t *iter;
+	for (iter=idata->blocks; error == 0 && *iter!=0; iter++)
+	{
+		error = sdSyncRange(gxfs->fp, 0x200000 + ((*iter) << 12), 4096);
+	};
+	
+	if (error == 0)
+	{
+		error = sdSyncRange(gxfs->fp, GXFS_SBB_OFFSET, sizeof(GXFS_SuperblockBody));
+	};
+	
+	if (error == 0)
+	{
+		error = recError;
+	};
+	
+	if (error != 0)
+	{
+		ERRNO = error;
+		return -1;
+	};
+	
 	return 0;
 };
 
 static void gxfsFreeInode(Inode *inode)
 {
 	GXFS_Inode *idata = (GXFS_Inode*) inode->fsdata;
+	if (idata->dirIndex != NULL) gxfsFreeTree(idata->dirIndex);
+	kfree(idata->dirPrints);
 	kfree(idata->blocks);
 	kfree(idata);
+	
+	// the tree has already been uncached, so nothing calls into it anymore
+	if (inode->ft != NULL)
+	{
+		gxfsFreeTree((GXFS_Tree*) inode->ft->data);
+		inode->ft->data = NULL;
+	};
 };
 
 static void gxfsDeleteTreeRecur(FileSystem *fs, uint64_t depth, uint64_t head)
@@ -407,10 +1911,38 @@ static void gxfsDropInode(Inode *inode)
 		*iter = 0;
 	};
 	
+	if (idata->dirIndex != NULL)
+	{
+		gxfsDirFreeIndex(inode->fs, idata->dirIndex);
+		idata->dirIndex = NULL;
+	};
+	
 	if (inode->ft != NULL)
 	{
 		GXFS_Tree *data = (GXFS_Tree*) inode->ft->data;
-		gxfsDeleteTreeRecur(inode->fs, data->depth, data->head);
+		if (data->useExtents)
+		{
+			uint64_t i;
+			for (i=0; i<data->numExtents; i++)
+			{
+				gxfsFreeExtent(inode->fs, data->extents[i].exPhysical, data->extents[i].exLength);
+			};
+			
+			for (i=0; i<data->numExtFreed; i++)
+			{
+				gxfsFreeExtent(inode->fs, data->extFreed[i].exPhysical, data->extFreed[i].exLength);
+			};
+			
+			gxfsExtFreeTree(inode->fs, data->extDepth, data->extRoot);
+		}
+		else
+		{
+			gxfsDeleteTreeRecur(inode->fs, data->depth, data->head);
+		};
+		
+		// the tree is released once we return, and has already been uncached
+		gxfsFreeTree(data);
+		inode->ft->data = NULL;
 	};
 };
 
@@ -425,80 +1957,127 @@ static int gxfsTreeLoad(FileTree *ft, off_t pos, void *buffer)
 {
 	GXFS_Tree *data = (GXFS_Tree*) ft->data;
 	
-	uint64_t sizeLimit = (1UL << 57) - 1;
-	if (pos > sizeLimit)
+	// get to the data block
+	uint64_t datablock;
+	if (gxfsTreeGrow(data, pos) != 0 || gxfsTreeWalk(data, pos, data->depth, &datablock) != 0)
 	{
 		return -1;
 	};
 	
-	while (pos >= (1UL << (12 + 9 * data->depth)))
+	// finally, load the data
+	if (gxfsReadDataBlock((GXFS*) data->fs->fsdata, datablock, buffer) != 0)
 	{
-		// we must increase the depth
-		uint64_t indirect = gxfsAllocBlock(data->fs);
-		if (indirect == 0) return -1;
-		
-		uint64_t table[512];
-		memset(table, 0, 4096);
-		table[0] = data->head;
-		
-		if (gxfsWriteBlock((GXFS*) data->fs->fsdata, indirect, table) != 0)
-		{
-			gxfsFreeBlock(data->fs, indirect);
-			return -1;
-		};
-		
-		data->head = indirect;
-		data->depth++;
+		return -1;
 	};
 	
-	uint64_t lvl[5];
-	lvl[4] = (pos >> 12) & 0x1FF;
-	lvl[3] = (pos >> 21) & 0x1FF;
-	lvl[2] = (pos >> 30) & 0x1FF;
-	lvl[1] = (pos >> 39) & 0x1FF;
-	lvl[0] = (pos >> 48) & 0x1FF;
+	return 0;
+};
+
+static int gxfsTreeLoadRange(FileTree *ft, off_t pos, const uint64_t *frames, int count)
+{
+	GXFS_Tree *data = (GXFS_Tree*) ft->data;
 	
-	// get to the data block
-	uint64_t datablock = data->head;
-	int i;
-	for (i=(5-data->depth); i<5; i++)
+	if (gxfsTreeGrow(data, pos) != 0)
 	{
-		uint64_t table[512];
-		if (gxfsReadBlock((GXFS*) data->fs->fsdata, datablock, table) != 0)
+		return -1;
+	};
+	
+	if (data->depth == 0)
+	{
+		// the head is the only data block
+		if (gxfsTreeLoad(ft, pos, FRAME_TO_VIRT(frames[0])) != 0) return -1;
+		return 1;
+	};
+	
+	// find the bottom-level table, then load pages from it until we reach the end of the table
+	GXFS *gxfs = (GXFS*) data->fs->fsdata;
+	uint64_t tableBlock;
+	uint64_t table[512];
+	if (gxfsTreeWalk(data, pos, data->depth-1, &tableBlock) != 0
+		|| gxfsReadLeaf(data, pos >> 21, tableBlock, table) != 0)
+	{
+		return -1;
+	};
+	
+	uint64_t first = (pos >> 12) & 0x1FF;
+	if ((uint64_t) count > 512-first) count = (int) (512-first);
+	
+	// blocks allocated below are zeroed on disk from the (still zeroed) frames, and need not be read back
+	uint8_t fresh[512];
+	memset(fresh, 0, count);
+	
+	int dirty = 0;
+	int mapped = 0;
+	while (mapped < count)
+	{
+		if (table[first+mapped] != 0)
 		{
-			return -1;
+			mapped++;
+			continue;
 		};
 		
-		if (table[lvl[i]] == 0)
+		// allocate each run of missing blocks as a single extent, following on from the previous block
+		int missing = 1;
+		while ((mapped+missing) < count && table[first+mapped+missing] == 0) missing++;
+		
+		uint64_t hint = tableBlock + 1;
+		if ((first+mapped) != 0 && table[first+mapped-1] != 0) hint = table[first+mapped-1] + 1;
+		
+		// data blocks bypass the block cache, so they are cleared with a direct write, and are not put on
+		// the tree's dirty list
+		uint64_t got;
+		uint64_t block = gxfsAllocExtent(data->fs, hint, missing, &got);
+		if (block == 0) break;
+		
+		uint64_t i;
+		if (gxfsWriteDataFrames(gxfs, block, &frames[mapped], (int) got) != 0)
 		{
-			uint64_t newblock = gxfsAllocZeroBlock(data->fs);
-			if (newblock == 0)
+			for (i=0; i<got; i++)
 			{
-				return -1;
+				gxfsFreeBlock(data->fs, block + i);
 			};
 			
-			table[lvl[i]] = newblock;
-			if (gxfsWriteBlock((GXFS*) data->fs->fsdata, datablock, table) != 0)
-			{
-				gxfsFreeBlock(data->fs, newblock);
-				return -1;
-			};
-
-			datablock = newblock;
-		}
-		else
+			break;
+		};
+		
+		for (i=0; i<got; i++)
 		{
-			datablock = table[lvl[i]];
+			table[first+mapped+i] = block + i;
+			fresh[mapped+i] = 1;
+		};
+		
+		mapped += got;
+		dirty = 1;
+	};
+	
+	if (dirty)
+	{
+		if (gxfsWriteTreeBlock(data, tableBlock, table) != 0)
+		{
+			return -1;
 		};
 	};
 	
-	// finally, load the data
-	if (gxfsReadBlock((GXFS*) data->fs->fsdata, datablock, buffer) != 0)
+	// read each run of blocks which are consecutive on disk with a single transfer
+	int loaded = 0;
+	while (loaded < mapped)
 	{
-		return -1;
+		if (fresh[loaded])
+		{
+			loaded++;
+			continue;
+		};
+		
+		int run = 1;
+		while ((loaded+run) < mapped && !fresh[loaded+run]
+			&& table[first+loaded+run] == (table[first+loaded]+run)) run++;
+		
+		if (gxfsReadDataFrames(gxfs, table[first+loaded], &frames[loaded], run) != 0) break;
+		loaded += run;
 	};
 	
-	return 0;
+	if (loaded == 0) return -1;
+	return loaded;
 };
 
 static int gxfsTreeFlush(FileTree *ft, off_t pos, const void *buffer)
@@ -529,11 +2108,28 @@ static int gxfsTreeFlush(FileTree *ft, off_t pos, const void *buffer)
 	
 	// get to the data block
 	uint64_t datablock = data->head;
-	int i;
-	for (i=(5-data->depth); i<5; i++)
+	uint64_t leafBlock, entry;
+	int i = 5 - data->depth;
+	if (data->depth != 0 && gxfsLookupLeaf(data, pos, &leafBlock, &entry) && entry != 0)
+	{
+		datablock = entry;
+		i = 5;
+	};
+	
+	for (; i<5; i++)
 	{
 		uint64_t table[512];
-		if (gxfsReadBlock((GXFS*) data->fs->fsdata, datablock, table) != 0)
+		int status;
+		if (i == 4)
+		{
+			status = gxfsReadLeaf(data, pos >> 21, datablock, table);
+		}
+		else
+		{
+			status = gxfsReadBlock((GXFS*) data->fs->fsdata, datablock, table);
+		};
+		
+		if (status != 0)
 		{
 			return -1;
 		};
@@ -549,7 +2145,7 @@ static int gxfsTreeFlush(FileTree *ft, off_t pos, const void *buffer)
 	};
 	
 	// write the data
-	if (gxfsWriteBlock((GXFS*) data->fs->fsdata, datablock, buffer) != 0)
+	if (gxfsWriteDataBlock((GXFS*) data->fs->fsdata, datablock, buffer) != 0)
 	{
 		return -1;
 	};
@@ -557,13 +2153,75 @@ static int gxfsTreeFlush(FileTree *ft, off_t pos, const void *buffer)
 	return 0;
 };	
 
-static void gxfsTruncateRecur(FileSystem *fs, uint64_t depth, uint64_t head, uint64_t base, uint64_t maxpage)
+static int gxfsTreeFlushRange(FileTree *ft, off_t pos, const uint64_t *frames, int count)
+{
+	GXFS_Tree *data = (GXFS_Tree*) ft->data;
+	if (data->fs->flags & VFS_ST_RDONLY)
+	{
+		return 0;
+	};
+	
+	if (data->depth == 0)
+	{
+		// a single page
+		return gxfsTreeFlush(ft, pos, FRAME_TO_VIRT(frames[0]));
+	};
+	
+	GXFS *gxfs = (GXFS*) data->fs->fsdata;
+	while (count > 0)
+	{
+		if (pos >= (1UL << (12 + 9 * data->depth)))
+		{
+			panic("tree inconsistent: offset out of bounds");
+		};
+		
+		uint64_t tableBlock;
+		uint64_t table[512];
+		if (gxfsTreeWalk(data, pos, data->depth-1, &tableBlock) != 0
+			|| gxfsReadLeaf(data, pos >> 21, tableBlock, table) != 0)
+		{
+			return -1;
+		};
+		
+		uint64_t first = (pos >> 12) & 0x1FF;
+		int chunk = count;
+		if ((uint64_t) chunk > 512-first) chunk = (int) (512-first);
+		
+		// write each run of blocks which are consecutive on disk with a single transfer
+		int done = 0;
+		while (done < chunk)
+		{
+			if (table[first+done] == 0)
+			{
+				panic("tree inconsistent: flushing non-allocated block");
+			};
+			
+			int run = 1;
+			while ((done+run) < chunk && table[first+done+run] == (table[first+done]+run)) run++;
+			
+			if (gxfsWriteDataFrames(gxfs, table[first+done], &frames[done], run) != 0)
+			{
+				return -1;
+			};
+			
+			done += run;
+		};
+		
+		pos += (off_t) chunk << 12;
+		frames += chunk;
+		count -= chunk;
+	};
+	
+	return 0;
+};
+
+static void gxfsTruncateRecur(GXFS_Tree *data, uint64_t depth, uint64_t head, uint64_t base, uint64_t maxpage)
 {
 	if (depth == 0) return;			// cannot free if there is only a single block in the tree
 	
 	uint64_t table[512];
 	int dirty = 0;
-	if (gxfsReadBlock((GXFS*) fs->fsdata, head, table) != 0)
+	if (gxfsReadBlock((GXFS*) data->fs->fsdata, head, table) != 0)
 	{
 		kprintf("gxfs: WARNING: failed to read a tree block; filesystem probably corrupt\n");
 		return;
@@ -579,21 +2237,21 @@ static void gxfsTruncateRecur(FileSystem *fs, uint64_t depth, uint64_t head, uin
 			{
 				if (dest >= maxpage)
 				{
-					gxfsFreeBlock(fs, table[i]);
+					gxfsFreeBlock(data->fs, table[i]);
 					table[i] = 0;
 					dirty = 1;
 				};
 			}
 			else
 			{
-				gxfsTruncateRecur(fs, depth-1, table[i], dest, maxpage);
+				gxfsTruncateRecur(data, depth-1, table[i], dest, maxpage);
 			};
 		};
 	};
 	
 	if (dirty)
 	{
-		if (gxfsWriteBlock((GXFS*) fs->fsdata, head, table) != 0)
+		if (gxfsWriteTreeBlock(data, head, table) != 0)
 		{
 			kprintf("gxfs: WARNING: failed to write a tree block; filesystem probably corrupt\n");
 			return;
@@ -606,18 +2264,303 @@ static void gxfsTreeUpdate(FileTree *ft)
 	GXFS_Tree *data = (GXFS_Tree*) ft->data;
 	
 	// free all blocks that are further than the new file size
-	gxfsTruncateRecur(data->fs, data->depth, data->head, 0, (ft->size >> 12) + (!!(ft->size & 0xFFF)));
+	gxfsTruncateRecur(data, data->depth, data->head, 0, (ft->size >> 12) + (!!(ft->size & 0xFFF)));
 };
 
-static FileTree* gxfsTree(FileSystem *fs, uint64_t depth, uint64_t head, size_t size, uint32_t iflags)
+/**
+ * Find the extent which maps 'page', or else the first one after it. Returns its index, which is 'numExtents' if
+ * there is no such extent. Call with 'extLock' held.
+ */
+static uint64_t gxfsExtSearch(GXFS_Tree *data, uint64_t page)
 {
-	GXFS_Tree *data = NEW(GXFS_Tree);
-	data->fs = fs;
-	data->depth = depth;
-	data->head = head;
+	uint64_t lo = 0;
+	uint64_t hi = data->numExtents;
+	while (lo < hi)
+	{
+		uint64_t mid = (lo + hi) / 2;
+		GXFS_Extent *ex = &data->extents[mid];
+		if ((ex->exLogical + ex->exLength) <= page)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		};
+	};
+	
+	return lo;
+};
+
+/**
+ * Map the page 'page' of an extent-mapped file. If it is mapped, return its block, with the number of pages from
+ * there on (at most 'max') which are consecutive on disk in '*runOut'. Otherwise, return 0, with the number of
+ * unmapped pages from there on (at most 'max') in '*runOut', and the block which would continue the previous
+ * extent (0 if none) in '*hintOut', if not NULL.
+ */
+static uint64_t gxfsExtMap(GXFS_Tree *data, uint64_t page, uint64_t max, uint64_t *runOut, uint64_t *hintOut)
+{
+	uint64_t block = 0;
+	uint64_t run = max;
+	uint64_t hint = 0;
+	
+	semWait(&data->extLock);
+	uint64_t index = gxfsExtSearch(data, page);
+	if (index != data->numExtents)
+	{
+		GXFS_Extent *ex = &data->extents[index];
+		if (ex->exLogical <= page)
+		{
+			block = ex->exPhysical + (page - ex->exLogical);
+			run = ex->exLogical + ex->exLength - page;
+		}
+		else
+		{
+			run = ex->exLogical - page;
+		};
+	};
+	
+	if (index != 0)
+	{
+		GXFS_Extent *prev = &data->extents[index-1];
+		hint = prev->exPhysical + (page - prev->exLogical);
+	};
+	semSignal(&data->extLock);
+	
+	if (run > max) run = max;
+	*runOut = run;
+	if (hintOut != NULL) *hintOut = hint;
+	return block;
+};
+
+/**
+ * Make room for at least one more extent. Call with the file tree locked, but not 'extLock'.
+ */
+static void gxfsExtReserve(GXFS_Tree *data)
+{
+	if (data->numExtents < data->maxExtents) return;
+	
+	// allocate outside the lock; freeing pages may call back into this tree
+	uint64_t newMax = data->maxExtents * 2;
+	if (newMax == 0) newMax = GXFS_INLINE_EXTENTS;
+	GXFS_Extent *newList = (GXFS_Extent*) kmalloc(sizeof(GXFS_Extent) * newMax);
+	
+	semWait(&data->extLock);
+	GXFS_Extent *oldList = data->extents;
+	memcpy(newList, oldList, sizeof(GXFS_Extent) * data->numExtents);
+	data->extents = newList;
+	data->maxExtents = newMax;
+	semSignal(&data->extLock);
+	
+	kfree(oldList);
+};
+
+/**
+ * Map 'count' pages starting at 'page', which are not mapped yet, to the blocks starting at 'block', merging with
+ * the neighbouring extents where possible. Call with the file tree locked, after gxfsExtReserve().
+ */
+static void gxfsExtInsert(GXFS_Tree *data, uint64_t page, uint64_t block, uint64_t count)
+{
+	semWait(&data->extLock);
+	uint64_t index = gxfsExtSearch(data, page);
+	GXFS_Extent *prev = NULL;
+	GXFS_Extent *next = NULL;
+	if (index != 0) prev = &data->extents[index-1];
+	if (index != data->numExtents) next = &data->extents[index];
+	
+	int joinPrev = (prev != NULL && (prev->exLogical + prev->exLength) == page
+			&& (prev->exPhysical + prev->exLength) == block);
+	int joinNext = (next != NULL && (page + count) == next->exLogical && (block + count) == next->exPhysical);
+	
+	// everything from the first extent changed on moves or changes
+	uint64_t changed = joinPrev ? index-1 : index;
+	if (changed < data->extClean) data->extClean = changed;
+	
+	uint64_t i;
+	if (joinPrev)
+	{
+		prev->exLength += count;
+		if (joinNext)
+		{
+			prev->exLength += next->exLength;
+			for (i=index; i<data->numExtents-1; i++)
+			{
+				data->extents[i] = data->extents[i+1];
+			};
+			
+			data->numExtents--;
+		};
+	}
+	else if (joinNext)
+	{
+		next->exLogical = page;
+		next->exPhysical = block;
+		next->exLength += count;
+	}
+	else
+	{
+		for (i=data->numExtents; i>index; i--)
+		{
+			data->extents[i] = data->extents[i-1];
+		};
+		
+		data->extents[index].exLogical = page;
+		data->extents[index].exPhysical = block;
+		data->extents[index].exLength = count;
+		data->numExtents++;
+	};
+	
+	data->extDirty = 1;
+	semSignal(&data->extLock);
+};
+
+static int gxfsExtLoadRange(FileTree *ft, off_t pos, const uint64_t *frames, int count)
+{
+	GXFS_Tree *data = (GXFS_Tree*) ft->data;
+	GXFS *gxfs = (GXFS*) data->fs->fsdata;
+	uint64_t page = pos >> 12;
+	
+	int loaded = 0;
+	while (loaded < count)
+	{
+		uint64_t run, hint;
+		uint64_t block = gxfsExtMap(data, page + loaded, count - loaded, &run, &hint);
+		if (block != 0)
+		{
+			if (gxfsReadDataFrames(gxfs, block, &frames[loaded], (int) run) != 0) break;
+		}
+		else if ((data->fs->flags & VFS_ST_RDONLY) == 0)
+		{
+			// allocate the hole as a single extent, continuing the previous one on disk if possible;
+			// the frames are already zeroed, so the new pages are marked dirty instead of being read
+			gxfsExtReserve(data);
+			block = gxfsAllocExtent(data->fs, hint, run, &run);
+			if (block == 0) break;
+			gxfsExtInsert(data, page + loaded, block, run);
+			
+			uint64_t i;
+			for (i=0; i<run; i++)
+			{
+				piMarkDirty(frames[loaded+i]);
+			};
+		};
+		
+		loaded += (int) run;
+	};
+	
+	if (loaded == 0) return -1;
+	return loaded;
+};
+
+static int gxfsExtFlush(FileTree *ft, off_t pos, const void *buffer)
+{
+	GXFS_Tree *data = (GXFS_Tree*) ft->data;
+	if (data->fs->flags & VFS_ST_RDONLY)
+	{
+		return 0;
+	};
+	
+	uint64_t run;
+	uint64_t block = gxfsExtMap(data, pos >> 12, 1, &run, NULL);
+	if (block == 0)
+	{
+		kprintf("gxfs: extent map inconsistent: flushing non-allocated page at offset 0x%lx\n", (uint64_t) pos);
+		ERRNO = EIO;
+		return -1;
+	};
+	
+	return gxfsWriteDataBlock((GXFS*) data->fs->fsdata, block, buffer);
+};
+
+static int gxfsExtFlushRange(FileTree *ft, off_t pos, const uint64_t *frames, int count)
+{
+	GXFS_Tree *data = (GXFS_Tree*) ft->data;
+	if (data->fs->flags & VFS_ST_RDONLY)
+	{
+		return 0;
+	};
+	
+	while (count > 0)
+	{
+		uint64_t run;
+		uint64_t block = gxfsExtMap(data, pos >> 12, count, &run, NULL);
+		if (block == 0)
+		{
+			kprintf("gxfs: extent map inconsistent: flushing non-allocated page at offset 0x%lx\n", (uint64_t) pos);
+			ERRNO = EIO;
+			return -1;
+		};
+		
+		if (gxfsWriteDataFrames((GXFS*) data->fs->fsdata, block, frames, (int) run) != 0)
+		{
+			return -1;
+		};
+		
+		pos += (off_t) run << 12;
+		frames += run;
+		count -= (int) run;
+	};
 	
+	return 0;
+};
+
+/**
+ * Queue the blocks [first, first+count) to be freed once the EXTS record no longer refers to them.
+ * Call with 'extLock' held.
+ */
+static void gxfsExtQueueFree(GXFS_Tree *data, uint64_t first, uint64_t count)
+{
+	data->extFreed = (GXFS_Extent*) krealloc(data->extFreed, sizeof(GXFS_Extent) * (data->numExtFreed+1));
+	GXFS_Extent *ex = &data->extFreed[data->numExtFreed++];
+	ex->exLogical = 0;
+	ex->exPhysical = first;
+	ex->exLength = count;
+};
+
+static void gxfsExtUpdate(FileTree *ft)
+{
+	GXFS_Tree *data = (GXFS_Tree*) ft->data;
+	uint64_t maxpage = (ft->size >> 12) + (!!(ft->size & 0xFFF));
+	
+	// cut the list at the new end of the file
+	semWait(&data->extLock);
+	uint64_t oldCount = data->numExtents;
+	uint64_t index = gxfsExtSearch(data, maxpage);
+	if (index != oldCount && data->extents[index].exLogical < maxpage)
+	{
+		GXFS_Extent *ex = &data->extents[index];
+		uint64_t keep = maxpage - ex->exLogical;
+		if (keep != ex->exLength)
+		{
+			gxfsExtQueueFree(data, ex->exPhysical + keep, ex->exLength - keep);
+			ex->exLength = keep;
+			data->extDirty = 1;
+			if (index < data->extClean) data->extClean = index;
+		};
+		
+		index++;
+	};
+	
+	// the on-disk map still refers to the removed extents, so they are only freed once it is rewritten
+	uint64_t i;
+	for (i=index; i<oldCount; i++)
+	{
+		gxfsExtQueueFree(data, data->extents[i].exPhysical, data->extents[i].exLength);
+	};
+	
+	data->numExtents = index;
+	if (index != oldCount) data->extDirty = 1;
+	if (index < data->extClean) data->extClean = index;
+	semSignal(&data->extLock);
+};
+
+/**
+ * Create the file tree for 'data', mapped by a block tree or by extents as 'data' says.
+ */
+static FileTree* gxfsMakeFileTree(GXFS_Tree *data, size_t size, uint32_t iflags)
+{
 	int treeFlags = 0;
-	if (fs->flags & VFS_ST_RDONLY)
+	if (data->fs->flags & VFS_ST_RDONLY)
 	{
 		treeFlags = FT_READONLY;
 	};
@@ -630,14 +2573,34 @@ static FileTree* gxfsTree(FileSystem *fs, uint64_t depth, uint64_t head, size_t
 	FileTree *ft = ftCreate(treeFlags);
 	ft->size = size;
 	ft->data = data;
-	ft->load = gxfsTreeLoad;
-	ft->flush = gxfsTreeFlush;
-	ft->update = gxfsTreeUpdate;
+	if (data->useExtents)
+	{
+		ft->loadRange = gxfsExtLoadRange;
+		ft->flush = gxfsExtFlush;
+		ft->flushRange = gxfsExtFlushRange;
+		ft->update = gxfsExtUpdate;
+	}
+	else
+	{
+		ft->load = gxfsTreeLoad;
+		ft->loadRange = gxfsTreeLoadRange;
+		ft->flush = gxfsTreeFlush;
+		ft->flushRange = gxfsTreeFlushRange;
+		ft->update = gxfsTreeUpdate;
+	};
 	ftDown(ft);
 	
 	return ft;
 };
 
+static FileTree* gxfsTree(FileSystem *fs, uint64_t depth, uint64_t head, size_t size, uint32_t iflags)
+{
+	GXFS_Tree *data = gxfsNewTreeData(fs);
+	data->depth = depth;
+	data->head = head;
+	return gxfsMakeFileTree(data, size, iflags);
+};
+
 static int gxfsRegInode(FileSystem *fs, Inode *inode)
 {
 	uint64_t num = gxfsAllocBlock(fs);
@@ -649,10 +2612,18 @@ static int gxfsRegInode(FileSystem *fs, Inode *inode)
 	
 	inode->ino = num;
 	
-	if ((inode->mode & VFS_MODE_TYPEMASK) == 0)
+	if ((inode->mode & VFS_MODE_TYPEMASK) == 0 && ((GXFS*) fs->fsdata)->useExtents)
+	{
+		// regular file mapped by extents; nothing is allocated until it is written
+		GXFS_Tree *data = gxfsNewTreeData(fs);
+		data->useExtents = 1;
+		data->extDirty = 1;
+		inode->ft = gxfsMakeFileTree(data, 0, 0);
+	}
+	else if ((inode->mode & VFS_MODE_TYPEMASK) == 0)
 	{
 		// regular file needs a tree
-		uint64_t head = gxfsAllocZeroBlock(fs);
+		uint64_t head = gxfsAllocDataBlock(fs, num + 1);
 		if (head == 0)
 		{
 			gxfsFreeBlock(fs, num);
@@ -667,6 +2638,9 @@ static int gxfsRegInode(FileSystem *fs, Inode *inode)
 	idata->blocks = (uint64_t*) kmalloc(16);
 	idata->blocks[0] = num;
 	idata->blocks[1] = 0;
+	idata->dirIndex = NULL;
+	idata->dirBuckets = 0;
+	idata->dirPrints = NULL;
 	
 	inode->fsdata = idata;
 	gxfsSetInodeCallbacks(inode);
@@ -697,6 +2671,10 @@ static int gxfsLoadInode(FileSystem *fs, Inode *inode)
 	size_t numBlocks = 1;
 	blocks[0] = inode->ino;
 	
+	GXFS_Tree *dirIndex = NULL;
+	uint64_t dirBuckets = 0;
+	uint64_t *dirPrints = NULL;
+	
 	while (1)
 	{
 		if (readpos == 4096)
@@ -839,6 +2817,49 @@ static int gxfsLoadInode(FileSystem *fs, Inode *inode)
 			GXFS_DentRecord *dr = (GXFS_DentRecord*) buffer;
 			vfsAppendDentry(inode, dr->drName, dr->drInode);
 		}
+		else if (rh->rhType == GXFS_RT("DIDX"))
+		{
+			if (!foundAttr)
+			{
+				kfree(buffer);
+				kfree(blocks);
+				kprintf("gxfs: encountered a DIDX record before an ATTR record\n");
+				return -1;
+			};
+			
+			GXFS_DirIndexRecord *di = (GXFS_DirIndexRecord*) buffer;
+			if (di->diSize != sizeof(GXFS_DirIndexRecord) || dirIndex != NULL
+				|| di->diBuckets < 2 || (di->diBuckets & (di->diBuckets - 1)) != 0
+				|| di->diDepth == 0 || di->diDepth > 5 || di->diBuckets > (1UL << (9 * di->diDepth)))
+			{
+				kfree(buffer);
+				kfree(blocks);
+				kprintf("gxfs: encountered an invalid DIDX record\n");
+				return -1;
+			};
+			
+			dirIndex = gxfsNewTreeData(fs);
+			dirIndex->metaLeaves = 1;
+			dirIndex->depth = di->diDepth;
+			dirIndex->head = di->diHead;
+			dirBuckets = di->diBuckets;
+			dirPrints = (uint64_t*) kmalloc(8 * dirBuckets);
+			memset(dirPrints, 0, 8 * dirBuckets);
+			
+			GXFS_DirBlock *dirbuf = NEW(GXFS_DirBlock);
+			int status = gxfsDirLoadRecur(inode, di->diDepth, di->diHead, dirPrints, dirBuckets, dirbuf);
+			kfree(dirbuf);
+			
+			if (status != 0)
+			{
+				gxfsFreeTree(dirIndex);
+				kfree(dirPrints);
+				kfree(buffer);
+				kfree(blocks);
+				kprintf("gxfs: cannot read the directory index of inode %lu\n", inode->ino);
+				return -1;
+			};
+		}
 		else if (rh->rhType == GXFS_RT("TREE"))
 		{
 			if (!foundAttr)
@@ -860,6 +2881,53 @@ static int gxfsLoadInode(FileSystem *fs, Inode *inode)
 			
 			inode->ft = gxfsTree(fs, tr->trDepth, tr->trHead, fileSize, fileFlags);
 		}
+		else if (rh->rhType == GXFS_RT("EXTS"))
+		{
+			if (!foundAttr)
+			{
+				kfree(buffer);
+				kfree(blocks);
+				kprintf("gxfs: encountered an EXTS record before an ATTR record\n");
+				return -1;
+			};
+			
+			GXFS_ExtentRecord *xr = (GXFS_ExtentRecord*) buffer;
+			if (xr->xrSize != sizeof(GXFS_ExtentRecord) || xr->xrCount > GXFS_INLINE_EXTENTS)
+			{
+				kfree(buffer);
+				kfree(blocks);
+				kprintf("gxfs: encountered an invalid EXTS record\n");
+				return -1;
+			};
+			
+			GXFS_Tree *data = gxfsNewTreeData(fs);
+			data->useExtents = 1;
+			if (xr->xrDepth == 0)
+			{
+				data->extents = (GXFS_Extent*) kmalloc(sizeof(GXFS_Extent) * GXFS_INLINE_EXTENTS);
+				data->maxExtents = GXFS_INLINE_EXTENTS;
+				data->numExtents = xr->xrCount;
+				memcpy(data->extents, xr->xrExtents, sizeof(GXFS_Extent) * xr->xrCount);
+			}
+			else
+			{
+				data->extDepth = xr->xrDepth;
+				data->extRoot = xr->xrRoot;
+				data->extClean = ~((uint64_t) 0);
+				if (gxfsExtLoadTree(data, xr->xrDepth, xr->xrRoot) != 0)
+				{
+					gxfsFreeTree(data);
+					kfree(buffer);
+					kfree(blocks);
+					kprintf("gxfs: cannot read the extent tree of inode %lu\n", inode->ino);
+					return -1;
+				};
+				
+				if (data->extClean > data->numExtents) data->extClean = data->numExtents;
+			};
+			
+			inode->ft = gxfsMakeFileTree(data, fileSize, fileFlags);
+		}
 		else if (rh->rhType == GXFS_RT("LINK"))
 		{
 			if (!foundAttr)
@@ -917,6 +2985,9 @@ static int gxfsLoadInode(FileSystem *fs, Inode *inode)
 	blocks = (uint64_t*) krealloc(blocks, 8 * (numBlocks+1));
 	blocks[numBlocks] = 0;
 	idata->blocks = blocks;
+	idata->dirIndex = dirIndex;
+	idata->dirBuckets = dirBuckets;
+	idata->dirPrints = dirPrints;
 	inode->fsdata = idata;
 	gxfsSetInodeCallbacks(inode);
 	return 0;
@@ -991,7 +3062,7 @@ static Inode* gxfsOpenRoot(const char *image, int flags, const void *options, si
 		requiredFeatures = sbh.sbhWriteFeatures;
 	};
 	
-	if ((requiredFeatures & GXFS_SUPPORTED_FEATURES) != GXFS_SUPPORTED_FEATURES)
+	if ((requiredFeatures & ~GXFS_SUPPORTED_FEATURES) != 0)
 	{
 		kprintf("gxfs: this filesystem uses unsupported features; try read-only\n");
 		vfsClose(fp);
@@ -1010,6 +3081,7 @@ static Inode* gxfsOpenRoot(const char *image, int flags, const void *options, si
 	gxfs->fp = fp;
 	gxfs->flags = flags;
 	semInit(&gxfs->lock);
+	gxfsDirtyInit(&gxfs->allocDirty);
 	
 	if (vfsPRead(fp, &gxfs->sbb, sizeof(GXFS_SuperblockBody), GXFS_SBB_OFFSET) != sizeof(GXFS_SuperblockBody))
 	{
@@ -1020,6 +3092,38 @@ static Inode* gxfsOpenRoot(const char *image, int flags, const void *options, si
 		return NULL;
 	};
 	
+	gxfs->useExtents = !!(sbh.sbhWriteFeatures & GXFS_FEATURE_EXTENTS);
+	gxfs->useDirIndex = !!(sbh.sbhWriteFeatures & GXFS_FEATURE_DIRINDEX);
+	gxfs->useBitmap = 0;
+	if (sbh.sbhWriteFeatures & GXFS_FEATURE_BITMAP)
+	{
+		gxfs->numGroups = (gxfs->sbb.sbbTotalBlocks + GXFS_GROUP_BLOCKS - 1) / GXFS_GROUP_BLOCKS;
+		if (gxfs->sbb.sbbBitmapBlocks < gxfs->numGroups
+			|| gxfs->sbb.sbbBitmapStart == 0
+			|| (gxfs->sbb.sbbBitmapStart + gxfs->numGroups) > gxfs->sbb.sbbTotalBlocks)
+		{
+			vfsClose(fp);
+			kfree(gxfs);
+			kprintf("gxfs: the free-space bitmap does not fit the filesystem\n");
+			*error = EINVAL;
+			return NULL;
+		};
+		
+		// bitmap blocks are loaded on first use
+		gxfs->useBitmap = 1;
+		gxfs->bitmap = (uint8_t**) kmalloc(sizeof(uint8_t*) * gxfs->numGroups);
+		gxfs->groupFree = (uint32_t*) kmalloc(sizeof(uint32_t) * gxfs->numGroups);
+		
+		uint64_t i;
+		for (i=0; i<gxfs->numGroups; i++)
+		{
+			gxfs->bitmap[i] = NULL;
+			gxfs->groupFree[i] = GXFS_GROUP_UNKNOWN;
+		};
+		
+		gxfs->allocHint = gxfs->sbb.sbbBitmapStart + gxfs->sbb.sbbBitmapBlocks;
+	};
+	
 	if (gxfs->sbb.sbbRuntimeFlags & GXFS_RF_DIRTY)
 	{
 		kprintf("gxfs: WARNING: filesystem on `%s' is dirty!\n", image);
@@ -1058,6 +3162,7 @@ static Inode* gxfsOpenRoot(const char *image, int flags, const void *options, si
 		kprintf("gxfs: failed to load root directory!\n");
 		vfsDownrefInode(root);
 		kfree(fs);
+		gxfsFreeBitmap(gxfs);
 		kfree(gxfs);
 		vfsClose(fp);
 		*error = EIO;
@@ -35,6 +35,9 @@
 
 /* features */
 #define	GXFS_FEATURE_BASE				(1 << 0)
+#define	GXFS_FEATURE_BITMAP				(1 << 1)		/* free-space bitmap instead of the free list */
+#define	GXFS_FEATURE_EXTENTS				(1 << 2)		/* files may be mapped by EXTS records */
+#define	GXFS_FEATURE_DIRINDEX				(1 << 3)		/* directories may be indexed by DIDX records */
 
 /* position of the SBB on disk */
 #define	GXFS_SBB_OFFSET					(0x200000 + sizeof(GXFS_SuperblockHeader))
@@ -48,6 +51,29 @@
 /* inode flags (must start with bit 16 as low 16 bits = mode) */
 #define	GXFS_INODE_FIXED_SIZE				(1 << 16)
 
+/* maximum number of metadata blocks remembered for a targeted fsync; beyond that, the whole partition is synced */
+#define	GXFS_DIRTY_MAX					64
+
+/* number of blocks described by a single bitmap block */
+#define	GXFS_GROUP_BLOCKS				(4096 * 8)
+
+/* 'groupFree' value for a bitmap block which has not been loaded yet */
+#define	GXFS_GROUP_UNKNOWN				0xFFFFFFFF
+
+/* number of extents stored in an EXTS record itself, in an extent B-tree leaf, and keys in a B-tree index node */
+#define	GXFS_INLINE_EXTENTS				4
+#define	GXFS_LEAF_EXTENTS				170
+#define	GXFS_INDEX_KEYS					255
+
+/* number of entries at which a directory gets a hashed index, the number of entries per bucket aimed for when sizing
+ * the index, and the average number of entries per bucket beyond which the index is rebuilt with more buckets */
+#define	GXFS_DIRINDEX_MIN				128
+#define	GXFS_DIRINDEX_LOAD				32
+#define	GXFS_DIRINDEX_MAXLOAD				128
+
+/* space for entries in a directory index block */
+#define	GXFS_DIRBLOCK_DATA				4080
+
 typedef struct
 {
 	uint64_t sbhMagic;
@@ -69,6 +95,8 @@ typedef struct
 	uint64_t sbbLastMountTime;
 	uint64_t sbbLastCheckTime;
 	uint64_t sbbRuntimeFlags;
+	uint64_t sbbBitmapStart;	/* GXFS_FEATURE_BITMAP: first bitmap block */
+	uint64_t sbbBitmapBlocks;	/* GXFS_FEATURE_BITMAP: number of bitmap blocks */
 } GXFS_SuperblockBody;
 
 typedef struct
@@ -121,6 +149,78 @@ typedef struct
 	uint64_t trHead;
 } GXFS_TreeRecord;
 
+/**
+ * Maps 'exLength' consecutive pages of a file, starting at page 'exLogical', to the same number of consecutive
+ * blocks starting at 'exPhysical'.
+ */
+typedef struct
+{
+	uint64_t exLogical;
+	uint64_t exPhysical;
+	uint64_t exLength;
+} GXFS_Extent;
+
+typedef struct
+{
+	uint32_t xrType;	/* "EXTS" */
+	uint32_t xrSize;	/* sizeof(GXFS_ExtentRecord) */
+	uint64_t xrDepth;	/* 0 = the extents are in xrExtents, otherwise the height of the B-tree at xrRoot */
+	uint64_t xrRoot;
+	uint64_t xrCount;	/* number of entries used in xrExtents */
+	GXFS_Extent xrExtents[GXFS_INLINE_EXTENTS];
+} GXFS_ExtentRecord;
+
+typedef struct
+{
+	uint64_t ikFirst;	/* first page mapped by the subtree */
+	uint64_t ikChild;
+} GXFS_IndexKey;
+
+/**
+ * A block of an extent B-tree. Leaves (level 0) hold extents sorted by logical page; index nodes hold the
+ * subtrees of the level below, sorted by the first page they map.
+ */
+typedef struct
+{
+	uint64_t enCount;
+	uint64_t enLevel;
+	union
+	{
+		GXFS_Extent enExtents[GXFS_LEAF_EXTENTS];
+		GXFS_IndexKey enKeys[GXFS_INDEX_KEYS];
+	};
+} GXFS_ExtentNode;
+
+/**
+ * Indexes the entries of a directory by a hash of their names. Bucket 'i' is the chain of GXFS_DirBlock starting
+ * at page 'i' of the tree at 'diHead', of depth 'diDepth', laid out like the block tree of a file; holes are empty
+ * buckets. The hash is 32-bit FNV-1a of the name, and the bucket is its low bits.
+ */
+typedef struct
+{
+	uint32_t diType;	/* "DIDX" */
+	uint32_t diSize;	/* sizeof(GXFS_DirIndexRecord) */
+	uint64_t diBuckets;	/* number of buckets; a power of 2 */
+	uint64_t diDepth;
+	uint64_t diHead;
+} GXFS_DirIndexRecord;
+
+typedef struct
+{
+	uint64_t dbNext;	/* next block of the same bucket, or 0 */
+	uint64_t dbUsed;	/* number of bytes of 'dbData' used by entries */
+	uint8_t dbData[GXFS_DIRBLOCK_DATA];
+} GXFS_DirBlock;
+
+typedef struct
+{
+	uint64_t deInode;
+	uint16_t deSize;	/* sizeof(GXFS_DirEntry) + deNameLen, 8-byte-aligned */
+	uint16_t deNameLen;
+	uint32_t deResv;
+	char deName[];
+} GXFS_DirEntry;
+
 typedef struct
 {
 	uint32_t crType;	/* "_ACL" */
@@ -128,6 +228,29 @@ typedef struct
 	AccessControlEntry acl[VFS_ACL_SIZE];
 } GXFS_AclRecord;
 
+/**
+ * A list of metadata blocks written since the last sync, so that fsync() can commit just the blocks that a
+ * file depends on.
+ */
+typedef struct
+{
+	/**
+	 * Lock protecting the list.
+	 */
+	Semaphore lock;
+	
+	/**
+	 * The block numbers, and how many there are.
+	 */
+	uint64_t blocks[GXFS_DIRTY_MAX];
+	int count;
+	
+	/**
+	 * Set if more than GXFS_DIRTY_MAX blocks were written.
+	 */
+	int overflow;
+} GXFS_DirtyList;
+
 /**
  * GXFS driver data.
  */
@@ -152,18 +275,42 @@ typedef struct
 	 * Lock for updating the superblock etc.
 	 */
 	Semaphore lock;
-} GXFS;
-
-/**
- * GXFS inode data.
- */
-typedef struct
-{
+	
 	/**
-	 * An array of block numbers storing the inode data, terminated with '0'.
+	 * Free list blocks written by the block allocator.
 	 */
-	uint64_t *blocks;
-} GXFS_Inode;
+	GXFS_DirtyList allocDirty;
+	
+	/**
+	 * Set if the filesystem uses a free-space bitmap (GXFS_FEATURE_BITMAP) rather than the free list.
+	 * In that case, each bitmap block covers a "group" of GXFS_GROUP_BLOCKS blocks, with set bits marking
+	 * used blocks.
+	 */
+	int useBitmap;
+	
+	/**
+	 * Number of groups, the bitmap blocks which have been loaded so far (NULL if not yet loaded), and the
+	 * number of free blocks in each group (GXFS_GROUP_UNKNOWN if not yet loaded). Protected by 'lock'.
+	 */
+	uint64_t numGroups;
+	uint8_t **bitmap;
+	uint32_t *groupFree;
+	
+	/**
+	 * Where to start searching for free blocks when the caller has no preference.
+	 */
+	uint64_t allocHint;
+	
+	/**
+	 * Set if new files are mapped by extents (GXFS_FEATURE_EXTENTS) rather than block trees.
+	 */
+	int useExtents;
+	
+	/**
+	 * Set if large directories get a hashed index (GXFS_FEATURE_DIRINDEX).
+	 */
+	int useDirIndex;
+} GXFS;
 
 /**
  * Represents file tree data.
@@ -180,6 +327,84 @@ typedef struct
 	 */
 	uint64_t depth;
 	uint64_t head;
+	
+	/**
+	 * Set when 'depth' and 'head' change, so that the TREE record is rewritten at the next flush.
+	 */
+	int headDirty;
+	
+	/**
+	 * Tree index blocks written since the last fsync. File data blocks are written directly rather than
+	 * through the block cache, so they are never on this list.
+	 */
+	GXFS_DirtyList dirty;
+	
+	/**
+	 * Set if the blocks at the bottom of the tree are metadata accessed through the block cache (the buckets
+	 * of a directory index) rather than file data.
+	 */
+	int metaLeaves;
+	
+	/**
+	 * Cached copy of the most recently used bottom-level table (NULL until first needed), its block number
+	 * (0 if nothing is cached), and the index of the 2MB region of the file which it maps. This lets
+	 * sequential access skip the upper levels of the tree. Protected by 'cacheLock'.
+	 */
+	Semaphore cacheLock;
+	uint64_t *leafTable;
+	uint64_t leafBlock;
+	uint64_t leafKey;
+	
+	/**
+	 * Set if the file is mapped by extents (an EXTS record) instead of the block tree above. The extents
+	 * are kept in memory sorted by logical page, and only written to the inode (and the B-tree at 'extRoot',
+	 * of height 'extDepth', once there are more than GXFS_INLINE_EXTENTS of them) when the inode is flushed.
+	 * 'extDirty' is set when they have changed since. Readers take 'extLock'; changes are only made with
+	 * the file tree locked, and also take 'extLock'.
+	 * 
+	 * Blocks cut off by truncation are queued in 'extFreed' rather than freed straight away, since the
+	 * EXTS record on disk still refers to them; they are released once the updated record is written.
+	 * 
+	 * The leaves of the B-tree are filled in order, GXFS_LEAF_EXTENTS extents each. 'extLeaves' lists the
+	 * blocks of its leaves in order and 'extIndex' those of its index nodes, and the first 'extClean'
+	 * extents have not changed since it was written. Full leaves holding only such extents are kept when
+	 * the tree is next written, and only the rest of it is written to new blocks.
+	 */
+	int useExtents;
+	GXFS_Extent *extents;
+	uint64_t numExtents;
+	uint64_t maxExtents;
+	uint64_t extDepth;
+	uint64_t extRoot;
+	int extDirty;
+	Semaphore extLock;
+	GXFS_Extent *extFreed;
+	uint64_t numExtFreed;
+	uint64_t *extLeaves;
+	uint64_t numExtLeaves;
+	uint64_t *extIndex;
+	uint64_t numExtIndex;
+	uint64_t extClean;
 } GXFS_Tree;
 
+/**
+ * GXFS inode data.
+ */
+typedef struct
+{
+	/**
+	 * An array of block numbers storing the inode data, terminated with '0'.
+	 */
+	uint64_t *blocks;
+	
+	/**
+	 * For a directory stored as a DIDX record: the tree of bucket chains (else NULL), the number of buckets,
+	 * and a fingerprint of the entries in each bucket as last written, so that flushing rewrites only the
+	 * buckets which have changed. Protected by the inode lock.
+	 */
+	GXFS_Tree *dirIndex;
+	uint64_t dirBuckets;
+	uint64_t *dirPrints;
+} GXFS_Inode;
+
 #endif
@@ -0,0 +1,764 @@
+/*
+	Glidix kernel
+
+	Copyright (c) 2014-2017, Madd Games.
+	All rights reserved.
+	
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+	
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <glidix/module/module.h>
+#include <glidix/display/console.h>
+#include <glidix/storage/storage.h>
+#include <glidix/util/string.h>
+#include <glidix/util/memory.h>
+#include <glidix/util/time.h>
+#include <glidix/hw/pci.h>
+#include <glidix/hw/dma.h>
+#include <glidix/hw/cpu.h>
+
+#include "nvme.h"
+
+static NVMeController *firstCtrl;
+static NVMeController *lastCtrl;
+static int numCtrlFound;
+
+static uint32_t nvmeRead32(NVMeController *ctrl, int reg)
+{
+	return *((volatile uint32_t*) (ctrl->regs + reg));
+};
+
+static void nvmeWrite32(NVMeController *ctrl, int reg, uint32_t value)
+{
+	*((volatile uint32_t*) (ctrl->regs + reg)) = value;
+};
+
+static uint64_t nvmeRead64(NVMeController *ctrl, int reg)
+{
+	return (uint64_t) nvmeRead32(ctrl, reg) | ((uint64_t) nvmeRead32(ctrl, reg+4) << 32);
+};
+
+static void nvmeWrite64(NVMeController *ctrl, int reg, uint64_t value)
+{
+	nvmeWrite32(ctrl, reg, (uint32_t) value);
+	nvmeWrite32(ctrl, reg+4, (uint32_t) (value >> 32));
+};
+
+static void nvmeRingSQ(NVMeController *ctrl, NVMeQueue *q)
+{
+	nvmeWrite32(ctrl, NVME_REG_DOORBELL + (2 * q->qid) * ctrl->stride, q->sqTail);
+};
+
+static void nvmeRingCQ(NVMeController *ctrl, NVMeQueue *q)
+{
+	nvmeWrite32(ctrl, NVME_REG_DOORBELL + (2 * q->qid + 1) * ctrl->stride, q->cqHead);
+};
+
+/**
+ * Allocate the memory for a queue pair with the given number of entries. If 'numSlots' is nonzero,
+ * also set up that many command slots. Returns 0 on success, -1 if out of memory.
+ */
+static int nvmeInitQueue(NVMeQueue *q, int qid, uint16_t size, int numSlots)
+{
+	memset(q, 0, sizeof(NVMeQueue));
+	q->qid = qid;
+	q->size = size;
+	q->phase = 1;
+	
+	if (dmaCreateBuffer(&q->sqBuf, sizeof(NVMeCommand) * size, 0) != 0)
+	{
+		return -1;
+	};
+	
+	if (dmaCreateBuffer(&q->cqBuf, sizeof(NVMeCompletion) * size, 0) != 0)
+	{
+		dmaReleaseBuffer(&q->sqBuf);
+		return -1;
+	};
+	
+	q->sq = (volatile NVMeCommand*) dmaGetPtr(&q->sqBuf);
+	q->cq = (volatile NVMeCompletion*) dmaGetPtr(&q->cqBuf);
+	memset((void*) q->sq, 0, sizeof(NVMeCommand) * size);
+	memset((void*) q->cq, 0, sizeof(NVMeCompletion) * size);
+	
+	if (numSlots != 0)
+	{
+		if (dmaCreateBuffer(&q->prpBuf, 0x1000 * numSlots, 0) != 0)
+		{
+			dmaReleaseBuffer(&q->sqBuf);
+			dmaReleaseBuffer(&q->cqBuf);
+			return -1;
+		};
+		
+		q->freeSlots = (numSlots == 32) ? 0xFFFFFFFF : ((1U << numSlots) - 1);
+		semInit2(&q->semSlots, numSlots);
+		
+		int i;
+		for (i=0; i<numSlots; i++)
+		{
+			wcInit(&q->wcSlots[i]);
+		};
+	};
+	
+	return 0;
+};
+
+static void nvmeReleaseQueue(NVMeQueue *q)
+{
+	dmaReleaseBuffer(&q->sqBuf);
+	dmaReleaseBuffer(&q->cqBuf);
+	if (q->qid != 0) dmaReleaseBuffer(&q->prpBuf);
+};
+
+/**
+ * Place a command in a submission queue. The caller must hold the queue lock.
+ */
+static void nvmeEnqueue(NVMeController *ctrl, NVMeQueue *q, NVMeCommand *cmd)
+{
+	memcpy((void*) &q->sq[q->sqTail], cmd, sizeof(NVMeCommand));
+	__sync_synchronize();
+	
+	if (++q->sqTail == q->size) q->sqTail = 0;
+	nvmeRingSQ(ctrl, q);
+};
+
+/**
+ * Run an admin command and poll for its completion; only used during initialization. Returns 0 on
+ * success (and stores the result in 'dw0' if not NULL), or EIO on error or timeout.
+ */
+static int nvmeAdminCommand(NVMeController *ctrl, NVMeCommand *cmd, uint32_t *dw0)
+{
+	NVMeQueue *q = &ctrl->admin;
+	cmd->cid = q->sqTail;
+	nvmeEnqueue(ctrl, q, cmd);
+	
+	uint64_t startTime = getNanotime();
+	volatile NVMeCompletion *cqe = &q->cq[q->cqHead];
+	while ((cqe->status & 1) != q->phase)
+	{
+		if (getNanotime()-startTime > NVME_ADMIN_TIMEOUT)
+		{
+			kprintf("nvme: admin command 0x%02X timed out\n", cmd->opcode);
+			return EIO;
+		};
+	};
+	
+	__sync_synchronize();
+	uint16_t status = cqe->status >> 1;
+	if (dw0 != NULL) *dw0 = cqe->dw0;
+	
+	if (++q->cqHead == q->size)
+	{
+		q->cqHead = 0;
+		q->phase ^= 1;
+	};
+	nvmeRingCQ(ctrl, q);
+	
+	if (status != 0)
+	{
+		kprintf("nvme: admin command 0x%02X failed with status 0x%04X\n", cmd->opcode, status);
+		return EIO;
+	};
+	
+	return 0;
+};
+
+static int nvmeIdentify(NVMeController *ctrl, uint32_t cns, uint32_t nsid)
+{
+	NVMeCommand cmd;
+	memset(&cmd, 0, sizeof(NVMeCommand));
+	cmd.opcode = NVME_ADMIN_IDENTIFY;
+	cmd.nsid = nsid;
+	cmd.prp1 = dmaGetPhys(&ctrl->identBuf);
+	cmd.cdw10 = cns;
+	return nvmeAdminCommand(ctrl, &cmd, NULL);
+};
+
+/**
+ * Wait for CSTS.RDY to take the given value. Returns 0 on success, -1 on timeout or fatal status.
+ */
+static int nvmeWaitReady(NVMeController *ctrl, uint32_t ready)
+{
+	uint64_t timeout = NVME_CAP_TO(nvmeRead64(ctrl, NVME_REG_CAP)) * 500 * (NANO_PER_SEC / 1000);
+	if (timeout < NVME_ADMIN_TIMEOUT) timeout = NVME_ADMIN_TIMEOUT;
+	
+	uint64_t startTime = getNanotime();
+	while (1)
+	{
+		uint32_t csts = nvmeRead32(ctrl, NVME_REG_CSTS);
+		if (csts & NVME_CSTS_CFS) return -1;
+		if ((csts & NVME_CSTS_RDY) == ready) return 0;
+		if (getNanotime()-startTime > timeout) return -1;
+	};
+};
+
+static int nvmeIrqHandler(void *context)
+{
+	NVMeController *ctrl = (NVMeController*) context;
+	int handled = 0;
+	
+	int i;
+	for (i=0; i<ctrl->numQueues; i++)
+	{
+		NVMeQueue *q = &ctrl->queues[i];
+		spinlockAcquire(&q->lock);
+		
+		int count = 0;
+		while ((q->cq[q->cqHead].status & 1) == q->phase)
+		{
+			__sync_synchronize();
+			volatile NVMeCompletion *cqe = &q->cq[q->cqHead];
+			
+			int slot = cqe->cid;
+			q->slotStatus[slot] = (cqe->status >> 1) ? EIO : 0;
+			wcUp(&q->wcSlots[slot]);
+			
+			if (++q->cqHead == q->size)
+			{
+				q->cqHead = 0;
+				q->phase ^= 1;
+			};
+			
+			count++;
+		};
+		
+		if (count != 0)
+		{
+			nvmeRingCQ(ctrl, q);
+			handled = 1;
+		};
+		
+		spinlockRelease(&q->lock);
+	};
+	
+	return handled ? 0 : -1;
+};
+
+static int nvmeAllocSlot(NVMeQueue *q)
+{
+	semWait(&q->semSlots);
+	
+	while (1)
+	{
+		uint32_t free = q->freeSlots;
+		int slot = __builtin_ctz(free);
+		
+		if (__sync_bool_compare_and_swap(&q->freeSlots, free, free & ~(1U << slot)))
+		{
+			return slot;
+		};
+	};
+};
+
+static void nvmeFreeSlot(NVMeQueue *q, int slot)
+{
+	__sync_fetch_and_or(&q->freeSlots, 1U << slot);
+	semSignal(&q->semSlots);
+};
+
+/**
+ * Return the queue pair belonging to the CPU we're running on.
+ */
+static NVMeQueue* nvmeGetQueue(NVMeController *ctrl)
+{
+	return &ctrl->queues[getCurrentCPU()->id % ctrl->numQueues];
+};
+
+/**
+ * Builds the PRPs of a command. Page 0 goes into PRP1; the rest go into the slot's PRP list, which
+ * PRP2 points to, unless there are only 2 pages (then PRP2 points to the second page directly).
+ */
+typedef struct
+{
+	NVMeCommand*				cmd;
+	uint64_t*				list;
+	uint64_t				listPhys;
+	int					count;
+} PRPBuilder;
+
+static void nvmeBeginPRP(PRPBuilder *prp, NVMeQueue *q, int slot, NVMeCommand *cmd)
+{
+	prp->cmd = cmd;
+	prp->list = (uint64_t*) ((char*) dmaGetPtr(&q->prpBuf) + 0x1000 * slot);
+	prp->listPhys = dmaGetPhys(&q->prpBuf) + 0x1000 * slot;
+	prp->count = 0;
+};
+
+static void nvmeAddPRP(PRPBuilder *prp, uint64_t phys)
+{
+	if (prp->count == 0) prp->cmd->prp1 = phys;
+	else prp->list[prp->count-1] = phys;
+	prp->count++;
+};
+
+static void nvmeEndPRP(PRPBuilder *prp)
+{
+	if (prp->count == 1) prp->cmd->prp2 = 0;
+	else if (prp->count == 2) prp->cmd->prp2 = prp->list[0];
+	else prp->cmd->prp2 = prp->listPhys;
+};
+
+/**
+ * Submit a read or write whose PRPs have been set, and sleep until it completes. Returns 0 on
+ * success or EIO on error.
+ */
+static int nvmeIssue(NVMeNamespace *ns, NVMeQueue *q, int slot, NVMeCommand *cmd, int type, size_t startBlock, size_t numBlocks)
+{
+	cmd->opcode = (type == SD_REQ_WRITE) ? NVME_CMD_WRITE : NVME_CMD_READ;
+	cmd->cid = slot;
+	cmd->nsid = ns->nsid;
+	cmd->cdw10 = (uint32_t) startBlock;
+	cmd->cdw11 = (uint32_t) (startBlock >> 32);
+	cmd->cdw12 = (numBlocks - 1) | ((type == SD_REQ_WRITE) ? NVME_RW_FUA : 0);
+	
+	uint64_t flags = getFlagsRegister();
+	cli();
+	spinlockAcquire(&q->lock);
+	nvmeEnqueue(ns->ctrl, q, cmd);
+	spinlockRelease(&q->lock);
+	setFlagsRegister(flags);
+	
+	wcDown(&q->wcSlots[slot]);
+	return q->slotStatus[slot];
+};
+
+static int nvmeTransfer(NVMeNamespace *ns, int type, size_t startBlock, size_t numBlocks, const void *buffer)
+{
+	NVMeQueue *q = nvmeGetQueue(ns->ctrl);
+	int slot = nvmeAllocSlot(q);
+	
+	NVMeCommand cmd;
+	memset(&cmd, 0, sizeof(NVMeCommand));
+	
+	PRPBuilder prp;
+	nvmeBeginPRP(&prp, q, slot, &cmd);
+	
+	// every PRP entry but the first must start on a page boundary, so split the physical regions
+	// at page boundaries
+	DMARegion reg;
+	for (dmaFirstRegion(&reg, buffer, numBlocks << ns->lbaShift, 0); reg.physAddr!=0; dmaNextRegion(&reg))
+	{
+		uint64_t addr = reg.physAddr;
+		uint64_t end = reg.physAddr + reg.physSize;
+		
+		while (addr < end)
+		{
+			if (prp.count == ns->ctrl->maxPages)
+			{
+				// larger than maxTransfer allows
+				kprintf("nvme: transfer of %lu blocks does not fit in a PRP list\n", numBlocks);
+				nvmeFreeSlot(q, slot);
+				return EIO;
+			};
+			
+			nvmeAddPRP(&prp, addr);
+			addr = (addr & ~0xFFFUL) + 0x1000;
+		};
+	};
+	
+	nvmeEndPRP(&prp);
+	
+	int status = nvmeIssue(ns, q, slot, &cmd, type, startBlock, numBlocks);
+	nvmeFreeSlot(q, slot);
+	return status;
+};
+
+static int nvmeReadBlocks(void *drvdata, size_t startBlock, size_t numBlocks, void *buffer)
+{
+	return nvmeTransfer((NVMeNamespace*) drvdata, SD_REQ_READ, startBlock, numBlocks, buffer);
+};
+
+static int nvmeWriteBlocks(void *drvdata, size_t startBlock, size_t numBlocks, const void *buffer)
+{
+	return nvmeTransfer((NVMeNamespace*) drvdata, SD_REQ_WRITE, startBlock, numBlocks, buffer);
+};
+
+static int nvmeTransferFrames(void *drvdata, int type, size_t startBlock, size_t numBlocks, const uint64_t *frames)
+{
+	NVMeNamespace *ns = (NVMeNamespace*) drvdata;
+	size_t blocksPerPage = 0x1000 >> ns->lbaShift;
+	size_t numFrames = numBlocks / blocksPerPage;
+	
+	while (numFrames > 0)
+	{
+		size_t count = numFrames;
+		if (count > ns->ctrl->maxPages) count = ns->ctrl->maxPages;
+		
+		NVMeQueue *q = nvmeGetQueue(ns->ctrl);
+		int slot = nvmeAllocSlot(q);
+		
+		NVMeCommand cmd;
+		memset(&cmd, 0, sizeof(NVMeCommand));
+		
+		PRPBuilder prp;
+		nvmeBeginPRP(&prp, q, slot, &cmd);
+		
+		size_t i;
+		for (i=0; i<count; i++)
+		{
+			nvmeAddPRP(&prp, frames[i] << 12);
+		};
+		
+		nvmeEndPRP(&prp);
+		
+		int status = nvmeIssue(ns, q, slot, &cmd, type, startBlock, count * blocksPerPage);
+		nvmeFreeSlot(q, slot);
+		if (status != 0) return status;
+		
+		startBlock += count * blocksPerPage;
+		frames += count;
+		numFrames -= count;
+	};
+	
+	return 0;
+};
+
+static SDOps nvmeOpsTemplate = {
+	.size = sizeof(SDOps),
+	.readBlocks = nvmeReadBlocks,
+	.writeBlocks = nvmeWriteBlocks,
+	.queueDepth = SD_MAX_WORKERS,
+	.transferFrames = nvmeTransferFrames,
+};
+
+/**
+ * Create the I/O queue pairs; one per CPU if the controller allows. Returns 0 on success, -1 if
+ * not even one could be created.
+ */
+static int nvmeCreateQueues(NVMeController *ctrl, uint32_t maxEntries)
+{
+	int want = getCPUCount();
+	if (want > NVME_MAX_QUEUES) want = NVME_MAX_QUEUES;
+	
+	int doorbells = (NVME_MMIO_SIZE - NVME_REG_DOORBELL) / (2 * ctrl->stride) - 1;
+	if (want > doorbells) want = doorbells;
+	
+	NVMeCommand cmd;
+	memset(&cmd, 0, sizeof(NVMeCommand));
+	cmd.opcode = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+	cmd.cdw11 = (want - 1) | ((want - 1) << 16);
+	
+	uint32_t allocated;
+	if (nvmeAdminCommand(ctrl, &cmd, &allocated) != 0)
+	{
+		return -1;
+	};
+	
+	if ((allocated & 0xFFFF) + 1 < want) want = (allocated & 0xFFFF) + 1;
+	if ((allocated >> 16) + 1 < want) want = (allocated >> 16) + 1;
+	
+	uint16_t size = NVME_IO_QUEUE_SIZE;
+	if (size > maxEntries) size = maxEntries;
+	
+	ctrl->queues = (NVMeQueue*) kmalloc(sizeof(NVMeQueue) * want);
+	ctrl->numQueues = 0;
+	
+	while (ctrl->numQueues < want)
+	{
+		NVMeQueue *q = &ctrl->queues[ctrl->numQueues];
+		int qid = ctrl->numQueues + 1;
+		
+		if (nvmeInitQueue(q, qid, size, size - 1) != 0)
+		{
+			break;
+		};
+		
+		memset(&cmd, 0, sizeof(NVMeCommand));
+		cmd.opcode = NVME_ADMIN_CREATE_CQ;
+		cmd.prp1 = dmaGetPhys(&q->cqBuf);
+		cmd.cdw10 = ((size - 1) << 16) | qid;
+		cmd.cdw11 = NVME_QUEUE_PC | NVME_QUEUE_IEN;		// interrupt vector 0
+		
+		if (nvmeAdminCommand(ctrl, &cmd, NULL) != 0)
+		{
+			nvmeReleaseQueue(q);
+			break;
+		};
+		
+		memset(&cmd, 0, sizeof(NVMeCommand));
+		cmd.opcode = NVME_ADMIN_CREATE_SQ;
+		cmd.prp1 = dmaGetPhys(&q->sqBuf);
+		cmd.cdw10 = ((size - 1) << 16) | qid;
+		cmd.cdw11 = (qid << 16) | NVME_QUEUE_PC;
+		
+		if (nvmeAdminCommand(ctrl, &cmd, NULL) != 0)
+		{
+			// the completion queue stays allocated on the controller until it is reset
+			nvmeReleaseQueue(q);
+			break;
+		};
+		
+		ctrl->numQueues++;
+	};
+	
+	if (ctrl->numQueues == 0)
+	{
+		kfree(ctrl->queues);
+		return -1;
+	};
+	
+	return 0;
+};
+
+static void nvmeAddNamespace(NVMeController *ctrl, uint32_t nsid, const char *model)
+{
+	if (nvmeIdentify(ctrl, NVME_CNS_NAMESPACE, nsid) != 0)
+	{
+		return;
+	};
+	
+	uint8_t *ident = (uint8_t*) dmaGetPtr(&ctrl->identBuf);
+	uint64_t nsze = *((uint64_t*)(ident + NVME_IDNS_NSZE));
+	if (nsze == 0)
+	{
+		// inactive
+		return;
+	};
+	
+	uint8_t flbas = ident[NVME_IDNS_FLBAS] & 0xF;
+	uint32_t lbaf = *((uint32_t*)(ident + NVME_IDNS_LBAF + 4 * flbas));
+	int lbaShift = (lbaf >> 16) & 0xFF;
+	
+	if (lbaShift < 9 || lbaShift > 12)
+	{
+		kprintf("nvme: namespace %u has unsupported block size 2^%d\n", nsid, lbaShift);
+		return;
+	};
+	
+	NVMeNamespace *ns = NEW(NVMeNamespace);
+	memset(ns, 0, sizeof(NVMeNamespace));
+	ns->ctrl = ctrl;
+	ns->nsid = nsid;
+	ns->lbaShift = lbaShift;
+	
+	// a buffer spanning N pages may start partway through a page, so it needs up to N+1 PRPs
+	memcpy(&ns->ops, &nvmeOpsTemplate, sizeof(SDOps));
+	ns->ops.maxTransfer = 0x1000 * (ctrl->maxPages - 1);
+	
+	SDParams sdpars;
+	sdpars.flags = 0;
+	sdpars.blockSize = 1 << lbaShift;
+	sdpars.totalSize = nsze << lbaShift;
+	
+	kprintf("nvme: namespace %u: %lu blocks of %d bytes\n", nsid, nsze, 1 << lbaShift);
+	ns->sd = sdCreate(&sdpars, model, &ns->ops, ns);
+	
+	ns->next = ctrl->namespaces;
+	ctrl->namespaces = ns;
+};
+
+static void nvmeInit(NVMeController *ctrl)
+{
+	uint64_t base = ctrl->pcidev->bar[0] & ~0xF;
+	if ((ctrl->pcidev->bar[0] & 0x6) == 0x4)
+	{
+		base |= (uint64_t) ctrl->pcidev->bar[1] << 32;
+	};
+	
+	ctrl->regs = (volatile uint8_t*) mapPhysMemory(base, NVME_MMIO_SIZE);
+	pciSetBusMastering(ctrl->pcidev, 1);
+	
+	uint64_t cap = nvmeRead64(ctrl, NVME_REG_CAP);
+	ctrl->stride = 4 << NVME_CAP_DSTRD(cap);
+	
+	if (NVME_CAP_MPSMIN(cap) != 0)
+	{
+		kprintf("nvme: controller does not support 4KB pages\n");
+		return;
+	};
+	
+	// reset the controller
+	nvmeWrite32(ctrl, NVME_REG_CC, nvmeRead32(ctrl, NVME_REG_CC) & ~NVME_CC_EN);
+	if (nvmeWaitReady(ctrl, 0) != 0)
+	{
+		kprintf("nvme: controller failed to reset\n");
+		return;
+	};
+	
+	// set up the admin queue; MQES is 0-based and may be 0xFFFF, and we never allocate queues
+	// larger than NVME_IO_QUEUE_SIZE anyway
+	uint32_t maxEntries = NVME_CAP_MQES(cap) + 1;
+	if (maxEntries > NVME_IO_QUEUE_SIZE) maxEntries = NVME_IO_QUEUE_SIZE;
+	uint16_t adminSize = NVME_ADMIN_QUEUE_SIZE;
+	if (adminSize > maxEntries) adminSize = maxEntries;
+	
+	if (nvmeInitQueue(&ctrl->admin, 0, adminSize, 0) != 0)
+	{
+		kprintf("nvme: out of memory\n");
+		return;
+	};
+	
+	if (dmaCreateBuffer(&ctrl->identBuf, 0x1000, 0) != 0)
+	{
+		kprintf("nvme: out of memory\n");
+		nvmeReleaseQueue(&ctrl->admin);
+		return;
+	};
+	
+	nvmeWrite32(ctrl, NVME_REG_AQA, (adminSize - 1) | ((adminSize - 1) << 16));
+	nvmeWrite64(ctrl, NVME_REG_ASQ, dmaGetPhys(&ctrl->admin.sqBuf));
+	nvmeWrite64(ctrl, NVME_REG_ACQ, dmaGetPhys(&ctrl->admin.cqBuf));
+	
+	// enable it with 4KB pages and the NVM command set
+	nvmeWrite32(ctrl, NVME_REG_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+	if (nvmeWaitReady(ctrl, NVME_CSTS_RDY) != 0)
+	{
+		kprintf("nvme: controller failed to become ready\n");
+		dmaReleaseBuffer(&ctrl->identBuf);
+		nvmeReleaseQueue(&ctrl->admin);
+		return;
+	};
+	
+	// identify the controller
+	if (nvmeIdentify(ctrl, NVME_CNS_CONTROLLER, 0) != 0)
+	{
+		dmaReleaseBuffer(&ctrl->identBuf);
+		nvmeReleaseQueue(&ctrl->admin);
+		return;
+	};
+	
+	uint8_t *ident = (uint8_t*) dmaGetPtr(&ctrl->identBuf);
+	
+	char model[41];
+	memcpy(model, ident + NVME_IDCTL_MODEL, 40);
+	model[40] = 0;
+	
+	char *check = &model[39];
+	while (*check == ' ')
+	{
+		if (check == model) break;
+		*check-- = 0;
+	};
+	
+	ctrl->maxPages = NVME_MAX_PAGES;
+	uint8_t mdts = ident[NVME_IDCTL_MDTS];
+	if (mdts != 0 && mdts < 10 && (1 << mdts) < ctrl->maxPages)
+	{
+		ctrl->maxPages = 1 << mdts;
+	};
+	
+	uint32_t nn = *((uint32_t*)(ident + NVME_IDCTL_NN));
+	
+	if (nvmeCreateQueues(ctrl, maxEntries) != 0)
+	{
+		kprintf("nvme: failed to create I/O queues\n");
+		dmaReleaseBuffer(&ctrl->identBuf);
+		nvmeReleaseQueue(&ctrl->admin);
+		return;
+	};
+	
+	kprintf("nvme: %s: %d I/O queues, %u namespaces\n", model, ctrl->numQueues, nn);
+	pciSetIrqHandler(ctrl->pcidev, nvmeIrqHandler, ctrl);
+	
+	uint32_t nsid;
+	for (nsid=1; nsid<=nn; nsid++)
+	{
+		nvmeAddNamespace(ctrl, nsid, model);
+	};
+};
+
+static int nvmeEnumerator(PCIDevice *dev, void *ignore)
+{
+	if (dev->type == 0x0108 && dev->progif == 0x02)
+	{
+		strcpy(dev->deviceName, "NVMe Controller");
+		
+		NVMeController *ctrl = NEW(NVMeController);
+		memset(ctrl, 0, sizeof(NVMeController));
+		ctrl->pcidev = dev;
+		
+		if (lastCtrl == NULL)
+		{
+			firstCtrl = lastCtrl = ctrl;
+		}
+		else
+		{
+			lastCtrl->next = ctrl;
+			lastCtrl = ctrl;
+		};
+		
+		numCtrlFound++;
+		return 1;
+	};
+	
+	return 0;
+};
+
+MODULE_INIT()
+{
+	pciEnumDevices(THIS_MODULE, nvmeEnumerator, NULL);
+	
+	kprintf("nvme: found %d controllers, initializing\n", numCtrlFound);
+	NVMeController *ctrl;
+	for (ctrl=firstCtrl; ctrl!=NULL; ctrl=ctrl->next)
+	{
+		nvmeInit(ctrl);
+	};
+	
+	return MODINIT_OK;
+};
+
+MODULE_FINI()
+{
+	kprintf("nvme: removing controllers\n");
+	
+	NVMeController *ctrl;
+	while (firstCtrl != NULL)
+	{
+		ctrl = firstCtrl;
+		firstCtrl = ctrl->next;
+		
+		while (ctrl->namespaces != NULL)
+		{
+			NVMeNamespace *ns = ctrl->namespaces;
+			ctrl->namespaces = ns->next;
+			
+			sdHangup(ns->sd);
+			kfree(ns);
+		};
+		
+		if (ctrl->numQueues != 0)
+		{
+			// disabling the controller deletes all queues
+			nvmeWrite32(ctrl, NVME_REG_CC, nvmeRead32(ctrl, NVME_REG_CC) & ~NVME_CC_EN);
+			nvmeWaitReady(ctrl, 0);
+			
+			int i;
+			for (i=0; i<ctrl->numQueues; i++)
+			{
+				nvmeReleaseQueue(&ctrl->queues[i]);
+			};
+			
+			kfree(ctrl->queues);
+			nvmeReleaseQueue(&ctrl->admin);
+			dmaReleaseBuffer(&ctrl->identBuf);
+		};
+		
+		unmapPhysMemory(ctrl->regs, NVME_MMIO_SIZE);
+		pciSetBusMastering(ctrl->pcidev, 0);
+		pciReleaseDevice(ctrl->pcidev);
+		kfree(ctrl);
+	};
+	
+	return 0;
+};
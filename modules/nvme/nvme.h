@@ -0,0 +1,264 @@
+/*
+	Glidix kernel
+
+	Copyright (c) 2014-2017, Madd Games.
+	All rights reserved.
+	
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+	
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef NVME_H_
+#define NVME_H_
+
+#include <glidix/util/common.h>
+#include <glidix/storage/storage.h>
+#include <glidix/hw/pci.h>
+#include <glidix/hw/dma.h>
+#include <glidix/thread/semaphore.h>
+#include <glidix/thread/spinlock.h>
+#include <glidix/thread/waitcnt.h>
+
+/* controller registers */
+#define	NVME_REG_CAP			0x00
+#define	NVME_REG_VS			0x08
+#define	NVME_REG_INTMS			0x0C
+#define	NVME_REG_INTMC			0x10
+#define	NVME_REG_CC			0x14
+#define	NVME_REG_CSTS			0x1C
+#define	NVME_REG_AQA			0x24
+#define	NVME_REG_ASQ			0x28
+#define	NVME_REG_ACQ			0x30
+#define	NVME_REG_DOORBELL		0x1000
+
+/* capabilities */
+#define	NVME_CAP_MQES(cap)		((cap) & 0xFFFF)
+#define	NVME_CAP_TO(cap)		(((cap) >> 24) & 0xFF)		/* in 500ms units */
+#define	NVME_CAP_DSTRD(cap)		(((cap) >> 32) & 0xF)
+#define	NVME_CAP_MPSMIN(cap)		(((cap) >> 48) & 0xF)
+
+/* controller configuration */
+#define	NVME_CC_EN			(1 << 0)
+#define	NVME_CC_IOSQES			(6 << 16)			/* 64-byte submission entries */
+#define	NVME_CC_IOCQES			(4 << 20)			/* 16-byte completion entries */
+
+/* controller status */
+#define	NVME_CSTS_RDY			(1 << 0)
+#define	NVME_CSTS_CFS			(1 << 1)
+
+/* admin commands */
+#define	NVME_ADMIN_CREATE_SQ		0x01
+#define	NVME_ADMIN_CREATE_CQ		0x05
+#define	NVME_ADMIN_IDENTIFY		0x06
+#define	NVME_ADMIN_SET_FEATURES		0x09
+
+/* identify CNS values */
+#define	NVME_CNS_NAMESPACE		0
+#define	NVME_CNS_CONTROLLER		1
+
+/* features */
+#define	NVME_FEAT_NUM_QUEUES		0x07
+
+/* queue creation flags (CDW11) */
+#define	NVME_QUEUE_PC			(1 << 0)			/* physically contiguous */
+#define	NVME_QUEUE_IEN			(1 << 1)			/* interrupts enabled (CQ only) */
+
+/* I/O commands */
+#define	NVME_CMD_WRITE			0x01
+#define	NVME_CMD_READ			0x02
+
+/* force unit access (CDW12 of read/write) */
+#define	NVME_RW_FUA			(1 << 30)
+
+/* offsets into identify data */
+#define	NVME_IDCTL_MODEL		24
+#define	NVME_IDCTL_MDTS			77
+#define	NVME_IDCTL_NN			516
+#define	NVME_IDNS_NSZE			0
+#define	NVME_IDNS_FLBAS			26
+#define	NVME_IDNS_LBAF			128
+
+/**
+ * Amount of register space mapped; this includes the doorbells of the admin queue and as many
+ * I/O queues as we could ever create (with a doorbell stride of 0, several hundred).
+ */
+#define	NVME_MMIO_SIZE			0x4000
+
+/**
+ * Queue sizes. The admin queue is only used during initialization; each I/O queue has up to
+ * NVME_QUEUE_SLOTS commands in flight, and is given one more entry than that so that it never
+ * appears full.
+ */
+#define	NVME_ADMIN_QUEUE_SIZE		16
+#define	NVME_QUEUE_SLOTS		32
+#define	NVME_IO_QUEUE_SIZE		(NVME_QUEUE_SLOTS + 1)
+
+/**
+ * Maximum number of I/O queues per controller.
+ */
+#define	NVME_MAX_QUEUES			64
+
+/**
+ * Each slot has a page holding its PRP list, so a command may describe up to this many pages
+ * (the first one in PRP1, the rest in the list).
+ */
+#define	NVME_PRP_LIST_MAX		512
+#define	NVME_MAX_PAGES			(NVME_PRP_LIST_MAX + 1)
+
+/**
+ * Timeout for admin commands and controller state changes.
+ */
+#define	NVME_ADMIN_TIMEOUT		(8 * NANO_PER_SEC)
+
+/**
+ * Submission queue entry.
+ */
+typedef struct
+{
+	uint8_t					opcode;
+	uint8_t					flags;
+	uint16_t				cid;
+	uint32_t				nsid;
+	uint64_t				rsvd;
+	uint64_t				mptr;
+	uint64_t				prp1;
+	uint64_t				prp2;
+	uint32_t				cdw10;
+	uint32_t				cdw11;
+	uint32_t				cdw12;
+	uint32_t				cdw13;
+	uint32_t				cdw14;
+	uint32_t				cdw15;
+} PACKED NVMeCommand;
+
+/**
+ * Completion queue entry.
+ */
+typedef struct
+{
+	uint32_t				dw0;
+	uint32_t				dw1;
+	uint16_t				sqhd;
+	uint16_t				sqid;
+	uint16_t				cid;
+	uint16_t				status;		// bit 0 = phase tag
+} PACKED NVMeCompletion;
+
+/**
+ * A submission/completion queue pair.
+ */
+typedef struct
+{
+	/**
+	 * Queue ID (0 = admin) and number of entries.
+	 */
+	int					qid;
+	uint16_t				size;
+	
+	/**
+	 * The queues, and our positions in them; 'phase' is the phase tag expected in new
+	 * completion entries.
+	 */
+	DMABuffer				sqBuf;
+	DMABuffer				cqBuf;
+	volatile NVMeCommand*			sq;
+	volatile NVMeCompletion*		cq;
+	uint16_t				sqTail;
+	uint16_t				cqHead;
+	int					phase;
+	
+	/**
+	 * Protects the positions above.
+	 */
+	Spinlock				lock;
+	
+	/**
+	 * Command slots; the slot number is used as the command ID. Each has a page in 'prpBuf'
+	 * for its PRP list.
+	 */
+	uint32_t				freeSlots;
+	Semaphore				semSlots;
+	DMABuffer				prpBuf;
+	WaitCounter				wcSlots[NVME_QUEUE_SLOTS];
+	int					slotStatus[NVME_QUEUE_SLOTS];
+} NVMeQueue;
+
+struct NVMeController_;
+
+/**
+ * Describes an active namespace.
+ */
+typedef struct NVMeNamespace_
+{
+	struct NVMeNamespace_*			next;
+	struct NVMeController_*			ctrl;
+	uint32_t				nsid;
+	
+	/**
+	 * log2 of the block size.
+	 */
+	int					lbaShift;
+	
+	/**
+	 * Driver operations; per namespace, since the transfer limit depends on the block size.
+	 */
+	SDOps					ops;
+	StorageDevice*				sd;
+} NVMeNamespace;
+
+/**
+ * Describes an NVMe controller.
+ */
+typedef struct NVMeController_
+{
+	struct NVMeController_*			next;
+	PCIDevice*				pcidev;
+	volatile uint8_t*			regs;
+	
+	/**
+	 * Doorbell stride, in bytes.
+	 */
+	int					stride;
+	
+	/**
+	 * Largest number of pages in one command (from MDTS), capped at NVME_MAX_PAGES.
+	 */
+	int					maxPages;
+	
+	/**
+	 * The admin queue, and the I/O queues; ideally one per CPU.
+	 */
+	NVMeQueue				admin;
+	NVMeQueue*				queues;
+	int					numQueues;
+	
+	/**
+	 * Buffer for identify data.
+	 */
+	DMABuffer				identBuf;
+	
+	/**
+	 * Namespaces.
+	 */
+	NVMeNamespace*				namespaces;
+} NVMeController;
+
+#endif
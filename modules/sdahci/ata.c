@@ -35,102 +35,391 @@
 #define	ATA_READ					0
 #define	ATA_WRITE					1
 
-int ataTransferBlocks(ATADevice *dev, size_t startBlock, size_t numBlocks, void *buffer, int dir)
+/**
+ * Maximum number of pages transferred by a single command (the sector count is 16 bits).
+ */
+#define	ATA_MAX_COMMAND_FRAMES				8191
+
+/**
+ * Take a free command slot, waiting if they are all in use.
+ */
+static int ataAllocSlot(ATADevice *dev)
+{
+	semWait(&dev->semSlots);
+	
+	while (1)
+	{
+		uint32_t free = dev->freeSlots;
+		int slot = __builtin_ctz(free);
+		
+		if (__sync_bool_compare_and_swap(&dev->freeSlots, free, free & ~(1U << slot)))
+		{
+			return slot;
+		};
+	};
+};
+
+static void ataFreeSlot(ATADevice *dev, int slot)
+{
+	__sync_fetch_and_or(&dev->freeSlots, 1U << slot);
+	semSignal(&dev->semSlots);
+};
+
+static void ataRecoverNCQ(ATADevice *dev, int slot);
+
+/**
+ * Issue the command in the specified slot, and sleep until the interrupt handler reports its completion.
+ * 'queued' is nonzero for NCQ commands, which are held back until the drive has recovered from an earlier
+ * queued command error. Returns 0 on success, or EIO on error.
+ */
+static int ataIssueSlot(ATADevice *dev, int slot, int queued)
+{
+	uint32_t mask = 1U << slot;
+	
+	while (1)
+	{
+		uint64_t flags = getFlagsRegister();
+		cli();
+		spinlockAcquire(&dev->slotLock);
+		
+		if (!queued || !dev->ncqError)
+		{
+			dev->busySlots |= mask;
+			__sync_synchronize();
+			
+			if (queued) dev->port->sact = mask;
+			dev->port->ci = mask;
+			
+			spinlockRelease(&dev->slotLock);
+			setFlagsRegister(flags);
+			break;
+		};
+		
+		spinlockRelease(&dev->slotLock);
+		setFlagsRegister(flags);
+		
+		ataRecoverNCQ(dev, slot);
+	};
+	
+	wcDown(&dev->wcSlots[slot]);
+	return dev->slotStatus[slot];
+};
+
+/**
+ * Reset the port with a COMRESET, used when the NCQ error log cannot be read. The command engine must be
+ * stopped.
+ */
+static void ataResetPort(ATADevice *dev)
+{
+	dev->port->sctl = (dev->port->sctl & ~SCTL_DET_MASK) | SCTL_DET_COMRESET;
+	sleep(2);
+	dev->port->sctl &= ~SCTL_DET_MASK;
+	
+	uint64_t startTime = getNanotime();
+	while ((dev->port->ssts & 0x0F) != SSTS_DET_OK)
+	{
+		if (getNanotime()-startTime > NANO_PER_SEC)
+		{
+			kprintf("sdahci: device did not come back after COMRESET\n");
+			break;
+		};
+	};
+	
+	dev->port->serr = dev->port->serr;
+};
+
+/**
+ * After a queued command fails, the drive aborts all of them and rejects new ones until the host reads
+ * the NCQ command error log (or resets the port). Do that with a non-queued READ LOG EXT in 'slot', whose
+ * command is restored afterwards. The interrupt handler has already failed every queued command, and no
+ * new ones are issued while 'ncqError' is set.
+ */
+static void ataRecoverNCQ(ATADevice *dev, int slot)
 {
 	mutexLock(&dev->lock);
+	if (!dev->ncqError)
+	{
+		// someone else already recovered
+		mutexUnlock(&dev->lock);
+		return;
+	};
 	
 	AHCIOpArea *opArea = (AHCIOpArea*) dmaGetPtr(&dev->dmabuf);
-	opArea->cmdlist[0].cfl = sizeof(FIS_REG_H2D) / 4;
+	AHCICommandHeader *cmdhead = &opArea->cmdlist[slot];
+	AHCICommandTable *cmdtab = &opArea->cmdtab[slot];
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtab->cfis);
+	
+	AHCICommandHeader savedHead = *cmdhead;
+	FIS_REG_H2D savedFIS = *cmdfis;
+	AHCI_PRDT savedPRDT = cmdtab->prdt[0];
 	
-	if (dir == ATA_READ)
+	cmdhead->cfl = sizeof(FIS_REG_H2D) / 4;
+	cmdhead->w = 0;
+	cmdhead->p = 0;
+	cmdhead->c = 0;
+	cmdhead->prdtl = 1;
+	
+	cmdtab->prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, ncqLog);
+	cmdtab->prdt[0].dbc = 511;
+	cmdtab->prdt[0].i = 0;
+	
+	memset(cmdfis, 0, sizeof(FIS_REG_H2D));
+	cmdfis->fis_type = FIS_TYPE_REG_H2D;
+	cmdfis->c = 1;
+	cmdfis->command = ATA_CMD_READ_LOG_EXT;
+	cmdfis->device = 1<<6;	// LBA mode
+	cmdfis->lba0 = ATA_LOG_NCQ_ERROR;
+	cmdfis->countl = 1;
+	
+	if (ataIssueSlot(dev, slot, 0) == 0)
 	{
-		opArea->cmdlist[0].w = 0;
-		opArea->cmdlist[0].p = 0;
-		opArea->cmdlist[0].c = 0;
+		uint8_t *log = (uint8_t*) opArea->ncqLog;
+		if (log[0] & 0x80)
+		{
+			kprintf("sdahci: NCQ error log: non-queued command failed, status=0x%02X, error=0x%02X\n",
+				log[2], log[3]);
+		}
+		else
+		{
+			kprintf("sdahci: NCQ error log: tag %d failed, status=0x%02X, error=0x%02X\n",
+				log[0] & 0x1F, log[2], log[3]);
+		};
 	}
 	else
 	{
-		opArea->cmdlist[0].w = 1;
-		opArea->cmdlist[0].p = 1;
-		opArea->cmdlist[0].c = 1;
+		kprintf("sdahci: failed to read the NCQ error log; resetting the port\n");
+		
+		uint64_t flags = getFlagsRegister();
+		cli();
+		spinlockAcquire(&dev->slotLock);
+		ahciStopCmd(dev->port);
+		ataResetPort(dev);
+		dev->port->is = dev->port->is;
+		ahciStartCmd(dev->port);
+		spinlockRelease(&dev->slotLock);
+		setFlagsRegister(flags);
 	};
 	
-	uint16_t prdtl = 0;
+	*cmdhead = savedHead;
+	*cmdfis = savedFIS;
+	cmdtab->prdt[0] = savedPRDT;
 	
-	DMARegion reg;
-	for (dmaFirstRegion(&reg, buffer, 512*numBlocks, 0); reg.physAddr!=0; dmaNextRegion(&reg))
+	dev->ncqError = 0;
+	__sync_synchronize();
+	mutexUnlock(&dev->lock);
+};
+
+void ataInterrupt(ATADevice *dev)
+{
+	spinlockAcquire(&dev->slotLock);
+	
+	uint32_t is = dev->port->is;
+	dev->port->is = is;
+	
+	uint32_t done;
+	int status = 0;
+	if (is & IS_ERR_FATAL)
 	{
-		if (prdtl == 9) panic("unexpected input");
+		// the command engine stops on errors; fail everything in progress and restart it
+		kprintf("sdahci: fatal error. IS=0x%08X, SERR=0x%08X, TFD=0x%08X\n", is, dev->port->serr, dev->port->tfd);
 		
-		opArea->cmdtab.prdt[prdtl].dba = reg.physAddr;
-		opArea->cmdtab.prdt[prdtl].dbc = reg.physSize - 1;
-		opArea->cmdtab.prdt[prdtl].i = 0;
+		done = dev->busySlots;
+		status = EIO;
 		
-		prdtl++;
+		ahciStopCmd(dev->port);
+		ahciStartCmd(dev->port);
+		dev->port->serr = dev->port->serr;
+		
+		// the drive now rejects queued commands until ataRecoverNCQ() reads its error log
+		if (dev->ncq) dev->ncqError = 1;
+	}
+	else
+	{
+		// queued commands stay in SACT until they complete; others stay in CI
+		done = dev->busySlots & ~(dev->port->ci | dev->port->sact);
+		if ((!dev->ncq || dev->ncqError) && (dev->port->tfd & STS_ERR)) status = EIO;
 	};
 	
-	opArea->cmdlist[0].prdtl = prdtl;
+	dev->busySlots &= ~done;
+	spinlockRelease(&dev->slotLock);
+	
+	while (done != 0)
+	{
+		int slot = __builtin_ctz(done);
+		done &= ~(1U << slot);
+		
+		dev->slotStatus[slot] = status;
+		wcUp(&dev->wcSlots[slot]);
+	};
+};
 
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab.cfis);
-	cmdfis->fis_type = FIS_TYPE_REG_H2D;
-	cmdfis->c = 1;
-	if (dir == ATA_READ)
+/**
+ * Perform a transfer using the command in 'slot', whose PRDT has already been filled in.
+ */
+static int ataIssueTransfer(ATADevice *dev, int slot, size_t startBlock, size_t numBlocks, int dir)
+{
+	AHCIOpArea *opArea = (AHCIOpArea*) dmaGetPtr(&dev->dmabuf);
+	AHCICommandHeader *cmdhead = &opArea->cmdlist[slot];
+	AHCICommandTable *cmdtab = &opArea->cmdtab[slot];
+	cmdhead->cfl = sizeof(FIS_REG_H2D) / 4;
+	
+	// prefetch and clear-busy-on-ack must not be set for queued commands
+	cmdhead->w = (dir == ATA_WRITE);
+	if (dir == ATA_READ || dev->ncq)
 	{
-		cmdfis->command = ATA_CMD_READ_DMA_EXT;
+		cmdhead->p = 0;
+		cmdhead->c = 0;
 	}
 	else
 	{
-		cmdfis->command = ATA_CMD_WRITE_DMA_EXT;
+		cmdhead->p = 1;
+		cmdhead->c = 1;
 	};
 	
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&cmdtab->cfis);
+	memset(cmdfis, 0, sizeof(FIS_REG_H2D));
+	cmdfis->fis_type = FIS_TYPE_REG_H2D;
+	cmdfis->c = 1;
+	cmdfis->device = 1<<6;	// LBA mode
+	
 	cmdfis->lba0 = (uint8_t)startBlock;
 	cmdfis->lba1 = (uint8_t)(startBlock>>8);
 	cmdfis->lba2 = (uint8_t)(startBlock>>16);
-	cmdfis->device = 1<<6;	// LBA mode
- 
 	cmdfis->lba3 = (uint8_t)(startBlock>>24);
 	cmdfis->lba4 = (uint8_t)(startBlock>>32);
 	cmdfis->lba5 = (uint8_t)(startBlock>>40);
 	
-	cmdfis->countl = numBlocks & 0xFF;
-	cmdfis->counth = (numBlocks >> 8) & 0xFF;
+	if (dev->ncq)
+	{
+		// queued command: the count goes in the feature register, and the tag in the count register;
+		// writes are FUA instead of being followed by a cache flush, which cannot be queued
+		if (dir == ATA_READ)
+		{
+			cmdfis->command = ATA_CMD_READ_FPDMA_QUEUED;
+		}
+		else
+		{
+			cmdfis->command = ATA_CMD_WRITE_FPDMA_QUEUED;
+			cmdfis->device |= 1<<7;
+		};
+		
+		cmdfis->featurel = numBlocks & 0xFF;
+		cmdfis->featureh = (numBlocks >> 8) & 0xFF;
+		cmdfis->countl = slot << 3;
+	}
+	else
+	{
+		if (dir == ATA_READ)
+		{
+			cmdfis->command = ATA_CMD_READ_DMA_EXT;
+		}
+		else
+		{
+			cmdfis->command = ATA_CMD_WRITE_DMA_EXT;
+		};
+		
+		cmdfis->countl = numBlocks & 0xFF;
+		cmdfis->counth = (numBlocks >> 8) & 0xFF;
+	};
 	
 	// issue the command
-	int status = ahciIssueCmd(dev->port);
-	if (status != 0)
+	int status = ataIssueSlot(dev, slot, dev->ncq);
+	if (status != 0 || dev->ncq || dir == ATA_READ)
 	{
-		mutexUnlock(&dev->lock);
 		return status;
 	};
 	
 	// do a cache flush
-	opArea->cmdlist[0].w = 0;
-	opArea->cmdlist[0].p = 0;
-	opArea->cmdlist[0].c = 0;
-	opArea->cmdlist[0].prdtl = 0;
+	cmdhead->w = 0;
+	cmdhead->p = 0;
+	cmdhead->c = 0;
+	cmdhead->prdtl = 0;
 
+	memset(cmdfis, 0, sizeof(FIS_REG_H2D));
 	cmdfis->fis_type = FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
 	cmdfis->command = ATA_CMD_CACHE_FLUSH_EXT;
-	
-	cmdfis->lba0 = 0;
-	cmdfis->lba1 = 0;
-	cmdfis->lba2 = 0;
 	cmdfis->device = 1<<6;	// LBA mode
- 
-	cmdfis->lba3 = 0;
-	cmdfis->lba4 = 0;
-	cmdfis->lba5 = 0;
-	
-	cmdfis->countl = 0;
-	cmdfis->counth = 0;
 	
 	// issue the flush command
-	status = ahciIssueCmd(dev->port);
-	mutexUnlock(&dev->lock);
+	return ataIssueSlot(dev, slot, 0);
+};
+
+
+int ataTransferBlocks(ATADevice *dev, size_t startBlock, size_t numBlocks, void *buffer, int dir)
+{
+	int slot = ataAllocSlot(dev);
+	
+	AHCIOpArea *opArea = (AHCIOpArea*) dmaGetPtr(&dev->dmabuf);
+	AHCICommandTable *cmdtab = &opArea->cmdtab[slot];
+	uint16_t prdtl = 0;
+	
+	DMARegion reg;
+	for (dmaFirstRegion(&reg, buffer, 512*numBlocks, 0); reg.physAddr!=0; dmaNextRegion(&reg))
+	{
+		if (prdtl == AHCI_PRDT_MAX) panic("unexpected input");
+		
+		cmdtab->prdt[prdtl].dba = reg.physAddr;
+		cmdtab->prdt[prdtl].dbc = reg.physSize - 1;
+		cmdtab->prdt[prdtl].i = 0;
+		
+		prdtl++;
+	};
+	
+	opArea->cmdlist[slot].prdtl = prdtl;
+	
+	int status = ataIssueTransfer(dev, slot, startBlock, numBlocks, dir);
+	ataFreeSlot(dev, slot);
 	return status;
 };
 
+int ataTransferFrames(void *drvdata, int type, size_t startBlock, size_t numBlocks, const uint64_t *frames)
+{
+	ATADevice *dev = (ATADevice*) drvdata;
+	int dir = (type == SD_REQ_WRITE) ? ATA_WRITE : ATA_READ;
+	size_t numFrames = numBlocks / 8;			// 512-byte blocks
+	
+	while (numFrames > 0)
+	{
+		int slot = ataAllocSlot(dev);
+		
+		AHCIOpArea *opArea = (AHCIOpArea*) dmaGetPtr(&dev->dmabuf);
+		AHCICommandTable *cmdtab = &opArea->cmdtab[slot];
+		
+		// one PRDT entry for each run of contiguous frames, as many as fit in the table
+		uint16_t prdtl = 0;
+		size_t done = 0;
+		size_t limit = numFrames;
+		if (limit > ATA_MAX_COMMAND_FRAMES) limit = ATA_MAX_COMMAND_FRAMES;
+		
+		while (done < limit && prdtl < AHCI_PRDT_MAX)
+		{
+			size_t run = 1;
+			while ((done+run) < limit && frames[done+run] == (frames[done]+run) && run < AHCI_PRDT_RUN_MAX) run++;
+			
+			cmdtab->prdt[prdtl].dba = frames[done] << 12;
+			cmdtab->prdt[prdtl].dbc = (run << 12) - 1;
+			cmdtab->prdt[prdtl].i = 0;
+			
+			prdtl++;
+			done += run;
+		};
+		
+		opArea->cmdlist[slot].prdtl = prdtl;
+		
+		int status = ataIssueTransfer(dev, slot, startBlock, done * 8, dir);
+		ataFreeSlot(dev, slot);
+		
+		if (status != 0) return status;
+		
+		startBlock += done * 8;
+		frames += done;
+		numFrames -= done;
+	};
+	
+	return 0;
+};
+
 int ataReadBlocks(void *drvdata, size_t startBlock, size_t numBlocks, void *buffer)
 {
 	ATADevice *dev = (ATADevice*) drvdata;
@@ -147,6 +436,9 @@ SDOps ataOps = {
 	.size = sizeof(SDOps),
 	.readBlocks = ataReadBlocks,
 	.writeBlocks = ataWriteBlocks,
+	.maxTransfer = (AHCI_PRDT_MAX - 1) * 0x1000,
+	.queueDepth = 32,
+	.transferFrames = ataTransferFrames,
 };
 
 void ataInit(AHCIController *ctrl, int portno)
@@ -156,8 +448,11 @@ void ataInit(AHCIController *ctrl, int portno)
 	mutexInit(&dev->lock);
 	
 	dev->ctrl = ctrl;
+	dev->portno = portno;
 	dev->port = &ctrl->regs->ports[portno];
 	dev->sd = NULL;
+	dev->numSlots = 0;
+	dev->ncqError = 0;
 	
 	// stop the command engine while setting up the commands and stuff
 	ahciStopCmd(dev->port);
@@ -180,8 +475,13 @@ void ataInit(AHCIController *ctrl, int portno)
 	dev->port->clb = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, cmdlist);
 	dev->port->fb = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, fisArea);
 	
-	// we only use the first command header, so initialize it to point to the table
-	opArea->cmdlist[0].ctba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, cmdtab);
+	// point each command header to its table
+	int slot;
+	for (slot=0; slot<32; slot++)
+	{
+		opArea->cmdlist[slot].ctba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, cmdtab)
+						+ slot * sizeof(AHCICommandTable);
+	};
 	
 	// start the command engine
 	ahciStartCmd(dev->port);
@@ -194,12 +494,12 @@ void ataInit(AHCIController *ctrl, int portno)
 	opArea->cmdlist[0].prdtl = 1;				// only one PRDT entry
 	opArea->cmdlist[0].p = 1;
 	
-	opArea->cmdtab.prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, id);
-	opArea->cmdtab.prdt[0].dbc = 511;			// length-1
-	opArea->cmdtab.prdt[0].i = 0;				// do not interrupt
+	opArea->cmdtab[0].prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, id);
+	opArea->cmdtab[0].prdt[0].dbc = 511;			// length-1
+	opArea->cmdtab[0].prdt[0].i = 0;				// do not interrupt
 	
 	// set up command FIS
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*) opArea->cmdtab.cfis;
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*) opArea->cmdtab[0].cfis;
 	cmdfis->fis_type = FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
 	cmdfis->command = ATA_CMD_IDENTIFY;
@@ -275,6 +575,37 @@ void ataInit(AHCIController *ctrl, int portno)
 	int status = ahciIssueCmd(dev->port);
 	kprintf("sdahci: cache flush status: %d\n", status);
 	
+	// from now on, commands are issued in any free slot and complete by interrupt; use NCQ if both the
+	// HBA and the drive support it
+	uint16_t *identWords = (uint16_t*) opArea->id;
+	uint16_t sataCaps = identWords[ATA_IDENT_SATA_CAPABILITIES / 2];
+	dev->ncq = 0;
+	dev->numSlots = 1;
+	if ((ctrl->regs->cap & CAP_SNCQ) && sataCaps != 0xFFFF && (sataCaps & (1 << 8)))
+	{
+		int driveDepth = (identWords[ATA_IDENT_QUEUE_DEPTH / 2] & 0x1F) + 1;
+		int hbaSlots = ((ctrl->regs->cap >> CAP_NCS_SHIFT) & CAP_NCS_MASK) + 1;
+		
+		dev->ncq = 1;
+		dev->numSlots = driveDepth;
+		if (hbaSlots < dev->numSlots) dev->numSlots = hbaSlots;
+	};
+	
+	kprintf("sdahci: using %d command slot(s), NCQ %s\n", dev->numSlots, dev->ncq ? "enabled" : "disabled");
+	
+	if (dev->numSlots == 32) dev->freeSlots = 0xFFFFFFFF;
+	else dev->freeSlots = (1U << dev->numSlots) - 1;
+	semInit2(&dev->semSlots, dev->numSlots);
+	spinlockRelease(&dev->slotLock);
+	dev->busySlots = 0;
+	for (slot=0; slot<32; slot++)
+	{
+		wcInit(&dev->wcSlots[slot]);
+	};
+	
+	dev->port->is = dev->port->is;
+	dev->port->ie = IE_COMPLETION;
+	
 	dev->sd = sdCreate(&sdpars, model, &ataOps, dev);
 	if (dev->sd == NULL)
 	{
@@ -36,4 +36,10 @@
  */
 void ataInit(AHCIController *ctrl, int portno);
 
+/**
+ * Handle an interrupt from the port of an ATA device: wake up the waiters on all completed commands. Called
+ * with interrupts disabled.
+ */
+void ataInterrupt(ATADevice *dev);
+
 #endif
@@ -43,14 +43,14 @@ int atapiReadBlocks(void *drvdata, size_t startBlock, size_t numBlocks, void *bu
 	opArea->cmdlist[0].w = 0;
 	opArea->cmdlist[0].a = 1;
 	
-	memset(opArea->cmdtab.acmd, 0, 16);
-	opArea->cmdtab.acmd[0] = ATAPI_CMD_READ;
-	opArea->cmdtab.acmd[2] = (startBlock >> 24) & 0xFF;
-	opArea->cmdtab.acmd[3] = (startBlock >> 16) & 0xFF;
-	opArea->cmdtab.acmd[4] = (startBlock >> 8) & 0xFF;
-	opArea->cmdtab.acmd[5] = startBlock & 0xFF;
-	opArea->cmdtab.acmd[8] = (numBlocks >> 8) & 0xFF;
-	opArea->cmdtab.acmd[9] = numBlocks & 0xFF;
+	memset(opArea->cmdtab[0].acmd, 0, 16);
+	opArea->cmdtab[0].acmd[0] = ATAPI_CMD_READ;
+	opArea->cmdtab[0].acmd[2] = (startBlock >> 24) & 0xFF;
+	opArea->cmdtab[0].acmd[3] = (startBlock >> 16) & 0xFF;
+	opArea->cmdtab[0].acmd[4] = (startBlock >> 8) & 0xFF;
+	opArea->cmdtab[0].acmd[5] = startBlock & 0xFF;
+	opArea->cmdtab[0].acmd[8] = (numBlocks >> 8) & 0xFF;
+	opArea->cmdtab[0].acmd[9] = numBlocks & 0xFF;
 	
 	uint16_t prdtl = 0;
 	
@@ -59,16 +59,16 @@ int atapiReadBlocks(void *drvdata, size_t startBlock, size_t numBlocks, void *bu
 	{
 		if (prdtl == 9) panic("unexpected input");
 		
-		opArea->cmdtab.prdt[prdtl].dba = reg.physAddr;
-		opArea->cmdtab.prdt[prdtl].dbc = reg.physSize - 1;
-		opArea->cmdtab.prdt[prdtl].i = 0;
+		opArea->cmdtab[0].prdt[prdtl].dba = reg.physAddr;
+		opArea->cmdtab[0].prdt[prdtl].dbc = reg.physSize - 1;
+		opArea->cmdtab[0].prdt[prdtl].i = 0;
 		
 		prdtl++;
 	};
 
 	opArea->cmdlist[0].prdtl = prdtl;
 
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab.cfis);
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab[0].cfis);
 	cmdfis->fis_type = FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
 	cmdfis->command = ATA_CMD_PACKET;
@@ -108,16 +108,16 @@ size_t atapiGetSize(void *drvdata)
 	opArea->cmdlist[0].w = 0;
 	opArea->cmdlist[0].a = 1;
 	
-	memset(opArea->cmdtab.acmd, 0, 16);
-	opArea->cmdtab.acmd[0] = ATAPI_CMD_READ_CAPACITY;
+	memset(opArea->cmdtab[0].acmd, 0, 16);
+	opArea->cmdtab[0].acmd[0] = ATAPI_CMD_READ_CAPACITY;
 	
-	opArea->cmdtab.prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, id);
-	opArea->cmdtab.prdt[0].dbc = 1023;				// size minus 1
-	opArea->cmdtab.prdt[0].i = 0;
+	opArea->cmdtab[0].prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, id);
+	opArea->cmdtab[0].prdt[0].dbc = 1023;				// size minus 1
+	opArea->cmdtab[0].prdt[0].i = 0;
 
 	opArea->cmdlist[0].prdtl = 1;
 
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab.cfis);
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab[0].cfis);
 	cmdfis->fis_type = FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
 	cmdfis->command = ATA_CMD_PACKET;
@@ -160,13 +160,13 @@ int atapiEject(void *drvdata)
 	opArea->cmdlist[0].w = 0;
 	opArea->cmdlist[0].a = 1;
 	
-	memset(opArea->cmdtab.acmd, 0, 16);
-	opArea->cmdtab.acmd[0] = ATAPI_CMD_EJECT;
-	opArea->cmdtab.acmd[4] = 0x02;
+	memset(opArea->cmdtab[0].acmd, 0, 16);
+	opArea->cmdtab[0].acmd[0] = ATAPI_CMD_EJECT;
+	opArea->cmdtab[0].acmd[4] = 0x02;
 
 	opArea->cmdlist[0].prdtl = 0;
 
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab.cfis);
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*)(&opArea->cmdtab[0].cfis);
 	cmdfis->fis_type = FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
 	cmdfis->command = ATA_CMD_PACKET;
@@ -204,8 +204,10 @@ void atapiInit(AHCIController *ctrl, int portno)
 	mutexInit(&dev->lock);
 	
 	dev->ctrl = ctrl;
+	dev->portno = portno;
 	dev->port = &ctrl->regs->ports[portno];
 	dev->sd = NULL;
+	dev->numSlots = 0;
 	
 	// stop the command engine while setting up the commands and stuff
 	ahciStopCmd(dev->port);
@@ -241,12 +243,12 @@ void atapiInit(AHCIController *ctrl, int portno)
 	opArea->cmdlist[0].prdtl = 1;				// only one PRDT entry
 	opArea->cmdlist[0].p = 1;
 	
-	opArea->cmdtab.prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, id);
-	opArea->cmdtab.prdt[0].dbc = 511;			// length-1
-	opArea->cmdtab.prdt[0].i = 0;				// do not interrupt
+	opArea->cmdtab[0].prdt[0].dba = dmaGetPhys(&dev->dmabuf) + __builtin_offsetof(AHCIOpArea, id);
+	opArea->cmdtab[0].prdt[0].dbc = 511;			// length-1
+	opArea->cmdtab[0].prdt[0].i = 0;				// do not interrupt
 	
 	// set up command FIS
-	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*) opArea->cmdtab.cfis;
+	FIS_REG_H2D *cmdfis = (FIS_REG_H2D*) opArea->cmdtab[0].cfis;
 	cmdfis->fis_type = FIS_TYPE_REG_H2D;
 	cmdfis->c = 1;
 	cmdfis->command = ATA_CMD_IDENTIFY_PACKET;
@@ -121,6 +121,30 @@ int ahciIssueCmd(volatile AHCIPort *port)
 	return 0;
 };
 
+static int ahciIrqHandler(void *context)
+{
+	AHCIController *ctrl = (AHCIController*) context;
+	uint32_t is = ctrl->regs->is;
+	
+	if (is == 0)
+	{
+		return -1;
+	};
+	
+	int i;
+	for (i=0; i<ctrl->numAtaDevices; i++)
+	{
+		ATADevice *dev = ctrl->ataDevices[i];
+		if ((is & (1U << dev->portno)) && dev->numSlots != 0)
+		{
+			ataInterrupt(dev);
+		};
+	};
+	
+	ctrl->regs->is = is;
+	return 0;
+};
+
 static void ahciInit(AHCIController *ctrl)
 {
 	// map MMIO regs
@@ -133,6 +157,7 @@ static void ahciInit(AHCIController *ctrl)
 	// make sure bus mastering is enabled and perform port initialization
 	pciSetBusMastering(ctrl->pcidev, 1);
 	ctrl->numAtaDevices = 0;
+	pciSetIrqHandler(ctrl->pcidev, ahciIrqHandler, ctrl);
 	
 	int i;
 	for (i=0; i<32; i++)
@@ -172,6 +197,10 @@ static void ahciInit(AHCIController *ctrl)
 			};
 		};
 	};
+	
+	// ATA ports have their interrupts enabled by now
+	ctrl->regs->is = ctrl->regs->is;
+	ctrl->regs->ghc |= GHC_IE;
 };
 
 static int ahciEnumerator(PCIDevice *dev, void *ignore)
@@ -229,10 +258,12 @@ MODULE_FINI()
 		for (i=0; i<ctrl->numAtaDevices; i++)
 		{
 			if (ctrl->ataDevices[i]->sd != NULL) sdHangup(ctrl->ataDevices[i]->sd);
+			ctrl->ataDevices[i]->port->ie = 0;
 			ahciStopCmd(ctrl->ataDevices[i]->port);
 			dmaReleaseBuffer(&ctrl->ataDevices[i]->dmabuf);
 		};
 		
+		ctrl->regs->ghc &= ~GHC_IE;
 		unmapPhysMemory(ctrl->regs, sizeof(AHCIMemoryRegs));
 		pciSetBusMastering(ctrl->pcidev, 0);
 		pciReleaseDevice(ctrl->pcidev);
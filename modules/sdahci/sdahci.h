@@ -33,6 +33,8 @@
 #include <glidix/hw/pci.h>
 #include <glidix/hw/dma.h>
 #include <glidix/storage/storage.h>
+#include <glidix/thread/spinlock.h>
+#include <glidix/thread/waitcnt.h>
 
 #define	AHCI_SIG_ATA	0x00000101
 #define	AHCI_SIG_ATAPI	0xEB140101
@@ -47,11 +49,16 @@
 #define ATA_CMD_WRITE_PIO_EXT				0x34
 #define ATA_CMD_WRITE_DMA				0xCA
 #define ATA_CMD_WRITE_DMA_EXT				0x35
+#define ATA_CMD_READ_FPDMA_QUEUED			0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED			0x61
 #define ATA_CMD_CACHE_FLUSH				0xE7
 #define ATA_CMD_CACHE_FLUSH_EXT				0xEA
 #define ATA_CMD_PACKET					0xA0
 #define ATA_CMD_IDENTIFY_PACKET				0xA1
 #define ATA_CMD_IDENTIFY				0xEC
+#define ATA_CMD_READ_LOG_EXT				0x2F
+
+#define	ATA_LOG_NCQ_ERROR				0x10
 
 #define ATA_IDENT_DEVICETYPE				0
 #define ATA_IDENT_CYLINDERS				2
@@ -62,6 +69,8 @@
 #define ATA_IDENT_CAPABILITIES				98
 #define ATA_IDENT_FIELDVALID				106
 #define ATA_IDENT_MAX_LBA				120
+#define ATA_IDENT_QUEUE_DEPTH				150
+#define ATA_IDENT_SATA_CAPABILITIES			152
 #define ATA_IDENT_COMMANDSETS				164
 #define ATA_IDENT_MAX_LBA_EXT				200
 
@@ -69,6 +78,12 @@
 #define	ATAPI_CMD_EJECT					0x1B
 #define	ATAPI_CMD_READ_CAPACITY				0x25
 
+#define	CAP_SNCQ					(1 << 30)
+#define	CAP_NCS_SHIFT					8
+#define	CAP_NCS_MASK					0x1F
+
+#define	GHC_IE						(1 << 1)
+
 #define	BOHC_BOS					(1 << 0)
 #define	BOHC_OOS					(1 << 1)
 #define	BOHC_SOOE					(1 << 2)
@@ -80,6 +95,9 @@
 #define	SSTS_DET_OK					0x03
 #define	SSTS_DET_DISABLED				0x04
 
+#define	SCTL_DET_MASK					0x0F
+#define	SCTL_DET_COMRESET				0x01
+
 #define	SSTS_IPM_NONE					0x00
 #define	SSTS_IPM_ACTIVE					0x01
 #define	SSTS_IPM_PARTIAL				0x02
@@ -115,6 +133,23 @@
 
 #define	IS_ERR_FATAL					(IS_HBFS | IS_HBDS | IS_IFS | IS_TFES)
 
+/**
+ * Interrupts we enable on ports whose commands complete by interrupt: register FIS (non-queued commands),
+ * set device bits FIS (queued commands), and errors.
+ */
+#define	IE_COMPLETION					(IS_DHRS | IS_SDBS | IS_ERR_FATAL)
+
+/**
+ * Number of PRDT entries in each command table. This makes each command table exactly one page, keeping
+ * every table in the command table array 128-byte-aligned as the HBA requires.
+ */
+#define	AHCI_PRDT_MAX					248
+
+/**
+ * Maximum number of pages described by a single PRDT entry (4MB).
+ */
+#define	AHCI_PRDT_RUN_MAX				1024
+
 typedef enum
 {
 	FIS_TYPE_REG_H2D	= 0x27,	// Register FIS - host to device
@@ -208,6 +243,38 @@ typedef struct ATADevice_	/* or ATAPI */
 	StorageDevice*			sd;
 	DMABuffer			dmabuf;
 	Mutex				lock;
+	
+	/**
+	 * Number of command slots used for interrupt-driven transfers (0 if the device's commands are
+	 * polled with ahciIssueCmd()), and whether they are queued (NCQ) commands.
+	 */
+	int				numSlots;
+	int				ncq;
+	
+	/**
+	 * Set by the interrupt handler when a queued command fails. The drive then rejects queued commands
+	 * until its NCQ error log is read, so none are issued until ataRecoverNCQ() has done that.
+	 */
+	volatile int			ncqError;
+	
+	/**
+	 * Bitmap of free slots, and a semaphore counting them.
+	 */
+	volatile uint32_t		freeSlots;
+	Semaphore			semSlots;
+	
+	/**
+	 * Bitmap of slots with commands in progress, protected by 'slotLock', which is also held (with
+	 * interrupts disabled) while issuing commands.
+	 */
+	Spinlock			slotLock;
+	uint32_t			busySlots;
+	
+	/**
+	 * The waiter on each slot is woken by the interrupt handler, which sets the command status.
+	 */
+	WaitCounter			wcSlots[32];
+	volatile int			slotStatus[32];
 } ATADevice;
 
 typedef struct tagHBA_PRDT_ENTRY
@@ -233,7 +300,7 @@ typedef struct tagHBA_CMD_TBL
 	uint8_t				rsv[48];	// Reserved
  
 	// 0x80
-	AHCI_PRDT			prdt[9];
+	AHCI_PRDT			prdt[AHCI_PRDT_MAX];
 } AHCICommandTable;
 
 typedef struct tagFIS_REG_H2D
@@ -287,14 +354,19 @@ typedef struct
 	char				fisArea[256];
 	
 	/**
-	 * Command table.
+	 * Command tables, one for each slot.
 	 */
-	AHCICommandTable		cmdtab;
+	AHCICommandTable		cmdtab[32];
 	
 	/**
 	 * Identify area.
 	 */
 	char				id[1024];
+	
+	/**
+	 * Receives the NCQ command error log when recovering from a failed queued command.
+	 */
+	char				ncqLog[512];
 } AHCIOpArea;
 
 /**
@@ -28,6 +28,7 @@
 
 #include <glidix/hw/port.h>
 #include <glidix/display/console.h>
+#include <glidix/util/string.h>
 
 #include "ata.h"
 #include "sdide.h"
@@ -35,36 +36,29 @@
 #define	ATA_READ					0
 #define	ATA_WRITE					1
 
-static int ataTransferBlocks(int direction, IDEDevice *dev, size_t startBlock, size_t numBlocks, void *buffer)
+/**
+ * Select the drive and program the starting block and count, with the given value of the
+ * control register (other than HOB).
+ */
+static void ataSetupCommand(IDEDevice *dev, size_t startBlock, size_t numBlocks, int lba48, uint8_t control)
 {
 	IDEController *ctrl = dev->ctrl;
 	int channel = dev->channel;
 	
-	semWait(&dev->ctrl->lock);
-	
-	ideInts[dev->channel] = 0;
-	outb(dev->ctrl->channels[dev->channel].ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN);
-	
-	// wait for it to stop being busy
-	while (inb(ctrl->channels[channel].base + ATA_IOREG_STATUS) & ATA_SR_BSY);
-	
-	int lba48 = 0;
-	if (startBlock > 0x10000000) lba48 = 1;
-
 	if (lba48)
 	{
 		// select drive, use LBA
 		outb(ctrl->channels[channel].base + ATA_IOREG_HDDEVSEL, 0xE0 | (dev->slot << 4));
 	
 		// select starting block and count; first write high-order bytes
-		outb(dev->ctrl->channels[dev->channel].ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN | ATA_CTRL_HOB);
+		outb(ctrl->channels[channel].ctrl + ATA_CREG_CONTROL, control | ATA_CTRL_HOB);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA0, (startBlock >> 24) & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA1, (startBlock >> 32) & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA2, (startBlock >> 40) & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_SECCOUNT, (numBlocks >> 8) & 0xFF);
 
 		// now the low-order bytes
-		outb(dev->ctrl->channels[dev->channel].ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN);
+		outb(ctrl->channels[channel].ctrl + ATA_CREG_CONTROL, control);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA0, startBlock & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA1, (startBlock >> 8) & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA2, (startBlock >> 16) & 0xFF);
@@ -77,11 +71,45 @@ static int ataTransferBlocks(int direction, IDEDevice *dev, size_t startBlock, s
 		outb(ctrl->channels[channel].base + ATA_IOREG_HDDEVSEL, 0xE0 | (dev->slot << 4) | head);
 		
 		// select starting block and count
+		outb(ctrl->channels[channel].ctrl + ATA_CREG_CONTROL, control);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA0, startBlock & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA1, (startBlock >> 8) & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_LBA2, (startBlock >> 16) & 0xFF);
 		outb(ctrl->channels[channel].base + ATA_IOREG_SECCOUNT, numBlocks & 0xFF);
 	};
+};
+
+/**
+ * Flush the drive's write cache. The caller must hold the controller lock.
+ */
+static void ataFlushCache(IDEDevice *dev)
+{
+	IDEChannel *chan = &dev->ctrl->channels[dev->channel];
+	
+	outb(chan->base + ATA_IOREG_COMMAND, ATA_CMD_CACHE_FLUSH_EXT);
+	
+	// wait for it to stop being busy
+	while (inb(chan->base + ATA_IOREG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
+};
+
+/**
+ * Perform a PIO transfer. The caller must hold the controller lock.
+ */
+static int ataTransferPIO(int direction, IDEDevice *dev, size_t startBlock, size_t numBlocks, void *buffer)
+{
+	IDEController *ctrl = dev->ctrl;
+	int channel = dev->channel;
+	
+	ideInts[dev->channel] = 0;
+	outb(dev->ctrl->channels[dev->channel].ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN);
+	
+	// wait for it to stop being busy
+	while (inb(ctrl->channels[channel].base + ATA_IOREG_STATUS) & ATA_SR_BSY);
+	
+	int lba48 = 0;
+	if (startBlock > 0x10000000) lba48 = 1;
+	
+	ataSetupCommand(dev, startBlock, numBlocks, lba48, ATA_CTRL_NIEN);
 	
 	// send the appropriate command
 	uint8_t cmd;
@@ -115,7 +143,6 @@ static int ataTransferBlocks(int direction, IDEDevice *dev, size_t startBlock, s
 	
 	if (error)
 	{
-		semSignal(&dev->ctrl->lock);
 		return EIO;
 	};
 	
@@ -142,14 +169,173 @@ static int ataTransferBlocks(int direction, IDEDevice *dev, size_t startBlock, s
 	};
 	
 	// if we're writing, flush the cache
-	outb(ctrl->channels[channel].base + ATA_IOREG_COMMAND, ATA_CMD_CACHE_FLUSH_EXT);
+	ataFlushCache(dev);
+	return 0;
+};
+
+/**
+ * Add a physical region to the channel's PRD table, splitting it so that no entry crosses
+ * a 64KB boundary. Returns the new number of entries, or -1 if the region cannot be reached
+ * by the bus master or the table is full.
+ */
+static int ataAddRegion(IDEChannel *chan, int count, uint64_t phys, size_t size)
+{
+	if ((phys & 3) != 0 || (phys + size) > 0x100000000UL)
+	{
+		return -1;
+	};
+	
+	while (size != 0)
+	{
+		if (count == IDE_PRD_MAX)
+		{
+			return -1;
+		};
+		
+		size_t chunk = 0x10000 - (phys & 0xFFFF);
+		if (chunk > size) chunk = size;
+		
+		chan->prdt[count].phys = (uint32_t) phys;
+		chan->prdt[count].size = (uint16_t) chunk;	// 64KB wraps to 0, as the hardware expects
+		chan->prdt[count].flags = 0;
+		count++;
+		
+		phys += chunk;
+		size -= chunk;
+	};
+	
+	return count;
+};
+
+/**
+ * Run a bus master transfer using the PRD table already filled with 'count' entries. The caller
+ * must hold the controller lock. Returns 0 on success, EIO if the drive reported an error, or -1
+ * if the bus master itself failed (in which case DMA is disabled on the channel, and the caller
+ * should retry with PIO).
+ */
+static int ataTransferDMA(int direction, IDEDevice *dev, size_t startBlock, size_t numBlocks, int count)
+{
+	IDEChannel *chan = &dev->ctrl->channels[dev->channel];
+	chan->prdt[count-1].flags = IDE_PRD_EOT;
 	
 	// wait for it to stop being busy
-	while (inb(ctrl->channels[channel].base + ATA_IOREG_STATUS) & (ATA_SR_BSY | ATA_SR_DRQ));
+	while (inb(chan->base + ATA_IOREG_STATUS) & ATA_SR_BSY);
+	
+	int lba48 = 0;
+	if (startBlock > 0x10000000) lba48 = 1;
+	
+	// program the bus master: table, direction, and clear status
+	uint8_t bmcmd = (direction == ATA_READ) ? BM_CMD_READ : 0;
+	outb(chan->bmide + BM_REG_COMMAND, bmcmd);
+	outd(chan->bmide + BM_REG_PRDT, (uint32_t) dmaGetPhys(&chan->prdBuffer));
+	outb(chan->bmide + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+	
+	// enable interrupts and issue the command
+	ataSetupCommand(dev, startBlock, numBlocks, lba48, 0);
+	
+	uint8_t cmd;
+	if (direction == ATA_READ && lba48) cmd = ATA_CMD_READ_DMA_EXT;
+	else if (direction == ATA_WRITE && lba48) cmd = ATA_CMD_WRITE_DMA_EXT;
+	else if (direction == ATA_READ) cmd = ATA_CMD_READ_DMA;
+	else cmd = ATA_CMD_WRITE_DMA;
+	
+	ideDMAActive[dev->channel] = 1;
+	outb(chan->base + ATA_IOREG_COMMAND, cmd);
+	outb(chan->bmide + BM_REG_COMMAND, bmcmd | BM_CMD_START);
+	
+	// wait for the completion interrupt (or a bus master error); ACTIVE alone is not enough, as it
+	// clears as soon as the PRD table is exhausted, possibly before the drive is done. the status
+	// is always re-checked after re-arming, so stray interrupts (and wakeups left over from them)
+	// are harmless
+	uint8_t bmstat;
+	while (1)
+	{
+		bmstat = inb(chan->bmide + BM_REG_STATUS);
+		if (bmstat & (BM_SR_IRQ | BM_SR_ERR))
+		{
+			break;
+		};
+		
+		wcDown(&ideDMAWait[dev->channel]);
+		ideDMAActive[dev->channel] = 1;
+	};
+	
+	ideDMAActive[dev->channel] = 0;
+	
+	// stop the engine, wait for the drive to finish (unless the bus master failed, in which case
+	// the PIO retry waits for it), and acknowledge the interrupt on both the drive and the bus master
+	outb(chan->bmide + BM_REG_COMMAND, bmcmd);
+	uint8_t status = inb(chan->base + ATA_IOREG_STATUS);
+	if ((bmstat & BM_SR_ERR) == 0)
+	{
+		while (status & ATA_SR_BSY) status = inb(chan->base + ATA_IOREG_STATUS);
+	};
+	outb(chan->bmide + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+	outb(chan->ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN);
+	
+	if (bmstat & BM_SR_ERR)
+	{
+		kprintf("sdide: bus master error on channel %d, falling back to PIO\n", dev->channel);
+		chan->dma = 0;
+		return -1;
+	};
+	
+	if (status & (ATA_SR_ERR | ATA_SR_DF))
+	{
+		return EIO;
+	};
+	
+	if (direction == ATA_WRITE)
+	{
+		ataFlushCache(dev);
+	};
+	
+	return 0;
+};
 
-	// OK
+static int ataTransferBlocks(int direction, IDEDevice *dev, size_t startBlock, size_t numBlocks, void *buffer)
+{
+	IDEChannel *chan = &dev->ctrl->channels[dev->channel];
+	size_t size = 512 * numBlocks;
+	
+	semWait(&dev->ctrl->lock);
+	
+	if (dev->dma && chan->dma && size <= IDE_BOUNCE_SIZE)
+	{
+		// try to describe the buffer directly
+		int count = 0;
+		DMARegion reg;
+		for (dmaFirstRegion(&reg, buffer, size, 0); reg.physAddr!=0; dmaNextRegion(&reg))
+		{
+			count = ataAddRegion(chan, count, reg.physAddr, reg.physSize);
+			if (count == -1) break;
+		};
+		
+		// otherwise go through the bounce buffer
+		int bounced = 0;
+		if (count == -1)
+		{
+			bounced = 1;
+			count = ataAddRegion(chan, 0, dmaGetPhys(&chan->bounceBuffer), size);
+			if (direction == ATA_WRITE) memcpy(chan->bounce, buffer, size);
+		};
+		
+		int status = ataTransferDMA(direction, dev, startBlock, numBlocks, count);
+		if (status != -1)
+		{
+			if (status == 0 && bounced && direction == ATA_READ)
+			{
+				memcpy(buffer, chan->bounce, size);
+			};
+			
+			semSignal(&dev->ctrl->lock);
+			return status;
+		};
+	};
+	
+	int status = ataTransferPIO(direction, dev, startBlock, numBlocks, buffer);
 	semSignal(&dev->ctrl->lock);
-	return 0;
+	return status;
 };
 
 int ataReadBlocks(void *drvdata, size_t startBlock, size_t numBlocks, void *buffer)
@@ -168,4 +354,5 @@ SDOps ataOps = {
 	.size = sizeof(SDOps),
 	.readBlocks = ataReadBlocks,
 	.writeBlocks = ataWriteBlocks,
+	.maxTransfer = IDE_BOUNCE_SIZE,
 };
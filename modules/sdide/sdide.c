@@ -54,9 +54,61 @@ int numCtrlFound;
  */
 volatile int ideInts[2];
 
+/**
+ * Bus master completion.
+ */
+volatile int ideDMAActive[2];
+WaitCounter ideDMAWait[2];
+
 static void ideIrqHandler(int irq)
 {
-	ideInts[irq-14] = 1;
+	int channel = irq - 14;
+	ideInts[channel] = 1;
+	
+	if (ideDMAActive[channel])
+	{
+		ideDMAActive[channel] = 0;
+		wcUp(&ideDMAWait[channel]);
+	};
+};
+
+/**
+ * Set up bus mastering for a channel, if the controller supports it. On failure, the channel
+ * simply stays in PIO mode.
+ */
+static void ideInitDMA(IDEController *ctrl, int channel)
+{
+	IDEChannel *chan = &ctrl->channels[channel];
+	
+	// BAR4 must be an I/O BAR
+	uint32_t bar = ctrl->pcidev->bar[4];
+	if ((bar & 1) == 0 || (bar & 0xFFFFFFFC) == 0)
+	{
+		return;
+	};
+	
+	chan->bmide = (bar & 0xFFFFFFFC) + 8 * channel;
+	
+	if (dmaCreateBuffer(&chan->prdBuffer, sizeof(IDEPRD) * IDE_PRD_MAX, DMA_32BIT) != 0)
+	{
+		return;
+	};
+	
+	if (dmaCreateBuffer(&chan->bounceBuffer, IDE_BOUNCE_SIZE, DMA_32BIT) != 0)
+	{
+		dmaReleaseBuffer(&chan->prdBuffer);
+		return;
+	};
+	
+	chan->prdt = (IDEPRD*) dmaGetPtr(&chan->prdBuffer);
+	chan->bounce = dmaGetPtr(&chan->bounceBuffer);
+	
+	// stop the engine and clear any stale error/interrupt status
+	outb(chan->bmide + BM_REG_COMMAND, 0);
+	outb(chan->bmide + BM_REG_STATUS, BM_SR_ERR | BM_SR_IRQ);
+	outd(chan->bmide + BM_REG_PRDT, (uint32_t) dmaGetPhys(&chan->prdBuffer));
+	
+	chan->dma = 1;
 };
 
 static void ideInit(IDEController *ctrl)
@@ -78,6 +130,14 @@ static void ideInit(IDEController *ctrl)
 	if (ctrl->pcidev->bar[3] == 0) ctrl->channels[ATA_SECONDARY].ctrl = 0x376;
 	else ctrl->channels[ATA_SECONDARY].ctrl = ctrl->pcidev->bar[3] & 0xFFFFFFFC;
 	
+	// bus mastering; the programming interface has bit 7 set if it is supported
+	if (ctrl->pcidev->progif & 0x80)
+	{
+		pciSetBusMastering(ctrl->pcidev, 1);
+		ideInitDMA(ctrl, ATA_PRIMARY);
+		ideInitDMA(ctrl, ATA_SECONDARY);
+	};
+	
 	// disable interrupts for both channels
 	outb(ctrl->channels[ATA_PRIMARY].ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN);
 	outb(ctrl->channels[ATA_SECONDARY].ctrl + ATA_CREG_CONTROL, ATA_CTRL_NIEN);
@@ -194,6 +254,10 @@ static void ideInit(IDEController *ctrl)
 				ctrl->devs[index].channel = channel;
 				ctrl->devs[index].slot = slot;
 				ctrl->devs[index].ctrl = ctrl;
+				
+				uint16_t caps = *((uint16_t*)(identBuf + ATA_IDENT_CAPABILITIES));
+				ctrl->devs[index].dma = ctrl->channels[channel].dma && (caps & ATA_CAP_DMA);
+				
 				ctrl->devs[index].sd = sdCreate(&sdpars, model, &ataOps, &ctrl->devs[index]);
 			}
 			else if (type == IDE_ATAPI)
@@ -247,6 +311,9 @@ static int ideEnumerator(PCIDevice *dev, void *param)
 
 MODULE_INIT(const char *opt)
 {
+	wcInit(&ideDMAWait[ATA_PRIMARY]);
+	wcInit(&ideDMAWait[ATA_SECONDARY]);
+	
 	registerIRQHandler(14, ideIrqHandler);
 	registerIRQHandler(15, ideIrqHandler);
 	
@@ -279,6 +346,17 @@ MODULE_FINI()
 		{
 			sdHangup(ctrl->devs[i].sd);
 		};
+		
+		for (i=0; i<2; i++)
+		{
+			IDEChannel *chan = &ctrl->channels[i];
+			if (chan->prdt != NULL)
+			{
+				outb(chan->bmide + BM_REG_COMMAND, 0);
+				dmaReleaseBuffer(&chan->prdBuffer);
+				dmaReleaseBuffer(&chan->bounceBuffer);
+			};
+		};
 
 		pciReleaseDevice(ctrl->pcidev);
 		kfree(ctrl);
@@ -32,6 +32,8 @@
 #include <glidix/util/common.h>
 #include <glidix/storage/storage.h>
 #include <glidix/hw/pci.h>
+#include <glidix/hw/dma.h>
+#include <glidix/thread/waitcnt.h>
 
 /* status register */
 #define ATA_SR_BSY			0x80    // Busy
@@ -119,6 +121,45 @@
 /* command sets */
 #define	ATA_CMDSET_LBA_EXT		(1 << 26)
 
+/* capabilities (word 49 of identification) */
+#define	ATA_CAP_DMA			(1 << 8)
+
+/* bus master registers, from bus master base of the channel */
+#define	BM_REG_COMMAND			0x00
+#define	BM_REG_STATUS			0x02
+#define	BM_REG_PRDT			0x04
+
+/* bus master command bits */
+#define	BM_CMD_START			(1 << 0)
+#define	BM_CMD_READ			(1 << 3)		/* device to memory */
+
+/* bus master status bits */
+#define	BM_SR_ACTIVE			(1 << 0)
+#define	BM_SR_ERR			(1 << 1)
+#define	BM_SR_IRQ			(1 << 2)
+
+/* PRD flags */
+#define	IDE_PRD_EOT			0x8000
+
+/**
+ * Number of PRD entries per channel (the table takes up exactly one page), and the
+ * size of the bounce buffer used for parts of memory the controller cannot reach.
+ * The largest single transfer is one bounce buffer, which is also 256 sectors, the
+ * most an LBA28 command can describe.
+ */
+#define	IDE_PRD_MAX			512
+#define	IDE_BOUNCE_SIZE			0x20000
+
+/**
+ * Physical Region Descriptor, as read by the bus master.
+ */
+typedef struct
+{
+	uint32_t				phys;
+	uint16_t				size;		// 0 = 64KB
+	uint16_t				flags;
+} PACKED IDEPRD;
+
 /**
  * Describes a channel.
  */
@@ -126,6 +167,21 @@ typedef struct
 {
 	uint16_t				base;	// I/O base
 	uint16_t				ctrl;	// control base
+	uint16_t				bmide;	// bus master base (0 = no bus mastering)
+	
+	/**
+	 * Nonzero if DMA may be used on this channel; cleared if the bus master ever fails,
+	 * so that all further transfers fall back to PIO.
+	 */
+	int					dma;
+	
+	/**
+	 * The PRD table, and the bounce buffer; both are below 4GB.
+	 */
+	DMABuffer				prdBuffer;
+	IDEPRD*					prdt;
+	DMABuffer				bounceBuffer;
+	void*					bounce;
 } IDEChannel;
 
 struct IDEController_;
@@ -159,6 +215,11 @@ typedef struct
 	 * The thread which handles this device.
 	 */
 	Thread*					thread;
+	
+	/**
+	 * Nonzero if the drive reports DMA support.
+	 */
+	int					dma;
 } IDEDevice;
 
 /**
@@ -195,4 +256,11 @@ typedef struct IDEController_
 
 extern volatile int ideInts[2];
 
+/**
+ * Completion of bus master transfers; ideDMAActive[channel] is set while a DMA command
+ * is in progress, and the interrupt handler then signals ideDMAWait[channel].
+ */
+extern volatile int ideDMAActive[2];
+extern WaitCounter ideDMAWait[2];
+
 #endif
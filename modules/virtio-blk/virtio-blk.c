@@ -0,0 +1,455 @@
+/*
+	Glidix kernel
+
+	Copyright (c) 2014-2017, Madd Games.
+	All rights reserved.
+	
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+	
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <glidix/module/module.h>
+#include <glidix/display/console.h>
+#include <glidix/storage/storage.h>
+#include <glidix/util/string.h>
+#include <glidix/util/memory.h>
+#include <glidix/hw/pci.h>
+#include <glidix/hw/port.h>
+#include <glidix/hw/dma.h>
+#include <glidix/hw/physmem.h>
+
+#include "virtio-blk.h"
+
+static VirtioBlkDevice *firstDev;
+static VirtioBlkDevice *lastDev;
+static int numDevFound;
+
+static int vblkAllocSlot(VirtioBlkDevice *dev)
+{
+	semWait(&dev->semSlots);
+	
+	while (1)
+	{
+		uint32_t free = dev->freeSlots;
+		int slot = __builtin_ctz(free);
+		
+		if (__sync_bool_compare_and_swap(&dev->freeSlots, free, free & ~(1U << slot)))
+		{
+			return slot;
+		};
+	};
+};
+
+static void vblkFreeSlot(VirtioBlkDevice *dev, int slot)
+{
+	__sync_fetch_and_or(&dev->freeSlots, 1U << slot);
+	semSignal(&dev->semSlots);
+};
+
+/**
+ * Return the descriptors which make up the request chain of a slot. Descriptor 0 is the header,
+ * the data segments start at 1. The index of the first one, as seen by the device, is stored in
+ * 'firstOut' (it is relative to the indirect table if indirect descriptors are used).
+ */
+static volatile VirtqDesc* vblkGetChain(VirtioBlkDevice *dev, int slot, uint16_t *firstOut)
+{
+	if (dev->indirect)
+	{
+		*firstOut = 0;
+		return (volatile VirtqDesc*) ((char*) dmaGetPtr(&dev->slotBuf) + 0x1000 * slot + VBLK_SLOT_TABLE);
+	}
+	else
+	{
+		*firstOut = slot * dev->chainLen;
+		return &dev->desc[slot * dev->chainLen];
+	};
+};
+
+/**
+ * Set the data segment 'index' (counting from 0) of a slot's chain.
+ */
+static void vblkSetSegment(VirtioBlkDevice *dev, int slot, int index, int type, uint64_t phys, uint32_t size)
+{
+	uint16_t first;
+	volatile VirtqDesc *chain = vblkGetChain(dev, slot, &first);
+	
+	chain[index+1].addr = phys;
+	chain[index+1].len = size;
+	chain[index+1].flags = VIRTQ_DESC_F_NEXT | (type == SD_REQ_READ ? VIRTQ_DESC_F_WRITE : 0);
+	chain[index+1].next = first + index + 2;
+};
+
+/**
+ * Complete the chain of a slot which has 'numSegs' data segments set up, submit it, and sleep until
+ * the interrupt handler reports its completion. Returns 0 on success, or EIO on error.
+ */
+static int vblkIssue(VirtioBlkDevice *dev, int slot, int type, size_t sector, int numSegs)
+{
+	uint64_t slotPhys = dmaGetPhys(&dev->slotBuf) + 0x1000 * slot;
+	char *slotPtr = (char*) dmaGetPtr(&dev->slotBuf) + 0x1000 * slot;
+	
+	VirtioBlkHeader *header = (VirtioBlkHeader*) (slotPtr + VBLK_SLOT_HEADER);
+	header->type = (type == SD_REQ_WRITE) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	header->reserved = 0;
+	header->sector = sector;
+	
+	volatile uint8_t *status = (volatile uint8_t*) (slotPtr + VBLK_SLOT_STATUS);
+	*status = 0xFF;
+	
+	uint16_t first;
+	volatile VirtqDesc *chain = vblkGetChain(dev, slot, &first);
+	
+	chain[0].addr = slotPhys + VBLK_SLOT_HEADER;
+	chain[0].len = sizeof(VirtioBlkHeader);
+	chain[0].flags = VIRTQ_DESC_F_NEXT;
+	chain[0].next = first + 1;
+	
+	chain[numSegs+1].addr = slotPhys + VBLK_SLOT_STATUS;
+	chain[numSegs+1].len = 1;
+	chain[numSegs+1].flags = VIRTQ_DESC_F_WRITE;
+	chain[numSegs+1].next = 0;
+	
+	uint16_t head = first;
+	if (dev->indirect)
+	{
+		// the ring descriptor with the slot's index points to its table
+		dev->desc[slot].addr = slotPhys + VBLK_SLOT_TABLE;
+		dev->desc[slot].len = sizeof(VirtqDesc) * (numSegs + 2);
+		dev->desc[slot].flags = VIRTQ_DESC_F_INDIRECT;
+		dev->desc[slot].next = 0;
+		head = slot;
+	};
+	
+	uint64_t flags = getFlagsRegister();
+	cli();
+	spinlockAcquire(&dev->queueLock);
+	
+	uint16_t idx = dev->avail->idx;
+	dev->avail->ring[idx % dev->queueSize] = head;
+	__sync_synchronize();
+	dev->avail->idx = idx + 1;
+	__sync_synchronize();
+	
+	if ((dev->used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0)
+	{
+		outw(dev->iobase + VIRTIO_REG_QUEUE_NOTIFY, 0);
+	};
+	
+	spinlockRelease(&dev->queueLock);
+	setFlagsRegister(flags);
+	
+	wcDown(&dev->wcSlots[slot]);
+	
+	if (*status != VIRTIO_BLK_S_OK)
+	{
+		return EIO;
+	};
+	
+	return 0;
+};
+
+static int vblkIrqHandler(void *context)
+{
+	VirtioBlkDevice *dev = (VirtioBlkDevice*) context;
+	
+	// reading the ISR status acknowledges the interrupt
+	if (inb(dev->iobase + VIRTIO_REG_ISR) == 0)
+	{
+		return -1;
+	};
+	
+	spinlockAcquire(&dev->queueLock);
+	
+	while (dev->lastUsed != dev->used->idx)
+	{
+		__sync_synchronize();
+		uint32_t id = dev->used->ring[dev->lastUsed % dev->queueSize].id;
+		dev->lastUsed++;
+		
+		int slot = dev->indirect ? (int) id : (int) (id / dev->chainLen);
+		wcUp(&dev->wcSlots[slot]);
+	};
+	
+	spinlockRelease(&dev->queueLock);
+	return 0;
+};
+
+static int vblkTransfer(VirtioBlkDevice *dev, int type, size_t startBlock, size_t numBlocks, const void *buffer)
+{
+	int slot = vblkAllocSlot(dev);
+	int numSegs = 0;
+	size_t segBytes = 0;
+	int status = 0;
+	
+	DMARegion reg;
+	for (dmaFirstRegion(&reg, buffer, 512*numBlocks, 0); reg.physAddr!=0; dmaNextRegion(&reg))
+	{
+		// if the chain is full, issue what we have so far and continue with another request;
+		// this is only possible on a sector boundary
+		if (numSegs == dev->maxSegs)
+		{
+			if (segBytes & 511)
+			{
+				status = EIO;
+				break;
+			};
+			
+			status = vblkIssue(dev, slot, type, startBlock, numSegs);
+			if (status != 0) break;
+			
+			startBlock += segBytes / 512;
+			numSegs = 0;
+			segBytes = 0;
+		};
+		
+		vblkSetSegment(dev, slot, numSegs++, type, reg.physAddr, reg.physSize);
+		segBytes += reg.physSize;
+	};
+	
+	if (status == 0 && numSegs != 0)
+	{
+		status = vblkIssue(dev, slot, type, startBlock, numSegs);
+	};
+	
+	vblkFreeSlot(dev, slot);
+	return status;
+};
+
+static int vblkReadBlocks(void *drvdata, size_t startBlock, size_t numBlocks, void *buffer)
+{
+	return vblkTransfer((VirtioBlkDevice*) drvdata, SD_REQ_READ, startBlock, numBlocks, buffer);
+};
+
+static int vblkWriteBlocks(void *drvdata, size_t startBlock, size_t numBlocks, const void *buffer)
+{
+	return vblkTransfer((VirtioBlkDevice*) drvdata, SD_REQ_WRITE, startBlock, numBlocks, buffer);
+};
+
+static int vblkTransferFrames(void *drvdata, int type, size_t startBlock, size_t numBlocks, const uint64_t *frames)
+{
+	VirtioBlkDevice *dev = (VirtioBlkDevice*) drvdata;
+	size_t numFrames = numBlocks / 8;			// 512-byte sectors
+	
+	while (numFrames > 0)
+	{
+		int slot = vblkAllocSlot(dev);
+		
+		// one segment for each run of contiguous frames, as many as fit in the chain
+		int numSegs = 0;
+		size_t done = 0;
+		
+		while (done < numFrames && numSegs < dev->maxSegs)
+		{
+			size_t run = 1;
+			while ((done+run) < numFrames && frames[done+run] == (frames[done]+run)) run++;
+			
+			vblkSetSegment(dev, slot, numSegs++, type, frames[done] << 12, run << 12);
+			done += run;
+		};
+		
+		int status = vblkIssue(dev, slot, type, startBlock, numSegs);
+		vblkFreeSlot(dev, slot);
+		if (status != 0) return status;
+		
+		startBlock += done * 8;
+		frames += done;
+		numFrames -= done;
+	};
+	
+	return 0;
+};
+
+static SDOps vblkOpsTemplate = {
+	.size = sizeof(SDOps),
+	.readBlocks = vblkReadBlocks,
+	.writeBlocks = vblkWriteBlocks,
+	.queueDepth = VBLK_MAX_SLOTS,
+	.transferFrames = vblkTransferFrames,
+};
+
+static void vblkInit(VirtioBlkDevice *dev)
+{
+	dev->iobase = dev->pcidev->bar[0] & ~3;
+	pciSetBusMastering(dev->pcidev, 1);
+	
+	// reset, then tell the device we found it and can drive it
+	outb(dev->iobase + VIRTIO_REG_STATUS, 0);
+	outb(dev->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+	outb(dev->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	
+	uint32_t features = ind(dev->iobase + VIRTIO_REG_DEVICE_FEATURES);
+	features &= VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_F_RING_INDIRECT_DESC;
+	outd(dev->iobase + VIRTIO_REG_GUEST_FEATURES, features);
+	dev->indirect = !!(features & VIRTIO_F_RING_INDIRECT_DESC);
+	
+	// set up queue 0
+	outw(dev->iobase + VIRTIO_REG_QUEUE_SELECT, 0);
+	dev->queueSize = inw(dev->iobase + VIRTIO_REG_QUEUE_SIZE);
+	
+	size_t qsize = dev->queueSize;
+	size_t usedOffset = (sizeof(VirtqDesc) * qsize + sizeof(VirtqAvail) + 2 * qsize + 2 + 0xFFF) & ~0xFFFUL;
+	size_t queueBytes = usedOffset + ((sizeof(VirtqUsed) + sizeof(VirtqUsedElem) * qsize + 2 + 0xFFF) & ~0xFFFUL);
+	
+	if (qsize == 0 || dmaCreateBuffer(&dev->queueBuf, queueBytes, 0) != 0)
+	{
+		kprintf("virtio-blk: cannot set up the request queue\n");
+		outb(dev->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+		return;
+	};
+	
+	char *queuePtr = (char*) dmaGetPtr(&dev->queueBuf);
+	memset(queuePtr, 0, queueBytes);
+	dev->desc = (volatile VirtqDesc*) queuePtr;
+	dev->avail = (volatile VirtqAvail*) (queuePtr + sizeof(VirtqDesc) * qsize);
+	dev->used = (volatile VirtqUsed*) (queuePtr + usedOffset);
+	dev->lastUsed = 0;
+	
+	// divide the queue between slots
+	if (dev->indirect)
+	{
+		dev->numSlots = VBLK_MAX_SLOTS;
+		if (dev->numSlots > qsize) dev->numSlots = qsize;
+		dev->chainLen = VBLK_INDIRECT_MAX;
+	}
+	else
+	{
+		dev->numSlots = qsize / VBLK_DIRECT_CHAIN;
+		if (dev->numSlots > VBLK_MAX_SLOTS) dev->numSlots = VBLK_MAX_SLOTS;
+		if (dev->numSlots == 0) dev->numSlots = 1;
+		dev->chainLen = qsize / dev->numSlots;
+	};
+	
+	dev->maxSegs = dev->chainLen - 2;
+	if (features & VIRTIO_BLK_F_SEG_MAX)
+	{
+		uint32_t segMax = ind(dev->iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_SEG_MAX);
+		if (segMax != 0 && segMax < dev->maxSegs) dev->maxSegs = segMax;
+	};
+	
+	if (dev->maxSegs < 2 || dmaCreateBuffer(&dev->slotBuf, 0x1000 * dev->numSlots, 0) != 0)
+	{
+		kprintf("virtio-blk: cannot set up request slots\n");
+		dmaReleaseBuffer(&dev->queueBuf);
+		outb(dev->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+		return;
+	};
+	
+	dev->freeSlots = (dev->numSlots == 32) ? 0xFFFFFFFF : ((1U << dev->numSlots) - 1);
+	semInit2(&dev->semSlots, dev->numSlots);
+	spinlockRelease(&dev->queueLock);
+	
+	int i;
+	for (i=0; i<dev->numSlots; i++)
+	{
+		wcInit(&dev->wcSlots[i]);
+	};
+	
+	outd(dev->iobase + VIRTIO_REG_QUEUE_ADDR, (uint32_t) (dmaGetPhys(&dev->queueBuf) >> 12));
+	
+	pciSetIrqHandler(dev->pcidev, vblkIrqHandler, dev);
+	outb(dev->iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	
+	// a buffer spanning N pages may start partway through a page, so it needs up to N+1 segments
+	memcpy(&dev->ops, &vblkOpsTemplate, sizeof(SDOps));
+	dev->ops.maxTransfer = 0x1000 * (dev->maxSegs - 1);
+	dev->ops.queueDepth = dev->numSlots;
+	
+	uint64_t capacity = (uint64_t) ind(dev->iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY)
+		| ((uint64_t) ind(dev->iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+	
+	SDParams sdpars;
+	sdpars.flags = (features & VIRTIO_BLK_F_RO) ? SD_READONLY : 0;
+	sdpars.blockSize = 512;
+	sdpars.totalSize = capacity << 9;
+	
+	kprintf("virtio-blk: %lu sectors, queue size %d, %d slots of %d segments%s\n", capacity,
+		(int) dev->queueSize, dev->numSlots, dev->maxSegs, dev->indirect ? " (indirect)" : "");
+	dev->sd = sdCreate(&sdpars, "Virtio Block Device", &dev->ops, dev);
+};
+
+static int vblkEnumerator(PCIDevice *pcidev, void *ignore)
+{
+	if (pcidev->vendor == VIRTIO_VENDOR && pcidev->device == VIRTIO_DEVICE_BLK)
+	{
+		strcpy(pcidev->deviceName, "Virtio Block Device");
+		
+		VirtioBlkDevice *dev = NEW(VirtioBlkDevice);
+		memset(dev, 0, sizeof(VirtioBlkDevice));
+		dev->pcidev = pcidev;
+		
+		if (lastDev == NULL)
+		{
+			firstDev = lastDev = dev;
+		}
+		else
+		{
+			lastDev->next = dev;
+			lastDev = dev;
+		};
+		
+		numDevFound++;
+		return 1;
+	};
+	
+	return 0;
+};
+
+MODULE_INIT()
+{
+	pciEnumDevices(THIS_MODULE, vblkEnumerator, NULL);
+	
+	kprintf("virtio-blk: found %d devices, initializing\n", numDevFound);
+	VirtioBlkDevice *dev;
+	for (dev=firstDev; dev!=NULL; dev=dev->next)
+	{
+		vblkInit(dev);
+	};
+	
+	return MODINIT_OK;
+};
+
+MODULE_FINI()
+{
+	kprintf("virtio-blk: removing devices\n");
+	
+	VirtioBlkDevice *dev;
+	while (firstDev != NULL)
+	{
+		dev = firstDev;
+		firstDev = dev->next;
+		
+		if (dev->sd != NULL)
+		{
+			sdHangup(dev->sd);
+			
+			// resetting the device stops it from using the queue
+			outb(dev->iobase + VIRTIO_REG_STATUS, 0);
+			dmaReleaseBuffer(&dev->slotBuf);
+			dmaReleaseBuffer(&dev->queueBuf);
+		};
+		
+		pciSetBusMastering(dev->pcidev, 0);
+		pciReleaseDevice(dev->pcidev);
+		kfree(dev);
+	};
+	
+	return 0;
+};
@@ -0,0 +1,204 @@
+/*
+	Glidix kernel
+
+	Copyright (c) 2014-2017, Madd Games.
+	All rights reserved.
+	
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+	
+	* Redistributions of source code must retain the above copyright notice, this
+	  list of conditions and the following disclaimer.
+	
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+	DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+	FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+	DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+	SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+	CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+	OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef VIRTIO_BLK_H_
+#define VIRTIO_BLK_H_
+
+#include <glidix/util/common.h>
+#include <glidix/storage/storage.h>
+#include <glidix/hw/pci.h>
+#include <glidix/hw/dma.h>
+#include <glidix/thread/semaphore.h>
+#include <glidix/thread/spinlock.h>
+#include <glidix/thread/waitcnt.h>
+
+/**
+ * PCI IDs. Only the transitional device is supported, since it is driven through the legacy
+ * I/O interface in BAR0.
+ */
+#define	VIRTIO_VENDOR			0x1AF4
+#define	VIRTIO_DEVICE_BLK		0x1001
+
+/* legacy registers, from BAR0 */
+#define	VIRTIO_REG_DEVICE_FEATURES	0x00
+#define	VIRTIO_REG_GUEST_FEATURES	0x04
+#define	VIRTIO_REG_QUEUE_ADDR		0x08
+#define	VIRTIO_REG_QUEUE_SIZE		0x0C
+#define	VIRTIO_REG_QUEUE_SELECT		0x0E
+#define	VIRTIO_REG_QUEUE_NOTIFY		0x10
+#define	VIRTIO_REG_STATUS		0x12
+#define	VIRTIO_REG_ISR			0x13
+#define	VIRTIO_REG_CONFIG		0x14		/* without MSI-X */
+
+/* device status bits */
+#define	VIRTIO_STATUS_ACK		(1 << 0)
+#define	VIRTIO_STATUS_DRIVER		(1 << 1)
+#define	VIRTIO_STATUS_DRIVER_OK		(1 << 2)
+#define	VIRTIO_STATUS_FAILED		(1 << 7)
+
+/* feature bits */
+#define	VIRTIO_BLK_F_SEG_MAX		(1 << 2)
+#define	VIRTIO_BLK_F_RO			(1 << 5)
+#define	VIRTIO_F_RING_INDIRECT_DESC	(1 << 28)
+
+/* block device configuration, from VIRTIO_REG_CONFIG */
+#define	VIRTIO_BLK_CFG_CAPACITY		0x00
+#define	VIRTIO_BLK_CFG_SEG_MAX		0x0C
+
+/* descriptor flags */
+#define	VIRTQ_DESC_F_NEXT		1
+#define	VIRTQ_DESC_F_WRITE		2
+#define	VIRTQ_DESC_F_INDIRECT		4
+
+/* used ring flags */
+#define	VIRTQ_USED_F_NO_NOTIFY		1
+
+/* request types and status */
+#define	VIRTIO_BLK_T_IN			0
+#define	VIRTIO_BLK_T_OUT		1
+#define	VIRTIO_BLK_S_OK			0
+
+/**
+ * Maximum number of requests in flight on one device.
+ */
+#define	VBLK_MAX_SLOTS			32
+
+/**
+ * Each slot has a page holding the request header, the status byte, and (if indirect descriptors
+ * are supported) the descriptor table for the request.
+ */
+#define	VBLK_SLOT_HEADER		0x00
+#define	VBLK_SLOT_STATUS		0x10
+#define	VBLK_SLOT_TABLE			0x40
+#define	VBLK_INDIRECT_MAX		((0x1000 - VBLK_SLOT_TABLE) / sizeof(VirtqDesc))
+
+/**
+ * Without indirect descriptors, the ring is split evenly between slots; each slot gets at least
+ * this many descriptors.
+ */
+#define	VBLK_DIRECT_CHAIN		32
+
+typedef struct
+{
+	uint64_t				addr;
+	uint32_t				len;
+	uint16_t				flags;
+	uint16_t				next;
+} PACKED VirtqDesc;
+
+typedef struct
+{
+	uint16_t				flags;
+	uint16_t				idx;
+	uint16_t				ring[];
+} PACKED VirtqAvail;
+
+typedef struct
+{
+	uint32_t				id;
+	uint32_t				len;
+} PACKED VirtqUsedElem;
+
+typedef struct
+{
+	uint16_t				flags;
+	uint16_t				idx;
+	VirtqUsedElem				ring[];
+} PACKED VirtqUsed;
+
+typedef struct
+{
+	uint32_t				type;
+	uint32_t				reserved;
+	uint64_t				sector;
+} PACKED VirtioBlkHeader;
+
+/**
+ * Describes a virtio block device.
+ */
+typedef struct VirtioBlkDevice_
+{
+	/**
+	 * Next device.
+	 */
+	struct VirtioBlkDevice_*		next;
+	
+	/**
+	 * The PCI device, and its legacy I/O base.
+	 */
+	PCIDevice*				pcidev;
+	uint16_t				iobase;
+	
+	/**
+	 * The request virtqueue (queue 0), and the index of the next used ring entry to consume.
+	 */
+	DMABuffer				queueBuf;
+	uint16_t				queueSize;
+	volatile VirtqDesc*			desc;
+	volatile VirtqAvail*			avail;
+	volatile VirtqUsed*			used;
+	uint16_t				lastUsed;
+	
+	/**
+	 * Nonzero if indirect descriptors were negotiated.
+	 */
+	int					indirect;
+	
+	/**
+	 * Request slots: one page each in 'slotBuf'. 'chainLen' is the number of descriptors each slot
+	 * may use, and 'maxSegs' the number of data segments in one request.
+	 */
+	DMABuffer				slotBuf;
+	int					numSlots;
+	int					chainLen;
+	int					maxSegs;
+	
+	/**
+	 * Bitmap of free slots, and a semaphore counting them.
+	 */
+	uint32_t				freeSlots;
+	Semaphore				semSlots;
+	
+	/**
+	 * Protects the available ring.
+	 */
+	Spinlock				queueLock;
+	
+	/**
+	 * Signalled by the interrupt handler when the request in a slot completes.
+	 */
+	WaitCounter				wcSlots[VBLK_MAX_SLOTS];
+	
+	/**
+	 * Driver operations; per device, since the transfer limit depends on what was negotiated.
+	 */
+	SDOps					ops;
+	StorageDevice*				sd;
+} VirtioBlkDevice;
+
+#endif
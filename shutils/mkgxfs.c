@@ -42,6 +42,14 @@
 #define	GXFS_MAGIC				(*((const uint64_t*)"__GXFS__"))
 
 #define	GXFS_FEATURE_BASE			(1 << 0)
+#define	GXFS_FEATURE_BITMAP			(1 << 1)
+#define	GXFS_FEATURE_EXTENTS			(1 << 2)
+#define	GXFS_FEATURE_DIRINDEX			(1 << 3)
+
+#define	GXFS_RF_DIRTY				(1 << 0)
+
+/* number of blocks described by a single bitmap block */
+#define	GXFS_GROUP_BLOCKS			(4096 * 8)
 
 typedef struct
 {
@@ -64,6 +72,8 @@ typedef struct
 	uint64_t sbbLastMountTime;
 	uint64_t sbbLastCheckTime;
 	uint64_t sbbRuntimeFlags;
+	uint64_t sbbBitmapStart;
+	uint64_t sbbBitmapBlocks;
 } GXFS_SuperblockBody;
 
 typedef struct
@@ -176,13 +186,166 @@ void doChecksum(uint64_t *ptr)
 	*ptr = state;
 };
 
+void markUsed(uint8_t *bitmap, uint64_t block)
+{
+	bitmap[block >> 3] |= (1 << (block & 7));
+};
+
+void markFree(uint8_t *bitmap, uint64_t block)
+{
+	bitmap[block >> 3] &= ~(1 << (block & 7));
+};
+
+/**
+ * Convert an existing filesystem from the free list to a free-space bitmap. The bitmap is placed at the end of
+ * the filesystem, which must not have been used yet. Returns the exit status.
+ */
+int convertToBitmap(const char *progName, const char *filename)
+{
+	int fd = open(filename, O_RDWR);
+	if (fd == -1)
+	{
+		fprintf(stderr, "%s: cannot open %s: %s\n", progName, filename, strerror(errno));
+		return 1;
+	};
+	
+	char block[4096];
+	if (pread(fd, block, 4096, 0x200000) != 4096)
+	{
+		fprintf(stderr, "%s: cannot read the superblock: %s\n", progName, strerror(errno));
+		close(fd);
+		return 1;
+	};
+	
+	GXFS_SuperblockHeader *sbh = (GXFS_SuperblockHeader*) block;
+	GXFS_SuperblockBody *sbb = (GXFS_SuperblockBody*) &sbh[1];
+	
+	uint64_t checksum = sbh->sbhChecksum;
+	doChecksum((uint64_t*) sbh);
+	if (sbh->sbhMagic != GXFS_MAGIC || sbh->sbhChecksum != checksum)
+	{
+		fprintf(stderr, "%s: %s does not contain a valid GXFS filesystem\n", progName, filename);
+		close(fd);
+		return 1;
+	};
+	
+	if (sbh->sbhWriteFeatures & GXFS_FEATURE_BITMAP)
+	{
+		fprintf(stderr, "%s: %s already uses a free-space bitmap\n", progName, filename);
+		close(fd);
+		return 0;
+	};
+	
+	if (sbb->sbbRuntimeFlags & GXFS_RF_DIRTY)
+	{
+		fprintf(stderr, "%s: %s is mounted or was not cleanly unmounted\n", progName, filename);
+		close(fd);
+		return 1;
+	};
+	
+	uint64_t totalBlocks = sbb->sbbTotalBlocks;
+	uint64_t bitmapBlocks = (totalBlocks + GXFS_GROUP_BLOCKS - 1) / GXFS_GROUP_BLOCKS;
+	uint64_t bitmapStart = totalBlocks - bitmapBlocks;
+	
+	// blocks at or above sbbUsedBlocks have never been allocated, so the end of the filesystem is free
+	// unless it is full
+	if (sbb->sbbUsedBlocks > bitmapStart)
+	{
+		fprintf(stderr, "%s: not enough space at the end of %s for the bitmap\n", progName, filename);
+		close(fd);
+		return 1;
+	};
+	
+	uint8_t *bitmap = (uint8_t*) malloc(bitmapBlocks * 4096);
+	if (bitmap == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", progName);
+		close(fd);
+		return 1;
+	};
+	
+	// everything below the allocation mark is in use unless it is on the free list; everything at or above
+	// it is free, except the bitmap itself and the bits past the end of the filesystem
+	memset(bitmap, 0xFF, bitmapBlocks * 4096);
+	uint64_t i;
+	for (i=sbb->sbbUsedBlocks; i<bitmapStart; i++)
+	{
+		markFree(bitmap, i);
+	};
+	
+	uint64_t freeHead = sbb->sbbFreeHead;
+	uint64_t listed = 0;
+	while (freeHead != 0)
+	{
+		if (freeHead >= sbb->sbbUsedBlocks || listed++ == totalBlocks)
+		{
+			fprintf(stderr, "%s: the free list is corrupt; run a filesystem check first\n", progName);
+			free(bitmap);
+			close(fd);
+			return 1;
+		};
+		
+		markFree(bitmap, freeHead);
+		
+		uint64_t next;
+		if (pread(fd, &next, 8, 0x200000 + (freeHead << 12)) != 8)
+		{
+			fprintf(stderr, "%s: cannot read the free list: %s\n", progName, strerror(errno));
+			free(bitmap);
+			close(fd);
+			return 1;
+		};
+		
+		freeHead = next;
+	};
+	
+	uint64_t usedBlocks = 0;
+	for (i=0; i<totalBlocks; i++)
+	{
+		if (bitmap[i >> 3] & (1 << (i & 7))) usedBlocks++;
+	};
+	
+	if (pwrite(fd, bitmap, bitmapBlocks * 4096, 0x200000 + (bitmapStart << 12)) != (ssize_t) (bitmapBlocks * 4096))
+	{
+		fprintf(stderr, "%s: cannot write the bitmap: %s\n", progName, strerror(errno));
+		free(bitmap);
+		close(fd);
+		return 1;
+	};
+	
+	free(bitmap);
+	
+	sbh->sbhWriteFeatures |= GXFS_FEATURE_BITMAP;
+	doChecksum((uint64_t*) sbh);
+	
+	sbb->sbbUsedBlocks = usedBlocks;
+	sbb->sbbFreeHead = 0;
+	sbb->sbbBitmapStart = bitmapStart;
+	sbb->sbbBitmapBlocks = bitmapBlocks;
+	
+	if (pwrite(fd, block, 4096, 0x200000) != 4096)
+	{
+		fprintf(stderr, "%s: cannot write the superblock: %s\n", progName, strerror(errno));
+		close(fd);
+		return 1;
+	};
+	
+	close(fd);
+	return 0;
+};
+
 int main(int argc, char *argv[])
 {	
 	const char *filename = NULL;
+	int convert = 0;
 	int n;
 	for (n=1; n<argc; n++)
 	{
-		if (argv[n][0] != '-')
+		if (strcmp(argv[n], "--convert") == 0)
+		{
+			convert = 1;
+		}
+		else if (argv[n][0] != '-')
 		{
 			if (filename != NULL)
 			{
@@ -206,9 +369,16 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "USAGE:\t%s <device>\n", argv[0]);
 		fprintf(stderr, "\tCreate a GXFS filesystem on the specified device or image.\n");
 		fprintf(stderr, "\tWARNING: This will delete all data on the device!\n");
+		fprintf(stderr, "\n\t%s --convert <device>\n", argv[0]);
+		fprintf(stderr, "\tConvert an existing (unmounted) GXFS filesystem to use a free-space bitmap.\n");
 		return 1;
 	};
 	
+	if (convert)
+	{
+		return convertToBitmap(argv[0], filename);
+	};
+	
 	int fd = open(filename, O_RDWR);
 	if (fd == -1)
 	{
@@ -246,21 +416,51 @@ int main(int argc, char *argv[])
 	sbh->sbhMagic = GXFS_MAGIC;
 	generateMGSID(sbh->sbhBootID);
 	sbh->sbhFormatTime = formatTime;
-	sbh->sbhWriteFeatures = GXFS_FEATURE_BASE;
-	sbh->sbhReadFeatures = GXFS_FEATURE_BASE;
+	sbh->sbhWriteFeatures = GXFS_FEATURE_BASE | GXFS_FEATURE_BITMAP | GXFS_FEATURE_EXTENTS | GXFS_FEATURE_DIRINDEX;
+	sbh->sbhReadFeatures = GXFS_FEATURE_BASE | GXFS_FEATURE_EXTENTS | GXFS_FEATURE_DIRINDEX;
 	sbh->sbhOptionalFeatures = 0;
 	doChecksum((uint64_t*) sbh);
 
+	uint64_t totalBlocks = (st.st_size - 0x200000) >> 12;
+	uint64_t bitmapBlocks = (totalBlocks + GXFS_GROUP_BLOCKS - 1) / GXFS_GROUP_BLOCKS;
+	
 	sbb->sbbResvBlocks = 8;
-	sbb->sbbUsedBlocks = 9;			/* reserved + /boot (inode 8) */
-	sbb->sbbTotalBlocks = (st.st_size - 0x200000) >> 12;
+	sbb->sbbUsedBlocks = 9 + bitmapBlocks;	/* reserved + /boot (inode 8) + the bitmap */
+	sbb->sbbTotalBlocks = totalBlocks;
 	sbb->sbbFreeHead = 0;
 	sbb->sbbLastMountTime = formatTime;
 	sbb->sbbLastCheckTime = formatTime;
 	sbb->sbbRuntimeFlags = 0;
+	sbb->sbbBitmapStart = 9;
+	sbb->sbbBitmapBlocks = bitmapBlocks;
 	
 	pwrite(fd, block, 4096, 0x200000);
 	
+	// create the free-space bitmap; the used blocks are all at the start, and bits past the end of the
+	// filesystem are marked used so that they are never allocated
+	uint8_t *bitmap = (uint8_t*) malloc(bitmapBlocks * 4096);
+	if (bitmap == NULL)
+	{
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		close(fd);
+		return 1;
+	};
+	
+	memset(bitmap, 0, bitmapBlocks * 4096);
+	uint64_t blockIndex;
+	for (blockIndex=0; blockIndex<sbb->sbbUsedBlocks; blockIndex++)
+	{
+		markUsed(bitmap, blockIndex);
+	};
+	
+	for (blockIndex=totalBlocks; blockIndex<bitmapBlocks*GXFS_GROUP_BLOCKS; blockIndex++)
+	{
+		markUsed(bitmap, blockIndex);
+	};
+	
+	pwrite(fd, bitmap, bitmapBlocks * 4096, 0x200000 + (sbb->sbbBitmapStart << 12));
+	free(bitmap);
+	
 	// create the "bad blocks" inode
 	memset(block, 0, 4096);
 	
@@ -45,8 +45,64 @@ const char *progName;
 
 void usage()
 {
-	fprintf(stderr, "USAGE:\t%s [-t <type>] <device> <mountpoint>\n", progName);
-	fprintf(stderr, "\tMount a filesystem.\n");
+	fprintf(stderr, "USAGE:\t%s [-t <type>] [-o <options>] <device> <mountpoint>\n", progName);
+	fprintf(stderr, "\tMount a filesystem. <options> is a comma-separated list of:\n");
+	fprintf(stderr, "\t  ro          Mount read-only.\n");
+	fprintf(stderr, "\t  nosuid      Ignore the set-UID and set-GID bits.\n");
+	fprintf(stderr, "\t  noatime     Never update access times.\n");
+	fprintf(stderr, "\t  nodiratime  Never update access times of directories.\n");
+	fprintf(stderr, "\t  relatime    Update an access time only if it is older than the modification\n");
+	fprintf(stderr, "\t              or change time, or more than a day old.\n");
+};
+
+/**
+ * Parse a comma-separated list of mount options into MNT_* flags. Returns 0 on success, or -1 if an
+ * option is not recognised.
+ */
+int parseMountOptions(const char *options, int *flagsOut)
+{
+	char *copy = strdup(options);
+	char *saveptr;
+	char *opt;
+	int flags = 0;
+	
+	for (opt=strtok_r(copy, ",", &saveptr); opt!=NULL; opt=strtok_r(NULL, ",", &saveptr))
+	{
+		if (strcmp(opt, "ro") == 0)
+		{
+			flags |= MNT_RDONLY;
+		}
+		else if (strcmp(opt, "rw") == 0 || strcmp(opt, "defaults") == 0)
+		{
+			// nothing to set
+		}
+		else if (strcmp(opt, "nosuid") == 0)
+		{
+			flags |= MNT_NOSUID;
+		}
+		else if (strcmp(opt, "noatime") == 0)
+		{
+			flags |= MNT_NOATIME;
+		}
+		else if (strcmp(opt, "nodiratime") == 0)
+		{
+			flags |= MNT_NODIRATIME;
+		}
+		else if (strcmp(opt, "relatime") == 0)
+		{
+			flags |= MNT_RELATIME;
+		}
+		else
+		{
+			fprintf(stderr, "%s: unknown mount option `%s'\n", progName, opt);
+			free(copy);
+			return -1;
+		};
+	};
+	
+	free(copy);
+	*flagsOut = flags;
+	return 0;
 };
 
 int parseFstabLine(char *line)
@@ -62,11 +118,19 @@ int parseFstabLine(char *line)
 	char *device = strtok_r(NULL, " \t", &saveptr);
 	if (device == NULL) return 1;
 	
+	// optional fourth field: mount options
+	int flags = 0;
+	char *options = strtok_r(NULL, " \t", &saveptr);
+	if (options != NULL)
+	{
+		if (parseMountOptions(options, &flags) != 0) return 1;
+	};
+	
 	char mountPrefix[256];
 	strcpy(mountPrefix, mountpoint);
 	if (mountPrefix[strlen(mountPrefix)-1] != '/') strcat(mountPrefix, "/");
 
-	if (_glidix_mount(type, device, mountPrefix, 0, NULL, 0) != 0)
+	if (_glidix_mount(type, device, mountPrefix, flags, NULL, 0) != 0)
 	{
 		perror(progName);
 		return 1;
@@ -133,6 +197,7 @@ int main(int argc, char *argv[])
 	const char *mountpoint = NULL;
 	const char *device = NULL;
 	int mountAll = 0;
+	int flags = 0;
 	
 	int i;
 	for (i=1; i<argc; i++)
@@ -154,6 +219,32 @@ int main(int argc, char *argv[])
 				fstype = argv[i];
 			};
 		}
+		else if (memcmp(argv[i], "-o", 2) == 0)
+		{
+			const char *options;
+			if (strlen(argv[i]) > 2)
+			{
+				options = &argv[i][2];
+			}
+			else
+			{
+				i++;
+				if (i == argc)
+				{
+					usage();
+					return 1;
+				};
+				options = argv[i];
+			};
+			
+			int newFlags;
+			if (parseMountOptions(options, &newFlags) != 0)
+			{
+				return 1;
+			};
+			
+			flags |= newFlags;
+		}
 		else if (strcmp(argv[i], "-a") == 0)
 		{
 			mountAll = 1;
@@ -195,7 +286,7 @@ int main(int argc, char *argv[])
 		fstype = "gxfs";
 	};
 
-	if (mount(fstype, device, mountpoint, 0, NULL, 0) != 0)
+	if (mount(fstype, device, mountpoint, flags, NULL, 0) != 0)
 	{
 		perror(argv[0]);
 		return 1;